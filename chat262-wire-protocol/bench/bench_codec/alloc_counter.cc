@@ -0,0 +1,72 @@
+#include "alloc_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<uint64_t> alloc_count(0);
+static std::atomic<uint64_t> alloc_bytes(0);
+
+static void count_alloc(const size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+#ifdef BENCH_WRAP_MALLOC
+
+extern "C" void* __real_malloc(size_t size);
+
+extern "C" void* __wrap_malloc(size_t size) {
+    count_alloc(size);
+    return __real_malloc(size);
+}
+
+// `operator new` below calls `malloc`, which is wrapped and counted
+static void* counted_malloc(const size_t size) {
+    return malloc(size);
+}
+
+#else
+
+static void* counted_malloc(const size_t size) {
+    count_alloc(size);
+    return malloc(size);
+}
+
+#endif
+
+void* operator new(size_t size) {
+    void* ptr = counted_malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+uint64_t alloc_counter::count() {
+    return alloc_count.load(std::memory_order_relaxed);
+}
+
+uint64_t alloc_counter::bytes() {
+    return alloc_bytes.load(std::memory_order_relaxed);
+}
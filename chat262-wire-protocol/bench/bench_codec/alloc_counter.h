@@ -0,0 +1,18 @@
+#ifndef _ALLOC_COUNTER_H_
+#define _ALLOC_COUNTER_H_
+
+#include <cstdint>
+
+// Counts heap allocations made by the benchmark. Both `operator new` and
+// `malloc` are counted; the latter is how Chat 262 messages are allocated.
+// On Linux, calls to `malloc` are intercepted at link time with
+// `--wrap=malloc`. Elsewhere, only `operator new` is counted.
+struct alloc_counter {
+    // Number of allocations so far
+    static uint64_t count();
+
+    // Number of bytes allocated so far
+    static uint64_t bytes();
+};
+
+#endif
@@ -0,0 +1,456 @@
+#include "alloc_counter.h"
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "common.h"
+#include "endianness.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+// Prevent the compiler from optimizing away a computed value
+template <typename T>
+static void do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct bench_case {
+    // Name of the benchmark, "<message>/<direction>/<input>"
+    std::string name_;
+    // Number of message bytes processed by one iteration
+    size_t bytes_;
+    // Runs one iteration
+    std::function<void()> fn_;
+};
+
+struct bench_result {
+    std::string name_;
+    uint64_t iterations_;
+    double ns_per_op_;
+    double mb_per_s_;
+    double allocs_per_op_;
+    double alloc_bytes_per_op_;
+};
+
+// Return the body of a serialized message as the receiving side sees it
+static std::vector<uint8_t> body_of(
+    const std::shared_ptr<chat262::message>& m) {
+    uint32_t body_len = e_le32toh(m->hdr_.body_len_);
+    return std::vector<uint8_t>(m->body_, m->body_ + body_len);
+}
+
+static size_t size_of(const std::shared_ptr<chat262::message>& m) {
+    return sizeof(chat262::message_header) + e_le32toh(m->hdr_.body_len_);
+}
+
+static std::vector<std::string> make_usernames(const size_t n) {
+    std::vector<std::string> usernames(n);
+    for (size_t i = 0; i != n; ++i) {
+        usernames[i] = "user" + std::to_string(i * 2654435761u % 1000000007u);
+    }
+    return usernames;
+}
+
+static chat make_chat(const size_t n) {
+    chat c;
+    c.texts_.resize(n);
+    for (size_t i = 0; i != n; ++i) {
+        c.texts_[i].sender_ =
+            i % 3 == 0 ? text::sender_you : text::sender_other;
+        // Short chat messages of varying length
+        c.texts_[i].content_.assign(8 + i % 57,
+                                    static_cast<char>('a' + i % 26));
+    }
+    return c;
+}
+
+// Lay out `c` like the server stores it, with text bytes in runs of up to
+// 64 KiB
+static chat_view make_view(const chat& c) {
+    chat_view v;
+    std::vector<uint8_t> run;
+    auto flush = [&v, &run]() {
+        std::shared_ptr<uint8_t> data(
+            static_cast<uint8_t*>(malloc(run.size())),
+            free);
+        memcpy(data.get(), run.data(), run.size());
+        v.runs_.push_back({data, run.size()});
+        run.clear();
+    };
+    for (const text& txt : c.texts_) {
+        if (run.size() + txt.content_.length() > 64 * 1024) {
+            flush();
+        }
+        v.senders_.push_back(txt.sender_);
+        v.lengths_.push_back(static_cast<uint32_t>(txt.content_.length()));
+        run.insert(run.end(), txt.content_.begin(), txt.content_.end());
+    }
+    if (!run.empty()) {
+        flush();
+    }
+    return v;
+}
+
+// Add serialize and deserialize benchmarks for a message whose body only holds
+// a status code
+template <typename msg_type>
+static void add_status_cases(std::vector<bench_case>& cases,
+                             const std::string& name) {
+    auto msg = msg_type::serialize(chat262::status_code_ok);
+    auto body = std::make_shared<std::vector<uint8_t>>(body_of(msg));
+    cases.push_back({name + "/serialize", size_of(msg), []() {
+                         do_not_optimize(
+                             msg_type::serialize(chat262::status_code_ok));
+                     }});
+    cases.push_back({name + "/deserialize", body->size(), [body]() {
+                         uint32_t stat_code;
+                         do_not_optimize(
+                             msg_type::deserialize(*body, stat_code));
+                         do_not_optimize(stat_code);
+                     }});
+}
+
+// Add serialize and deserialize benchmarks for a message without a body
+template <typename msg_type>
+static void add_empty_cases(std::vector<bench_case>& cases,
+                            const std::string& name) {
+    auto msg = msg_type::serialize();
+    auto body = std::make_shared<std::vector<uint8_t>>(body_of(msg));
+    cases.push_back({name + "/serialize", size_of(msg), []() {
+                         do_not_optimize(msg_type::serialize());
+                     }});
+    cases.push_back({name + "/deserialize", body->size(), [body]() {
+                         do_not_optimize(msg_type::deserialize(*body));
+                     }});
+}
+
+// Add serialize and deserialize benchmarks for a message with two strings
+template <typename msg_type>
+static void add_two_string_cases(std::vector<bench_case>& cases,
+                                 const std::string& name,
+                                 const std::string& input,
+                                 const std::string& a,
+                                 const std::string& b) {
+    auto msg = msg_type::serialize(a, b);
+    auto body = std::make_shared<std::vector<uint8_t>>(body_of(msg));
+    cases.push_back({name + "/serialize/" + input, size_of(msg), [a, b]() {
+                         do_not_optimize(msg_type::serialize(a, b));
+                     }});
+    cases.push_back(
+        {name + "/deserialize/" + input, body->size(), [body]() {
+             std::string out_a;
+             std::string out_b;
+             do_not_optimize(msg_type::deserialize(*body, out_a, out_b));
+             do_not_optimize(out_a);
+             do_not_optimize(out_b);
+         }});
+}
+
+// Add serialize and deserialize benchmarks for a message with one string
+template <typename msg_type>
+static void add_one_string_cases(std::vector<bench_case>& cases,
+                                 const std::string& name,
+                                 const std::string& a) {
+    auto msg = msg_type::serialize(a);
+    auto body = std::make_shared<std::vector<uint8_t>>(body_of(msg));
+    cases.push_back({name + "/serialize", size_of(msg), [a]() {
+                         do_not_optimize(msg_type::serialize(a));
+                     }});
+    cases.push_back({name + "/deserialize", body->size(), [body]() {
+                         std::string out;
+                         do_not_optimize(msg_type::deserialize(*body, out));
+                         do_not_optimize(out);
+                     }});
+}
+
+// Add serialize and deserialize benchmarks for a message with a list of
+// usernames
+template <typename msg_type>
+static void add_usernames_cases(std::vector<bench_case>& cases,
+                                const std::string& name,
+                                const size_t n) {
+    auto usernames =
+        std::make_shared<const std::vector<std::string>>(make_usernames(n));
+    auto msg = msg_type::serialize(chat262::status_code_ok, *usernames);
+    auto body = std::make_shared<std::vector<uint8_t>>(body_of(msg));
+    std::string input = std::to_string(n) + "_usernames";
+    cases.push_back(
+        {name + "/serialize/" + input, size_of(msg), [usernames]() {
+             do_not_optimize(
+                 msg_type::serialize(chat262::status_code_ok, *usernames));
+         }});
+    cases.push_back(
+        {name + "/deserialize/" + input, body->size(), [body]() {
+             uint32_t stat_code;
+             std::vector<std::string> out;
+             do_not_optimize(msg_type::deserialize(*body, stat_code, out));
+             do_not_optimize(out);
+         }});
+}
+
+static void add_recv_txt_cases(std::vector<bench_case>& cases, const size_t n) {
+    auto c = std::make_shared<const chat>(make_chat(n));
+    auto msg =
+        chat262::recv_txt_response::serialize(chat262::status_code_ok, *c);
+    auto body = std::make_shared<std::vector<uint8_t>>(body_of(msg));
+    std::string input = std::to_string(n) + "_texts";
+    cases.push_back(
+        {"recv_txt_response/serialize/" + input, size_of(msg), [c]() {
+             do_not_optimize(
+                 chat262::recv_txt_response::serialize(chat262::status_code_ok,
+                                                       *c));
+         }});
+    auto v = std::make_shared<const chat_view>(make_view(*c));
+    cases.push_back(
+        {"recv_txt_response/serialize_view/" + input, size_of(msg), [v]() {
+             do_not_optimize(
+                 chat262::recv_txt_response::serialize(chat262::status_code_ok,
+                                                       *v));
+         }});
+    cases.push_back(
+        {"recv_txt_response/deserialize/" + input, body->size(), [body]() {
+             uint32_t stat_code;
+             chat out;
+             do_not_optimize(chat262::recv_txt_response::deserialize(*body,
+                                                                     stat_code,
+                                                                     out));
+             do_not_optimize(out);
+         }});
+}
+
+static std::vector<bench_case> make_cases() {
+    using namespace chat262;
+    std::vector<bench_case> cases;
+
+    // Header
+    auto hdr_data = std::make_shared<std::vector<uint8_t>>(
+        sizeof(message_header),
+        static_cast<uint8_t>(1));
+    cases.push_back({"message_header/deserialize", hdr_data->size(), [=]() {
+                         message_header hdr;
+                         do_not_optimize(
+                             message_header::deserialize(*hdr_data, hdr));
+                         do_not_optimize(hdr);
+                     }});
+
+    // Requests
+    add_two_string_cases<registration_request>(cases,
+                                               "registration_request",
+                                               "typical",
+                                               "username_of_a_user",
+                                               "hunter2hunter2");
+    add_two_string_cases<login_request>(cases,
+                                        "login_request",
+                                        "typical",
+                                        "username_of_a_user",
+                                        "hunter2hunter2");
+    add_empty_cases<logout_request>(cases, "logout_request");
+    add_one_string_cases<accounts_request>(cases, "accounts_request", "user*");
+    add_two_string_cases<send_txt_request>(cases,
+                                           "send_txt_request",
+                                           "16B",
+                                           "recipient",
+                                           std::string(16, 'x'));
+    add_two_string_cases<send_txt_request>(cases,
+                                           "send_txt_request",
+                                           "1KB",
+                                           "recipient",
+                                           std::string(1024, 'x'));
+    add_two_string_cases<send_txt_request>(cases,
+                                           "send_txt_request",
+                                           "64KB",
+                                           "recipient",
+                                           std::string(65536, 'x'));
+    add_one_string_cases<recv_txt_request>(cases, "recv_txt_request", "sender");
+    add_empty_cases<correspondents_request>(cases, "correspondents_request");
+    add_empty_cases<delete_request>(cases, "delete_request");
+
+    // Responses
+    add_status_cases<registration_response>(cases, "registration_response");
+    add_status_cases<login_response>(cases, "login_response");
+    add_status_cases<logout_response>(cases, "logout_response");
+    for (size_t n : {10, 1000, 1000000}) {
+        add_usernames_cases<accounts_response>(cases, "accounts_response", n);
+    }
+    add_status_cases<send_txt_response>(cases, "send_txt_response");
+    for (size_t n : {10, 1000, 100000}) {
+        add_recv_txt_cases(cases, n);
+    }
+    for (size_t n : {10, 1000}) {
+        add_usernames_cases<correspondents_response>(cases,
+                                                     "correspondents_response",
+                                                     n);
+    }
+    add_status_cases<delete_response>(cases, "delete_response");
+
+    auto version_msg = wrong_version_response::serialize(version);
+    auto version_body =
+        std::make_shared<std::vector<uint8_t>>(body_of(version_msg));
+    cases.push_back({"wrong_version_response/serialize",
+                     size_of(version_msg),
+                     []() {
+                         do_not_optimize(
+                             wrong_version_response::serialize(version));
+                     }});
+    cases.push_back({"wrong_version_response/deserialize",
+                     version_body->size(),
+                     [version_body]() {
+                         uint16_t v;
+                         do_not_optimize(
+                             wrong_version_response::deserialize(*version_body,
+                                                                 v));
+                         do_not_optimize(v);
+                     }});
+    add_empty_cases<invalid_type_response>(cases, "invalid_type_response");
+    add_empty_cases<invalid_body_response>(cases, "invalid_body_response");
+
+    return cases;
+}
+
+static bench_result run_case(const bench_case& c, const double min_time_s) {
+    // Warm up and estimate the cost of one iteration
+    steady_clock::time_point start = steady_clock::now();
+    c.fn_();
+    double one_s = duration<double>(steady_clock::now() - start).count();
+
+    uint64_t iterations = static_cast<uint64_t>(
+        std::max(1.0, std::min(1e9, min_time_s / std::max(one_s, 1e-9))));
+    uint64_t allocs_before = alloc_counter::count();
+    uint64_t bytes_before = alloc_counter::bytes();
+    start = steady_clock::now();
+    for (uint64_t i = 0; i != iterations; ++i) {
+        c.fn_();
+    }
+    double total_s = duration<double>(steady_clock::now() - start).count();
+    uint64_t allocs = alloc_counter::count() - allocs_before;
+    uint64_t bytes = alloc_counter::bytes() - bytes_before;
+
+    bench_result r;
+    r.name_ = c.name_;
+    r.iterations_ = iterations;
+    r.ns_per_op_ = total_s * 1e9 / iterations;
+    r.mb_per_s_ = c.bytes_ * iterations / total_s / 1e6;
+    r.allocs_per_op_ = static_cast<double>(allocs) / iterations;
+    r.alloc_bytes_per_op_ = static_cast<double>(bytes) / iterations;
+    return r;
+}
+
+static void write_json(FILE* out, const std::vector<bench_result>& results) {
+    fprintf(out, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i != results.size(); ++i) {
+        const bench_result& r = results[i];
+        fprintf(out,
+                "    {\"name\": \"%s\", \"iterations\": %" PRIu64
+                ", \"ns_per_op\": %.3f, \"mb_per_s\": %.3f"
+                ", \"allocs_per_op\": %.3f, \"alloc_bytes_per_op\": %.1f}%s\n",
+                r.name_.c_str(),
+                r.iterations_,
+                r.ns_per_op_,
+                r.mb_per_s_,
+                r.allocs_per_op_,
+                r.alloc_bytes_per_op_,
+                i + 1 == results.size() ? "" : ",");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static void usage(const char* prog) {
+    std::cerr << "usage: " << prog
+              << " [-h] [-f filter] [-t seconds] [-j file]\n"
+                 "\n"
+                 "Measure serialization and deserialization throughput and\n"
+                 "allocations of every Chat 262 Protocol message.\n"
+                 "\n"
+                 "Options:\n"
+                 "\t-h\t\t Display this message and exit.\n"
+                 "\t-f filter\t Only run benchmarks whose name contains "
+                 "<filter>.\n"
+                 "\t-t seconds\t Minimum time to run each benchmark (default "
+                 "0.2).\n"
+                 "\t-j file\t\t Also write the results as JSON into <file>.\n";
+}
+
+int main(int argc, char** argv) {
+    std::string filter;
+    std::string json_path;
+    double min_time_s = 0.2;
+    try {
+        int opt;
+        while ((opt = getopt(argc, argv, "hf:t:j:")) != -1) {
+            switch (opt) {
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            case 'f':
+                filter = optarg;
+                break;
+            case 't':
+                min_time_s = std::stod(optarg);
+                break;
+            case 'j':
+                json_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << "\n";
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (optind != argc) {
+        std::cerr << "Unknown argument\n";
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-52s %12s %14s %12s %10s %14s\n",
+           "benchmark",
+           "iterations",
+           "ns/op",
+           "MB/s",
+           "allocs/op",
+           "alloc B/op");
+    std::vector<bench_result> results;
+    for (const bench_case& c : make_cases()) {
+        if (c.name_.find(filter) == std::string::npos) {
+            continue;
+        }
+        bench_result r = run_case(c, min_time_s);
+        printf("%-52s %12" PRIu64 " %14.1f %12.1f %10.2f %14.1f\n",
+               r.name_.c_str(),
+               r.iterations_,
+               r.ns_per_op_,
+               r.mb_per_s_,
+               r.allocs_per_op_,
+               r.alloc_bytes_per_op_);
+        fflush(stdout);
+        results.push_back(r);
+    }
+
+    if (!json_path.empty()) {
+        FILE* out = fopen(json_path.c_str(), "w");
+        if (out == nullptr) {
+            std::cerr << "Could not open " << json_path << "\n";
+            return EXIT_FAILURE;
+        }
+        write_json(out, results);
+        fclose(out);
+    }
+    return EXIT_SUCCESS;
+}
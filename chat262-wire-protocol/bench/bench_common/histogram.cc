@@ -0,0 +1,86 @@
+#include "histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+histogram::histogram() :
+    buckets_(bucket_index(std::numeric_limits<uint64_t>::max()) + 1, 0),
+    count_(0),
+    min_(std::numeric_limits<uint64_t>::max()),
+    max_(0),
+    sum_(0) {
+}
+
+void histogram::record(const uint64_t value) {
+    ++buckets_[bucket_index(value)];
+    ++count_;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+    sum_ += value;
+}
+
+void histogram::merge(const histogram& other) {
+    for (size_t i = 0; i != buckets_.size(); ++i) {
+        buckets_[i] += other.buckets_[i];
+    }
+    count_ += other.count_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    sum_ += other.sum_;
+}
+
+uint64_t histogram::percentile(const double p) const {
+    if (count_ == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(
+        std::ceil(p / 100.0 * static_cast<double>(count_)));
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i != buckets_.size(); ++i) {
+        seen += buckets_[i];
+        if (seen >= rank) {
+            // The bucket's upper bound can overshoot the largest value
+            return std::min(bucket_value(i), max_);
+        }
+    }
+    return max_;
+}
+
+uint64_t histogram::count() const {
+    return count_;
+}
+
+uint64_t histogram::min() const {
+    return count_ == 0 ? 0 : min_;
+}
+
+uint64_t histogram::max() const {
+    return max_;
+}
+
+double histogram::mean() const {
+    return count_ == 0 ? 0.0 : static_cast<double>(sum_ / count_);
+}
+
+size_t histogram::bucket_index(const uint64_t value) {
+    // Small values are recorded exactly
+    if (value < sub_buckets) {
+        return static_cast<size_t>(value);
+    }
+    // Keep the most significant bit and the `sub_bucket_bits` bits below it
+    size_t msb = 63 - static_cast<size_t>(__builtin_clzll(value));
+    size_t shift = msb - sub_bucket_bits;
+    size_t mantissa = static_cast<size_t>(value >> shift);
+    return (shift + 1) * sub_buckets + (mantissa - sub_buckets);
+}
+
+uint64_t histogram::bucket_value(const size_t index) {
+    if (index < sub_buckets) {
+        return index;
+    }
+    size_t shift = index / sub_buckets - 1;
+    uint64_t mantissa = sub_buckets + index % sub_buckets;
+    return (mantissa << shift) + ((static_cast<uint64_t>(1) << shift) - 1);
+}
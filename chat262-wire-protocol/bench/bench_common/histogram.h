@@ -0,0 +1,52 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A latency histogram with bounded relative error, in the spirit of
+// HdrHistogram. Values are bucketed by their most significant bit, and each
+// power of two is further split into `sub_buckets` linear sub-buckets, so
+// every recorded value is off by at most 1/`sub_buckets` (about 1.6%).
+//
+// A histogram is not thread-safe. Each thread should record into its own
+// histogram, and the histograms should be merged after the run.
+class histogram {
+public:
+    histogram();
+
+    // Record a single value, e.g. a latency in nanoseconds
+    void record(const uint64_t value);
+
+    // Add all values recorded in `other` to this histogram
+    void merge(const histogram& other);
+
+    // Return the smallest recorded value `v` such that at least `p` percent
+    // of recorded values are less than or equal to `v`. `p` is in [0, 100].
+    // Returns 0 if nothing was recorded.
+    uint64_t percentile(const double p) const;
+
+    uint64_t count() const;
+    uint64_t min() const;
+    uint64_t max() const;
+    double mean() const;
+
+private:
+    static constexpr size_t sub_bucket_bits = 6;
+    static constexpr size_t sub_buckets = 1 << sub_bucket_bits;
+
+    // Map a value to its bucket index and back. The value returned by
+    // `bucket_value` is the largest value that maps into the bucket.
+    static size_t bucket_index(const uint64_t value);
+    static uint64_t bucket_value(const size_t index);
+
+    std::vector<uint64_t> buckets_;
+    uint64_t count_;
+    uint64_t min_;
+    uint64_t max_;
+    // Sum of all recorded values, for the mean
+    long double sum_;
+};
+
+#endif
@@ -0,0 +1,24 @@
+#include "zipf.h"
+
+#include <algorithm>
+#include <cmath>
+
+zipf_distribution::zipf_distribution(const size_t n, const double s) :
+    cdf_(n) {
+    double total = 0;
+    for (size_t i = 0; i != n; ++i) {
+        total += 1.0 / std::pow(static_cast<double>(i + 1), s);
+        cdf_[i] = total;
+    }
+    for (double& c : cdf_) {
+        c /= total;
+    }
+}
+
+size_t zipf_distribution::operator()(std::mt19937_64& rng) const {
+    double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    size_t i = static_cast<size_t>(
+        std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin());
+    // Guard against rounding in the last element of the CDF
+    return std::min(i, cdf_.size() - 1);
+}
@@ -0,0 +1,23 @@
+#ifndef _ZIPF_H_
+#define _ZIPF_H_
+
+#include <cstddef>
+#include <random>
+#include <vector>
+
+// Draws integers in [0, n) following a Zipfian distribution with exponent
+// `s`: the probability of drawing `i` is proportional to 1 / (i + 1)^s. Small
+// integers are therefore the most popular ones.
+class zipf_distribution {
+public:
+    zipf_distribution(const size_t n, const double s);
+
+    size_t operator()(std::mt19937_64& rng) const;
+
+private:
+    // Cumulative distribution function, `cdf_[i]` is the probability of
+    // drawing an integer less than or equal to `i`
+    std::vector<double> cdf_;
+};
+
+#endif
@@ -0,0 +1,828 @@
+#include "chat.h"
+#include "common.h"
+#include "conversation.h"
+#include "database.h"
+#include "dump_file.h"
+#include "lz_block.h"
+#include "zipf.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    #include <malloc.h>
+    #define HAVE_MALLINFO2
+#endif
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+struct bench_config {
+    // The largest number of threads to scale to
+    size_t max_threads_;
+    // Duration of each measurement in time-based scenarios
+    double duration_s_;
+    // Number of users in the messaging scenarios
+    size_t num_users_;
+    // Number of users in the search scenario
+    size_t population_;
+    // Number of correspondents of every deleted user
+    size_t num_correspondents_;
+    // Number of users deleted by every thread
+    size_t deletes_per_thread_;
+    // Number of texts in the hot chat for the receive scenario
+    size_t hot_chat_len_;
+    // Exponent of the Zipfian distributions
+    double zipf_s_;
+    // Only run scenarios whose name contains this string
+    std::string filter_;
+    // If not 0, measure the memory used by this many stored texts instead of
+    // the throughput
+    size_t memory_texts_;
+    // If not 0, measure the compression of this many stored texts instead of
+    // the throughput
+    size_t compress_texts_;
+    // If not 0, measure loading a dump of this many texts between
+    // `num_users_` users instead of the throughput
+    size_t load_texts_;
+};
+
+struct scenario {
+    std::string name_;
+    std::string description_;
+    // Populate the database before the measurement, for `num_threads` threads
+    std::function<void(database&, size_t num_threads)> setup_;
+    // Body of the `thread_idx`-th thread. Runs until `stop` is set or until
+    // it runs out of work, and returns the number of completed operations.
+    std::function<uint64_t(database&,
+                           size_t thread_idx,
+                           const std::atomic<bool>& stop)>
+        worker_;
+    // If set, workers run out of work on their own and `stop` is never set
+    bool fixed_work_;
+};
+
+static std::string user_name(const size_t i) {
+    return "user" + std::to_string(i);
+}
+
+static void register_users(database& db,
+                           const std::string& prefix,
+                           const size_t n) {
+    for (size_t i = 0; i != n; ++i) {
+        db.registration(prefix + std::to_string(i), "password");
+    }
+}
+
+// Log the current thread in as `username`, logging out first if needed
+static void switch_user(database& db, const std::string& username) {
+    if (db.is_logged_in()) {
+        db.logout();
+    }
+    db.login(username, "password");
+}
+
+static std::vector<scenario> make_scenarios(const bench_config& cfg) {
+    std::vector<scenario> scenarios;
+    const std::string txt(32, 'x');
+
+    scenarios.push_back(
+        {"send_uniform",
+         "every thread is one sender, recipients are uniformly random",
+         [&cfg](database& db, size_t) {
+             register_users(db, "user", cfg.num_users_);
+         },
+         [&cfg, txt](database& db, size_t thread_idx,
+                     const std::atomic<bool>& stop) {
+             std::mt19937_64 rng(thread_idx);
+             std::uniform_int_distribution<size_t> pick(0, cfg.num_users_ - 1);
+             switch_user(db, user_name(thread_idx % cfg.num_users_));
+             uint64_t ops = 0;
+             while (!stop.load(std::memory_order_relaxed)) {
+                 db.send_txt(user_name(pick(rng)), txt);
+                 ++ops;
+             }
+             return ops;
+         },
+         false});
+
+    scenarios.push_back(
+        {"send_zipf",
+         "senders and recipients are Zipfian, senders switch every 64 texts",
+         [&cfg](database& db, size_t) {
+             register_users(db, "user", cfg.num_users_);
+         },
+         [&cfg, txt](database& db, size_t thread_idx,
+                     const std::atomic<bool>& stop) {
+             std::mt19937_64 rng(thread_idx);
+             zipf_distribution pick(cfg.num_users_, cfg.zipf_s_);
+             uint64_t ops = 0;
+             while (!stop.load(std::memory_order_relaxed)) {
+                 if (ops % 64 == 0) {
+                     switch_user(db, user_name(pick(rng)));
+                 }
+                 db.send_txt(user_name(pick(rng)), txt);
+                 ++ops;
+             }
+             return ops;
+         },
+         false});
+
+    scenarios.push_back(
+        {"send_hot_chat",
+         "all threads text back and forth within a single chat",
+         [](database& db, size_t) {
+             register_users(db, "user", 2);
+         },
+         [txt](database& db, size_t thread_idx,
+               const std::atomic<bool>& stop) {
+             switch_user(db, user_name(thread_idx % 2));
+             const std::string recipient = user_name((thread_idx + 1) % 2);
+             uint64_t ops = 0;
+             while (!stop.load(std::memory_order_relaxed)) {
+                 db.send_txt(recipient, txt);
+                 ++ops;
+             }
+             return ops;
+         },
+         false});
+
+    scenarios.push_back(
+        {"recv_hot_chat",
+         "all threads retrieve the same long chat",
+         [&cfg, txt](database& db, size_t) {
+             register_users(db, "user", 2);
+             switch_user(db, user_name(0));
+             for (size_t i = 0; i != cfg.hot_chat_len_; ++i) {
+                 db.send_txt(user_name(1), txt);
+             }
+             db.logout();
+         },
+         [](database& db, size_t thread_idx, const std::atomic<bool>& stop) {
+             switch_user(db, user_name(thread_idx % 2));
+             const std::string sender = user_name((thread_idx + 1) % 2);
+             chat_view v;
+             uint64_t ops = 0;
+             while (!stop.load(std::memory_order_relaxed)) {
+                 db.recv_txt(sender, v);
+                 ++ops;
+             }
+             return ops;
+         },
+         false});
+
+    scenarios.push_back(
+        {"get_usernames",
+         "search a large population with a pattern matching ~10% of users",
+         [&cfg](database& db, size_t) {
+             register_users(db, "user", cfg.population_);
+         },
+         [](database& db, size_t thread_idx, const std::atomic<bool>& stop) {
+             switch_user(db, user_name(thread_idx));
+             uint64_t ops = 0;
+             while (!stop.load(std::memory_order_relaxed)) {
+                 std::vector<std::string> usernames = db.get_usernames("*7");
+                 ++ops;
+             }
+             return ops;
+         },
+         false});
+
+    scenarios.push_back(
+        {"delete_user",
+         "delete users who each have many correspondents",
+         [&cfg, txt](database& db, size_t num_threads) {
+             register_users(db, "corr", cfg.num_correspondents_);
+             size_t num_victims = num_threads * cfg.deletes_per_thread_;
+             register_users(db, "victim", num_victims);
+             for (size_t v = 0; v != num_victims; ++v) {
+                 switch_user(db, "victim" + std::to_string(v));
+                 for (size_t c = 0; c != cfg.num_correspondents_; ++c) {
+                     db.send_txt("corr" + std::to_string(c), txt);
+                 }
+             }
+             db.logout();
+         },
+         [&cfg](database& db, size_t thread_idx, const std::atomic<bool>&) {
+             size_t first = thread_idx * cfg.deletes_per_thread_;
+             for (size_t v = first; v != first + cfg.deletes_per_thread_; ++v) {
+                 switch_user(db, "victim" + std::to_string(v));
+                 db.delete_user();
+             }
+             return static_cast<uint64_t>(cfg.deletes_per_thread_);
+         },
+         true});
+
+    return scenarios;
+}
+
+// Run `sc` with `num_threads` threads on a fresh database and return the
+// throughput in operations per second
+static double measure(const scenario& sc,
+                      const size_t num_threads,
+                      const bench_config& cfg) {
+    auto db = std::make_unique<database>();
+    sc.setup_(*db, num_threads);
+
+    std::atomic<size_t> ready(0);
+    std::atomic<bool> go(false);
+    std::atomic<bool> stop(false);
+    std::vector<uint64_t> ops(num_threads, 0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t != num_threads; ++t) {
+        threads.emplace_back([&, t]() {
+            ++ready;
+            while (!go.load()) {
+                std::this_thread::yield();
+            }
+            ops[t] = sc.worker_(*db, t, stop);
+        });
+    }
+    while (ready.load() != num_threads) {
+        std::this_thread::yield();
+    }
+
+    steady_clock::time_point start = steady_clock::now();
+    go.store(true);
+    if (!sc.fixed_work_) {
+        std::this_thread::sleep_for(duration<double>(cfg.duration_s_));
+        stop.store(true);
+    }
+    for (std::thread& th : threads) {
+        th.join();
+    }
+    double elapsed_s = duration<double>(steady_clock::now() - start).count();
+
+    uint64_t total = 0;
+    for (uint64_t o : ops) {
+        total += o;
+    }
+    return total / elapsed_s;
+}
+
+// Number of bytes allocated on the heap, or 0 if it cannot be measured
+static size_t heap_in_use() {
+#ifdef HAVE_MALLINFO2
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+enum class layout { chat, conversation, conversation_timestamps };
+
+// Store `corpus` into chats of `chat_len` texts with the given layout and
+// return the number of heap bytes used per text
+static double bytes_per_text(const std::vector<std::string>& corpus,
+                             const size_t chat_len,
+                             const layout l) {
+    std::mt19937_64 rng(0);
+    // Texts arrive every few seconds
+    std::exponential_distribution<double> gap_ms(1.0 / 5000);
+    uint64_t timestamp_ms = 1700000000000;
+
+    const size_t before = heap_in_use();
+    std::vector<chat> chats;
+    std::vector<conversation> conversations;
+    const size_t num_chats = (corpus.size() + chat_len - 1) / chat_len;
+    if (l == layout::chat) {
+        chats.resize(num_chats);
+    } else {
+        conversations.resize(num_chats);
+    }
+    for (size_t i = 0; i != corpus.size(); ++i) {
+        const uint8_t sender = i % 3 == 0 ? text::sender_you
+                                          : text::sender_other;
+        switch (l) {
+        case layout::chat:
+            chats[i / chat_len].texts_.push_back({sender, corpus[i]});
+            break;
+        case layout::conversation:
+            conversations[i / chat_len].append(sender, corpus[i]);
+            break;
+        case layout::conversation_timestamps:
+            timestamp_ms += static_cast<uint64_t>(gap_ms(rng));
+            conversations[i / chat_len].append(sender,
+                                               corpus[i],
+                                               timestamp_ms);
+            break;
+        }
+    }
+    const size_t after = heap_in_use();
+    return static_cast<double>(after - before) / corpus.size();
+}
+
+static void measure_memory(const bench_config& cfg) {
+    if (heap_in_use() == 0) {
+        fprintf(stderr, "Heap usage cannot be measured on this platform\n");
+        return;
+    }
+
+    // Short chat messages, like "ok see you at 8"
+    std::mt19937_64 rng(0);
+    std::uniform_int_distribution<size_t> pick_len(4, 60);
+    std::vector<std::string> corpus(cfg.memory_texts_);
+    double payload = 0;
+    for (size_t i = 0; i != corpus.size(); ++i) {
+        corpus[i].assign(pick_len(rng), static_cast<char>('a' + i % 26));
+        payload += corpus[i].length();
+    }
+    payload /= corpus.size();
+
+    printf("Memory per stored text, %zu texts of 4 to 60 bytes "
+           "(%.1f on average)\n",
+           corpus.size(),
+           payload);
+    printf("%-32s %10s %12s %10s\n",
+           "layout",
+           "texts/chat",
+           "bytes/text",
+           "overhead");
+    const std::pair<layout, const char*> layouts[] = {
+        {layout::chat, "chat (std::vector<text>)"},
+        {layout::conversation, "conversation"},
+        {layout::conversation_timestamps, "conversation with timestamps"}};
+    for (size_t chat_len : {size_t(10), cfg.hot_chat_len_}) {
+        for (const auto& l : layouts) {
+            double bytes = bytes_per_text(corpus, chat_len, l.first);
+            printf("%-32s %10zu %12.1f %10.1f\n",
+                   l.second,
+                   chat_len,
+                   bytes,
+                   bytes - payload);
+        }
+    }
+}
+
+// Generate `n` chat texts. Words are drawn from a vocabulary of common chat
+// words following a Zipfian distribution, texts are 1 to 16 words long, and
+// some are capitalized or end with punctuation.
+static std::vector<std::string> chat_corpus(const size_t n) {
+    static const char* const words[] = {
+        "i",       "you",     "the",    "to",       "a",       "ok",
+        "is",      "it",      "and",    "that",     "lol",     "what",
+        "are",     "we",      "do",     "in",       "for",     "be",
+        "have",    "so",      "me",     "my",       "not",     "no",
+        "yes",     "at",      "on",     "can",      "just",    "was",
+        "this",    "get",     "like",   "go",       "will",    "know",
+        "up",      "u",       "with",   "if",       "but",     "good",
+        "now",     "see",     "time",   "think",    "how",     "tomorrow",
+        "today",   "there",   "going",  "yeah",     "want",    "out",
+        "about",   "all",     "when",   "back",     "one",     "tonight",
+        "home",    "thanks",  "sure",   "haha",     "did",     "need",
+        "work",    "come",    "let",    "sounds",   "great",   "love",
+        "call",    "later",   "dinner", "meeting",  "class",   "after",
+        "still",   "really",  "gonna",  "soon",     "maybe",   "right",
+        "sorry",   "here",    "then",   "should",   "pm",      "morning",
+        "night",   "week",    "weekend", "friday",  "office",  "late",
+        "lunch",   "coffee",  "pick",   "meet",     "leave",   "bus",
+        "finished", "problem", "set",   "homework", "train",   "car",
+        "store",   "send",    "photo",  "picture",  "game",    "movie",
+        "party",   "birthday", "happy", "miss",     "wait",    "minutes",
+        "hour",    "where",   "why",    "who",      "which",   "free",
+        "busy",    "idk",     "omg",    "btw",      "tbh",     "nice",
+        "cool",    "awesome", "bad",    "tired",    "hungry",  "ready",
+        "done",    "started", "thing",  "things",   "stuff",   "people",
+        "mom",     "dad",     "guys",   "friend",   "text",    "phone",
+        "email",   "link",    "address", "place",   "room",    "library",
+        "exam",    "project", "deadline", "report", "slides",  "notes"};
+    static constexpr size_t num_words = sizeof(words) / sizeof(words[0]);
+
+    std::mt19937_64 rng(0);
+    zipf_distribution pick_word(num_words, 1.0);
+    std::uniform_int_distribution<size_t> pick_len(1, 16);
+    std::uniform_int_distribution<int> pick_style(0, 9);
+    static const char* const endings[] = {"", "", "", "?", "!", ".", " :)"};
+    std::uniform_int_distribution<size_t> pick_ending(0, 6);
+
+    std::vector<std::string> corpus(n);
+    for (std::string& txt : corpus) {
+        const size_t len = pick_len(rng);
+        for (size_t i = 0; i != len; ++i) {
+            if (i != 0) {
+                txt += ' ';
+            }
+            txt += words[pick_word(rng)];
+        }
+        if (pick_style(rng) < 3) {
+            txt[0] = static_cast<char>(toupper(txt[0]));
+        }
+        txt += endings[pick_ending(rng)];
+    }
+    return corpus;
+}
+
+// Average time of `db.recv_txt` of the chats with `num_chats` senders, in
+// microseconds, measured for about `duration_s` seconds
+static double recv_latency_us(database& db,
+                              const size_t num_chats,
+                              const double duration_s) {
+    switch_user(db, "reader");
+    chat_view v;
+    uint64_t ops = 0;
+    const steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point now = start;
+    do {
+        for (size_t i = 0; i != num_chats; ++i) {
+            db.recv_txt(user_name(i), v);
+        }
+        ops += num_chats;
+        now = steady_clock::now();
+    } while (duration<double>(now - start).count() < duration_s);
+    return duration<double, std::micro>(now - start).count() / ops;
+}
+
+static void measure_compression(const bench_config& cfg) {
+    const std::vector<std::string> corpus = chat_corpus(cfg.compress_texts_);
+    const size_t chat_len = cfg.hot_chat_len_;
+    const size_t num_chats = (corpus.size() + chat_len - 1) / chat_len;
+    size_t payload = 0;
+    for (const std::string& txt : corpus) {
+        payload += txt.length();
+    }
+    printf("Compression of %zu chat texts (%.1f bytes on average), in %zu "
+           "chats of %zu texts\n",
+           corpus.size(),
+           static_cast<double>(payload) / corpus.size(),
+           num_chats,
+           chat_len);
+
+    // Compress every sealed chunk of the chats directly, to measure the
+    // codec on its own
+    std::vector<conversation> conversations(num_chats);
+    for (size_t i = 0; i != corpus.size(); ++i) {
+        conversations[i / chat_len].append(
+            i % 3 == 0 ? text::sender_you : text::sender_other,
+            corpus[i]);
+    }
+    const steady_clock::time_point sealed_before =
+        steady_clock::now() + std::chrono::seconds(1);
+    size_t raw_bytes = 0;
+    size_t compressed_bytes = 0;
+    double compress_s = 0;
+    double decompress_s = 0;
+    std::vector<uint8_t> out;
+    for (const conversation& c : conversations) {
+        std::vector<conversation::chunk_ref> chunks;
+        c.compressible_chunks(sealed_before, chunks);
+        for (const conversation::chunk_ref& ref : chunks) {
+            lz_block block;
+            steady_clock::time_point start = steady_clock::now();
+            if (lz_compress(ref.data_.get(), ref.len_, ref.len_ * 2, block) !=
+                status::ok) {
+                continue;
+            }
+            compress_s += duration<double>(steady_clock::now() - start).count();
+            out.resize(block.raw_len_);
+            start = steady_clock::now();
+            lz_decompress(block, out.data());
+            decompress_s +=
+                duration<double>(steady_clock::now() - start).count();
+            raw_bytes += ref.len_;
+            compressed_bytes += block.data_.size();
+        }
+    }
+    if (raw_bytes == 0) {
+        printf("No chunk is large enough to be compressed, use longer "
+               "chats (-l)\n");
+        return;
+    }
+    printf("  %-28s %zu of %zu bytes (%.1f%%)\n",
+           "bytes in sealed chunks",
+           raw_bytes,
+           payload,
+           100.0 * raw_bytes / payload);
+    printf("  %-28s %zu -> %zu bytes (ratio %.2f)\n",
+           "compressed",
+           raw_bytes,
+           compressed_bytes,
+           static_cast<double>(raw_bytes) / compressed_bytes);
+    printf("  %-28s %.0f MB/s\n", "compression", raw_bytes / compress_s / 1e6);
+    printf("  %-28s %.0f MB/s\n",
+           "decompression",
+           raw_bytes / decompress_s / 1e6);
+
+    // Receive every chat from the database, before and after compressing it
+    printf("%-32s %12s\n", "recv_txt", "avg us");
+    const std::pair<size_t, const char*> caches[] = {
+        {0, "compressed, no cache"},
+        {size_t(1) << 40, "compressed, warm cache"}};
+    for (size_t mode = 0; mode != 3; ++mode) {
+        database db;
+        database::config db_cfg{false,
+                                0,
+                                0,
+                                0,
+                                std::chrono::seconds(0),
+                                "",
+                                0,
+                                std::chrono::seconds(0),
+                                mode == 0 ? 0 : caches[mode - 1].first};
+        db.configure(db_cfg);
+        db.registration("reader", "password");
+        for (size_t i = 0; i != num_chats; ++i) {
+            db.registration(user_name(i), "password");
+            switch_user(db, user_name(i));
+            const size_t end = std::min(corpus.size(), (i + 1) * chat_len);
+            for (size_t j = i * chat_len; j != end; ++j) {
+                db.send_txt("reader", corpus[j]);
+            }
+        }
+        if (mode != 0) {
+            db.compress_cold_chunks(std::chrono::seconds(0));
+            // Fill the cache
+            recv_latency_us(db, num_chats, 0);
+        }
+        printf("%-32s %12.1f\n",
+               mode == 0 ? "uncompressed" : caches[mode - 1].second,
+               recv_latency_us(db, num_chats, cfg.duration_s_));
+    }
+}
+
+// Every user of the load scenario chats with the next few users
+static constexpr size_t load_chats_per_user = 4;
+
+// Number of bytes in the file at `path`, or 0 if it doesn't exist
+static uint64_t file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+}
+
+// Write a dump of `cfg.num_users_` users, every one of which chats with the
+// next `load_chats_per_user` users, and of `cfg.load_texts_` texts of 4 to 60
+// bytes spread evenly over the chats
+static status write_load_dump(const bench_config& cfg, const char* path) {
+    dump_writer writer;
+    if (writer.open(path) != status::ok) {
+        return status::error;
+    }
+    for (size_t i = 0; i != cfg.num_users_; ++i) {
+        if (writer.add_user(user_name(i), "password", false) != status::ok) {
+            return status::error;
+        }
+    }
+
+    std::mt19937_64 rng(0);
+    std::uniform_int_distribution<uint32_t> pick_len(4, 60);
+    const size_t num_chats = cfg.num_users_ * load_chats_per_user;
+    for (size_t c = 0; c != num_chats; ++c) {
+        const size_t num_texts =
+            cfg.load_texts_ / num_chats + (c < cfg.load_texts_ % num_chats);
+        chat_view v;
+        size_t len = 0;
+        for (size_t i = 0; i != num_texts; ++i) {
+            v.senders_.push_back(i % 3 == 0 ? text::sender_you
+                                            : text::sender_other);
+            v.lengths_.push_back(pick_len(rng));
+            len += v.lengths_.back();
+        }
+        std::shared_ptr<uint8_t> data(new uint8_t[len],
+                                      std::default_delete<uint8_t[]>());
+        std::fill(data.get(), data.get() + len, 'a' + c % 26);
+        v.runs_.push_back({data, len});
+
+        const size_t owner = c / load_chats_per_user;
+        const size_t correspondent =
+            (owner + c % load_chats_per_user + 1) % cfg.num_users_;
+        if (writer.add_chat(static_cast<uint32_t>(owner),
+                            static_cast<uint32_t>(correspondent),
+                            v) != status::ok) {
+            return status::error;
+        }
+    }
+    return writer.close();
+}
+
+static void measure_load(const bench_config& cfg,
+                         const std::vector<size_t>& thread_counts) {
+    const char* dump_path = "bench_database.dmp";
+    const char* export_path = "bench_database.export.dmp";
+    const steady_clock::time_point write_start = steady_clock::now();
+    if (write_load_dump(cfg, dump_path) != status::ok) {
+        perror("Could not write the dump");
+        remove(dump_path);
+        return;
+    }
+    const uint64_t dump_bytes = file_size(dump_path);
+    printf("Load of a dump of %zu users and %zu texts of 4 to 60 bytes in "
+           "%zu chats (%.1f MB, written in %.1f s)\n",
+           cfg.num_users_,
+           cfg.load_texts_,
+           cfg.num_users_ * load_chats_per_user,
+           dump_bytes / 1e6,
+           duration<double>(steady_clock::now() - write_start).count());
+    printf("%8s %10s %14s %10s %8s\n",
+           "threads",
+           "seconds",
+           "texts/s",
+           "MB/s",
+           "speedup");
+
+    double base = 0;
+    std::unique_ptr<database> db;
+    for (size_t t : thread_counts) {
+        // Free the previous database before measuring the next load
+        db.reset();
+        db = std::make_unique<database>();
+        const steady_clock::time_point start = steady_clock::now();
+        if (db->load_dump(dump_path, t) != status::ok) {
+            fprintf(stderr, "Could not load the dump\n");
+            break;
+        }
+        const double load_s =
+            duration<double>(steady_clock::now() - start).count();
+        if (base == 0) {
+            base = load_s;
+        }
+        printf("%8zu %10.2f %14.0f %10.0f %8.2f\n",
+               t,
+               load_s,
+               cfg.load_texts_ / load_s,
+               dump_bytes / load_s / 1e6,
+               base / load_s);
+        fflush(stdout);
+    }
+
+    // Export what was loaded last
+    if (db) {
+        const steady_clock::time_point start = steady_clock::now();
+        if (db->export_dump(export_path) == status::ok) {
+            const double export_s =
+                duration<double>(steady_clock::now() - start).count();
+            printf("Export: %.2f s, %.0f MB/s\n",
+                   export_s,
+                   file_size(export_path) / export_s / 1e6);
+        } else {
+            perror("Could not export the dump");
+        }
+    }
+    remove(dump_path);
+    remove(export_path);
+}
+
+static void usage(const char* prog) {
+    std::cerr
+        << "usage: " << prog
+        << " [-h] [-t threads] [-d seconds] [-u users] [-p users] [-k users]\n"
+           "       [-n deletes] [-l texts] [-s exponent] [-f filter] "
+           "[-m texts]\n"
+           "       [-z texts] [-b texts]\n"
+           "\n"
+           "Measure the throughput of the Chat 262 database, without any\n"
+           "sockets, from 1 up to <threads> threads.\n"
+           "\n"
+           "Options:\n"
+           "\t-h\t\t Display this message and exit.\n"
+           "\t-t threads\t Largest number of threads (default 8).\n"
+           "\t-d seconds\t Duration of each measurement (default 1).\n"
+           "\t-u users\t Users in the send scenarios (default 10000).\n"
+           "\t-p users\t Users in the search scenario (default 100000).\n"
+           "\t-k users\t Correspondents of every deleted user (default 1000).\n"
+           "\t-n deletes\t Users deleted by every thread (default 20).\n"
+           "\t-l texts\t Length of the hot chat in recv_hot_chat (default\n"
+           "\t\t\t 1000).\n"
+           "\t-s exponent\t Exponent of the Zipfian distribution (default\n"
+           "\t\t\t 0.99).\n"
+           "\t-f filter\t Only run scenarios whose name contains <filter>.\n"
+           "\t-m texts\t Instead of the throughput, measure the memory used\n"
+           "\t\t\t to store <texts> short texts.\n"
+           "\t-z texts\t Instead of the throughput, measure the compression\n"
+           "\t\t\t of <texts> chat texts in chats of -l texts, and its\n"
+           "\t\t\t effect on receiving them.\n"
+           "\t-b texts\t Instead of the throughput, measure loading a dump\n"
+           "\t\t\t of -u users and <texts> short texts, and\n"
+           "\t\t\t exporting it again. The dump is written to the\n"
+           "\t\t\t working directory, and removed at the end.\n";
+}
+
+int main(int argc, char** argv) {
+    bench_config cfg;
+    cfg.max_threads_ = 8;
+    cfg.duration_s_ = 1;
+    cfg.num_users_ = 10000;
+    cfg.population_ = 100000;
+    cfg.num_correspondents_ = 1000;
+    cfg.deletes_per_thread_ = 20;
+    cfg.hot_chat_len_ = 1000;
+    cfg.zipf_s_ = 0.99;
+    cfg.memory_texts_ = 0;
+    cfg.compress_texts_ = 0;
+    cfg.load_texts_ = 0;
+
+    try {
+        int opt;
+        while ((opt = getopt(argc, argv, "ht:d:u:p:k:n:l:s:f:m:z:b:")) != -1) {
+            switch (opt) {
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            case 't':
+                cfg.max_threads_ = std::stoul(optarg);
+                break;
+            case 'd':
+                cfg.duration_s_ = std::stod(optarg);
+                break;
+            case 'u':
+                cfg.num_users_ = std::stoul(optarg);
+                break;
+            case 'p':
+                cfg.population_ = std::stoul(optarg);
+                break;
+            case 'k':
+                cfg.num_correspondents_ = std::stoul(optarg);
+                break;
+            case 'n':
+                cfg.deletes_per_thread_ = std::stoul(optarg);
+                break;
+            case 'l':
+                cfg.hot_chat_len_ = std::stoul(optarg);
+                break;
+            case 's':
+                cfg.zipf_s_ = std::stod(optarg);
+                break;
+            case 'f':
+                cfg.filter_ = optarg;
+                break;
+            case 'm':
+                cfg.memory_texts_ = std::stoul(optarg);
+                break;
+            case 'z':
+                cfg.compress_texts_ = std::stoul(optarg);
+                break;
+            case 'b':
+                cfg.load_texts_ = std::stoul(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << "\n";
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (optind != argc || cfg.max_threads_ == 0 || cfg.num_users_ < 2 ||
+        cfg.population_ == 0 ||
+        (cfg.load_texts_ != 0 &&
+         cfg.num_users_ <= 2 * load_chats_per_user)) {
+        std::cerr << "Invalid argument\n";
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Thread counts double until the maximum, which is always included
+    std::vector<size_t> thread_counts;
+    for (size_t t = 1; t < cfg.max_threads_; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(cfg.max_threads_);
+
+    if (cfg.memory_texts_ != 0) {
+        measure_memory(cfg);
+        return EXIT_SUCCESS;
+    }
+    if (cfg.compress_texts_ != 0) {
+        measure_compression(cfg);
+        return EXIT_SUCCESS;
+    }
+    if (cfg.load_texts_ != 0) {
+        measure_load(cfg, thread_counts);
+        return EXIT_SUCCESS;
+    }
+
+
+    printf("Hardware threads: %u\n", std::thread::hardware_concurrency());
+    for (const scenario& sc : make_scenarios(cfg)) {
+        if (sc.name_.find(cfg.filter_) == std::string::npos) {
+            continue;
+        }
+        printf("\n%s: %s\n", sc.name_.c_str(), sc.description_.c_str());
+        printf("%8s %14s %8s\n", "threads", "ops/s", "speedup");
+        double base = 0;
+        for (size_t t : thread_counts) {
+            double ops_per_s = measure(sc, t, cfg);
+            if (base == 0) {
+                base = ops_per_s;
+            }
+            printf("%8zu %14.1f %8.2f\n", t, ops_per_s, ops_per_s / base);
+            fflush(stdout);
+        }
+    }
+    return EXIT_SUCCESS;
+}
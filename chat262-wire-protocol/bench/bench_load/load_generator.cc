@@ -0,0 +1,384 @@
+#include "load_generator.h"
+
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <ctime>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+// Addresses of the server and the other shards of its cluster
+static std::vector<uint32_t> shard_addresses(
+    const load_generator::config& cfg) {
+    std::vector<uint32_t> addrs = cfg.n_shard_addrs_;
+    addrs.push_back(cfg.n_ip_addr_);
+    return addrs;
+}
+
+load_generator::load_generator(const config& cfg) :
+    cfg_(cfg),
+    ring_(shard_addresses(cfg)),
+    ready_(0),
+    failed_(false),
+    go_(false),
+    registrations_(0) {
+    // Usernames must be unique across runs against the same server
+    prefix_ = "b" + std::to_string(getpid()) + "t" +
+              std::to_string(time(nullptr) % 1000000) + "_";
+}
+
+status load_generator::run() {
+    std::vector<user_stats> stats(cfg_.num_users_);
+    std::vector<std::thread> threads;
+    threads.reserve(cfg_.num_users_);
+    for (size_t i = 0; i != cfg_.num_users_; ++i) {
+        threads.emplace_back(&load_generator::run_user,
+                             this,
+                             i,
+                             std::ref(stats[i]));
+    }
+
+    // Wait until every user is connected and logged in
+    while (ready_.load() != cfg_.num_users_) {
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    start_ = steady_clock::now();
+    go_.store(true, std::memory_order_release);
+
+    for (std::thread& t : threads) {
+        t.join();
+    }
+    if (failed_.load()) {
+        fprintf(stderr, "Some users could not be set up\n");
+        return status::error;
+    }
+
+    print_report(stats, static_cast<double>(cfg_.duration_.count()));
+    return status::ok;
+}
+
+void load_generator::parse_mix(
+    const std::string& str,
+    std::array<double, static_cast<size_t>(op::num_ops)>& mix) {
+    mix.fill(0.0);
+    size_t pos = 0;
+    while (pos < str.length()) {
+        size_t comma = str.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = str.length();
+        }
+        std::string item = str.substr(pos, comma - pos);
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) {
+            throw std::invalid_argument("Invalid mix entry \"" + item + "\"");
+        }
+        std::string name = item.substr(0, eq);
+        double weight = std::stod(item.substr(eq + 1));
+        if (weight < 0) {
+            throw std::invalid_argument("Negative weight for \"" + name + "\"");
+        }
+
+        size_t i = 0;
+        for (; i != static_cast<size_t>(op::num_ops); ++i) {
+            if (name == op_lookup(static_cast<op>(i))) {
+                mix[i] = weight;
+                break;
+            }
+        }
+        if (i == static_cast<size_t>(op::num_ops)) {
+            throw std::invalid_argument("Unknown operation \"" + name + "\"");
+        }
+        pos = comma + 1;
+    }
+
+    double total = 0;
+    for (double w : mix) {
+        total += w;
+    }
+    if (total <= 0) {
+        throw std::invalid_argument("The mix contains no operations");
+    }
+}
+
+const char* load_generator::op_lookup(const op o) {
+    switch (o) {
+    case op::registration:
+        return "register";
+    case op::login:
+        return "login";
+    case op::send_txt:
+        return "send";
+    case op::recv_txt:
+        return "recv";
+    case op::search:
+        return "search";
+    case op::correspondents:
+        return "corr";
+    default:
+        return "unknown";
+    }
+}
+
+status load_generator::register_user(client& c, const std::string& self) {
+    uint32_t stat_code;
+    if (cfg_.n_primary_addr_ == 0) {
+        if (c.registration(self, "password", stat_code) != status::ok ||
+            stat_code != chat262::status_code_ok) {
+            return status::error;
+        }
+        return status::ok;
+    }
+
+    // Register on the primary, and wait until the replica applied it
+    client primary;
+    uint16_t chosen;
+    uint32_t enabled;
+    uint64_t applied;
+    uint32_t staleness_ms;
+    if (primary.connect_server(cfg_.n_primary_addr_) != status::ok ||
+        primary.hello(chat262::latest_version,
+                      chat262::feature_read_tokens,
+                      chosen,
+                      enabled) != status::ok ||
+        enabled != chat262::feature_read_tokens ||
+        primary.registration(self, "password", stat_code) != status::ok ||
+        stat_code != chat262::status_code_ok ||
+        c.sync(primary.last_token(),
+               5000,
+               stat_code,
+               applied,
+               staleness_ms) != status::ok ||
+        stat_code != chat262::status_code_ok) {
+        return status::error;
+    }
+    return status::ok;
+}
+
+uint32_t load_generator::server_of(const std::string& username) const {
+    return ring_.shard_of(username);
+}
+
+std::string load_generator::fresh_username(const uint32_t n_ip_addr) {
+    // A shard only registers its own users, so skip the others
+    while (true) {
+        std::string name = prefix_ + "r" + std::to_string(registrations_++);
+        if (server_of(name) == n_ip_addr) {
+            return name;
+        }
+    }
+}
+
+void load_generator::run_user(const size_t user_idx, user_stats& stats) {
+    stats.errors_.fill(0);
+
+    client c;
+    uint32_t stat_code;
+    const std::string self = username(user_idx);
+    const uint32_t n_ip_addr = server_of(self);
+    if (c.connect_server(n_ip_addr) != status::ok ||
+        register_user(c, self) != status::ok ||
+        c.login(self, "password", stat_code) != status::ok ||
+        stat_code != chat262::status_code_ok) {
+        failed_.store(true);
+        ++ready_;
+        return;
+    }
+    ++ready_;
+
+    while (!go_.load(std::memory_order_acquire)) {
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    if (failed_.load()) {
+        return;
+    }
+
+    const steady_clock::time_point measure_start = start_ + cfg_.warmup_;
+    const steady_clock::time_point end = measure_start + cfg_.duration_;
+
+    std::mt19937_64 rng(user_idx);
+    std::discrete_distribution<size_t> pick_op(cfg_.mix_.begin(),
+                                               cfg_.mix_.end());
+    std::uniform_int_distribution<size_t> pick_user(0, cfg_.num_users_ - 1);
+    std::uniform_int_distribution<int> pick_digit(0, 9);
+    const std::string txt(cfg_.txt_len_, 'x');
+
+    // In open-loop mode, each user gets an equal share of the total rate, and
+    // the users' schedules are staggered so they don't arrive in bursts
+    const bool open_loop = cfg_.rate_ > 0;
+    nanoseconds interval(0);
+    steady_clock::time_point next = start_;
+    if (open_loop) {
+        interval = duration_cast<nanoseconds>(
+            duration<double>(cfg_.num_users_ / cfg_.rate_));
+        next += interval * user_idx / cfg_.num_users_;
+    }
+
+    chat curr_chat;
+    std::vector<std::string> usernames;
+    while (true) {
+        steady_clock::time_point intended;
+        if (open_loop) {
+            intended = next;
+            next += interval;
+            std::this_thread::sleep_until(intended);
+        } else {
+            intended = steady_clock::now();
+        }
+        if (intended >= end) {
+            break;
+        }
+
+        op o = static_cast<op>(pick_op(rng));
+        steady_clock::time_point sent = steady_clock::now();
+        status s = status::ok;
+        switch (o) {
+        case op::registration: {
+            s = c.registration(fresh_username(n_ip_addr),
+                               "password",
+                               stat_code);
+            break;
+        }
+        case op::login:
+            s = c.login(self, "password", stat_code);
+            break;
+        case op::send_txt:
+            s = c.send_txt(username(pick_user(rng)), txt, stat_code);
+            break;
+        case op::recv_txt:
+            s = c.recv_txt(username(pick_user(rng)), stat_code, curr_chat);
+            break;
+        case op::search:
+            s = c.list_accounts(prefix_ + std::to_string(pick_digit(rng)) + "*",
+                                stat_code,
+                                usernames);
+            break;
+        case op::correspondents:
+            s = c.recv_correspondents(stat_code, usernames);
+            break;
+        default:
+            break;
+        }
+        steady_clock::time_point done = steady_clock::now();
+
+        size_t idx = static_cast<size_t>(o);
+        if (intended >= measure_start) {
+            stats.latency_[idx].record(static_cast<uint64_t>(
+                duration_cast<nanoseconds>(done - intended).count()));
+            stats.service_[idx].record(static_cast<uint64_t>(
+                duration_cast<nanoseconds>(done - sent).count()));
+            if (s != status::ok || stat_code != chat262::status_code_ok) {
+                ++stats.errors_[idx];
+            }
+        }
+        // The connection is unusable after a transport error
+        if (s != status::ok) {
+            fprintf(stderr,
+                    "User %zu stopped after a transport error\n",
+                    user_idx);
+            break;
+        }
+    }
+}
+
+std::string load_generator::username(const size_t user_idx) const {
+    return prefix_ + std::to_string(user_idx);
+}
+
+static void print_row(const char* name,
+                      const histogram& h,
+                      const uint64_t errors) {
+    // All latencies are printed in microseconds
+    printf("%-10s %10" PRIu64 " %8" PRIu64
+           " %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           name,
+           h.count(),
+           errors,
+           h.mean() / 1e3,
+           h.percentile(50) / 1e3,
+           h.percentile(90) / 1e3,
+           h.percentile(99) / 1e3,
+           h.percentile(99.9) / 1e3,
+           h.max() / 1e3);
+}
+
+static void print_header(const char* title) {
+    printf("\n%s (us)\n", title);
+    printf("%-10s %10s %8s %10s %10s %10s %10s %10s %10s\n",
+           "op",
+           "count",
+           "errors",
+           "mean",
+           "p50",
+           "p90",
+           "p99",
+           "p99.9",
+           "max");
+}
+
+void load_generator::print_report(const std::vector<user_stats>& stats,
+                                  const double elapsed_s) const {
+    const bool open_loop = cfg_.rate_ > 0;
+    if (open_loop) {
+        printf("Open loop at %.1f ops/s", cfg_.rate_);
+    } else {
+        printf("Closed loop");
+    }
+    printf(", %zu users, %" PRId64 "s warmup, %" PRId64 "s measured\n",
+           cfg_.num_users_,
+           static_cast<int64_t>(cfg_.warmup_.count()),
+           static_cast<int64_t>(cfg_.duration_.count()));
+
+    // Merge per-user results
+    user_stats total;
+    total.errors_.fill(0);
+    histogram all_latency;
+    histogram all_service;
+    uint64_t all_errors = 0;
+    for (const user_stats& u : stats) {
+        for (size_t i = 0; i != static_cast<size_t>(op::num_ops); ++i) {
+            total.latency_[i].merge(u.latency_[i]);
+            total.service_[i].merge(u.service_[i]);
+            total.errors_[i] += u.errors_[i];
+            all_latency.merge(u.latency_[i]);
+            all_service.merge(u.service_[i]);
+            all_errors += u.errors_[i];
+        }
+    }
+
+    printf("Throughput: %.1f ops/s\n", all_latency.count() / elapsed_s);
+
+    // In closed loop, latency and service time are the same thing
+    print_header(open_loop ? "Latency, corrected for coordinated omission"
+                           : "Latency");
+    for (size_t i = 0; i != static_cast<size_t>(op::num_ops); ++i) {
+        if (total.latency_[i].count() != 0) {
+            print_row(op_lookup(static_cast<op>(i)),
+                      total.latency_[i],
+                      total.errors_[i]);
+        }
+    }
+    print_row("all", all_latency, all_errors);
+
+    if (open_loop) {
+        print_header("Service time");
+        for (size_t i = 0; i != static_cast<size_t>(op::num_ops); ++i) {
+            if (total.service_[i].count() != 0) {
+                print_row(op_lookup(static_cast<op>(i)),
+                          total.service_[i],
+                          total.errors_[i]);
+            }
+        }
+        print_row("all", all_service, all_errors);
+    }
+}
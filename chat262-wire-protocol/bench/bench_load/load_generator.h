@@ -0,0 +1,135 @@
+#ifndef _LOAD_GENERATOR_H_
+#define _LOAD_GENERATOR_H_
+
+#include "client.h"
+#include "common.h"
+#include "histogram.h"
+#include "shard_ring.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Drives a Chat 262 server with many concurrent simulated users. Every user
+// has its own connection and its own thread, and issues a random sequence of
+// operations drawn from a configurable mix.
+//
+// In closed-loop mode, every user issues its next operation as soon as the
+// previous one completes, so the offered load adapts to the server.
+//
+// In open-loop mode, operations arrive at a fixed total rate, regardless of
+// how fast the server responds. Latency is measured from the time an
+// operation was scheduled to start, not from the time it was actually sent,
+// so time spent queued behind a slow operation is accounted for (this
+// corrects for coordinated omission).
+class load_generator {
+public:
+    // Operations a simulated user can perform
+    enum class op : size_t {
+        registration,
+        login,
+        send_txt,
+        recv_txt,
+        search,
+        correspondents,
+        num_ops
+    };
+
+    struct config {
+        // IP address of the server in network byte order
+        uint32_t n_ip_addr_;
+        // IP address of the primary that the server is a read replica of, or
+        // 0. Users are registered on the primary.
+        uint32_t n_primary_addr_;
+        // IP addresses of the other shards, if the server is a shard of a
+        // sharded cluster. Every user connects to its own shard.
+        std::vector<uint32_t> n_shard_addrs_;
+        // Number of concurrent users
+        size_t num_users_;
+        // Duration of the measured run
+        std::chrono::seconds duration_;
+        // Duration of the warmup, whose results are discarded
+        std::chrono::seconds warmup_;
+        // Total arrival rate in operations per second. 0 for closed loop.
+        double rate_;
+        // Length of sent texts in bytes
+        size_t txt_len_;
+        // Relative weights of operations in the mix, indexed by `op`
+        std::array<double, static_cast<size_t>(op::num_ops)> mix_;
+    };
+
+    explicit load_generator(const config& cfg);
+
+    // Run the benchmark and print the report to stdout.
+    // @return ok    - The run completed.
+    // @return error - Some user could not connect, register or log in.
+    status run();
+
+    // Parse an operation mix of the form "send=50,recv=30,search=20" into
+    // `mix`. Operations that are not mentioned get a weight of 0.
+    // Throws `std::invalid_argument` exception on error.
+    static void parse_mix(const std::string& str,
+                          std::array<double, static_cast<size_t>(op::num_ops)>&
+                              mix);
+
+    // Look up the operation and return its name, as used in the mix
+    static const char* op_lookup(const op o);
+
+private:
+    // Per-user results, merged after the run
+    struct user_stats {
+        std::array<histogram, static_cast<size_t>(op::num_ops)> latency_;
+        std::array<histogram, static_cast<size_t>(op::num_ops)> service_;
+        std::array<uint64_t, static_cast<size_t>(op::num_ops)> errors_;
+    };
+
+    // Register the user `self` for the connection `c`: on the server, or on
+    // the primary of a read replica, waiting until the replica applied it.
+    // @return ok    - The user is registered.
+    // @return error - The registration failed.
+    status register_user(client& c, const std::string& self);
+
+    // IP address of the server that `username` connects to: its shard, or
+    // the server
+    uint32_t server_of(const std::string& username) const;
+
+    // A fresh username for a registration operation of a user connected to
+    // `n_ip_addr`
+    std::string fresh_username(const uint32_t n_ip_addr);
+
+    // Body of a simulated user's thread
+    void run_user(const size_t user_idx, user_stats& stats);
+
+    // Username of the `user_idx`-th simulated user
+    std::string username(const size_t user_idx) const;
+
+    void print_report(const std::vector<user_stats>& stats,
+                      const double elapsed_s) const;
+
+    const config cfg_;
+
+    // The shards of the cluster. Without shards, holds the server only.
+    const chat262::shard_ring ring_;
+
+    // Prefix of all usernames in this run, so that runs against the same
+    // server do not clash
+    std::string prefix_;
+
+    // Number of users that finished the setup (connect, register, log in)
+    std::atomic<size_t> ready_;
+    // Set if any user failed the setup
+    std::atomic<bool> failed_;
+    // Set by the main thread when all users are ready
+    std::atomic<bool> go_;
+    // Start of the warmup, valid once `go_` is set
+    std::chrono::steady_clock::time_point start_;
+
+    // Counter for fresh usernames in registration operations
+    std::atomic<uint64_t> registrations_;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include "common.h"
+#include "load_generator.h"
+
+#include <arpa/inet.h>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+static const char* default_mix = "login=1,send=40,recv=40,search=5,corr=10";
+
+static void usage(const char* prog) {
+    std::cerr
+        << "usage: " << prog
+        << " [-h] [-u users] [-d seconds] [-w seconds] [-r rate] [-s bytes]\n"
+           "       [-m mix] [-p ip address | -H ip address] <ip address>\n"
+           "\n"
+           "Benchmark the Chat262 server on IP address <ip address> with many\n"
+           "concurrent simulated users.\n"
+           "\n"
+           "Options:\n"
+           "\t-h\t\t Display this message and exit.\n"
+           "\t-u users\t Number of concurrent users (default 16).\n"
+           "\t-d seconds\t Duration of the measured run (default 10).\n"
+           "\t-w seconds\t Duration of the warmup (default 2).\n"
+           "\t-r rate\t\t Run in open loop with a fixed total arrival rate,\n"
+           "\t\t\t in operations per second. By default, runs in closed\n"
+           "\t\t\t loop.\n"
+           "\t-s bytes\t Length of sent texts (default 32).\n"
+           "\t-m mix\t\t Relative weights of operations, e.g.\n"
+           "\t\t\t \"send=50,recv=30,search=20\". Operations are register,\n"
+           "\t\t\t login, send, recv, search and corr. The default is\n"
+           "\t\t\t \""
+        << default_mix
+        << "\".\n"
+           "\t-p ip address\t Register the users on the primary on\n"
+           "\t\t\t <ip address>, of which the benchmarked server is a\n"
+           "\t\t\t read replica. Writes fail on the replica, so the mix\n"
+           "\t\t\t should only hold reads.\n"
+           "\t-H ip address\t The benchmarked server is a shard of a cluster\n"
+           "\t\t\t with the shard on <ip address>. Given once for\n"
+           "\t\t\t every other shard. Every user connects to its own\n"
+           "\t\t\t shard.\n";
+}
+
+int main(int argc, char** argv) {
+    load_generator::config cfg;
+    cfg.num_users_ = 16;
+    cfg.duration_ = std::chrono::seconds(10);
+    cfg.warmup_ = std::chrono::seconds(2);
+    cfg.rate_ = 0;
+    cfg.txt_len_ = 32;
+    cfg.n_primary_addr_ = 0;
+
+    try {
+        load_generator::parse_mix(default_mix, cfg.mix_);
+        int opt;
+        while ((opt = getopt(argc, argv, "hu:d:w:r:s:m:p:H:")) != -1) {
+            switch (opt) {
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            case 'u':
+                cfg.num_users_ = std::stoul(optarg);
+                break;
+            case 'd':
+                cfg.duration_ = std::chrono::seconds(std::stoul(optarg));
+                break;
+            case 'w':
+                cfg.warmup_ = std::chrono::seconds(std::stoul(optarg));
+                break;
+            case 'r':
+                cfg.rate_ = std::stod(optarg);
+                break;
+            case 's':
+                cfg.txt_len_ = std::stoul(optarg);
+                break;
+            case 'm':
+                load_generator::parse_mix(optarg, cfg.mix_);
+                break;
+            case 'p':
+                if (inet_pton(AF_INET, optarg, &cfg.n_primary_addr_) != 1) {
+                    throw std::invalid_argument("Invalid primary IP address");
+                }
+                break;
+            case 'H': {
+                uint32_t n_shard_addr;
+                if (inet_pton(AF_INET, optarg, &n_shard_addr) != 1) {
+                    throw std::invalid_argument("Invalid shard IP address");
+                }
+                cfg.n_shard_addrs_.push_back(n_shard_addr);
+                break;
+            }
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << "\n";
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (optind != argc - 1) {
+        std::cerr << "Wrong number of arguments\n";
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (cfg.num_users_ == 0 || cfg.duration_.count() == 0 || cfg.rate_ < 0 ||
+        (cfg.n_primary_addr_ != 0 && !cfg.n_shard_addrs_.empty())) {
+        std::cerr << "Invalid argument\n";
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (inet_pton(AF_INET, argv[optind], &cfg.n_ip_addr_) != 1) {
+        std::cerr << "Invalid IP address\n";
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    load_generator gen(cfg);
+    if (gen.run() == status::ok) {
+        return EXIT_SUCCESS;
+    } else {
+        return EXIT_FAILURE;
+    }
+}
@@ -12,7 +12,13 @@
 
 namespace chat262 {
 
+// Every connection starts with this version, and messages are serialized
+// with it. A hello negotiates a later version for the rest of the connection,
+// and messages are then sent with that version instead.
 static constexpr uint16_t version = 1;
+// Latest version this implementation speaks. Version 2 adds the hello
+// features.
+static constexpr uint16_t latest_version = 2;
 static constexpr uint16_t port = 61079;
 
 // Message types.
@@ -29,6 +35,19 @@ enum message_type : uint16_t {
     msgtype_recv_txt_request = 106,
     msgtype_correspondents_request = 107,
     msgtype_delete_request = 108,
+    msgtype_hello_request = 109,
+    msgtype_replicate_request = 110,
+    msgtype_vote_request = 111,
+    msgtype_append_request = 112,
+    msgtype_snapshot_request = 113,
+    msgtype_tail_request = 114,
+    msgtype_sync_request = 115,
+    msgtype_forward_request = 116,
+    msgtype_shard_accounts_request = 117,
+    msgtype_proxy_request = 118,
+    msgtype_migrate_request = 119,
+    msgtype_import_request = 120,
+    msgtype_locate_request = 121,
 
     // Server responses
     msgtype_registration_response = 201,
@@ -39,6 +58,19 @@ enum message_type : uint16_t {
     msgtype_recv_txt_response = 206,
     msgtype_correspondents_response = 207,
     msgtype_delete_response = 208,
+    msgtype_hello_response = 209,
+    msgtype_replicate_response = 210,
+    msgtype_vote_response = 211,
+    msgtype_append_response = 212,
+    msgtype_snapshot_response = 213,
+    msgtype_tail_response = 214,
+    msgtype_sync_response = 215,
+    msgtype_forward_response = 216,
+    msgtype_shard_accounts_response = 217,
+    msgtype_proxy_response = 218,
+    msgtype_migrate_response = 219,
+    msgtype_import_response = 220,
+    msgtype_locate_response = 221,
 
     // Special server responses
     msgtype_wrong_version_response = 301,
@@ -54,7 +86,45 @@ enum status_code : uint32_t {
     status_code_user_noexist = 3,
     status_code_username_invalid = 4,
     status_code_password_invalid = 5,
-    status_code_unauthorized = 6
+    status_code_unauthorized = 6,
+    status_code_quota_exceeded = 7,
+    status_code_read_only = 8,
+    status_code_not_leader = 9,
+    status_code_stale = 10,
+    status_code_wrong_shard = 11
+};
+
+// A message type with this bit set carries a compressed body, laid out as in
+// `compressed_body`. Only responses are compressed, and only on connections
+// that negotiated `feature_compression`.
+static constexpr uint16_t msgflag_compressed = 0x8000;
+
+// A message type with this bit set carries a request ID ahead of its body,
+// laid out as in `identified_request`. Only requests carry IDs, and only on
+// connections that negotiated `feature_request_ids`.
+static constexpr uint16_t msgflag_request_id = 0x4000;
+
+// Optional protocol features of version 2, negotiated per connection with a
+// hello. A connection that never sends one uses none of them.
+enum feature : uint32_t {
+    // The server compresses large response bodies
+    feature_compression = 1u << 0,
+    // The client may send requests without waiting for the responses to the
+    // previous ones. Responses come back in the order of the requests.
+    feature_pipelining = 1u << 1,
+    // Reserved for the server sending texts as they arrive
+    feature_push = 1u << 2,
+    // Reserved for receiving long chats in pages
+    feature_cursors = 1u << 3,
+    // Reserved for several requests in one message
+    feature_batching = 1u << 4,
+    // Successful registration, send text and delete responses carry a read
+    // token, which a read replica can be asked to catch up to
+    feature_read_tokens = 1u << 5,
+    // Requests may carry an ID. A registration, send text or delete request
+    // with the ID of a recent one on the connection is not handled again,
+    // and is answered with the response to the first.
+    feature_request_ids = 1u << 6
 };
 
 // Look up the message type and returns a descriptive string
@@ -113,6 +183,10 @@ struct registration_response {
     // Layout from the specification:
     //
     // uint32_t status_code;
+    // uint64_t token;
+    //
+    // `token` is only present if `status_code` is `status_code_ok`, on
+    // connections that negotiated `feature_read_tokens`.
 
     // Form a complete registration response message from `stat_code`.
     static std::shared_ptr<message> serialize(const uint32_t stat_code);
@@ -130,6 +204,20 @@ struct registration_response {
     //                 advertised in the message header.
     static status deserialize(const std::vector<uint8_t>& data,
                               uint32_t& stat_code);
+
+    // Form a complete registration response message from `stat_code`, followed
+    // by `token` if it's OK.
+    static std::shared_ptr<message> serialize(const uint32_t stat_code,
+                                              const uint64_t token);
+
+    // Extract the status code from `data` into `stat_code`, and the token
+    // into `token` if the status code is OK. `data` must contain the
+    // `registration_response` structure with a token.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint32_t& stat_code,
+                              uint64_t& token);
 };
 
 struct login_request {
@@ -313,6 +401,10 @@ struct send_txt_response {
     // Layout from the specification:
     //
     // uint32_t status_code;
+    // uint64_t token;
+    //
+    // `token` is only present if `status_code` is `status_code_ok`, on
+    // connections that negotiated `feature_read_tokens`.
 
     // Form a complete send text response message from `stat_code`.
     static std::shared_ptr<message> serialize(const uint32_t stat_code);
@@ -330,6 +422,20 @@ struct send_txt_response {
     //                 advertised in the message header.
     static status deserialize(const std::vector<uint8_t>& data,
                               uint32_t& stat_code);
+
+    // Form a complete send text response message from `stat_code`, followed
+    // by `token` if it's OK.
+    static std::shared_ptr<message> serialize(const uint32_t stat_code,
+                                              const uint64_t token);
+
+    // Extract the status code from `data` into `stat_code`, and the token
+    // into `token` if the status code is OK. `data` must contain the
+    // `send_txt_response` structure with a token.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint32_t& stat_code,
+                              uint64_t& token);
 };
 
 struct recv_txt_request {
@@ -378,6 +484,11 @@ struct recv_txt_response {
     static std::shared_ptr<message> serialize(const uint32_t stat_code,
                                               const chat& c);
 
+    // Form a complete receive text response from `stat_code` and `v`. The
+    // text bytes are copied one run at a time.
+    static std::shared_ptr<message> serialize(const uint32_t stat_code,
+                                              const chat_view& v);
+
     // Extract the status code and the received texts from `data` into
     // `stat_code` and `c`. `data` must contain the `recv_txt_response`
     // structure. If `stat_code` is `status_code_ok`, then the data is properly
@@ -475,6 +586,10 @@ struct delete_response {
     // Layout from the specification:
     //
     // uint32_t status_code;
+    // uint64_t token;
+    //
+    // `token` is only present if `status_code` is `status_code_ok`, on
+    // connections that negotiated `feature_read_tokens`.
 
     // Form a complete delete response message from `stat_code`.
     static std::shared_ptr<message> serialize(const uint32_t stat_code);
@@ -492,6 +607,20 @@ struct delete_response {
     //                 advertised in the message header.
     static status deserialize(const std::vector<uint8_t>& data,
                               uint32_t& stat_code);
+
+    // Form a complete delete response message from `stat_code`, followed
+    // by `token` if it's OK.
+    static std::shared_ptr<message> serialize(const uint32_t stat_code,
+                                              const uint64_t token);
+
+    // Extract the status code from `data` into `stat_code`, and the token
+    // into `token` if the status code is OK. `data` must contain the
+    // `delete_response` structure with a token.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint32_t& stat_code,
+                              uint64_t& token);
 };
 
 struct wrong_version_response {
@@ -551,6 +680,906 @@ struct invalid_body_response {
     static status deserialize(const std::vector<uint8_t>& data);
 };
 
+struct hello_request {
+    // Layout from the specification:
+    //
+    // uint16_t version;
+    // uint32_t features;
+
+    // Form a complete hello request message offering protocol versions up to
+    // `max_version`, and asking for the `feature` bits in `features`.
+    static std::shared_ptr<message> serialize(const uint16_t max_version,
+                                              const uint32_t features);
+
+    // Extract the offered version and the requested feature bits from `data`
+    // into `max_version` and `features`. `data` must contain the
+    // `hello_request` structure.
+    // @return ok    - success. `features` may hold bits that are unknown to
+    //                 the local implementation, and should be ignored.
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint16_t& max_version,
+                              uint32_t& features);
+};
+
+struct hello_response {
+    // Layout from the specification:
+    //
+    // uint16_t version;
+    // uint32_t features;
+
+    // Form a complete hello response message from the chosen `version`, and
+    // `features`, the requested features that the server enabled on the
+    // connection.
+    static std::shared_ptr<message> serialize(const uint16_t chosen_version,
+                                              const uint32_t features);
+
+    // Extract the chosen version and the enabled feature bits from `data` into
+    // `chosen_version` and `features`. `data` must contain the
+    // `hello_response` structure.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint16_t& chosen_version,
+                              uint32_t& features);
+};
+
+// A change to the database that a primary server replicates to its followers
+struct mutation {
+    enum op : uint8_t {
+        op_registration = 1,
+        op_send_txt = 2,
+        op_delete_user = 3,
+        // Changes nothing. A new Raft leader appends one to commit the
+        // entries of earlier terms.
+        op_noop = 4,
+        // The user moved to the shard whose IP address is `arg_`, in the
+        // xxx.xxx.xxx.xxx format. Only forwarded between shards.
+        op_move_user = 5
+    };
+
+    uint8_t op_;
+    // The registered user, the sender of the text, or the deleted or moved
+    // user
+    std::string username_;
+    // The password of the registered user, the recipient of the text, or the
+    // new shard of the moved user. Empty for a deletion.
+    std::string arg_;
+    // The text. Empty for a registration or a deletion.
+    std::string txt_;
+};
+
+struct replicate_request {
+    // Layout from the specification:
+    //
+    // uint64_t first_seq;
+    // uint32_t num_mutations;
+    // uint8_t ops[num_mutations];
+    // uint32_t lengths[3 * num_mutations];
+    // uint8_t strings[...];
+    //
+    // Every mutation has three lengths, of `username_`, `arg_` and `txt_`,
+    // and its three strings follow in the same order.
+
+    // Form a complete replicate request message holding `mutations`, the
+    // first of which has the sequence number `first_seq`.
+    static std::shared_ptr<message> serialize(
+        const uint64_t first_seq,
+        const std::vector<mutation>& mutations);
+
+    // Extract the sequence number of the first mutation and the mutations
+    // from `data` into `first_seq` and `mutations`. `data` must contain the
+    // `replicate_request` structure.
+    // @return ok    - success. The operations of the mutations are not
+    //                 checked.
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint64_t& first_seq,
+                              std::vector<mutation>& mutations);
+};
+
+struct replicate_response {
+    // Layout from the specification:
+    //
+    // uint64_t last_seq;
+
+    // Form a complete replicate response message acknowledging every
+    // mutation up to the sequence number `last_seq`.
+    static std::shared_ptr<message> serialize(const uint64_t last_seq);
+
+    // Extract the sequence number of the last applied mutation from `data`
+    // into `last_seq`. `data` must contain the `replicate_response`
+    // structure.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint64_t& last_seq);
+};
+
+struct vote_request {
+    // Layout from the specification:
+    //
+    // uint64_t term;
+    // uint32_t candidate;
+    // uint64_t last_log_index;
+    // uint64_t last_log_term;
+    //
+    // Servers of a Raft cluster are identified by their IP address, in
+    // network byte order.
+
+    // Form a complete vote request message from the `candidate` of `term`,
+    // whose last log entry has the index `last_log_index` and the term
+    // `last_log_term`.
+    static std::shared_ptr<message> serialize(const uint64_t term,
+                                              const uint32_t candidate,
+                                              const uint64_t last_log_index,
+                                              const uint64_t last_log_term);
+
+    // Extract the fields of the vote request from `data`. `data` must
+    // contain the `vote_request` structure.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint64_t& term,
+                              uint32_t& candidate,
+                              uint64_t& last_log_index,
+                              uint64_t& last_log_term);
+};
+
+struct vote_response {
+    // Layout from the specification:
+    //
+    // uint64_t term;
+    // uint32_t granted;
+
+    // Form a complete vote response message with the `term` of the voter,
+    // granting the vote if `granted` is set.
+    static std::shared_ptr<message> serialize(const uint64_t term,
+                                              const bool granted);
+
+    // Extract the term of the voter and whether the vote was granted from
+    // `data` into `term` and `granted`. `data` must contain the
+    // `vote_response` structure.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint64_t& term,
+                              bool& granted);
+};
+
+struct append_request {
+    // Layout from the specification:
+    //
+    // uint64_t term;
+    // uint32_t leader;
+    // uint64_t prev_log_index;
+    // uint64_t prev_log_term;
+    // uint64_t leader_commit;
+    // uint32_t num_terms;
+    // uint32_t num_mutations;
+    // uint64_t terms[num_terms];
+    // uint8_t ops[num_mutations];
+    // uint32_t lengths[3 * num_mutations];
+    // uint8_t strings[...];
+    //
+    // `num_terms` and `num_mutations` are equal: every entry is a mutation
+    // with the term in which it was appended. An empty request is a
+    // heartbeat.
+
+    // Form a complete append request message from the `leader` of `term`,
+    // holding the entries with `terms` and `mutations`, which follow the
+    // entry with the index `prev_log_index` and the term `prev_log_term`.
+    // The leader committed all entries up to `leader_commit`.
+    static std::shared_ptr<message> serialize(
+        const uint64_t term,
+        const uint32_t leader,
+        const uint64_t prev_log_index,
+        const uint64_t prev_log_term,
+        const uint64_t leader_commit,
+        const std::vector<uint64_t>& terms,
+        const std::vector<mutation>& mutations);
+
+    // Extract the fields of the append request from `data`. `data` must
+    // contain the `append_request` structure.
+    // @return ok    - success. The operations of the mutations are not
+    //                 checked.
+    // @return error - `data.size()` is of incorrect size, or the numbers of
+    //                 terms and of mutations differ.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint64_t& term,
+                              uint32_t& leader,
+                              uint64_t& prev_log_index,
+                              uint64_t& prev_log_term,
+                              uint64_t& leader_commit,
+                              std::vector<uint64_t>& terms,
+                              std::vector<mutation>& mutations);
+};
+
+struct append_response {
+    // Layout from the specification:
+    //
+    // uint64_t term;
+    // uint32_t success;
+    // uint64_t match_index;
+
+    // Form a complete append response message with the `term` of the
+    // follower. If `success` is set, the log of the follower matches the log
+    // of the leader up to `match_index`. Otherwise, it may match up to
+    // `match_index` at most.
+    static std::shared_ptr<message> serialize(const uint64_t term,
+                                              const bool success,
+                                              const uint64_t match_index);
+
+    // Extract the fields of the append response from `data`. `data` must
+    // contain the `append_response` structure.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint64_t& term,
+                              bool& success,
+                              uint64_t& match_index);
+};
+
+struct snapshot_request {
+    // Layout from the specification:
+    //
+    // uint64_t term;
+    // uint32_t leader;
+    // uint64_t last_index;
+    // uint64_t last_term;
+    // uint64_t offset;
+    // uint32_t done;
+    // uint32_t num_mutations;
+    // uint8_t ops[num_mutations];
+    // uint32_t lengths[3 * num_mutations];
+    // uint8_t strings[...];
+    //
+    // A snapshot is the list of mutations that rebuild the database from
+    // scratch, up to and including the log entry `last_index`. It's sent in
+    // chunks, and `offset` is the number of mutations in earlier chunks.
+
+    // Form a complete snapshot request message from the `leader` of `term`,
+    // holding the chunk `mutations` at `offset` of the snapshot up to the
+    // entry with the index `last_index` and the term `last_term`. `done` is
+    // set on the last chunk.
+    static std::shared_ptr<message> serialize(
+        const uint64_t term,
+        const uint32_t leader,
+        const uint64_t last_index,
+        const uint64_t last_term,
+        const uint64_t offset,
+        const bool done,
+        const std::vector<mutation>& mutations);
+
+    // Extract the fields of the snapshot request from `data`. `data` must
+    // contain the `snapshot_request` structure.
+    // @return ok    - success. The operations of the mutations are not
+    //                 checked.
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint64_t& term,
+                              uint32_t& leader,
+                              uint64_t& last_index,
+                              uint64_t& last_term,
+                              uint64_t& offset,
+                              bool& done,
+                              std::vector<mutation>& mutations);
+};
+
+struct snapshot_response {
+    // Layout from the specification:
+    //
+    // uint64_t term;
+    // uint64_t received;
+
+    // Form a complete snapshot response message with the `term` of the
+    // follower, which holds the first `received` mutations of the snapshot.
+    static std::shared_ptr<message> serialize(const uint64_t term,
+                                              const uint64_t received);
+
+    // Extract the term of the follower and the number of received mutations
+    // from `data` into `term` and `received`. `data` must contain the
+    // `snapshot_response` structure.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint64_t& term,
+                              uint64_t& received);
+};
+
+struct tail_request {
+    // Layout from the specification:
+    //
+    // uint64_t next_seq;
+    // uint64_t snapshot_offset;
+    // uint32_t max_wait_ms;
+
+    // Form a complete tail request message, which asks for the mutations
+    // from `next_seq` on, or for the chunk of a snapshot from
+    // `snapshot_offset` on if a snapshot is being received. The server waits
+    // up to `max_wait_ms` milliseconds for new mutations.
+    static std::shared_ptr<message> serialize(const uint64_t next_seq,
+                                              const uint64_t snapshot_offset,
+                                              const uint32_t max_wait_ms);
+
+    // Extract the next sequence number, the snapshot offset and the longest
+    // wait from `data` into `next_seq`, `snapshot_offset` and `max_wait_ms`.
+    // `data` must contain the `tail_request` structure.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint64_t& next_seq,
+                              uint64_t& snapshot_offset,
+                              uint32_t& max_wait_ms);
+};
+
+struct tail_response {
+    // Layout from the specification:
+    //
+    // uint64_t first_seq;
+    // uint64_t last_seq;
+    // uint32_t snapshot;
+    // uint32_t done;
+    // uint32_t num_mutations;
+    // mutation mutations[num_mutations];
+    //
+    // `last_seq` is the sequence number of the last mutation of the server.
+    // If `snapshot` is 0, `mutations` are numbered from `first_seq` on.
+    // Otherwise, they are a chunk of a snapshot of the database after the
+    // mutation `first_seq - 1`, and `done` is 1 for the last chunk.
+
+    // Form a complete tail response message
+    static std::shared_ptr<message> serialize(
+        const uint64_t first_seq,
+        const uint64_t last_seq,
+        const bool snapshot,
+        const bool done,
+        const std::vector<mutation>& mutations);
+
+    // Extract the fields of the response from `data`. `data` must contain the
+    // `tail_response` structure.
+    // @return ok    - success
+    // @return error - `data` is malformed.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint64_t& first_seq,
+                              uint64_t& last_seq,
+                              bool& snapshot,
+                              bool& done,
+                              std::vector<mutation>& mutations);
+};
+
+struct sync_request {
+    // Layout from the specification:
+    //
+    // uint64_t token;
+    // uint32_t max_wait_ms;
+
+    // Form a complete sync request message, which asks the server to wait
+    // up to `max_wait_ms` milliseconds until it applied the write of `token`.
+    static std::shared_ptr<message> serialize(const uint64_t token,
+                                              const uint32_t max_wait_ms);
+
+    // Extract the token and the longest wait from `data` into `token` and
+    // `max_wait_ms`. `data` must contain the `sync_request` structure.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint64_t& token,
+                              uint32_t& max_wait_ms);
+};
+
+struct sync_response {
+    // Layout from the specification:
+    //
+    // uint32_t status_code;
+    // uint64_t applied;
+    // uint32_t staleness_ms;
+
+    // Form a complete sync response message from `stat_code`, the token of
+    // the last write the server applied, and how stale its data may be.
+    static std::shared_ptr<message> serialize(const uint32_t stat_code,
+                                              const uint64_t applied,
+                                              const uint32_t staleness_ms);
+
+    // Extract the fields of the response from `data` into `stat_code`,
+    // `applied` and `staleness_ms`. `data` must contain the `sync_response`
+    // structure.
+    // @return ok    - success. There is no guarantee that `stat_code` is a
+    //                 valid member of the `status_code` enum, and local
+    //                 implementation should do further error-checking.
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint32_t& stat_code,
+                              uint64_t& applied,
+                              uint32_t& staleness_ms);
+};
+
+struct forward_request {
+    // Layout from the specification:
+    //
+    // uint32_t op;
+    // uint32_t username_length;
+    // uint32_t arg_length;
+    // uint32_t txt_length;
+    // uint8_t username[username_length];
+    // uint8_t arg[arg_length];
+    // uint8_t txt[txt_length];
+    //
+    // A shard forwards a write of one of its users to the shard that owns the
+    // other user of the write, as a mutation: a text to a user of that shard,
+    // or the deletion of the user, whose chats with the users of that shard
+    // are deleted there too.
+
+    // Form a complete forward request message holding `m`.
+    static std::shared_ptr<message> serialize(const mutation& m);
+
+    // Extract the forwarded mutation from `data` into `m`. `data` must
+    // contain the `forward_request` structure.
+    // @return ok    - success. The operation of the mutation is not checked.
+    // @return error - `data.size()` is of incorrect size, or the operation
+    //                 doesn't fit in 8 bits.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data, mutation& m);
+};
+
+struct forward_response {
+    // Layout from the specification:
+    //
+    // uint32_t status_code;
+
+    // Form a complete forward response message from `stat_code`.
+    static std::shared_ptr<message> serialize(const uint32_t stat_code);
+
+    // Extract the status code from `data` into `stat_code`.
+    // `data` must contain the `forward_response` structure.
+    // @return ok    - success. There is no guarantee that `stat_code` is a
+    //                 valid member of the `status_code` enum, and local
+    //                 implementation should do further error-checking.
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint32_t& stat_code);
+};
+
+struct shard_accounts_request {
+    // Layout from the specification:
+    //
+    // uint32_t pattern_length;
+    // uint8_t pattern[pattern_length];
+    //
+    // Unlike an accounts request, which a shard answers with the matching
+    // users of all shards, a shard accounts request is answered with the
+    // matching users of the shard only.
+
+    // Form a complete shard accounts request message from `pattern`.
+    static std::shared_ptr<message> serialize(const std::string& pattern);
+
+    // Extract the pattern from `data` into `pattern`. `data` must contain
+    // the `shard_accounts_request` structure.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              std::string& pattern);
+};
+
+struct shard_accounts_response {
+    // Layout from the specification: the same as `accounts_response`.
+
+    // Form a complete shard accounts response from `stat_code` and
+    // `usernames`, which are sorted.
+    static std::shared_ptr<message> serialize(
+        const uint32_t stat_code,
+        const std::vector<std::string>& usernames);
+
+    // Extract the status code and the usernames from `data` into `stat_code`
+    // and `usernames`. `data` must contain the `shard_accounts_response`
+    // structure.
+    // @return ok    - success. There is no guarantee that `stat_code` is a
+    //                 valid member of the `status_code` enum, and local
+    //                 implementation should do further error-checking.
+    // @return error - `data` is malformed.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint32_t& stat_code,
+                              std::vector<std::string>& usernames);
+};
+
+struct proxy_request {
+    // Layout from the specification:
+    //
+    // uint32_t features;
+    // uint32_t username_length;
+    // uint32_t request_length;
+    // uint8_t username[username_length];
+    // uint8_t request[request_length];
+    //
+    // A proxy relays the request of one of its clients, header and body, on a
+    // connection that it shares with other clients. The server handles the
+    // request as if the user `username` (or no user, if it is empty) were
+    // logged in on a connection of the version of the request header that
+    // negotiated `features`.
+
+    // Form a complete proxy request message from `features`, `username` and
+    // `request`.
+    static std::shared_ptr<message> serialize(const uint32_t features,
+                                              const std::string& username,
+                                              const std::string& request);
+
+    // Extract the features, the username and the relayed request from `data`
+    // into `features`, `username` and `request`. `data` must contain the
+    // `proxy_request` structure.
+    // @return ok    - success. `request` is not checked.
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint32_t& features,
+                              std::string& username,
+                              std::string& request);
+};
+
+struct proxy_response {
+    // Layout from the specification:
+    //
+    // uint32_t username_length;
+    // uint32_t response_length;
+    // uint8_t username[username_length];
+    // uint8_t response[response_length];
+    //
+    // `username` is the user that is logged in after the request (empty if
+    // none), and `response` is the response to the relayed request, header
+    // and body, as the server would have sent it to the client.
+
+    // Form a complete proxy response message from `username` and `response`.
+    static std::shared_ptr<message> serialize(const std::string& username,
+                                              const std::string& response);
+
+    // Extract the username and the relayed response from `data` into
+    // `username` and `response`. `data` must contain the `proxy_response`
+    // structure.
+    // @return ok    - success. `response` is not checked.
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              std::string& username,
+                              std::string& response);
+};
+
+struct migrate_request {
+    // Layout from the specification:
+    //
+    // uint32_t shard;
+    // uint32_t username_length;
+    // uint8_t username[username_length];
+    //
+    // Asks the shard of `username` to move the user, with all of its chats,
+    // to the other shard `shard` of the cluster, given by its IP address in
+    // network byte order. The user keeps sending and receiving texts while
+    // its chats are copied, and its writes only pause while the last of them
+    // are copied and the user changes shards.
+
+    // Form a complete migrate request message from `shard` and `username`.
+    static std::shared_ptr<message> serialize(const uint32_t shard,
+                                              const std::string& username);
+
+    // Extract the shard and the username from `data` into `shard` and
+    // `username`. `data` must contain the `migrate_request` structure.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint32_t& shard,
+                              std::string& username);
+};
+
+struct migrate_response {
+    // Layout from the specification:
+    //
+    // uint32_t status_code;
+    // uint64_t bytes;
+    // uint64_t copy_us;
+    // uint64_t pause_us;
+    //
+    // The fields after the status code are only present if it's
+    // `status_code_ok`: the bytes sent to the new shard, the microseconds
+    // from the start of the copy to the pause, and the microseconds that the
+    // writes of the user were paused.
+
+    // Form a complete migrate response message from `stat_code`, which is
+    // not OK.
+    static std::shared_ptr<message> serialize(const uint32_t stat_code);
+
+    // Form a complete migrate response message from `stat_code`, `bytes`,
+    // `copy_us` and `pause_us`.
+    static std::shared_ptr<message> serialize(const uint32_t stat_code,
+                                              const uint64_t bytes,
+                                              const uint64_t copy_us,
+                                              const uint64_t pause_us);
+
+    // Extract the fields of the response from `data`. `data` must contain
+    // the `migrate_response` structure.
+    // @return ok    - success. There is no guarantee that `stat_code` is a
+    //                 valid member of the `status_code` enum, and local
+    //                 implementation should do further error-checking. The
+    //                 other fields are only set if `stat_code` is OK.
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint32_t& stat_code,
+                              uint64_t& bytes,
+                              uint64_t& copy_us,
+                              uint64_t& pause_us);
+};
+
+struct import_request {
+    // Layout from the specification:
+    //
+    // uint32_t done;
+    // uint32_t username_length;
+    // uint32_t num_mutations;
+    // uint8_t username[username_length];
+    // mutation mutations[num_mutations];
+    //
+    // A shard that moves `username` sends the user to the new shard as
+    // mutations, in chunks: the registration of the user, the texts of its
+    // chats, then the texts sent and the deletions of correspondents that
+    // happened during the copy. Only the user's own copy of a text is stored.
+    // `done` is 1 on the last chunk, after which the user belongs to the new
+    // shard.
+
+    // Form a complete import request message holding the chunk `mutations`
+    // of `username`. `done` is set on the last chunk.
+    static std::shared_ptr<message> serialize(
+        const bool done,
+        const std::string& username,
+        const std::vector<mutation>& mutations);
+
+    // Extract the fields of the import request from `data`. `data` must
+    // contain the `import_request` structure.
+    // @return ok    - success. The operations of the mutations are not
+    //                 checked.
+    // @return error - `data` is malformed.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              bool& done,
+                              std::string& username,
+                              std::vector<mutation>& mutations);
+};
+
+struct import_response {
+    // Layout from the specification:
+    //
+    // uint32_t status_code;
+
+    // Form a complete import response message from `stat_code`.
+    static std::shared_ptr<message> serialize(const uint32_t stat_code);
+
+    // Extract the status code from `data` into `stat_code`.
+    // `data` must contain the `import_response` structure.
+    // @return ok    - success. There is no guarantee that `stat_code` is a
+    //                 valid member of the `status_code` enum, and local
+    //                 implementation should do further error-checking.
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint32_t& stat_code);
+};
+
+struct locate_request {
+    // Layout from the specification:
+    //
+    // uint32_t username_length;
+    // uint8_t username[username_length];
+    //
+    // Asks any shard of a cluster for the shard of `username`. A client that
+    // was told that a user belongs to another shard finds it this way, since
+    // users that moved no longer belong to the shard of the ring.
+
+    // Form a complete locate request message from `username`.
+    static std::shared_ptr<message> serialize(const std::string& username);
+
+    // Extract the username from `data` into `username`. `data` must contain
+    // the `locate_request` structure.
+    // @return ok    - success
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              std::string& username);
+};
+
+struct locate_response {
+    // Layout from the specification:
+    //
+    // uint32_t status_code;
+    // uint32_t shard;
+    //
+    // `shard` is the IP address of the shard in network byte order, and only
+    // present if `status_code` is `status_code_ok`.
+
+    // Form a complete locate response message from `stat_code` and `shard`.
+    static std::shared_ptr<message> serialize(const uint32_t stat_code,
+                                              const uint32_t shard);
+
+    // Extract the status code and the shard from `data` into `stat_code` and
+    // `shard`. `data` must contain the `locate_response` structure.
+    // @return ok    - success. There is no guarantee that `stat_code` is a
+    //                 valid member of the `status_code` enum, and local
+    //                 implementation should do further error-checking.
+    //                 `shard` is only set if `stat_code` is OK.
+    // @return error - `data.size()` is of incorrect size.
+    //                 This is potentially the fault of the local
+    //                 implementation, if `data` was not resized to `body_len_`
+    //                 advertised in the message header. It could also be the
+    //                 fault of the remote party, if `body_len_` was incorrectly
+    //                 advertised in the message header.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint32_t& stat_code,
+                              uint32_t& shard);
+};
+
+struct compressed_body {
+    // Layout from the specification:
+    //
+    // uint32_t raw_length;
+    // uint8_t data[body_length - 4];
+    //
+    // `data` holds `raw_length` bytes of the original body in the LZ4 block
+    // format.
+
+    // Bodies shorter than this are never compressed
+    static constexpr uint32_t min_raw_len = 512;
+
+    // Form a message with the body of `msg` compressed and `msgflag_compressed`
+    // set in its type. Returns `msg` itself if its body is shorter than
+    // `min_raw_len`, or shrinks by less than an eighth.
+    static std::shared_ptr<message> compress(
+        const std::shared_ptr<message>& msg);
+
+    // Decompress the compressed body in `data` into `body`.
+    // @return ok    - success
+    // @return error - `data` is too short, or the compressed bytes are
+    //                 malformed. This is the fault of the remote party.
+    static status decompress(const std::vector<uint8_t>& data,
+                             std::vector<uint8_t>& body);
+};
+
+struct identified_request {
+    // Layout from the specification:
+    //
+    // uint64_t request_id;
+    // uint8_t body[body_length - 8];
+    //
+    // `body` is the body of the request without its ID.
+
+    // Form a message with `request_id` ahead of the body of `msg` and
+    // `msgflag_request_id` set in its type.
+    static std::shared_ptr<message> attach(const std::shared_ptr<message>& msg,
+                                           const uint64_t request_id);
+
+    // Extract the request ID from `data` into `request_id`, and the body that
+    // follows it into `body`.
+    // @return ok         - success
+    // @return body_error - `data` is too short to hold a request ID. This is
+    //                      the fault of the remote party.
+    static status detach(const std::vector<uint8_t>& data,
+                         uint64_t& request_id,
+                         std::vector<uint8_t>& body);
+};
+
 // Make sure the layout of `message` is as we expect it
 static_assert(sizeof(message_header) == 8);
 static_assert(sizeof(message) == 8);
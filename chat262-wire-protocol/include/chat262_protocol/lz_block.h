@@ -0,0 +1,36 @@
+#ifndef _LZ_BLOCK_H_
+#define _LZ_BLOCK_H_
+
+#include "common.h"
+
+#include <cstdint>
+#include <vector>
+
+// A block of bytes compressed with a small LZ77 codec. The compressed bytes
+// follow the LZ4 block format: a sequence of literal runs, each followed by a
+// back-reference of at least 4 bytes up to 64 KiB back, with the last 5 bytes
+// always stored as literals. The compressor is greedy, with a single hash
+// table of recent positions, which favors speed over ratio.
+struct lz_block {
+    // Compressed bytes
+    std::vector<uint8_t> data_;
+    // Number of bytes before compression
+    uint32_t raw_len_;
+};
+
+// Compress the `len` bytes at `src` into `block`.
+// @return ok    - The bytes were compressed into at most `max_compressed_len`
+//                 bytes.
+// @return error - The bytes don't compress to `max_compressed_len` bytes.
+//                 `block` is left unspecified.
+status lz_compress(const uint8_t* src,
+                   const uint32_t len,
+                   const uint32_t max_compressed_len,
+                   lz_block& block);
+
+// Decompress `block` into `dst`, which must hold `block.raw_len_` bytes.
+// @return ok    - The block was decompressed.
+// @return error - The block is malformed. `dst` is left unspecified.
+status lz_decompress(const lz_block& block, uint8_t* dst);
+
+#endif
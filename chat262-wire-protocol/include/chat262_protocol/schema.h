@@ -0,0 +1,635 @@
+#ifndef _SCHEMA_H_
+#define _SCHEMA_H_
+
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "common.h"
+#include "endianness.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Compile-time descriptions of Chat 262 Protocol message bodies, and the
+// encoders and decoders generated from them.
+//
+// A body is a list of fields. Every field has a head of a fixed size, and a
+// tail whose size depends on the value. The heads of all fields come first,
+// back to back and in the order of the fields, followed by the tails in the
+// same order. For example, the two strings of a login request are two `bytes`
+// fields: their two lengths are the heads, and their characters the tails.
+//
+// Every field kind provides:
+//
+//   value_type        - The type of a decoded value.
+//   scratch           - What the decoder remembers of the head.
+//   head_size         - The size of the head, known at compile time.
+//   tail_size(v)      - The size of the tail of `v`.
+//   put_head(p, v)    - Write the head of `v` at `p` and return the end.
+//   put_tail(p, v)    - Write the tail of `v` at `p` and return the end.
+//   get_head(p, sc)   - Read the head at `p` into `sc`.
+//   measure(b, n, off, sc, len)
+//                     - Store the size of the tail at offset `off` of the
+//                       `n`-byte body `b` into `len`. Returns false if the
+//                       tail doesn't fit, without reading past the body.
+//   get_tail(p, sc, v) - Read the tail at `p` into `v` and return the end.
+//
+// A decoder checks the heads of all fields with a single comparison, and the
+// tails of all fields with another. Fields with lists need one more
+// comparison for their list of lengths. The values are only read once
+// everything was checked, so reading them needs no checks at all.
+namespace chat262 {
+namespace schema {
+
+inline uint8_t* put16(uint8_t* p, const uint16_t x) {
+    const uint16_t x_le = e_htole16(x);
+    memcpy(p, &x_le, sizeof(uint16_t));
+    return p + sizeof(uint16_t);
+}
+
+inline uint8_t* put32(uint8_t* p, const uint32_t x) {
+    const uint32_t x_le = e_htole32(x);
+    memcpy(p, &x_le, sizeof(uint32_t));
+    return p + sizeof(uint32_t);
+}
+
+inline uint8_t* put64(uint8_t* p, const uint64_t x) {
+    const uint64_t x_le = e_htole64(x);
+    memcpy(p, &x_le, sizeof(uint64_t));
+    return p + sizeof(uint64_t);
+}
+
+inline uint16_t get16(const uint8_t* p) {
+    uint16_t x_le;
+    memcpy(&x_le, p, sizeof(uint16_t));
+    return e_le16toh(x_le);
+}
+
+inline uint32_t get32(const uint8_t* p) {
+    uint32_t x_le;
+    memcpy(&x_le, p, sizeof(uint32_t));
+    return e_le32toh(x_le);
+}
+
+inline uint64_t get64(const uint8_t* p) {
+    uint64_t x_le;
+    memcpy(&x_le, p, sizeof(uint64_t));
+    return e_le64toh(x_le);
+}
+
+// Allocate a message of type `type` with room for `body_len` body bytes
+inline std::shared_ptr<message> make_message(const message_type type,
+                                             const size_t body_len) {
+    std::shared_ptr<message> msg(
+        static_cast<message*>(malloc(sizeof(message_header) + body_len)),
+        free);
+    msg->hdr_.version_ = e_htole16(version);
+    msg->hdr_.type_ = e_htole16(type);
+    msg->hdr_.body_len_ = e_htole32(static_cast<uint32_t>(body_len));
+    return msg;
+}
+
+// An unsigned 16-bit integer
+struct u16 {
+    using value_type = uint16_t;
+    using scratch = uint16_t;
+    static constexpr size_t head_size = sizeof(uint16_t);
+
+    static size_t tail_size(const uint16_t) {
+        return 0;
+    }
+    static uint8_t* put_head(uint8_t* p, const uint16_t x) {
+        return put16(p, x);
+    }
+    static uint8_t* put_tail(uint8_t* p, const uint16_t) {
+        return p;
+    }
+    static void get_head(const uint8_t* p, uint16_t& sc) {
+        sc = get16(p);
+    }
+    static bool measure(const uint8_t*,
+                        const size_t,
+                        const uint64_t,
+                        const uint16_t,
+                        uint64_t& len) {
+        len = 0;
+        return true;
+    }
+    static const uint8_t* get_tail(const uint8_t* p,
+                                   const uint16_t sc,
+                                   uint16_t& x) {
+        x = sc;
+        return p;
+    }
+};
+
+// An unsigned 32-bit integer
+struct u32 {
+    using value_type = uint32_t;
+    using scratch = uint32_t;
+    static constexpr size_t head_size = sizeof(uint32_t);
+
+    static size_t tail_size(const uint32_t) {
+        return 0;
+    }
+    static uint8_t* put_head(uint8_t* p, const uint32_t x) {
+        return put32(p, x);
+    }
+    static uint8_t* put_tail(uint8_t* p, const uint32_t) {
+        return p;
+    }
+    static void get_head(const uint8_t* p, uint32_t& sc) {
+        sc = get32(p);
+    }
+    static bool measure(const uint8_t*,
+                        const size_t,
+                        const uint64_t,
+                        const uint32_t,
+                        uint64_t& len) {
+        len = 0;
+        return true;
+    }
+    static const uint8_t* get_tail(const uint8_t* p,
+                                   const uint32_t sc,
+                                   uint32_t& x) {
+        x = sc;
+        return p;
+    }
+};
+
+// An unsigned 64-bit integer
+struct u64 {
+    using value_type = uint64_t;
+    using scratch = uint64_t;
+    static constexpr size_t head_size = sizeof(uint64_t);
+
+    static size_t tail_size(const uint64_t) {
+        return 0;
+    }
+    static uint8_t* put_head(uint8_t* p, const uint64_t x) {
+        return put64(p, x);
+    }
+    static uint8_t* put_tail(uint8_t* p, const uint64_t) {
+        return p;
+    }
+    static void get_head(const uint8_t* p, uint64_t& sc) {
+        sc = get64(p);
+    }
+    static bool measure(const uint8_t*,
+                        const size_t,
+                        const uint64_t,
+                        const uint64_t,
+                        uint64_t& len) {
+        len = 0;
+        return true;
+    }
+    static const uint8_t* get_tail(const uint8_t* p,
+                                   const uint64_t sc,
+                                   uint64_t& x) {
+        x = sc;
+        return p;
+    }
+};
+
+// A string: its 32-bit length in the head, its characters in the tail
+struct bytes {
+    using value_type = std::string;
+    using scratch = uint32_t;
+    static constexpr size_t head_size = sizeof(uint32_t);
+
+    static size_t tail_size(const std::string& s) {
+        return s.length();
+    }
+    static uint8_t* put_head(uint8_t* p, const std::string& s) {
+        return put32(p, static_cast<uint32_t>(s.length()));
+    }
+    static uint8_t* put_tail(uint8_t* p, const std::string& s) {
+        memcpy(p, s.data(), s.length());
+        return p + s.length();
+    }
+    static void get_head(const uint8_t* p, uint32_t& sc) {
+        sc = get32(p);
+    }
+    static bool measure(const uint8_t*,
+                        const size_t,
+                        const uint64_t,
+                        const uint32_t sc,
+                        uint64_t& len) {
+        len = sc;
+        return true;
+    }
+    static const uint8_t* get_tail(const uint8_t* p,
+                                   const uint32_t sc,
+                                   std::string& s) {
+        s.assign(reinterpret_cast<const char*>(p), sc);
+        return p + sc;
+    }
+};
+
+// A list of unsigned 64-bit integers: the 32-bit number of integers in the
+// head, and the integers in the tail
+struct u64_list {
+    using value_type = std::vector<uint64_t>;
+    using scratch = uint32_t;
+    static constexpr size_t head_size = sizeof(uint32_t);
+
+    static size_t tail_size(const std::vector<uint64_t>& l) {
+        return l.size() * sizeof(uint64_t);
+    }
+    static uint8_t* put_head(uint8_t* p, const std::vector<uint64_t>& l) {
+        return put32(p, static_cast<uint32_t>(l.size()));
+    }
+    static uint8_t* put_tail(uint8_t* p, const std::vector<uint64_t>& l) {
+        for (const uint64_t x : l) {
+            p = put64(p, x);
+        }
+        return p;
+    }
+    static void get_head(const uint8_t* p, uint32_t& sc) {
+        sc = get32(p);
+    }
+    static bool measure(const uint8_t*,
+                        const size_t,
+                        const uint64_t,
+                        const uint32_t sc,
+                        uint64_t& len) {
+        len = static_cast<uint64_t>(sc) * sizeof(uint64_t);
+        return true;
+    }
+    static const uint8_t* get_tail(const uint8_t* p,
+                                   const uint32_t sc,
+                                   std::vector<uint64_t>& l) {
+        l.resize(sc);
+        for (uint64_t& x : l) {
+            x = get64(p);
+            p += sizeof(uint64_t);
+        }
+        return p;
+    }
+};
+
+// A list of strings: the 32-bit number of strings in the head, and the 32-bit
+// length of every string followed by the characters of all strings in the
+// tail
+struct string_list {
+    using value_type = std::vector<std::string>;
+    using scratch = uint32_t;
+    static constexpr size_t head_size = sizeof(uint32_t);
+
+    static size_t tail_size(const std::vector<std::string>& l) {
+        size_t len = l.size() * sizeof(uint32_t);
+        for (const std::string& s : l) {
+            len += s.length();
+        }
+        return len;
+    }
+    static uint8_t* put_head(uint8_t* p, const std::vector<std::string>& l) {
+        return put32(p, static_cast<uint32_t>(l.size()));
+    }
+    static uint8_t* put_tail(uint8_t* p, const std::vector<std::string>& l) {
+        uint8_t* chars = p + l.size() * sizeof(uint32_t);
+        for (const std::string& s : l) {
+            p = put32(p, static_cast<uint32_t>(s.length()));
+            memcpy(chars, s.data(), s.length());
+            chars += s.length();
+        }
+        return chars;
+    }
+    static void get_head(const uint8_t* p, uint32_t& sc) {
+        sc = get32(p);
+    }
+    static bool measure(const uint8_t* body,
+                        const size_t size,
+                        const uint64_t off,
+                        const uint32_t sc,
+                        uint64_t& len) {
+        len = static_cast<uint64_t>(sc) * sizeof(uint32_t);
+        if (off + len > size) {
+            return false;
+        }
+        // The lengths fit into the body, so there are at most 2^30 of them,
+        // and their sum can't overflow
+        const uint8_t* lengths = body + off;
+        for (uint32_t i = 0; i != sc; ++i) {
+            len += get32(lengths + i * sizeof(uint32_t));
+        }
+        return true;
+    }
+    static const uint8_t* get_tail(const uint8_t* p,
+                                   const uint32_t sc,
+                                   std::vector<std::string>& l) {
+        const uint8_t* chars = p + static_cast<size_t>(sc) * sizeof(uint32_t);
+        l.resize(sc);
+        for (std::string& s : l) {
+            const uint32_t len = get32(p);
+            p += sizeof(uint32_t);
+            s.assign(reinterpret_cast<const char*>(chars), len);
+            chars += len;
+        }
+        return chars;
+    }
+};
+
+// The texts of a chat: the 32-bit number of texts in the head, and the 8-bit
+// sender of every text, the 32-bit length of every text, and the bytes of all
+// texts in the tail. Encodes both a `chat` and a `chat_view`.
+struct text_list {
+    using value_type = chat;
+    using scratch = uint32_t;
+    static constexpr size_t head_size = sizeof(uint32_t);
+
+    static size_t tail_size(const chat& c) {
+        size_t len = c.texts_.size() * (sizeof(uint8_t) + sizeof(uint32_t));
+        for (const text& txt : c.texts_) {
+            len += txt.content_.length();
+        }
+        return len;
+    }
+    static size_t tail_size(const chat_view& v) {
+        size_t len = v.senders_.size() * (sizeof(uint8_t) + sizeof(uint32_t));
+        for (const chat_view::run& r : v.runs_) {
+            len += r.len_;
+        }
+        return len;
+    }
+    static uint8_t* put_head(uint8_t* p, const chat& c) {
+        return put32(p, static_cast<uint32_t>(c.texts_.size()));
+    }
+    static uint8_t* put_head(uint8_t* p, const chat_view& v) {
+        return put32(p, static_cast<uint32_t>(v.senders_.size()));
+    }
+    static uint8_t* put_tail(uint8_t* p, const chat& c) {
+        const size_t n = c.texts_.size();
+        uint8_t* lengths = p + n * sizeof(uint8_t);
+        uint8_t* bytes = lengths + n * sizeof(uint32_t);
+        for (const text& txt : c.texts_) {
+            *p++ = txt.sender_;
+            lengths =
+                put32(lengths, static_cast<uint32_t>(txt.content_.length()));
+            memcpy(bytes, txt.content_.data(), txt.content_.length());
+            bytes += txt.content_.length();
+        }
+        return bytes;
+    }
+    // The view is laid out like the tail already, so it is copied one array
+    // and one run at a time
+    static uint8_t* put_tail(uint8_t* p, const chat_view& v) {
+        memcpy(p, v.senders_.data(), v.senders_.size() * sizeof(uint8_t));
+        p += v.senders_.size() * sizeof(uint8_t);
+        for (const uint32_t len : v.lengths_) {
+            p = put32(p, len);
+        }
+        for (const chat_view::run& r : v.runs_) {
+            memcpy(p, r.data_.get(), r.len_);
+            p += r.len_;
+        }
+        return p;
+    }
+    static void get_head(const uint8_t* p, uint32_t& sc) {
+        sc = get32(p);
+    }
+    static bool measure(const uint8_t* body,
+                        const size_t size,
+                        const uint64_t off,
+                        const uint32_t sc,
+                        uint64_t& len) {
+        len = static_cast<uint64_t>(sc) * (sizeof(uint8_t) + sizeof(uint32_t));
+        if (off + len > size) {
+            return false;
+        }
+        const uint8_t* lengths = body + off + sc * sizeof(uint8_t);
+        for (uint32_t i = 0; i != sc; ++i) {
+            len += get32(lengths + i * sizeof(uint32_t));
+        }
+        return true;
+    }
+    static const uint8_t* get_tail(const uint8_t* p,
+                                   const uint32_t sc,
+                                   chat& c) {
+        const uint8_t* lengths = p + static_cast<size_t>(sc) * sizeof(uint8_t);
+        const uint8_t* bytes =
+            lengths + static_cast<size_t>(sc) * sizeof(uint32_t);
+        c.texts_.resize(sc);
+        for (text& txt : c.texts_) {
+            txt.sender_ = *p++;
+            const uint32_t len = get32(lengths);
+            lengths += sizeof(uint32_t);
+            txt.content_.assign(reinterpret_cast<const char*>(bytes), len);
+            bytes += len;
+        }
+        return bytes;
+    }
+};
+
+// The mutations of a replicate request: the 32-bit number of mutations in the
+// head, and the 8-bit operation of every mutation, the three 32-bit lengths
+// of the strings of every mutation, and the bytes of all strings in the tail
+struct mutation_list {
+    using value_type = std::vector<mutation>;
+    using scratch = uint32_t;
+    static constexpr size_t head_size = sizeof(uint32_t);
+    static constexpr size_t strings = 3;
+
+    static size_t tail_size(const std::vector<mutation>& l) {
+        size_t len = l.size() * (sizeof(uint8_t) + strings * sizeof(uint32_t));
+        for (const mutation& m : l) {
+            len += m.username_.length() + m.arg_.length() + m.txt_.length();
+        }
+        return len;
+    }
+    static uint8_t* put_head(uint8_t* p, const std::vector<mutation>& l) {
+        return put32(p, static_cast<uint32_t>(l.size()));
+    }
+    static uint8_t* put_tail(uint8_t* p, const std::vector<mutation>& l) {
+        uint8_t* lengths = p + l.size() * sizeof(uint8_t);
+        uint8_t* bytes = lengths + l.size() * strings * sizeof(uint32_t);
+        for (const mutation& m : l) {
+            *p++ = m.op_;
+            for (const std::string* str : {&m.username_, &m.arg_, &m.txt_}) {
+                lengths = put32(lengths, static_cast<uint32_t>(str->length()));
+                memcpy(bytes, str->data(), str->length());
+                bytes += str->length();
+            }
+        }
+        return bytes;
+    }
+    static void get_head(const uint8_t* p, uint32_t& sc) {
+        sc = get32(p);
+    }
+    static bool measure(const uint8_t* body,
+                        const size_t size,
+                        const uint64_t off,
+                        const uint32_t sc,
+                        uint64_t& len) {
+        len = static_cast<uint64_t>(sc) *
+              (sizeof(uint8_t) + strings * sizeof(uint32_t));
+        if (off + len > size) {
+            return false;
+        }
+        const uint8_t* lengths = body + off + sc * sizeof(uint8_t);
+        for (uint64_t i = 0; i != sc * strings; ++i) {
+            len += get32(lengths + i * sizeof(uint32_t));
+        }
+        return true;
+    }
+    static const uint8_t* get_tail(const uint8_t* p,
+                                   const uint32_t sc,
+                                   std::vector<mutation>& l) {
+        const uint8_t* lengths = p + static_cast<size_t>(sc) * sizeof(uint8_t);
+        const uint8_t* bytes =
+            lengths + static_cast<size_t>(sc) * strings * sizeof(uint32_t);
+        l.resize(sc);
+        for (mutation& m : l) {
+            m.op_ = *p++;
+            for (std::string* str : {&m.username_, &m.arg_, &m.txt_}) {
+                const uint32_t len = get32(lengths);
+                lengths += sizeof(uint32_t);
+                str->assign(reinterpret_cast<const char*>(bytes), len);
+                bytes += len;
+            }
+        }
+        return bytes;
+    }
+};
+
+// The encoder and decoder of a body made of `Fields`
+template <typename... Fields>
+struct layout {
+    // Size of all heads
+    static constexpr size_t head_size = (size_t{0} + ... + Fields::head_size);
+
+    // Exact size of the body holding `values`
+    template <typename... Values>
+    static size_t body_size(const Values&... values) {
+        static_assert(sizeof...(Values) == sizeof...(Fields));
+        return head_size + (size_t{0} + ... + Fields::tail_size(values));
+    }
+
+    // Write the body holding `values` at `p`, which must have room for
+    // `body_size(values...)` bytes
+    template <typename... Values>
+    static void encode(uint8_t* p, const Values&... values) {
+        static_assert(sizeof...(Values) == sizeof...(Fields));
+        ((p = Fields::put_head(p, values)), ...);
+        ((p = Fields::put_tail(p, values)), ...);
+        // The end of the last tail is the end of the body
+        (void) p;
+    }
+
+    // Read the `size`-byte body at `body` into `values`.
+    // @return ok         - success
+    // @return body_error - The body doesn't hold exactly these fields.
+    //                      `values` are left unchanged.
+    static status decode(const uint8_t* body,
+                         const size_t size,
+                         typename Fields::value_type&... values) {
+        return decode(body,
+                      size,
+                      std::index_sequence_for<Fields...>(),
+                      values...);
+    }
+
+private:
+    template <size_t... I>
+    static status decode(const uint8_t* body,
+                         const size_t size,
+                         std::index_sequence<I...>,
+                         typename Fields::value_type&... values) {
+        if (size < head_size) {
+            return status::body_error;
+        }
+        std::tuple<typename Fields::scratch...> sc;
+        const uint8_t* p = body;
+        ((Fields::get_head(p, std::get<I>(sc)), p += Fields::head_size), ...);
+
+        uint64_t off = head_size;
+        bool fits = true;
+        uint64_t len = 0;
+        ((fits = fits && Fields::measure(body, size, off, std::get<I>(sc), len),
+          off += len),
+         ...);
+        if (!fits || off != size) {
+            return status::body_error;
+        }
+
+        ((p = Fields::get_tail(p, std::get<I>(sc), values)), ...);
+        (void) p;
+        return status::ok;
+    }
+};
+
+// A message of type `Type` whose body is made of `Fields`
+template <message_type Type, typename... Fields>
+struct message_schema : layout<Fields...> {
+    // Form a complete message holding `values`
+    template <typename... Values>
+    static std::shared_ptr<message> serialize(const Values&... values) {
+        const size_t body_len = layout<Fields...>::body_size(values...);
+        std::shared_ptr<message> msg = make_message(Type, body_len);
+        layout<Fields...>::encode(msg->body_, values...);
+        return msg;
+    }
+
+    // Extract `values` from the body `data`
+    static status deserialize(const std::vector<uint8_t>& data,
+                              typename Fields::value_type&... values) {
+        return layout<Fields...>::decode(data.data(), data.size(), values...);
+    }
+};
+
+// A response of type `Type` whose body is a 32-bit status code, followed by
+// `Fields` only if the status code is `status_code_ok`
+template <message_type Type, typename... Fields>
+struct response_schema {
+    using rest = layout<Fields...>;
+
+    // Form a complete response with `stat_code`, and `values` if it's OK
+    template <typename... Values>
+    static std::shared_ptr<message> serialize(const uint32_t stat_code,
+                                              const Values&... values) {
+        if (stat_code != status_code_ok) {
+            std::shared_ptr<message> msg =
+                make_message(Type, sizeof(uint32_t));
+            put32(msg->body_, stat_code);
+            return msg;
+        }
+        const size_t body_len = sizeof(uint32_t) + rest::body_size(values...);
+        std::shared_ptr<message> msg = make_message(Type, body_len);
+        rest::encode(put32(msg->body_, stat_code), values...);
+        return msg;
+    }
+
+    // Extract the status code from the body `data` into `stat_code`, and
+    // `values` if it's OK. Anything after a status code that is not OK is
+    // ignored.
+    static status deserialize(const std::vector<uint8_t>& data,
+                              uint32_t& stat_code,
+                              typename Fields::value_type&... values) {
+        if (data.size() < sizeof(uint32_t)) {
+            return status::body_error;
+        }
+        const uint32_t stat_code_h = get32(data.data());
+        if (stat_code_h == status_code_ok) {
+            status s = rest::decode(data.data() + sizeof(uint32_t),
+                                    data.size() - sizeof(uint32_t),
+                                    values...);
+            if (s != status::ok) {
+                return s;
+            }
+        }
+        stat_code = stat_code_h;
+        return status::ok;
+    }
+};
+
+}  // namespace schema
+}  // namespace chat262
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _SHARD_RING_H_
+#define _SHARD_RING_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace chat262 {
+
+// Consistent hashing of usernames onto the shards of a cluster, which are
+// identified by their IP addresses.
+//
+// Every shard owns `points_per_shard` points on a ring of 64-bit positions,
+// and a username belongs to the shard of the first point at or after the
+// position of the username, wrapping around. Adding a shard to a cluster of
+// `n` thus only moves about `1 / (n + 1)` of the users, all of them to the
+// new shard, and the points spread the users evenly over the shards.
+//
+// The positions depend on nothing but the addresses and the usernames, so
+// every shard and every client that knows the addresses of a cluster agrees
+// on the owner of every username.
+class shard_ring {
+public:
+    static constexpr uint32_t points_per_shard = 64;
+
+    // Construct the ring of the shards on `shards` (in network byte order),
+    // in any order
+    explicit shard_ring(const std::vector<uint32_t>& shards);
+
+    // Returns the address of the shard that owns `username`
+    uint32_t shard_of(const std::string& username) const;
+
+    // Returns the addresses of all shards, in ascending order
+    const std::vector<uint32_t>& shards() const;
+
+    // Returns the position of `username` on the ring
+    static uint64_t position(const std::string& username);
+
+private:
+    std::vector<uint32_t> shards_;
+    // Positions of the points of all shards, and the address of the shard
+    // of each, in ascending order
+    std::vector<std::pair<uint64_t, uint32_t>> points_;
+};
+
+}  // namespace chat262
+
+#endif
@@ -17,6 +17,35 @@ public:
     //                        This number must be in network byte order.
     status connect_server(const uint32_t n_ip_addr);
 
+    // Send a hello request offering protocol versions up to `max_version` and
+    // asking for the `chat262::feature` bits in `wanted`, and switch the
+    // connection to the version and features in the response. A server that
+    // doesn't know hello requests stays on version 1, without features.
+    // @return ok                - The request was successfully sent, and the
+    //                             response was successfully received and
+    //                             parsed.
+    // @return send_error        - There was an error in sending the request.
+    // @return receive_error     - There was an error in receiving the header or
+    //                             the body.
+    // @return closed_connection - The server closed the connection.
+    // @return header_error      - The client received a header it cannot
+    //                             interpret.
+    // @return body_error        - The server sent an improperly formed response
+    //                             body, or chose a version or features that
+    //                             were not offered.
+    // @param[in]  max_version   - The latest version to offer.
+    // @param[in]  wanted        - The features to ask for.
+    // @param[out] chosen        - Stores the version the server chose. This
+    //                             parameter is ignored unless the return value
+    //                             is `status::ok`.
+    // @param[out] enabled       - Stores the features the server enabled. This
+    //                             parameter is ignored unless the return value
+    //                             is `status::ok`.
+    status hello(const uint16_t max_version,
+                 const uint32_t wanted,
+                 uint16_t& chosen,
+                 uint32_t& enabled);
+
     // Send a login request to the server and read the response.
     // @return ok                - The request was successfully sent, and the
     //                             response was successfully received and
@@ -127,6 +156,22 @@ public:
                     const std::string& txt,
                     uint32_t& stat_code);
 
+    // Send a send text request with the request ID `request_id` to the
+    // server and read the response. The connection must have negotiated
+    // `feature_request_ids`. Sending the request again with the same ID,
+    // after the response was lost, does not send the text twice.
+    // @return                   - As `send_txt` above.
+    // @param[in] recipient      - The username of the text recipient.
+    // @param[in] txt            - The text to send to the recipient.
+    // @param[in] request_id     - The ID of the request.
+    // @param[out] stat_code     - Stores the status code received from the
+    //                             server. This parameter is ignored unless the
+    //                             return value is `status::ok`.
+    status send_txt(const std::string& recipient,
+                    const std::string& txt,
+                    const uint64_t request_id,
+                    uint32_t& stat_code);
+
     // Send a receive texts request to the server and read the response.
     // @return ok                - The request was successfully sent, and the
     //                             response was successfully received and
@@ -191,38 +236,154 @@ public:
     //                             return value is `status::ok`.
     status delete_account(uint32_t& stat_code);
 
+    // Returns the read token of the last successful registration, text or
+    // deletion on this connection, or 0 if there was none. Writes only have
+    // tokens on connections that negotiated `chat262::feature_read_tokens`.
+    uint64_t last_token() const;
+
+    // Send a sync request to the server, which waits up to `max_wait_ms`
+    // milliseconds until it applied the write of `token`, and read the
+    // response. A read replica that answers OK serves reads that see the
+    // write.
+    // @return ok                - The request was successfully sent, and the
+    //                             response was successfully received and
+    //                             parsed.
+    // @return send_error        - There was an error in sending the request.
+    // @return receive_error     - There was an error in receiving the header or
+    //                             the body.
+    // @return closed_connection - The server closed the connection.
+    // @return header_error      - The client received a header it cannot
+    //                             interpret. This can happen if the response
+    //                             was a special response.
+    // @return body_error        - The server sent an improperly formed response
+    //                             body.
+    // @param[in]  token         - The read token of the write to wait for.
+    // @param[in]  max_wait_ms   - The longest wait, in milliseconds.
+    // @param[out] stat_code     - Stores the status code received from the
+    //                             server, which is stale if the write was not
+    //                             applied in time. This parameter is ignored
+    //                             unless the return value is `status::ok`.
+    // @param[out] applied       - Stores the token up to which the server
+    //                             applied all writes. This parameter is
+    //                             ignored unless the return value is
+    //                             `status::ok`.
+    // @param[out] staleness_ms  - Stores how many milliseconds behind the
+    //                             primary the data of the server may be, or
+    //                             `UINT32_MAX` if it doesn't know. This
+    //                             parameter is ignored unless the return value
+    //                             is `status::ok`.
+    status sync(const uint64_t token,
+                const uint32_t max_wait_ms,
+                uint32_t& stat_code,
+                uint64_t& applied,
+                uint32_t& staleness_ms);
+
+    // Send a migrate request to the shard, which moves `username` to the
+    // shard on `n_ip_addr`, and read the response.
+    // @return ok                - The request was successfully sent, and the
+    //                             response was successfully received and
+    //                             parsed.
+    // @return send_error        - There was an error in sending the request.
+    // @return receive_error     - There was an error in receiving the header or
+    //                             the body.
+    // @return closed_connection - The server closed the connection.
+    // @return header_error      - The client received a header it cannot
+    //                             interpret. This can happen if the response
+    //                             was a special response.
+    // @return body_error        - The server sent an improperly formed response
+    //                             body.
+    // @param[in]  username      - The user to move.
+    // @param[in]  n_ip_addr     - The address of the other shard, in network
+    //                             byte order.
+    // @param[out] stat_code     - Stores the status code received from the
+    //                             server. This parameter is ignored unless the
+    //                             return value is `status::ok`.
+    // @param[out] bytes         - Stores the number of bytes sent to move the
+    //                             user. This parameter is ignored unless the
+    //                             status code is OK.
+    // @param[out] copy_us       - Stores how many microseconds the copy of the
+    //                             user took. This parameter is ignored unless
+    //                             the status code is OK.
+    // @param[out] pause_us      - Stores how many microseconds the requests of
+    //                             the user were paused. This parameter is
+    //                             ignored unless the status code is OK.
+    status migrate(const std::string& username,
+                   const uint32_t n_ip_addr,
+                   uint32_t& stat_code,
+                   uint64_t& bytes,
+                   uint64_t& copy_us,
+                   uint64_t& pause_us);
+
+    // Send a locate request to the shard, and read the response.
+    // @return ok                - The request was successfully sent, and the
+    //                             response was successfully received and
+    //                             parsed.
+    // @return send_error        - There was an error in sending the request.
+    // @return receive_error     - There was an error in receiving the header or
+    //                             the body.
+    // @return closed_connection - The server closed the connection.
+    // @return header_error      - The client received a header it cannot
+    //                             interpret. This can happen if the response
+    //                             was a special response.
+    // @return body_error        - The server sent an improperly formed response
+    //                             body.
+    // @param[in]  username      - The user to locate.
+    // @param[out] stat_code     - Stores the status code received from the
+    //                             server. This parameter is ignored unless the
+    //                             return value is `status::ok`.
+    // @param[out] n_ip_addr     - Stores the address of the shard of the user,
+    //                             in network byte order. This parameter is
+    //                             ignored unless the status code is OK.
+    status locate(const std::string& username,
+                  uint32_t& stat_code,
+                  uint32_t& n_ip_addr);
+
 private:
-    // Send the message `msg` to the server.
+    // Send the message `msg` to the server with the version of the
+    // connection.
     // @return ok         - The message was successfully sent
     // @return send_error - The send failed. This is possibly due to a closed
     //                      connection.
     status send_msg(std::shared_ptr<chat262::message> msg) const;
 
+    // Send the send text request `msg` and read the response, as `send_txt`.
+    status exchange_send_txt(const std::shared_ptr<chat262::message>& msg,
+                             uint32_t& stat_code);
+
     // Receive a message header from the server into `hdr`.
     // @return ok                - The header was successfully read.
     // @return receive_error     - The read failed.
     // @return closed_connection - The server closed the connection.
     status recv_hdr(chat262::message_header& hdr) const;
 
-    // Receive a message body of length `body_len` from the server into `data`.
-    // `body_len` should be chosen depending on the header that was received
-    // first.
+    // Receive the message body announced by `hdr` from the server into `data`.
+    // A compressed body is decompressed.
     // @return ok                - The body was successfully read.
     // @return receive_error     - The read failed.
     // @return closed_connection - The server closed the connection.
-    status recv_body(uint32_t body_len, std::vector<uint8_t>& data) const;
+    // @return body_error        - The compressed body is malformed.
+    status recv_body(const chat262::message_header& hdr,
+                     std::vector<uint8_t>& data) const;
 
     // Check that `hdr` matches the Chat 262 Protocol format of a message
     // specified by message type `expected`.
     // @return ok           - The header is correctly formed.
     // @return header_error - There is an error in the header, which is
-    //                        either a version mismatch or a type mismatch.
+    //                        either a version mismatch or a type mismatch, or
+    //                        a compressed body that was never negotiated.
     status validate_hdr(const chat262::message_header& hdr,
                         const chat262::message_type& expected) const;
 
     // Connected socket file descriptor
     int server_fd_;
 
+    // Version and features negotiated on the connection
+    uint16_t version_;
+    uint32_t features_;
+
+    // Read token of the last successful write on the connection
+    uint64_t token_;
+
     // IP address in network byte order
     uint32_t n_ip_addr_;
 
@@ -1,6 +1,9 @@
 #ifndef _CHAT_H_
 #define _CHAT_H_
 
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -16,5 +19,22 @@ struct chat {
     std::vector<text> texts_;
 };
 
+// A read-only view of a chat, laid out like the body of a receive text
+// response. The text bytes are not copied into the view. Instead, they are
+// split into runs of contiguous memory, shared with the storage they come
+// from, which keep the memory alive for as long as the view exists.
+struct chat_view {
+    struct run {
+        std::shared_ptr<const uint8_t> data_;
+        size_t len_;
+    };
+
+    // Sender of every text, `text::sender_you` or `text::sender_other`
+    std::vector<uint8_t> senders_;
+    // Length of every text
+    std::vector<uint32_t> lengths_;
+    // Concatenated bytes of all texts, in order
+    std::vector<run> runs_;
+};
 
 #endif
@@ -8,7 +8,8 @@ enum class status {
     receive_error,
     closed_connection,
     header_error,
-    body_error
+    body_error,
+    quota_error
 };
 
 #endif
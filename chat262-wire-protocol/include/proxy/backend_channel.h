@@ -0,0 +1,95 @@
+#ifndef _BACKEND_CHANNEL_H_
+#define _BACKEND_CHANNEL_H_
+
+#include "chat262_protocol.h"
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A connection from the proxy to a backend server, shared by many client
+// sessions.
+//
+// The server handles the requests of a connection one at a time and answers
+// them in order, so the sessions pipeline their requests on the connection:
+// every session sends its request and waits, and the responses are handed to
+// the waiting sessions first in, first out. There is no reader thread.
+// Instead, one of the waiting sessions at a time reads the responses, until
+// it reads its own and passes the reading on. A session that is alone on the
+// connection thus reads its own response, without waking up another thread.
+//
+// The connection is opened by the first call, and opened again by the next
+// call after it breaks.
+class backend_channel {
+public:
+    // Construct the channel from the proxy on `n_proxy_addr` to the server on
+    // `n_ip_addr` (both in network byte order), written as `str_ip_addr`
+    backend_channel(const uint32_t n_proxy_addr,
+                    const uint32_t n_ip_addr,
+                    const std::string& str_ip_addr);
+    ~backend_channel();
+
+    // Prevent copy/move
+    backend_channel(const backend_channel&) = delete;
+    backend_channel(backend_channel&&) = delete;
+    backend_channel& operator=(const backend_channel&) = delete;
+    backend_channel& operator=(backend_channel&&) = delete;
+
+    // Send `msg` and wait for the response, into `hdr` and `body`.
+    // `received` is set to the time the response was received.
+    // @return ok    - The response was received.
+    // @return error - The server could not be reached, or the connection
+    //                 broke before the response arrived.
+    status call(const std::shared_ptr<chat262::message>& msg,
+                chat262::message_header& hdr,
+                std::vector<uint8_t>& body,
+                std::chrono::steady_clock::time_point& received);
+
+    const std::string& address() const;
+
+private:
+    // A request waiting for its response
+    struct pending {
+        std::condition_variable cv_;
+        bool done_;
+        status result_;
+        chat262::message_header hdr_;
+        std::vector<uint8_t> body_;
+        std::chrono::steady_clock::time_point received_;
+    };
+
+    // Open the connection, unless it is open. `send_mutex_` must be held.
+    status open();
+
+    // Read the next response and hand it to the oldest request, or fail all
+    // requests if the connection broke. `lock` holds `mutex_`, and is
+    // released while reading.
+    void read_response(std::unique_lock<std::mutex>& lock);
+
+    const uint32_t n_proxy_addr_;
+    const uint32_t n_ip_addr_;
+    const std::string str_ip_addr_;
+
+    // Held while a request is queued and sent, so that the requests go out
+    // in the order of the queue
+    std::mutex send_mutex_;
+
+    // Protects the fields below. `fd_` is only changed while `send_mutex_` is
+    // held too.
+    std::mutex mutex_;
+    int fd_;
+    // Requests sent and not answered yet, oldest first
+    std::deque<pending*> queue_;
+    // A session is reading a response
+    bool reading_;
+    // The connection broke, and must be opened again
+    bool broken_;
+};
+
+#endif
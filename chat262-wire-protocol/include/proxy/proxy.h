@@ -0,0 +1,161 @@
+#ifndef _PROXY_H_
+#define _PROXY_H_
+
+#include "backend_channel.h"
+#include "chat262_protocol.h"
+#include "common.h"
+#include "shard_ring.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Speaks the Chat 262 Protocol to clients, and relays their requests to
+// several backend servers.
+//
+// Every request goes to the server of the user it concerns: registration and
+// login requests to the server of the user they name, and all others to the
+// server of the logged in user. Users belong to the servers by a
+// `chat262::shard_ring` of the server addresses, so the servers can be the
+// shards of a sharded cluster. Requests go out as proxy requests on a few
+// connections per server, shared by all clients, which carry the user of the
+// client along with the request, so the server never needs a connection per
+// client. The proxy answers hello requests itself.
+//
+// A shard answers a request of a user that moved to another shard with an
+// empty response. The proxy then asks the shard where the user went, and
+// relays the request and all later ones of the user there.
+class proxy {
+public:
+    struct stats {
+        uint64_t sessions_;
+        uint64_t relayed_;
+        // Requests whose server could not be reached
+        uint64_t failures_;
+        // Requests relayed again because their user moved
+        uint64_t relocations_;
+        // Time spent in the proxy on a request, from receiving it to relaying
+        // it and from receiving the response to sending it on, and the round
+        // trip to the server, in nanoseconds
+        uint64_t total_proxy_ns_;
+        uint64_t max_proxy_ns_;
+        uint64_t total_backend_ns_;
+        uint64_t max_backend_ns_;
+    };
+
+    // Most times a request is relayed again because its user moved
+    static constexpr int max_relocations = 3;
+
+    proxy();
+    ~proxy();
+
+    // Prevent copy/move
+    proxy(const proxy&) = delete;
+    proxy(proxy&&) = delete;
+    proxy& operator=(const proxy&) = delete;
+    proxy& operator=(proxy&&) = delete;
+
+    // Run the proxy with command-line arguments.
+    // This function never returns if the proxy starts successfully.
+    // @return ok      - "-h" was supplied as a command-line argument
+    // @return error   - Invalid command-line arguments.
+    // @param[in] argc - Number of command-line arguments
+    // @param[in] argv - List of command-line arguments
+    status run(const int argc, char const* const* argv);
+
+    stats get_stats() const;
+
+private:
+    // Command-line arguments
+    struct cmdline_args {
+        bool help_;
+        uint32_t n_ip_addr_;
+        std::string str_ip_addr_;
+        // Addresses of the servers, in network byte order and as written
+        std::vector<std::pair<uint32_t, std::string>> backends_;
+        // Connections to every server
+        size_t channels_;
+    };
+    // Parse command-line arguments (`argc`, `argv`).
+    // Returns the filled `cmdline_args` structure on success.
+    // Throws `std::invalid_argument` exception on error.
+    cmdline_args parse_args(const int argc, char const* const* argv) const;
+
+    // Print usage information to standard error
+    void usage(char const* prog) const;
+
+    // Open the proxy socket for incoming connections
+    status start_listening();
+
+    // Dump the proxy statistics to stdout whenever the process receives
+    // SIGUSR1.
+    // @return ok    - The signal handler is installed.
+    // @return error - The signal handler could not be installed.
+    status start_stats_reporter();
+
+    // Print the statistics of this proxy to `out`.
+    void dump_stats(FILE* out);
+
+    // Forever accept incoming connections
+    __attribute__((noreturn)) void start_accepting();
+
+    // Handle the accepted connection, the session `session` of the proxy.
+    // Runs in a separate thread.
+    void handle_client(int client_fd,
+                       sockaddr_in client_addr,
+                       const uint64_t session);
+
+    // Returns the index of the server that `username` belongs to
+    size_t backend_of(const std::string& username) const;
+
+    // Ask the server of `channel`, which answered that `username` moved, for
+    // the user's server, store its index into `backend` and remember it.
+    // @return ok    - The user's server is in `backend`.
+    // @return error - The server could not be reached, or named a server
+    //                 that the proxy doesn't know.
+    status relocate(backend_channel& channel,
+                    const std::string& username,
+                    size_t& backend);
+
+    // Record a request that took `proxy_ns` in the proxy and `backend_ns` on
+    // the way to the server and back
+    void record_request(const uint64_t proxy_ns, const uint64_t backend_ns);
+
+    // Record a request whose server could not be reached
+    void record_failure(const backend_channel& channel);
+
+    // Listen socket file descriptor
+    int proxy_fd_;
+
+    // IP address in network byte order
+    uint32_t n_ip_addr_;
+
+    // IP address in string format
+    std::string str_ip_addr_;
+
+    // Addresses of the servers in the order they were given, and the ring
+    // that maps the users to them
+    std::vector<uint32_t> backend_addrs_;
+    std::unique_ptr<chat262::shard_ring> ring_;
+
+    // The connections to every server, in the order of `backend_addrs_`.
+    // A session always uses the same connection of a server.
+    std::vector<std::vector<std::unique_ptr<backend_channel>>> channels_;
+
+    // Protects the statistics and the moved users
+    mutable std::mutex mutex_;
+    stats stats_;
+    // Servers of the users that moved off their servers of the ring, by
+    // username
+    std::unordered_map<std::string, size_t> moved_;
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include "common.h"
+#include "lz_block.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// A cache of decompressed blocks, bounded by the number of decompressed
+// bytes. When the cache is full, the least recently used blocks are dropped.
+// Blocks are identified by their address, and the cache keeps a reference to
+// every cached block, so an address is never reused while it's cached.
+//
+// All member functions are thread-safe. Blocks are decompressed without
+// holding the cache lock.
+class block_cache {
+public:
+    struct stats {
+        uint64_t hits_;
+        uint64_t misses_;
+        // Blocks that could not be decompressed
+        uint64_t errors_;
+        // Time spent decompressing on misses, in nanoseconds
+        uint64_t total_ns_;
+        uint64_t max_ns_;
+        size_t blocks_;
+        size_t bytes_;
+        size_t capacity_;
+    };
+
+    // Construct an empty cache that holds nothing
+    block_cache();
+
+    // Prevent copy/move
+    block_cache(const block_cache&) = delete;
+    block_cache(block_cache&&) = delete;
+    block_cache& operator=(const block_cache&) = delete;
+    block_cache& operator=(block_cache&&) = delete;
+
+    // Hold at most `bytes` decompressed bytes. With a capacity of 0, every
+    // lookup decompresses its block.
+    void set_capacity(const size_t bytes);
+
+    // Store the decompressed bytes of `block` into `data`. `data` stays valid
+    // after the block is dropped from the cache.
+    // @return ok    - The block was found or decompressed.
+    // @return error - The block is malformed.
+    status get(const std::shared_ptr<const lz_block>& block,
+               std::shared_ptr<const uint8_t>& data);
+
+    stats get_stats() const;
+
+private:
+    struct entry {
+        std::shared_ptr<const lz_block> block_;
+        std::shared_ptr<const uint8_t> data_;
+    };
+
+    // Drop least recently used blocks until the cache holds at most
+    // `capacity_` bytes. `mutex_` must be held.
+    void shrink();
+
+    mutable std::mutex mutex_;
+    // Most recently used first
+    std::list<entry> lru_;
+    std::unordered_map<const lz_block*, std::list<entry>::iterator> index_;
+    stats stats_;
+};
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef _CONVERSATION_H_
+#define _CONVERSATION_H_
+
+#include "chat.h"
+#include "lz_block.h"
+#include "segment_store.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Append-only storage of the texts of one chat, as seen by one of its
+// participants. Text bytes are stored back to back in a few large chunks, and
+// every text is described by a 4-byte index entry, holding its length with
+// its sender packed into the top bit (its offset is implied, since texts are
+// stored in order). A long chat is therefore a handful of allocations rather
+// than one allocation per text, and its history can be serialized with one
+// copy per chunk.
+//
+// Optionally, the conversation also records when every text was sent. Send
+// times are stored as variable-length deltas from the previous text, which
+// takes 1 to 3 bytes per text in a lively chat.
+//
+// Chunks that are full are sealed, and can be compressed once they are no
+// longer recent. Views hold compressed chunks as they are, so decompressing
+// them is up to the reader.
+//
+// Texts can be evicted to a `segment_store` when the conversation is not in
+// use, and faulted back in when it's read again. Evicted texts are always
+// older than the texts in memory, so new texts can be appended without
+// faulting anything in.
+//
+// Text bytes are never moved or overwritten once written, so views of the
+// conversation can be read without holding any lock while more texts are
+// appended.
+class conversation {
+public:
+    // Texts longer than this cannot be stored
+    static constexpr uint32_t max_txt_len = 0x7FFFFFFF;
+
+    // Number of bytes a text of `txt_len` bytes adds to `stored_bytes`
+    static constexpr size_t stored_size(const size_t txt_len) {
+        return txt_len + sizeof(uint32_t);
+    }
+
+    // Sealed chunks shorter than this are not worth compressing
+    static constexpr uint32_t min_compress_len = 1024;
+
+    // A run of a view whose chunk is compressed. The run at index `run_` has
+    // no data, and holds the decompressed bytes of `block_`.
+    struct compressed_run {
+        size_t run_;
+        std::shared_ptr<const lz_block> block_;
+    };
+
+    // A sealed chunk that can be compressed
+    struct chunk_ref {
+        size_t idx_;
+        std::shared_ptr<const uint8_t> data_;
+        uint32_t len_;
+    };
+
+    conversation();
+
+    // Append `txt`, sent by `sender` (`text::sender_you` or
+    // `text::sender_other`). `txt` must not be longer than `max_txt_len`.
+    void append(const uint8_t sender, const std::string& txt);
+
+    // Append `txt`, sent by `sender` at `timestamp_ms` milliseconds since the
+    // epoch. Either all or none of the texts of a conversation must have a
+    // timestamp. A timestamp earlier than the previous one (e.g. after the
+    // clock is adjusted) is stored correctly, but takes 10 bytes.
+    void append(const uint8_t sender,
+                const std::string& txt,
+                const uint64_t timestamp_ms);
+
+    // Append all texts of `v`, without timestamps. `v` must hold no
+    // compressed runs, and no text longer than `max_txt_len`.
+    void append_all(const chat_view& v);
+
+    // Number of stored texts, including evicted ones
+    size_t num_texts() const;
+
+    // Number of texts in memory
+    size_t num_resident_texts() const;
+
+    // Store a view of all texts into `v`, and the runs of `v` that are
+    // compressed into `compressed`. The view shares the text bytes with the
+    // conversation and stays valid after the conversation is modified or
+    // destroyed. If some texts are evicted, the view only holds the texts in
+    // memory.
+    void view(chat_view& v, std::vector<compressed_run>& compressed) const;
+
+    // Record that the conversation was used just now. Appending texts also
+    // counts as a use.
+    void touch();
+
+    // When the conversation was last used
+    std::chrono::steady_clock::time_point last_access() const;
+
+    // Check if some texts are evicted
+    bool evicted() const;
+
+    // Locations of the evicted texts, oldest first
+    const std::vector<segment_store::segment_ref>& evicted_segments() const;
+
+    // Release the memory of all texts in memory, which were written to the
+    // segment at `ref`
+    void evict(const segment_store::segment_ref& ref);
+
+    // Bring the evicted texts back into memory. `segments` must hold the
+    // texts of `evicted_segments()`, in the same order.
+    void fault_in(const std::vector<chat_view>& segments);
+
+    // Store the sealed chunks that were sealed before `sealed_before`, hold
+    // at least `min_compress_len` bytes and were not compressed yet into
+    // `chunks`
+    void compressible_chunks(
+        const std::chrono::steady_clock::time_point& sealed_before,
+        std::vector<chunk_ref>& chunks) const;
+
+    // Replace the bytes of the chunk at `ref` with `block`, which holds them
+    // compressed. If `block` is null, the chunk doesn't compress and is never
+    // returned by `compressible_chunks` again. Does nothing if the chunk was
+    // evicted since `ref` was taken.
+    void compress(const chunk_ref& ref,
+                  const std::shared_ptr<const lz_block>& block);
+
+    // Number of compressed chunks, and the number of bytes they hold before
+    // and after compression
+    void compression_stats(size_t& num_chunks,
+                           size_t& raw_bytes,
+                           size_t& compressed_bytes) const;
+
+    // Decode the send times of all texts into `timestamps_ms`. If the texts
+    // were appended without timestamps, `timestamps_ms` is left empty.
+    void timestamps(std::vector<uint64_t>& timestamps_ms) const;
+
+    // Number of bytes stored in the conversation: the text bytes and their
+    // index entries
+    size_t stored_bytes() const;
+
+    // Number of bytes stored for the texts sent by `text::sender_you`. This
+    // is what quotas are enforced on, so that nobody can use up the quota of
+    // their correspondents.
+    size_t sent_bytes() const;
+
+    // Number of heap bytes reserved by the conversation. This additionally
+    // includes unused chunk space and timestamps, and counts compressed
+    // chunks at their compressed size.
+    size_t memory_usage() const;
+
+private:
+    // Smallest and largest size of a chunk. Chunks double in size, so short
+    // chats don't waste memory and long chats don't have too many chunks.
+    // Texts longer than the next chunk get a chunk of their own.
+    static constexpr uint32_t min_chunk_size = 128;
+    static constexpr uint32_t max_chunk_size = 64 * 1024;
+
+    // Index entries hold the sender in the top bit and the length below it
+    static constexpr uint32_t sender_bit = 0x80000000;
+
+    struct chunk {
+        // Null once compressed
+        std::shared_ptr<uint8_t> data_;
+        uint32_t capacity_;
+        uint32_t used_;
+        // Set once compressed
+        std::shared_ptr<const lz_block> block_;
+        // When the next chunk was started. Only valid for sealed chunks.
+        std::chrono::steady_clock::time_point sealed_at_;
+        bool incompressible_;
+    };
+
+    // Append the index entry of a text of `len` bytes and return where its
+    // bytes go
+    uint8_t* append_entry(const uint8_t sender, const uint32_t len);
+
+    // Append all texts of `v`
+    void append_view(const chat_view& v);
+
+    // Index of the texts, one entry per text
+    std::vector<uint32_t> entries_;
+
+    // Text bytes, in order. Texts never straddle chunks. All chunks but the
+    // last are sealed.
+    std::vector<chunk> chunks_;
+
+    // Send times, as LEB128-encoded differences between consecutive
+    // timestamps in milliseconds. The first difference is from 0.
+    std::vector<uint8_t> timestamps_;
+    uint64_t last_timestamp_ms_;
+
+    // Sum of `stored_size` of all texts, and of the texts sent by
+    // `text::sender_you`
+    size_t stored_bytes_;
+    size_t sent_bytes_;
+
+    std::chrono::steady_clock::time_point last_access_;
+
+    // Evicted texts, which come before the texts in memory
+    std::vector<segment_store::segment_ref> evicted_;
+};
+
+#endif
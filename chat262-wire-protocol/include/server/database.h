@@ -1,20 +1,123 @@
 #ifndef _DATABASE_H_
 #define _DATABASE_H_
 
+#include "block_cache.h"
 #include "chat.h"
+#include "chat262_protocol.h"
 #include "common.h"
+#include "conversation.h"
+#include "journal.h"
+#include "lock_profiler.h"
+#include "replication_log.h"
+#include "segment_store.h"
 
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
-#include <map>
+#include <cstdio>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
 class database {
 public:
+    struct config {
+        // Record the time every text was sent. Costs 1 to 3 bytes per text.
+        bool record_timestamps_;
+        // Largest number of bytes of the texts one user sent, in all its
+        // chats. Texts it received don't count. 0 means no limit.
+        size_t max_user_bytes_;
+        // Largest number of bytes of the texts one user sent in one chat.
+        // Texts it received don't count. 0 means no limit.
+        size_t max_chat_bytes_;
+        // Largest number of bytes stored in the whole database. 0 means no
+        // limit.
+        size_t max_total_bytes_;
+        // Chats that are not used for this long are evicted to the segment
+        // file. 0 means chats are never evicted.
+        std::chrono::seconds evict_after_;
+        // Prefix of the segment files that hold evicted chats
+        std::string segment_path_;
+        // Segment files are sealed and mapped once they would grow past
+        // this many bytes
+        uint64_t segment_file_size_;
+        // Chunks that were sealed this long ago are compressed. 0 means
+        // chunks are never compressed.
+        std::chrono::seconds compress_after_;
+        // Largest number of decompressed bytes cached for reading
+        // compressed chunks
+        size_t block_cache_bytes_;
+    };
+
+    // Construct an empty database with the default configuration, which
+    // records no timestamps, has no limits and never evicts chats
+    database();
+    ~database();
+
+    // Prevent copy/move
+    database(const database&) = delete;
+    database(database&&) = delete;
+    database& operator=(const database&) = delete;
+    database& operator=(database&&) = delete;
+
+    // Replace the configuration with `cfg`. Must be called before the
+    // database is used.
+    void configure(const config& cfg);
+
+    // Append every registration, sent text and deletion to `log` from now on,
+    // so that they can be replicated. Must be called before the database is
+    // used.
+    void set_replication_log(replication_log* log);
+
+    // Append every registration, sent text and deletion to `j` from now on,
+    // so that they are durable. Must be called before the database is used.
+    void set_journal(journal* j);
+
+    // Apply `mutations` read back from a journal, in order. Texts are stored
+    // even if they exceed the limits, which they were within when they were
+    // journaled. Must be called before the database is used, and before the
+    // replication log and the journal are set.
+    // @return ok    - All mutations were applied.
+    // @return error - A mutation has an unknown operation. The mutations
+    //                 before it were applied.
+    status replay(const std::vector<chat262::mutation>& mutations);
+
+    // Load the dump file at `path` into the empty database, with
+    // `num_threads` threads. The database mutex is taken once for the whole
+    // load, instead of once per operation. The users are added one by one,
+    // and then the threads build the chats of the users in parallel,
+    // straight from the mapped file, without taking any lock of their own.
+    // Texts are stored even if they exceed the limits.
+    // Must be called before the database is used, and before the
+    // replication log and the journal are set.
+    // @return ok    - The dump was loaded.
+    // @return error - The file could not be read, or is malformed, or the
+    //                 database is not empty, or it records timestamps,
+    //                 which the dump doesn't hold. The database is left
+    //                 empty.
+    status load_dump(const std::string& path, const size_t num_threads);
+
+    // Write all users and chats to a dump file at `path`, which is replaced.
+    // Like `snapshot`, evicted chats are read back without holding the
+    // database lock, so texts sent meanwhile may or may not be in the dump.
+    // Send times are not part of the dump. Must not be called on a sharded
+    // database.
+    // @return ok            - The dump was written.
+    // @return error         - The file could not be written. `errno` tells
+    //                         why.
+    // @return receive_error - An evicted chat could not be read back, or a
+    //                         compressed chunk could not be decompressed.
+    status export_dump(const std::string& path);
+
+    // If the configuration enables eviction or compression, start a thread
+    // that periodically evicts idle chats to the segment files (which are
+    // created first) and compresses old chunks.
+    // @return ok    - Eviction is started, or not enabled.
+    // @return error - The first segment file could not be created.
+    status start_tiering();
+
     // Attempts to log in with `username` and `password`..
     // @return ok      - `username` and `password` match an existing user.
     //                   This user becomes logged in and the executing thread
@@ -26,6 +129,14 @@ public:
     //                   `is_logged_in` before calling `login`.
     status login(const std::string& username, const std::string& password);
 
+    // Logs in as `username` without a password, for a request that a proxy
+    // relays for a user it logged in before.
+    // @return ok    - `username` is an existing user of this server, and the
+    //                 executing thread is dedicated to the user.
+    // @return error - `username` doesn't exist, or the executing thread is
+    //                 already logged in.
+    status login_as(const std::string& username);
+
     // Attempts to register a user with `username` and `password`.
     // @return ok      - A user is successfully created.
     // @return error   - `username` already exists or has existed.
@@ -41,29 +152,53 @@ public:
     // Checks if the current thread has an associated user.
     bool is_logged_in();
 
-    // Returns a vector of all usernames matching `pattern`.
+    // Stores the username of the current thread's user into `username`.
+    // @return ok    - The username was successfully retrieved.
+    // @return error - This thread does not have an associated user (not
+    //                 logged in).
+    status current_username(std::string& username);
+
+    // Returns a vector of all usernames matching `pattern`, in sorted order.
     std::vector<std::string> get_usernames(const std::string& pattern);
 
     // Stores `txt` into recipient's chat with the sender and into the sender's
     // chat with the recipient. Recipient is identified via
     // `recipient_username`, and sender is identified via the currently logged
-    // in thread.
-    // @return ok    - The text was successfully stored.
-    // @return error - The current thread does not have an associated user (not
-    //                 logged in).
-    // @return error - The recipient doesn't exist.
+    // in thread. The text counts towards the sent bytes of the sender only,
+    // so receiving texts never fills up the recipient's limits.
+    // @return ok          - The text was successfully stored.
+    // @return error       - The current thread does not have an associated
+    //                       user (not logged in).
+    // @return error       - The recipient doesn't exist.
+    // @return quota_error - Sending the text would exceed the sender's
+    //                       limits, or storing it the limit of the whole
+    //                       database. Nothing is stored.
+    // @return quota_error - `txt` is longer than `conversation::max_txt_len`.
     status send_txt(const std::string& recipient_username,
                     const std::string& txt);
 
-    // Retrieves the recipient's chat with the sender and stores it into `c`.
-    // Sender is identified via `sender_username`, and recipient is identified
-    // via the currently logged in thread.
+    // Retrieves a view of the recipient's chat with the sender and stores it
+    // into `v`. Sender is identified via `sender_username`, and recipient is
+    // identified via the currently logged in thread. The view shares the text
+    // bytes with the database, so it can be serialized without holding the
+    // database lock. If the chat was evicted, it is first read back from the
+    // segment files, without holding the database lock. Texts in sealed files
+    // are served from the mapping of the file; otherwise, the chat is
+    // faulted back into memory. Compressed chunks are decompressed through a
+    // cache, also without holding the database lock.
     // @return ok    - The chat was successfully retrieved (it could contain no
     // texts).
     // @return error - The current thread does not have an associated user (not
     //                 logged in).
     // @return error - The sender doesn't exist.
-    status recv_txt(const std::string& sender_username, chat& c);
+    // @return receive_error - The evicted chat could not be read back, or a
+    //                         compressed chunk could not be decompressed.
+    status recv_txt(const std::string& sender_username, chat_view& v);
+
+    // Compress all chunks that were sealed at least `min_age` ago. Normally
+    // called by the tiering thread.
+    void compress_cold_chunks(
+        const std::chrono::steady_clock::duration& min_age);
 
     // Retrieve the correspondents of the currently logged in user and stores
     // them into `usernames`.
@@ -73,41 +208,421 @@ public:
     //                 logged in).
     status get_correspondents(std::vector<std::string>& usernames);
 
-    // Delete the currently logged in user. This includes deleting from
-    // `users_`, but also deleting chats with all correspondents, both for the
-    // logged in user and the correspondents.
+    // Delete the currently logged in user. This includes marking the user as
+    // deleted in `users_`, but also deleting chats with all correspondents,
+    // both for the logged in user and the correspondents.
     // @return ok    - The deletion was successful. The running thread is
     //                 deassociated from the user (logged out).
     // @return error - The current thread does not have an associated user (not
     //                 logged in).
     status delete_user();
 
+    // Sharded databases hold only the users of one shard. A user of another
+    // shard that exchanged texts with local users is recorded as a remote
+    // user: it can't log in, `get_usernames` doesn't list it, and it holds no
+    // chats. The local users' chats with it are stored here, and its own
+    // chats with them on its shard. Remote users are not replicated, so a
+    // sharded database must not have a replication log.
+
+    // Check that the currently logged in user can send `txt` to the remote
+    // user `recipient_username`, within the sender's limits and the limit
+    // of the whole database. Nothing is stored.
+    // @return ok          - The text fits.
+    // @return error       - The current thread does not have an associated
+    //                       user (not logged in).
+    // @return quota_error - Storing the text would exceed the limits, or
+    //                       `txt` is longer than `conversation::max_txt_len`.
+    status check_remote_txt(const std::string& recipient_username,
+                            const std::string& txt);
+
+    // Store `txt` into the chat of the currently logged in user with the
+    // remote user `recipient_username`, once the recipient's shard stored
+    // the recipient's copy. The limits were checked by `check_remote_txt`.
+    // @return ok    - The text was successfully stored.
+    // @return error - The current thread does not have an associated user
+    //                 (not logged in).
+    status store_remote_txt(const std::string& recipient_username,
+                            const std::string& txt);
+
+    // Stores `txt` from the remote user `sender_username` into the chat of
+    // the local user `recipient_username` with the sender. The sender's
+    // limits were checked on its shard, and the text doesn't count towards
+    // the recipient's.
+    // @return ok          - The text was successfully stored.
+    // @return error       - The recipient doesn't exist.
+    // @return quota_error - Storing the text would exceed the limit of the
+    //                       whole database, or `txt` is longer than
+    //                       `conversation::max_txt_len`. Nothing is stored.
+    status deliver_remote_txt(const std::string& sender_username,
+                              const std::string& recipient_username,
+                              const std::string& txt);
+
+    // Delete the chats of all local users with the remote user `username`,
+    // which was deleted on its shard. Does nothing if there is no such
+    // remote user.
+    void remove_remote_user(const std::string& username);
+
+    // A local user moves to another shard of the cluster in the background.
+    // `export_user` copies the user's record and chats, and from then on the
+    // database keeps the later writes to them for the other shard to catch
+    // up with. `seal_user` hands the last writes over and stops the user's
+    // writes for good, and once the other shard adopted the user, `drop_user`
+    // turns it into a remote user. Meanwhile, on the other shard,
+    // `import_user` stores the user as a remote user that holds chats, until
+    // `adopt_user` makes it local.
+
+    // Store the mutations that rebuild the local user `username` on another
+    // shard into `mutations`: its registration and the texts of its chats,
+    // in order, of which only the user's copies are stored there. Every
+    // later text of the user's chats, and the deletion of any of its
+    // correspondents, is kept until `take_exported`, `seal_user` or
+    // `cancel_export`. Evicted chats are read back without holding the
+    // database lock. Send times are not part of the mutations.
+    // @return ok            - The user was copied.
+    // @return error         - There is no such local user, or it's already
+    //                         being exported.
+    // @return receive_error - An evicted chat could not be read back, or a
+    //                         compressed chunk could not be decompressed.
+    //                         The export is cancelled.
+    status export_user(const std::string& username,
+                       std::vector<chat262::mutation>& mutations);
+
+    // Move the writes to the exported user `username` that were kept since
+    // the export, or since the last call, into `mutations`.
+    void take_exported(const std::string& username,
+                       std::vector<chat262::mutation>& mutations);
+
+    // Stop the export of `username` and drop the writes that were kept
+    void cancel_export(const std::string& username);
+
+    // Move the last writes kept for the exported user `username` into
+    // `mutations` and stop the export. The user can't be written anymore: it
+    // can't log in, texts to it fail, and all threads that are logged in as
+    // the user are logged out.
+    // @return ok    - The user is sealed.
+    // @return error - The user was deleted during the export.
+    status seal_user(const std::string& username,
+                     std::vector<chat262::mutation>& mutations);
+
+    // Make the sealed user `username` local again, after the other shard
+    // could not adopt it
+    void unseal_user(const std::string& username);
+
+    // Delete the chats of the sealed user `username`, which another shard
+    // adopted. The user stays as a remote user, since local users hold chats
+    // with it.
+    void drop_user(const std::string& username);
+
+    // Store the chunk `mutations` of the user `username` that another shard
+    // exports, without checking the limits, which the user was within on its
+    // shard. The registration in the first chunk starts the import over.
+    // @return ok         - The chunk was stored.
+    // @return error      - `username` is a local user, or it was deleted.
+    // @return body_error - A mutation is not a registration of the user, a
+    //                      text of the user's, or a deletion of another
+    //                      user. The mutations before it were stored.
+    status import_user(const std::string& username,
+                       const std::vector<chat262::mutation>& mutations);
+
+    // Make the imported user `username` a local user.
+    // @return ok    - The user is local.
+    // @return error - The user is not being imported, or it was deleted.
+    status adopt_user(const std::string& username);
+
+    // Apply `mutations` replicated from a primary, the first of which has the
+    // sequence number `first_seq`. Mutations that were applied before are
+    // skipped, and if mutations before `first_seq` are missing, nothing is
+    // applied. The primary already checked the mutations, so texts are stored
+    // even if they exceed the limits of this database, which must not
+    // diverge from the primary.
+    // Stores the sequence number up to which all mutations are applied into
+    // `last_seq`.
+    // @return ok    - All mutations that follow the applied ones were
+    //                 applied.
+    // @return error - A mutation has an unknown operation. The mutations
+    //                 before it were applied.
+    status apply(const uint64_t first_seq,
+                 const std::vector<chat262::mutation>& mutations,
+                 uint64_t& last_seq);
+
+    // Apply `m` on behalf of the user `m.username_`, within the limits. The
+    // committed entries of a Raft log are applied this way, in the same order
+    // and with the same outcome on every server.
+    // @return ok          - The mutation was applied.
+    // @return error       - The registered username already exists or has
+    //                       existed, or the sender, the recipient or the
+    //                       deleted user doesn't exist.
+    // @return quota_error - The text would exceed the limits. Nothing is
+    //                       stored.
+    // @return body_error  - The mutation has an unknown operation.
+    status execute(const chat262::mutation& m);
+
+    // Store the mutations that rebuild the database from scratch into
+    // `mutations`: the registrations of all users, the deletions of the
+    // deleted ones, and the texts of every chat in order. Evicted chats are
+    // read back without holding the database lock, so the caller must make
+    // sure that nothing is written to the database meanwhile for the
+    // snapshot to be exact. Otherwise, texts sent to a chat while it is read
+    // back may be in the snapshot, as well as after it. Send times are not
+    // part of the snapshot.
+    // Stores the sequence number of the last mutation in the snapshot into
+    // `last_seq`: the last one appended to the replication log, or the last
+    // one applied from a primary.
+    // @return ok            - The snapshot was successfully taken.
+    // @return receive_error - An evicted chat could not be read back, or a
+    //                         compressed chunk could not be decompressed.
+    status snapshot(std::vector<chat262::mutation>& mutations,
+                    uint64_t& last_seq);
+
+    // Replace everything in the database with `mutations`, taken by
+    // `snapshot`, which hold the mutations of a primary up to the sequence
+    // number `last_seq`. All threads are logged out.
+    void restore(const std::vector<chat262::mutation>& mutations,
+                 const uint64_t last_seq);
+
+    // Wait up to `timeout` until the mutations of a primary are applied up
+    // to the sequence number `seq`. Stores the sequence number up to which
+    // they are applied into `applied`.
+    // @return ok    - The mutation `seq` is applied.
+    // @return error - The timeout expired first.
+    status wait_applied(const uint64_t seq,
+                        const std::chrono::milliseconds& timeout,
+                        uint64_t& applied);
+
+    // Print the database statistics to `out`: the memory usage against the
+    // limits, the users storing the most, and with the `LOCK_PROFILING`
+    // build option, the contention profile of `mutex_`.
+    void dump_stats(FILE* out);
+
 private:
+    // Usernames are interned into dense IDs at registration, so that all
+    // internal lookups after the first one work with integers instead of
+    // strings. IDs are never reused, not even after the user is deleted.
+    typedef uint32_t user_id;
+
     struct user {
-        std::string username_;
+        // Points to the key in `ids_`, so the username is stored only once
+        const std::string* username_;
         std::string password_;
-        std::unordered_map<std::string, chat> chats_;
+        // Set once the user is deleted. The record stays in `users_` so that
+        // the username can never be registered again.
+        bool deleted_;
+        // Set if the user belongs to another shard
+        bool remote_;
+        // Map from correspondents' IDs to chats with them
+        std::unordered_map<user_id, conversation> chats_;
+        // Sum of `stored_bytes` of all chats
+        size_t stored_bytes_;
+        // Bytes of the texts the user sent, in all chats. The per-user limit
+        // is enforced on these, so incoming texts never use up the quota.
+        size_t sent_bytes_;
+    };
+
+    // Find an existing (not deleted) user with `username`.
+    // @return A pointer to the user's record, or `nullptr` if there is no such
+    //         user.
+    user* find_user(const std::string& username);
+
+    // Find the user associated with the current thread.
+    // @return A pointer to the user's record, or `nullptr` if the current
+    //         thread is not logged in.
+    user* current_user();
+
+    // Register a user with `username` and `password`. `mutex_` must be held.
+    // Returns the same as `registration`.
+    status add_user(const std::string& username, const std::string& password);
+
+    // Store `txt` from `sender` to the user with `recipient_username`, within
+    // the limits if `enforce_limits` is set. `mutex_` must be held. Returns
+    // the same as `send_txt`.
+    status store_txt(user* sender,
+                     const std::string& recipient_username,
+                     const std::string& txt,
+                     const bool enforce_limits);
+
+    // Find the remote user with `username`, and record it if it's not
+    // recorded yet. `mutex_` must be held.
+    // @return A pointer to the user's record, or `nullptr` if `username` is
+    //         a local user, or a deleted remote user.
+    user* find_remote_user(const std::string& username);
+
+    // Append `txt` to the chat of `u` with `correspondent`, with `sender`
+    // as in `text`, and account for its bytes. `mutex_` must be held.
+    void append_txt(user& u,
+                    const user_id correspondent,
+                    const uint8_t sender,
+                    const std::string& txt);
+
+    // Delete the user `id` and all of their chats, and log out every thread
+    // logged in as the user. `mutex_` must be held.
+    void remove_user(const user_id id);
+
+    // Delete the chat of `u` with `correspondent`, and account for its
+    // bytes. `mutex_` must be held.
+    void remove_chat(user& u, const user_id correspondent);
+
+    // Delete the chats of all users with the remote user `id`, as well as its
+    // own chats if it's being imported, and mark it as deleted. `mutex_` must
+    // be held.
+    void remove_remote(const user_id id);
+
+    // Keep `m` for the exported user `id`, if it's being exported. `mutex_`
+    // must be held.
+    void keep_exported(const user_id id, chat262::mutation m);
+
+    // Append `m` to the replication log and to the journal, if they are set.
+    // `mutex_` must be held.
+    void record(const chat262::mutation& m);
+
+    // Apply `m`, within the limits if `enforce_limits` is set. `mutex_` must
+    // be held. Returns the same as `execute`.
+    status apply_mutation(const chat262::mutation& m,
+                          const bool enforce_limits);
+
+    // Check if `u` can send texts of `cost` more bytes in its chat with
+    // `correspondent`, according to the per-user and per-chat limits. Only
+    // the texts `u` sent count towards its limits.
+    bool within_quota(const user& u,
+                      const user_id correspondent,
+                      const size_t cost) const;
+
+    // Bytes of the texts of `c`, the chat of `u` with `correspondent`, that
+    // `u` sent. A chat with oneself holds both copies of every text.
+    size_t sent_bytes(const user& u,
+                      const user_id correspondent,
+                      const conversation& c) const;
+
+    // Body of the tiering thread. Runs an eviction pass periodically until
+    // `stop_tiering_` is set.
+    void run_tiering();
+
+    // A copy of a chat, as seen by the participant with the lower ID
+    struct chat_copy {
+        user_id owner_id_;
+        user_id correspondent_id_;
+        // The chat is evicted if this is not empty
+        std::vector<segment_store::segment_ref> refs_;
+        chat_view v_;
+        std::vector<conversation::compressed_run> compressed_;
     };
 
+    // Store a view of every chat into `chats`, once per pair of users.
+    // Evicted chats only hold the texts in memory. `mutex_` must be held.
+    void view_all_chats(std::vector<chat_copy>& chats);
+
+    // Read the evicted texts of `c` back, without holding the lock, and
+    // decompress its compressed runs. Returns the same as `recv_txt`.
+    status complete_view(chat_copy& c);
+
+    // Store a view of the chat of the current user with `sender_username`
+    // into `v`, and its compressed runs into `compressed`. Returns the same
+    // as `recv_txt`.
+    status view_chat(const std::string& sender_username,
+                     chat_view& v,
+                     std::vector<conversation::compressed_run>& compressed);
+
+    // Store a view of the evicted chat of `recipient_id` with `sender_id`
+    // into `v`, and its compressed runs into `compressed`. `refs` are the
+    // evicted segments of the chat, and `resident` and `resident_compressed`
+    // the view of its texts in memory at the time. The segments are read
+    // without holding the database lock. Returns the same as `recv_txt`.
+    status view_evicted_chat(
+        const user_id recipient_id,
+        const user_id sender_id,
+        std::vector<segment_store::segment_ref> refs,
+        chat_view resident,
+        std::vector<conversation::compressed_run> resident_compressed,
+        chat_view& v,
+        std::vector<conversation::compressed_run>& compressed);
+
+    // Fill the runs `compressed` of `v` with their decompressed bytes.
+    // @return ok    - All runs were decompressed.
+    // @return error - A block is malformed.
+    status decompress_runs(
+        chat_view& v,
+        const std::vector<conversation::compressed_run>& compressed);
+
+    // Evict all chats that were not used for `cfg_.evict_after_`. The chats
+    // are written to the segment files without holding the database lock.
+    void evict_idle_chats();
+
     // Check if `target` matches `pattern`. The only special character in
     // `pattern` is `*`, which matches zero or more of any character.
     bool wildcard_match(const std::string& pattern, const std::string& target);
 
     // Protects everything. We don't care about the performance, so we go for
-    // coarse-grained strategy.
-    std::mutex mutex_;
+    // coarse-grained strategy. The mutex can be profiled to see how much this
+    // actually costs.
+    profiled_mutex mutex_;
+
+    config cfg_;
 
-    // Map from usernames to users
-    std::map<std::string, user> users_;
+    // Map from all usernames ever registered with the service to their IDs
+    std::unordered_map<std::string, user_id> ids_;
 
-    // A set of all usernames ever registered with the service
-    std::unordered_set<std::string> historical_users_;
+    // Flat table of user records, indexed by user ID
+    std::vector<user> users_;
 
     // After a user logs in, each thread is in charge of exactly one user.
-    // `threads_` maps unique thread IDs to usernames, so that the server
+    // `threads_` maps unique thread IDs to user IDs, so that the server
     // doesn't have to keep track of usernames. If the thread ID is in the map,
     // the user is logged in.
-    std::unordered_map<std::thread::id, std::string> threads_;
+    std::unordered_map<std::thread::id, user_id> threads_;
+
+    // Sum of `stored_bytes_` of all users, and its highest value so far
+    size_t total_bytes_;
+    size_t peak_bytes_;
+
+    // Number of texts rejected because of the limits
+    uint64_t rejected_txts_;
+
+    // Evicted chats
+    segment_store segments_;
+
+    // The tiering thread sleeps on `tiering_cv_` between passes, and stops
+    // when `stop_tiering_` is set
+    std::thread tiering_thread_;
+    std::mutex tiering_mutex_;
+    std::condition_variable tiering_cv_;
+    bool stop_tiering_;
+
+    // Eviction and fault-in statistics. Latencies are per chat, in
+    // nanoseconds. Protected by `mutex_`.
+    struct tiering_stats {
+        uint64_t count_;
+        uint64_t total_ns_;
+        uint64_t max_ns_;
+        uint64_t errors_;
+
+        void record(const uint64_t ns);
+        void print(FILE* out, const char* name) const;
+    };
+    tiering_stats evictions_;
+    tiering_stats fault_ins_;
+    tiering_stats mapped_reads_;
+    tiering_stats compressions_;
+    uint64_t incompressible_chunks_;
+
+    // Decompressed chunks
+    block_cache cache_;
+
+    // Every mutation is appended here, if set
+    replication_log* log_;
+
+    // Every mutation is made durable here, if set
+    journal* journal_;
+
+    // Users being exported to another shard, and the writes to them since
+    // the export or since they were last taken
+    std::unordered_map<user_id, std::vector<chat262::mutation>> exports_;
+
+    // Sequence number up to which all replicated mutations are applied.
+    // Written while holding both `mutex_` and `applied_mutex_`, so that it
+    // can be read while holding either.
+    uint64_t applied_seq_;
+    std::mutex applied_mutex_;
+    // Signaled when `applied_seq_` changes
+    std::condition_variable applied_cv_;
 };
 
 #endif
@@ -0,0 +1,57 @@
+#ifndef _DEDUPE_CACHE_H_
+#define _DEDUPE_CACHE_H_
+
+#include "chat262_protocol.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// The responses to the last writes of a user or a connection that carried
+// request IDs, by ID, so that a write sent again is answered with the
+// response to the first instead of being applied twice. When the cache is
+// full, the oldest response is dropped. The cache is not thread-safe.
+class dedupe_cache {
+public:
+    // Most responses kept
+    static constexpr size_t capacity = 128;
+
+    // A request ID and the response to it
+    using entry = std::pair<uint64_t, std::shared_ptr<chat262::message>>;
+
+    dedupe_cache() = default;
+
+    // Prevent copy/move
+    dedupe_cache(const dedupe_cache&) = delete;
+    dedupe_cache(dedupe_cache&&) = delete;
+    dedupe_cache& operator=(const dedupe_cache&) = delete;
+    dedupe_cache& operator=(dedupe_cache&&) = delete;
+
+    // Returns the response to the request `request_id`, or `nullptr` if
+    // there is none
+    std::shared_ptr<chat262::message> find(const uint64_t request_id) const;
+
+    // Keep `response` as the response to the request `request_id`, which is
+    // not in the cache
+    void insert(const uint64_t request_id,
+                const std::shared_ptr<chat262::message>& response);
+
+    // Drop all responses
+    void clear();
+
+    // Returns the responses, oldest first, so that inserting them in order
+    // into an empty cache rebuilds this one
+    std::vector<entry> entries() const;
+
+private:
+    std::unordered_map<uint64_t, std::shared_ptr<chat262::message>>
+        responses_;
+    // Request IDs of the responses, oldest first
+    std::deque<uint64_t> order_;
+};
+
+#endif
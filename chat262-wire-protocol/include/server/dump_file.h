@@ -0,0 +1,160 @@
+#ifndef _DUMP_FILE_H_
+#define _DUMP_FILE_H_
+
+#include "chat.h"
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A dump of a database, written by `dump_writer` and read by `dump_reader`.
+// All fields are little-endian. The file is laid out as:
+//
+// dump_header header;
+// users[header.num_users_]:
+//     uint8_t deleted;
+//     uint32_t username_len;
+//     uint32_t password_len;
+//     uint8_t username[username_len];
+//     uint8_t password[password_len];
+// chats[header.num_chats_]:
+//     uint32_t owner;
+//     uint32_t correspondent;
+//     uint8_t segment[...];
+// uint64_t chat_offsets[header.num_chats_];
+//
+// Users are numbered in the order they are listed, starting from 0. Every
+// chat is stored once, as seen by its owner, in the layout of a segment of a
+// `segment_store`: the number of texts, the senders, the lengths and then
+// the text bytes. Texts are laid out as seen by its owner, and its
+// correspondent sees them with the senders swapped. A chat of a user with
+// itself holds both copies of every text. `chat_offsets` holds the offset of
+// every chat from the start of the file, so that the chats can be read in
+// parallel.
+struct dump_header {
+    // `dump_magic`
+    uint8_t magic_[8];
+    // `dump_version`
+    uint16_t version_;
+    uint16_t flags_;
+    uint32_t reserved_;
+    uint64_t num_users_;
+    uint64_t num_chats_;
+};
+static_assert(sizeof(dump_header) == 32, "Header must be packed");
+
+static constexpr uint8_t dump_magic[8] =
+    {'C', '2', '6', '2', 'D', 'M', 'P', '\0'};
+static constexpr uint16_t dump_version = 1;
+
+// Writes a dump file, through a buffer. All users must be added before the
+// first chat.
+class dump_writer {
+public:
+    dump_writer();
+    ~dump_writer();
+
+    // Prevent copy/move
+    dump_writer(const dump_writer&) = delete;
+    dump_writer(dump_writer&&) = delete;
+    dump_writer& operator=(const dump_writer&) = delete;
+    dump_writer& operator=(dump_writer&&) = delete;
+
+    // Create the file at `path`, replacing the file that is there.
+    // @return ok    - The file is created.
+    // @return error - The file could not be created. `errno` tells why.
+    status open(const std::string& path);
+
+    // Add the next user. The first user added is user 0.
+    // @return ok    - The user is added.
+    // @return error - The file could not be written. `errno` tells why.
+    status add_user(const std::string& username,
+                    const std::string& password,
+                    const bool deleted);
+
+    // Add the chat of user `owner` with user `correspondent`, holding the
+    // texts of `v` as seen by `owner`. `v` must hold no compressed runs.
+    // @return ok    - The chat is added.
+    // @return error - The file could not be written. `errno` tells why.
+    status add_chat(const uint32_t owner,
+                    const uint32_t correspondent,
+                    const chat_view& v);
+
+    // Write the chat offsets and the header, sync the file and close it.
+    // @return ok    - The dump is complete.
+    // @return error - The file could not be written. `errno` tells why.
+    status close();
+
+private:
+    // Append `len` bytes at `data` to the buffer, and write the buffer out
+    // once it is full
+    status put(const void* data, const size_t len);
+
+    // Write out the buffer
+    status flush();
+
+    int fd_;
+    std::vector<uint8_t> buffer_;
+    // Offset of the end of the buffer in the file
+    uint64_t offset_;
+    uint64_t num_users_;
+    std::vector<uint64_t> chat_offsets_;
+};
+
+// Reads a dump file from a read-only mapping. Chats can be read from many
+// threads at once.
+class dump_reader {
+public:
+    dump_reader();
+
+    // Prevent copy/move
+    dump_reader(const dump_reader&) = delete;
+    dump_reader(dump_reader&&) = delete;
+    dump_reader& operator=(const dump_reader&) = delete;
+    dump_reader& operator=(dump_reader&&) = delete;
+
+    // Map the file at `path` and validate its header and chat offsets.
+    // @return ok    - The dump is ready to be read.
+    // @return error - The file could not be mapped, or is not a dump of a
+    //                 supported version.
+    status open(const std::string& path);
+
+    uint64_t num_users() const;
+    uint64_t num_chats() const;
+
+    // Read the next user. Users are read in order, starting from user 0.
+    // @return ok    - The user was read.
+    // @return error - The user is malformed, or all users were read.
+    status next_user(std::string& username,
+                     std::string& password,
+                     bool& deleted);
+
+    // Read the participants of chat `idx`.
+    // @return ok    - The participants were read.
+    // @return error - The chat is malformed.
+    status read_participants(const uint64_t idx,
+                             uint32_t& owner,
+                             uint32_t& correspondent) const;
+
+    // Read chat `idx` into `v`, as seen by its owner. `v` points into the
+    // mapping of the file, and is only valid as long as the reader is.
+    // Thread-safe.
+    // @return ok    - The chat was read.
+    // @return error - The chat is malformed.
+    status read_chat(const uint64_t idx, chat_view& v) const;
+
+private:
+    std::shared_ptr<const uint8_t> data_;
+    size_t len_;
+    uint64_t num_users_;
+    uint64_t num_chats_;
+    // Offset of the next user to read
+    size_t user_offset_;
+    // Offset of `chat_offsets`
+    size_t index_offset_;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef _HANDOVER_H_
+#define _HANDOVER_H_
+
+#include "common.h"
+#include "dedupe_cache.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A hot restart hands the listening socket and the client connections of a
+// running server over to a new server process, so that the clients keep
+// their connections. The running server listens on a Unix socket, and the
+// new server connects to it when it starts. The running server then sends
+// the listening socket, the path of a dump of its database, and every
+// connection with its state, passing the descriptors with `SCM_RIGHTS`. Once
+// the new server loaded the dump, it confirms, and the running server exits.
+// If the new server goes away without confirming, the running server carries
+// on.
+//
+// The Unix socket is a `SOCK_SEQPACKET` socket, so that every message arrives
+// whole and with its own descriptors. The first message holds the number of
+// connections, the number of users with a dedupe cache, and the path of the
+// dump, with the listening socket:
+//
+// uint32_t num_connections;
+// uint32_t num_users;
+// uint8_t dump_path[...];
+//
+// Every connection follows in a message of its own, with its descriptor:
+//
+// uint16_t version;
+// uint32_t features;
+// uint8_t from_proxy;
+// uint32_t username_length;
+// uint8_t username[username_length];
+// dedupe cache of the connection
+//
+// Then every user with a dedupe cache, in a message without a descriptor:
+//
+// uint32_t username_length;
+// uint8_t username[username_length];
+// dedupe cache of the user
+//
+// A dedupe cache is laid out as its number of responses, followed by every
+// response, oldest first, as the request ID and the whole response message:
+//
+// uint32_t num_responses;
+// uint64_t request_id;
+// message response;
+// ...
+//
+// All fields are little-endian.
+
+// A client connection and its state
+struct handed_connection {
+    int fd_;
+    // Version and features negotiated on the connection
+    uint16_t version_;
+    uint32_t features_;
+    // The connection came from a proxy
+    bool from_proxy_;
+    // Username of the logged in user, or an empty string
+    std::string username_;
+    // Responses to the writes with request IDs sent before logging in
+    std::vector<dedupe_cache::entry> dedupe_;
+};
+
+// The responses to the last writes with request IDs of a user
+struct handed_user {
+    std::string username_;
+    std::vector<dedupe_cache::entry> dedupe_;
+};
+
+// Listen for a new server on the Unix socket `path`, replacing the socket
+// file of a server that went away.
+// @return ok    - `fd` listens on `path`.
+// @return error - The socket could not be created. `errno` tells why, and
+//                 `fd` is -1.
+status listen_handover(const std::string& path, int& fd);
+
+// Connect to the server that listens for a new server on `path`.
+// @return ok    - `fd` is connected to the running server.
+// @return error - No server listens on `path`. `fd` is -1.
+status connect_handover(const std::string& path, int& fd);
+
+// Send the listening socket `listen_fd`, the path of the dump `dump_path`,
+// `conns` and `users` to the new server on `fd`.
+// @return ok         - Everything was sent.
+// @return send_error - The new server went away, or a message was too long.
+status send_handover(int fd,
+                     int listen_fd,
+                     const std::string& dump_path,
+                     const std::vector<handed_connection>& conns,
+                     const std::vector<handed_user>& users);
+
+// Receive the listening socket into `listen_fd`, the path of the dump into
+// `dump_path`, the connections into `conns` and the users into `users` from
+// the running server on `fd`.
+// @return ok            - Everything was received.
+// @return receive_error - The running server went away, or sent a message
+//                         that is malformed or lacks its descriptor. The
+//                         descriptors received so far are closed.
+status recv_handover(int fd,
+                     int& listen_fd,
+                     std::string& dump_path,
+                     std::vector<handed_connection>& conns,
+                     std::vector<handed_user>& users);
+
+// Tell the running server on `fd` that the new server took over.
+// @return ok         - The running server was told.
+// @return send_error - The running server went away.
+status confirm_handover(int fd);
+
+// Wait for the new server on `fd` to confirm that it took over.
+// @return ok            - The new server took over.
+// @return receive_error - The new server went away without confirming.
+status wait_handover_confirmed(int fd);
+
+// Wait until the running server on `fd` exited, after it was told that the
+// new server took over
+void wait_handover_closed(int fd);
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "chat262_protocol.h"
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A file that holds every registration, sent text and deletion of a server,
+// so that they survive a restart.
+//
+// The threads that apply the mutations don't write the file. The database
+// pushes every mutation onto a lock-free queue while holding its lock, and a
+// writer thread of the journal takes everything that queued up, writes it to
+// the end of the file in one write and syncs the file once for the whole
+// batch. A write is answered only once the batch of its mutation is synced.
+// While a batch is synced, the next one queues up, so the more connections
+// write at once, the larger the batches and the fewer the syncs per write.
+//
+// The file is a sequence of replicate requests, one per batch, exactly as a
+// primary sends them to its backups. The mutations are numbered with
+// consecutive sequence numbers, starting from 1. A batch that a crash cut
+// short was never answered, and it is dropped when the journal is opened.
+//
+// All member functions are thread-safe.
+class journal {
+public:
+    // Batch sizes and commit latencies are bucketed by powers of two. The
+    // last bucket holds everything from 2^(num_buckets - 1) up.
+    static constexpr size_t num_buckets = 32;
+
+    // Most mutations written in one batch
+    static constexpr size_t max_batch_mutations = 4096;
+
+    struct stats {
+        uint64_t batches_;
+        uint64_t mutations_;
+        uint64_t bytes_;
+        // Time spent syncing the batches
+        uint64_t total_sync_ns_;
+        uint64_t max_sync_ns_;
+        // Time from queueing a mutation until its batch was synced
+        uint64_t total_commit_ns_;
+        uint64_t max_commit_ns_;
+        // Mutations per batch
+        uint64_t batch_hist_[num_buckets];
+        // Commit latencies in nanoseconds
+        uint64_t commit_hist_[num_buckets];
+        // A write or a sync of the file failed, and nothing is written since
+        bool failed_;
+    };
+
+    journal();
+    ~journal();
+
+    // Prevent copy/move
+    journal(const journal&) = delete;
+    journal(journal&&) = delete;
+    journal& operator=(const journal&) = delete;
+    journal& operator=(journal&&) = delete;
+
+    // Open the journal in the file `path`, which is created if it doesn't
+    // exist, read the mutations that it holds into `mutations`, and start the
+    // writer thread. A batch cut short at the end of the file is dropped.
+    // @return ok    - The journal is open.
+    // @return error - The file could not be opened, read or truncated.
+    //                 `errno` tells why.
+    status open(const std::string& path,
+                std::vector<chat262::mutation>& mutations);
+
+    // Queue `m` to be written. Must be called in the order in which the
+    // mutations were applied.
+    // Returns the sequence number of `m`.
+    uint64_t append(chat262::mutation m);
+
+    // Returns the sequence number of the last mutation that the calling thread
+    // appended, or 0 if it appended none.
+    static uint64_t last_appended();
+
+    // Wait until all mutations up to `seq` are synced to the file.
+    // @return ok    - The mutations are durable.
+    // @return error - The file could not be written, so they never will be.
+    status wait_durable(const uint64_t seq);
+
+    stats get_stats() const;
+
+private:
+    // A queued mutation. The queue is a stack that the writer empties all at
+    // once, so `next_` is the mutation queued before.
+    struct node {
+        chat262::mutation m_;
+        uint64_t seq_;
+        std::chrono::steady_clock::time_point queued_;
+        node* next_;
+    };
+
+    // Body of the writer thread. Writes batches until `stop_` is set and
+    // everything queued before is written.
+    void run_writer();
+
+    // Take all queued mutations into `pending_`, in the order of their
+    // sequence numbers. Only called by the writer thread.
+    void take_queued();
+
+    // Write the mutations of `pending_` that follow the last written one, up
+    // to `max_batch_mutations` of them, and sync the file. Only called by the
+    // writer thread.
+    // @return ok    - The batch is durable, or there was nothing to write.
+    // @return error - The file could not be written or synced.
+    status write_batch();
+
+    int fd_;
+    std::thread writer_;
+
+    // The queue, as a stack of the queued mutations, newest first
+    std::atomic<node*> head_;
+    // Sequence number of the next mutation
+    std::atomic<uint64_t> next_seq_;
+    // The writer thread waits for mutations to be queued, and must be woken
+    // up
+    std::atomic<bool> writer_idle_;
+
+    // Mutations taken from the queue and not yet written, oldest first. A
+    // mutation may be taken before an older one was queued, and then waits
+    // for it. Only used by the writer thread.
+    std::vector<node*> pending_;
+    // Sequence number of the last written mutation. Only used by the writer
+    // thread.
+    uint64_t written_seq_;
+
+    // Protects the fields below
+    mutable std::mutex mutex_;
+    // Signaled when mutations are queued while the writer thread is idle, or
+    // when it must stop
+    std::condition_variable queued_cv_;
+    // Signaled when a batch is synced, or when writing failed
+    std::condition_variable durable_cv_;
+    // Sequence number up to which all mutations are synced
+    uint64_t durable_seq_;
+    bool stop_;
+    stats stats_;
+};
+
+#endif
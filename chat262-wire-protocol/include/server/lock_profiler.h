@@ -0,0 +1,125 @@
+#ifndef _LOCK_PROFILER_H_
+#define _LOCK_PROFILER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+
+// Call sites that acquire a profiled mutex. Statistics are kept separately for
+// each site, so that the dump shows which operation waits and which operation
+// holds the lock for long.
+enum class lock_site : size_t {
+    login,
+    registration,
+    logout,
+    is_logged_in,
+    get_usernames,
+    send_txt,
+    recv_txt,
+    get_correspondents,
+    delete_user,
+    dump_stats,
+    fault_in,
+    evict,
+    compress,
+    apply,
+    snapshot,
+    migrate,
+    load,
+    num_sites
+};
+
+// Look up the lock site and return a descriptive string
+const char* lock_site_lookup(const lock_site site);
+
+#ifdef CHAT262_LOCK_PROFILING
+
+// A mutex that records, for every call site, the number of acquisitions, a
+// histogram of the time spent waiting for the lock, and the time spent holding
+// the lock. Enabled with the `LOCK_PROFILING` CMake option.
+class profiled_mutex {
+public:
+    profiled_mutex();
+
+    // Prevent copy/move
+    profiled_mutex(const profiled_mutex&) = delete;
+    profiled_mutex(profiled_mutex&&) = delete;
+    profiled_mutex& operator=(const profiled_mutex&) = delete;
+    profiled_mutex& operator=(profiled_mutex&&) = delete;
+
+    void lock(const lock_site site);
+    void unlock(const lock_site site);
+
+    // Print the collected statistics to `out`, one line per call site that
+    // has acquired the mutex at least once.
+    void dump(FILE* out) const;
+
+private:
+    // Wait times are bucketed by powers of two of nanoseconds. The last bucket
+    // holds everything longer than 2^(num_buckets - 1) ns (about 2 s).
+    static constexpr size_t num_buckets = 32;
+
+    struct site_stats {
+        std::atomic<uint64_t> acquisitions_;
+        std::atomic<uint64_t> wait_ns_;
+        std::atomic<uint64_t> max_wait_ns_;
+        std::atomic<uint64_t> hold_ns_;
+        std::atomic<uint64_t> max_hold_ns_;
+        std::atomic<uint64_t> wait_hist_[num_buckets];
+    };
+
+    static void update_max(std::atomic<uint64_t>& max, const uint64_t val);
+
+    std::mutex mutex_;
+
+    // When the current holder acquired the mutex. Only written by the holder.
+    std::chrono::steady_clock::time_point acquired_at_;
+
+    site_stats stats_[static_cast<size_t>(lock_site::num_sites)];
+};
+
+#else
+
+// Without `LOCK_PROFILING`, the profiled mutex is a plain mutex and the call
+// site is ignored, so production builds pay nothing.
+class profiled_mutex {
+public:
+    void lock(const lock_site) {
+        mutex_.lock();
+    }
+    void unlock(const lock_site) {
+        mutex_.unlock();
+    }
+    void dump(FILE* out) const {
+        fprintf(out, "Lock profiling is disabled in this build\n");
+    }
+
+private:
+    std::mutex mutex_;
+};
+
+#endif
+
+// RAII wrapper around `profiled_mutex`, the equivalent of `std::lock_guard`.
+class profiled_lock_guard {
+public:
+    profiled_lock_guard(profiled_mutex& mutex, const lock_site site) :
+        mutex_(mutex), site_(site) {
+        mutex_.lock(site_);
+    }
+    ~profiled_lock_guard() {
+        mutex_.unlock(site_);
+    }
+
+    profiled_lock_guard(const profiled_lock_guard&) = delete;
+    profiled_lock_guard& operator=(const profiled_lock_guard&) = delete;
+
+private:
+    profiled_mutex& mutex_;
+    const lock_site site_;
+};
+
+#endif
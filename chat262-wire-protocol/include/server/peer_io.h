@@ -0,0 +1,44 @@
+#ifndef _PEER_IO_H_
+#define _PEER_IO_H_
+
+#include "chat262_protocol.h"
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Blocking I/O on the connections that servers open to each other, to
+// replicate the database over the Chat 262 Protocol
+
+// Connect from `n_local_addr` to the server on `n_ip_addr` (both in network
+// byte order). Servers only take some requests from the addresses they were
+// told about, so the connection comes from the address that the caller
+// listens on, or from any address with `INADDR_ANY`. Requests and responses
+// between servers are small and must not wait for each other, so Nagle's
+// algorithm is disabled.
+// @return ok    - `fd` is connected to the server.
+// @return error - The server could not be reached.
+status connect_peer(const uint32_t n_ip_addr,
+                    const uint32_t n_local_addr,
+                    int& fd);
+
+// Send all bytes of `msg` to `fd`.
+// @return ok         - The message was sent.
+// @return send_error - The send failed.
+status send_all(int fd, const std::shared_ptr<chat262::message>& msg);
+
+// Receive exactly `len` bytes from `fd` into `data`.
+// @return ok                - The bytes were received.
+// @return receive_error     - The read failed.
+// @return closed_connection - The other side closed the connection.
+status recv_all(int fd, const size_t len, std::vector<uint8_t>& data);
+
+// Receive a message from `fd`, its header into `hdr` and its body into
+// `body`. Returns the same as `recv_all`.
+status recv_message(int fd,
+                    chat262::message_header& hdr,
+                    std::vector<uint8_t>& body);
+
+#endif
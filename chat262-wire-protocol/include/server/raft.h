@@ -0,0 +1,407 @@
+#ifndef _RAFT_H_
+#define _RAFT_H_
+
+#include "chat262_protocol.h"
+#include "common.h"
+#include "database.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A server of a Raft cluster, which replicates the writes to the database of
+// every server in the cluster. Servers are identified by their IP address, and
+// talk to each other over the Chat 262 Protocol.
+//
+// Every registration, text and deletion is proposed to the leader, which
+// appends it to its log as an entry. An entry is committed once a majority of
+// the cluster stored it, and every server applies the committed entries to its
+// database in the same order, with the same outcome. The outcome of a write,
+// such as a username that already exists, is therefore only known once its
+// entry is applied.
+//
+// The leader ships its log to every follower like a primary ships its
+// replication log (see `replicator`): in batches of append requests, with up
+// to `window` requests in flight. Entries that were appended while a batch is
+// in flight go out together in the next one, so throughput is not bound by the
+// round trip to the followers.
+//
+// A follower that hears nothing from a leader for a randomized election
+// timeout becomes a candidate and asks the others for their votes. A server
+// votes once per term, and only for a candidate whose log is at least as up
+// to date as its own, so a new leader holds every committed entry.
+//
+// The database itself is the snapshot of the applied entries, so applied
+// entries are dropped from the log once every follower stored them, or once
+// the log outgrows its capacity. A follower that needs dropped entries gets a
+// snapshot of the database instead (see `database::snapshot`), in chunks.
+//
+// The log is kept in memory, like the database, but the term and the vote
+// of a server are synced to its state file before it answers or sends a
+// request with them, so a server votes once per term even across restarts.
+// A server that finds a term in its state file restarted and lost its log,
+// including entries that it acknowledged and that may have been committed
+// with its help. It refuses entries until it installed a snapshot of the
+// leader, and it neither votes nor stands for election until it holds every
+// entry that the leader committed, so that it can't help elect a leader that
+// lacks one. If a majority of the cluster restarts, no leader is elected
+// again, since the committed entries are lost.
+class raft_node {
+public:
+    enum role : uint8_t { role_follower, role_candidate, role_leader };
+
+    struct config {
+        // Address of this server and of the other servers of the cluster, in
+        // network byte order and as written
+        uint32_t n_ip_addr_;
+        std::vector<std::pair<uint32_t, std::string>> peers_;
+        // Largest number of bytes of entries kept in the log once they are
+        // applied
+        size_t log_capacity_;
+    };
+
+    struct peer_stats {
+        std::string address_;
+        bool connected_;
+        // Index of the next entry to send, and up to which the log of the
+        // peer matches
+        uint64_t next_index_;
+        uint64_t match_index_;
+        uint64_t appends_;
+        uint64_t entries_;
+        // Times the leader went back to entries that the peer doesn't have
+        uint64_t rewinds_;
+        uint64_t snapshots_;
+        uint64_t snapshot_mutations_;
+        // Time from sending an append request to its response, in
+        // nanoseconds
+        uint64_t total_rtt_ns_;
+        uint64_t max_rtt_ns_;
+    };
+
+    struct stats {
+        role role_;
+        uint64_t term_;
+        // The server restarted, and doesn't hold every committed entry yet
+        bool catching_up_;
+        // Address of the leader of the term, or 0 if not known
+        uint32_t leader_;
+        // Index of the first and last entry of the log. The log is empty if
+        // the first is past the last.
+        uint64_t first_index_;
+        uint64_t last_index_;
+        uint64_t commit_index_;
+        uint64_t last_applied_;
+        size_t log_bytes_;
+        uint64_t elections_;
+        uint64_t proposals_;
+        // Proposals that were not committed, because the server lost its
+        // leadership or the cluster its majority
+        uint64_t failed_proposals_;
+        // Time from proposing an entry to applying it, in nanoseconds
+        uint64_t total_commit_ns_;
+        uint64_t max_commit_ns_;
+        uint64_t snapshots_installed_;
+        std::vector<peer_stats> peers_;
+    };
+
+    // Most append requests in flight to one peer at a time
+    static constexpr size_t window = 16;
+    // Most entries and bytes of entries in one append request or snapshot
+    // chunk
+    static constexpr size_t max_batch_entries = 4096;
+    static constexpr size_t max_batch_bytes = 1024 * 1024;
+    // Followers wait between one and two election timeouts for the leader
+    // before they start an election, and the leader sends an empty append
+    // request to every follower it has nothing to send for a heartbeat
+    // interval
+    static constexpr std::chrono::milliseconds election_timeout{150};
+    static constexpr std::chrono::milliseconds heartbeat_interval{50};
+    // Longest wait of a proposal to be applied
+    static constexpr std::chrono::milliseconds propose_timeout{2000};
+
+    // Construct a server of the cluster, which applies the committed entries
+    // to `db`
+    explicit raft_node(database& db);
+    ~raft_node();
+
+    // Prevent copy/move
+    raft_node(const raft_node&) = delete;
+    raft_node(raft_node&&) = delete;
+    raft_node& operator=(const raft_node&) = delete;
+    raft_node& operator=(raft_node&&) = delete;
+
+    // Open the state file `path`, which is created if it doesn't exist, and
+    // read the term and vote that it holds. Must be called before `start`.
+    // @return ok    - The state file is open.
+    // @return error - The file could not be opened or read, or is malformed.
+    //                 `errno` tells why.
+    status open_state(const std::string& path);
+
+    // Start the threads that elect a leader, talk to the other servers of
+    // `cfg` and apply the committed entries. The server starts as a follower.
+    void start(const config& cfg);
+
+    // Check if `n_ip_addr` (in network byte order) is another server of the
+    // cluster
+    bool is_peer(const uint32_t n_ip_addr) const;
+
+    // Append `m` to the log if this server is the leader, and wait until it
+    // is applied. Stores the outcome of `database::execute` into `result`.
+    // @return ok    - The mutation was applied.
+    // @return error - This server is not the leader, or the mutation was not
+    //                 committed within `propose_timeout`. It may still be
+    //                 committed later.
+    status propose(const chat262::mutation& m, status& result);
+
+    // Handle a vote request from `candidate`. Stores the term of this server
+    // into `resp_term` and whether it votes for the candidate into
+    // `granted`.
+    void handle_vote(const uint64_t term,
+                     const uint32_t candidate,
+                     const uint64_t last_log_index,
+                     const uint64_t last_log_term,
+                     uint64_t& resp_term,
+                     bool& granted);
+
+    // Handle an append request from `leader`. Stores the term of this server
+    // into `resp_term`, whether the entries were appended into `success`, and
+    // the index up to which the log matches the leader's into `match_index`.
+    // If the entries were not appended, `match_index` is as far as the log
+    // may match.
+    void handle_append(const uint64_t term,
+                       const uint32_t leader,
+                       const uint64_t prev_log_index,
+                       const uint64_t prev_log_term,
+                       const uint64_t leader_commit,
+                       const std::vector<uint64_t>& terms,
+                       const std::vector<chat262::mutation>& mutations,
+                       uint64_t& resp_term,
+                       bool& success,
+                       uint64_t& match_index);
+
+    // Handle a chunk of a snapshot from `leader`. Once the last chunk
+    // arrives, the database is replaced with the snapshot. Stores the term of
+    // this server into `resp_term`, and the number of mutations of the
+    // snapshot received so far into `received`.
+    void handle_snapshot(const uint64_t term,
+                         const uint32_t leader,
+                         const uint64_t last_index,
+                         const uint64_t last_term,
+                         const uint64_t offset,
+                         const bool done,
+                         const std::vector<chat262::mutation>& mutations,
+                         uint64_t& resp_term,
+                         uint64_t& received);
+
+    stats get_stats() const;
+
+private:
+    struct entry {
+        uint64_t term_;
+        chat262::mutation m_;
+    };
+
+    // The database up to and including the entry `last_index_`
+    struct snapshot {
+        uint64_t last_index_;
+        uint64_t last_term_;
+        std::vector<chat262::mutation> mutations_;
+    };
+
+    // A request in flight to a peer
+    struct request {
+        uint16_t type_;
+        // Term of this server when the request was sent
+        uint64_t term_;
+        // Index of the last entry of an append request, or the last index of
+        // a snapshot
+        uint64_t last_index_;
+        // For a snapshot chunk, the number of mutations up to the end of the
+        // chunk, and whether it's the last one
+        uint64_t received_;
+        bool done_;
+        // `generation_` of the peer when the request was sent
+        uint64_t generation_;
+        std::chrono::steady_clock::time_point sent_;
+    };
+
+    struct peer {
+        uint32_t n_ip_addr_;
+        std::string str_ip_addr_;
+        std::thread thread_;
+        // Descriptor of the connection, or -1
+        int fd_;
+        // The response thread stopped
+        bool broken_;
+        uint64_t next_index_;
+        uint64_t match_index_;
+        // Incremented whenever the leader goes back in the log of the peer,
+        // so that the requests sent before don't make it go back again
+        uint64_t generation_;
+        // Term in which the vote of the peer was requested
+        uint64_t vote_term_;
+        std::chrono::steady_clock::time_point last_sent_;
+        // Commit index sent in the last append request
+        uint64_t commit_sent_;
+        // Snapshot being sent, the number of its mutations sent, and whether
+        // the last chunk was sent
+        std::shared_ptr<const snapshot> snapshot_;
+        uint64_t snapshot_offset_;
+        bool snapshot_sent_;
+        // Requests in flight, oldest first
+        std::deque<request> in_flight_;
+        peer_stats stats_;
+    };
+
+    // A proposed entry whose proposer waits for it to be applied
+    struct proposal {
+        uint64_t term_;
+        bool done_;
+        // The entry was replaced by an entry of another leader
+        bool lost_;
+        status result_;
+    };
+
+    // Body of the thread of `p`. Connects to the peer and sends it requests
+    // until stopped.
+    void run_peer(peer& p);
+
+    // Send requests to `p` over the connected `fd` until the connection
+    // breaks or the server is stopped
+    void send_requests(peer& p, int fd);
+
+    // Form the next request to `p`, or return null if there is nothing to
+    // send. Sets `need_snapshot` instead if `p` needs a snapshot that
+    // wasn't taken yet. `mutex_` must be held.
+    std::shared_ptr<chat262::message> next_request(peer& p,
+                                                   bool& need_snapshot);
+
+    // Take a snapshot of the database at the last applied entry, unless the
+    // last one is still recent enough, and start sending it to `p`. `mutex_`
+    // must not be held.
+    // @return ok    - `p` has a snapshot to send.
+    // @return error - The snapshot could not be taken.
+    status take_snapshot(peer& p);
+
+    // Receive the responses of `p` from `fd` until the connection breaks.
+    // Runs in its own thread while sending requests.
+    void receive_responses(peer& p, int fd);
+
+    // Body of the election timer thread. Starts an election whenever the
+    // election deadline passes without a leader.
+    void run_timer();
+
+    // Body of the applier thread. Applies the committed entries to the
+    // database.
+    void run_applier();
+
+    // Install `s` into the database, unless the applied entries are already
+    // past it
+    void install_snapshot(const snapshot& s);
+
+    // The functions below require `mutex_` to be held
+
+    // Number of votes or copies of an entry that make a majority of the
+    // cluster
+    size_t majority() const;
+    // Index of the last entry in the log
+    uint64_t last_index() const;
+    // Term of the entry `index`, which must be in the log or be its base
+    uint64_t term_at(const uint64_t index) const;
+    // Append an entry of `term` with `m` and return its index
+    uint64_t append_entry(const uint64_t term, const chat262::mutation& m);
+    // Remove the entries from `index` on, which were replaced by a leader
+    void truncate(const uint64_t index);
+    // Drop the applied entries that no peer needs, and more if the log
+    // outgrows its capacity
+    void compact();
+    // Commit the entries of this term that a majority stored
+    void advance_commit();
+    // Write `term_` and `voted_for_` to the state file and sync it. If that
+    // fails, the server stops voting and standing for election.
+    // @return ok    - The term and vote are durable.
+    // @return error - The state file could not be written or synced.
+    status save_state();
+    // Push the election deadline past another randomized timeout
+    void reset_election_deadline();
+    // Start an election for the next term
+    void start_election();
+    // Become a follower in `term`, which is at least the current term
+    void become_follower(const uint64_t term);
+    // Become the leader of the current term
+    void become_leader();
+
+    database& db_;
+    uint32_t n_ip_addr_;
+    size_t log_capacity_;
+    std::vector<std::unique_ptr<peer>> peers_;
+    std::thread timer_thread_;
+    std::thread applier_thread_;
+
+    mutable std::mutex mutex_;
+    // Signaled when a peer may have something to send, or the server stops
+    std::condition_variable peer_cv_;
+    // Signaled when entries are committed, or the server stops
+    std::condition_variable commit_cv_;
+    // Signaled when entries are applied or lost
+    std::condition_variable applied_cv_;
+    // Signaled when the server stops
+    std::condition_variable timer_cv_;
+    bool stop_;
+
+    role role_;
+    uint64_t term_;
+    // Candidate voted for in this term, or 0
+    uint32_t voted_for_;
+    // The file that keeps `term_` and `voted_for_`, and whether writing it
+    // failed
+    int state_fd_;
+    bool state_failed_;
+    // The server restarted and refuses entries until it installed a snapshot,
+    // and doesn't vote or stand for election until it holds every entry that
+    // the leader committed
+    bool awaiting_snapshot_;
+    bool catching_up_;
+    uint32_t leader_;
+    // Votes received as a candidate, including the own vote
+    size_t votes_;
+    std::chrono::steady_clock::time_point election_deadline_;
+    std::mt19937 rng_;
+
+    // Entries after `base_index_`. The entry `base_index_` was applied and
+    // dropped, and had the term `base_term_`.
+    std::deque<entry> entries_;
+    uint64_t base_index_;
+    uint64_t base_term_;
+    size_t log_bytes_;
+    uint64_t commit_index_;
+    uint64_t last_applied_;
+
+    // Proposals waiting to be applied, by the index of their entry
+    std::unordered_map<uint64_t, proposal> proposals_;
+
+    // Held while entries are applied to the database or a snapshot is taken
+    // or installed, so that the database matches `last_applied_`. Acquired
+    // before `mutex_`.
+    std::mutex apply_mutex_;
+
+    // The last snapshot taken, shared by the peers that need it
+    std::shared_ptr<const snapshot> snapshot_;
+    // Snapshot being received from the leader
+    snapshot incoming_;
+
+    stats stats_;
+};
+
+#endif
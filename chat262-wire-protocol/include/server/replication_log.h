@@ -0,0 +1,141 @@
+#ifndef _REPLICATION_LOG_H_
+#define _REPLICATION_LOG_H_
+
+#include "chat262_protocol.h"
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// The mutations of a primary server that some of its followers have not
+// acknowledged yet. Mutations are numbered with consecutive sequence numbers,
+// starting from 1.
+//
+// The database appends every mutation while holding its lock, so the order of
+// the log is the order in which the mutations were applied. Replicators read
+// batches of mutations to ship to their followers, and record what the
+// followers acknowledge. Mutations that all followers acknowledged are
+// dropped. So that a follower that is gone for good can't grow the log
+// forever, the oldest mutations are also dropped once the log holds more than
+// its capacity, and a follower that still needs them is lost.
+//
+// A log that retains its mutations keeps them until it is over capacity, even
+// once all followers acknowledged them, so that read replicas can tail it.
+//
+// All member functions are thread-safe.
+class replication_log {
+public:
+    struct stats {
+        // Sequence number of the last appended mutation
+        uint64_t last_seq_;
+        // Sequence number of the oldest mutation in the log
+        uint64_t first_seq_;
+        size_t mutations_;
+        size_t bytes_;
+        size_t capacity_;
+        // Mutations dropped before all followers acknowledged them
+        uint64_t overflows_;
+        // Writes whose followers did not acknowledge them in time
+        uint64_t replication_timeouts_;
+    };
+
+    // Construct an empty log with no followers, holding up to 64 MiB
+    replication_log();
+
+    // Prevent copy/move
+    replication_log(const replication_log&) = delete;
+    replication_log(replication_log&&) = delete;
+    replication_log& operator=(const replication_log&) = delete;
+    replication_log& operator=(replication_log&&) = delete;
+
+    // Hold at most about `bytes` bytes of mutations
+    void set_capacity(const size_t bytes);
+
+    // Keep the mutations that all followers acknowledged, as long as the log
+    // is within its capacity
+    void set_retain(const bool retain);
+
+    // Register a follower, which starts out disconnected and having
+    // acknowledged nothing. Returns the index of the follower.
+    size_t add_follower();
+
+    // Append `m` to the log.
+    // Returns the sequence number of `m`.
+    uint64_t append(chat262::mutation m);
+
+    // Returns the sequence number of the last mutation that the calling thread
+    // appended, or 0 if it appended none.
+    static uint64_t last_appended();
+
+    // Returns the sequence number of the last appended mutation, or 0 if
+    // none was appended.
+    uint64_t last_seq() const;
+
+    // Wait up to `timeout` for a mutation with the sequence number `from`,
+    // and copy it and the mutations after it into `batch`, up to
+    // `max_mutations` of them and about `max_bytes` bytes.
+    // @return ok    - `batch` holds the mutations starting at `from`. It's
+    //                 empty if there were none in time.
+    // @return error - The mutation `from` was already dropped.
+    status read(const uint64_t from,
+                const size_t max_mutations,
+                const size_t max_bytes,
+                const std::chrono::milliseconds& timeout,
+                std::vector<chat262::mutation>& batch);
+
+    // Record whether `follower` is connected. Writes only wait for connected
+    // followers.
+    void set_connected(const size_t follower, const bool connected);
+
+    // Record that `follower` applied all mutations up to `seq`.
+    void acknowledge(const size_t follower, const uint64_t seq);
+
+    // Returns the sequence number up to which `follower` applied all
+    // mutations.
+    uint64_t acknowledged(const size_t follower) const;
+
+    // Wait up to `timeout` until every connected follower applied all
+    // mutations up to `seq`.
+    // @return ok    - The mutations are replicated.
+    // @return error - The timeout expired first.
+    status wait_replicated(const uint64_t seq,
+                           const std::chrono::milliseconds& timeout);
+
+    stats get_stats() const;
+
+private:
+    struct follower_state {
+        bool connected_;
+        uint64_t acked_;
+    };
+
+    // Approximate memory taken by `m` in the log
+    static size_t entry_size(const chat262::mutation& m);
+
+    // Drop the mutations that all followers acknowledged, unless the log
+    // retains them, and the oldest mutations while the log is over capacity.
+    // `mutex_` must be held.
+    void shrink();
+
+    mutable std::mutex mutex_;
+    // Signaled when a mutation is appended
+    std::condition_variable appended_cv_;
+    // Signaled when a follower acknowledges mutations or disconnects
+    std::condition_variable acked_cv_;
+    // Sequence number of `mutations_.front()`
+    uint64_t first_seq_;
+    std::deque<chat262::mutation> mutations_;
+    std::vector<follower_state> followers_;
+    size_t bytes_;
+    size_t capacity_;
+    bool retain_;
+    uint64_t overflows_;
+    uint64_t replication_timeouts_;
+};
+
+#endif
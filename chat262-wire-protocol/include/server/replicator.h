@@ -0,0 +1,131 @@
+#ifndef _REPLICATOR_H_
+#define _REPLICATOR_H_
+
+#include "chat262_protocol.h"
+#include "common.h"
+#include "replication_log.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Ships the replication log of a primary server to one follower, over a
+// connection of the Chat 262 Protocol.
+//
+// Mutations are shipped in batches of replicate requests, and the replicator
+// doesn't wait for the acknowledgement of a batch before it sends the next
+// one. Up to `window` batches are in flight at a time, so throughput is not
+// bound by the round trip to the follower: while a batch is in flight, new
+// mutations pile up in the log, and go out together in the next batch.
+//
+// The follower acknowledges every batch with the sequence number up to which
+// it applied all mutations. If that falls short of the batch, the follower
+// missed earlier mutations (because it restarted, say), and the replicator
+// goes back to the first missing one. If the connection breaks, the
+// replicator reconnects and resumes after the last acknowledged mutation.
+class replicator {
+public:
+    struct stats {
+        bool connected_;
+        // The follower needs mutations that were dropped from the log, and
+        // is no longer replicated to
+        bool lost_;
+        // Sequence number up to which the follower applied all mutations
+        uint64_t acked_;
+        uint64_t connects_;
+        uint64_t batches_;
+        uint64_t mutations_;
+        uint64_t bytes_;
+        // Times the replicator went back to mutations the follower missed
+        uint64_t rewinds_;
+        // Time from sending a batch to its acknowledgement, in nanoseconds
+        uint64_t total_rtt_ns_;
+        uint64_t max_rtt_ns_;
+    };
+
+    // Most batches in flight at a time
+    static constexpr size_t window = 16;
+    // Most mutations and bytes of mutations in one batch
+    static constexpr size_t max_batch_mutations = 4096;
+    static constexpr size_t max_batch_bytes = 1024 * 1024;
+
+    // Construct a replicator of `log` from the primary on `n_primary_addr` to
+    // the follower on `n_ip_addr` (both in network byte order), written
+    // `str_ip_addr`
+    replicator(replication_log& log,
+               const uint32_t n_primary_addr,
+               const uint32_t n_ip_addr,
+               const std::string& str_ip_addr);
+    ~replicator();
+
+    // Prevent copy/move
+    replicator(const replicator&) = delete;
+    replicator(replicator&&) = delete;
+    replicator& operator=(const replicator&) = delete;
+    replicator& operator=(replicator&&) = delete;
+
+    // Start the thread that connects to the follower and ships the log
+    void start();
+
+    const std::string& address() const;
+
+    stats get_stats() const;
+
+private:
+    struct batch {
+        // Sequence number of the last mutation in the batch
+        uint64_t last_seq_;
+        // `generation_` when the batch was sent
+        uint64_t generation_;
+        std::chrono::steady_clock::time_point sent_;
+    };
+
+    // Body of the replicator thread. Connects to the follower until stopped
+    // or the follower is lost.
+    void run();
+
+    // Connect to the follower.
+    // @return ok    - `fd` is connected to the follower.
+    // @return error - The follower could not be reached.
+    status connect_follower(int& fd);
+
+    // Ship the log over the connected `fd` until the connection breaks or
+    // the replicator is stopped
+    void ship(int fd);
+
+    // Receive the acknowledgements from `fd` until the connection breaks.
+    // Runs in its own thread while shipping.
+    void receive_acks(int fd);
+
+    replication_log& log_;
+    const size_t follower_;
+    const uint32_t n_primary_addr_;
+    const uint32_t n_ip_addr_;
+    const std::string str_ip_addr_;
+    std::thread thread_;
+
+    mutable std::mutex mutex_;
+    // Signaled when a batch is acknowledged, the connection breaks, or the
+    // replicator is stopped
+    std::condition_variable cv_;
+    bool stop_;
+    // Descriptor of the connection, or -1
+    int fd_;
+    // The acknowledgement thread stopped
+    bool broken_;
+    // Sequence number of the next mutation to send
+    uint64_t next_seq_;
+    // Incremented whenever the replicator goes back, so that the batches sent
+    // before don't make it go back again
+    uint64_t generation_;
+    // Batches in flight, oldest first
+    std::deque<batch> in_flight_;
+    stats stats_;
+};
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef _SEGMENT_STORE_H_
+#define _SEGMENT_STORE_H_
+
+#include "chat.h"
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Append-only files of segments, each holding a run of texts evicted from a
+// chat. A segment is laid out like the body of a receive text response
+// without the status code: the number of texts, the senders, the lengths and
+// then the text bytes.
+//
+// Segments are appended to the active file. Once the active file would grow
+// past the seal size, it is sealed: its header is completed, the file is
+// mapped read-only, and a new active file is started. Segments in a sealed
+// file are read straight from the mapping, without copying them.
+//
+// Segments are never overwritten. When a segment is no longer needed (its
+// texts were faulted back in, or the chat was deleted), its space becomes
+// garbage. A sealed file is deleted once all of its segments are garbage.
+//
+// All member functions are thread-safe.
+class segment_store {
+public:
+    // Every file starts with this header, in little-endian
+    struct file_header {
+        // `file_magic`
+        uint8_t magic_[8];
+        // `file_version`
+        uint16_t version_;
+        // `file_sealed` once the file is sealed
+        uint16_t flags_;
+        // Number of segments in the file. Valid once the file is sealed.
+        uint32_t num_segments_;
+        // Number of bytes after the header. Valid once the file is sealed.
+        uint64_t data_len_;
+        uint64_t reserved_;
+    };
+    static_assert(sizeof(file_header) == 32, "Header must be packed");
+
+    static constexpr uint8_t file_magic[8] =
+        {'C', '2', '6', '2', 'S', 'E', 'G', '\0'};
+    static constexpr uint16_t file_version = 1;
+    static constexpr uint16_t file_sealed = 0x0001;
+
+    // Location of a segment
+    struct segment_ref {
+        // Index of the file
+        uint32_t file_;
+        uint32_t num_txts_;
+        // Offset from the beginning of the file, including the header
+        uint64_t offset_;
+        uint64_t len_;
+
+        bool operator==(const segment_ref& other) const {
+            return file_ == other.file_ && num_txts_ == other.num_txts_ &&
+                   offset_ == other.offset_ && len_ == other.len_;
+        }
+    };
+
+    segment_store();
+    ~segment_store();
+
+    // Prevent copy/move
+    segment_store(const segment_store&) = delete;
+    segment_store(segment_store&&) = delete;
+    segment_store& operator=(const segment_store&) = delete;
+    segment_store& operator=(segment_store&&) = delete;
+
+    // Create the first segment file. Files are named `<prefix>.0`,
+    // `<prefix>.1` and so on. Files left over with these names are deleted.
+    // A file is sealed once it would grow past `seal_size` bytes.
+    // @return ok    - The first file is ready.
+    // @return error - The first file could not be created.
+    status open(const std::string& prefix, const uint64_t seal_size);
+
+    // Check if the store is open
+    bool is_open() const;
+
+    // Append the texts of `v` as a new segment and store its location into
+    // `ref`. Seals the active file first if needed.
+    // @return ok    - The segment was written.
+    // @return error - The write failed. Nothing can be read from `ref`.
+    status write(const chat_view& v, segment_ref& ref);
+
+    // Read the segment at `ref` and store its texts into `v`. If the
+    // segment is in a sealed file, `v` shares the mapping of the file.
+    // @return ok    - The segment was read.
+    // @return error - The read failed, or the segment is malformed.
+    status read(const segment_ref& ref, chat_view& v) const;
+
+    // Check if the segment at `ref` is in a sealed file
+    bool is_sealed(const segment_ref& ref) const;
+
+    // Mark the segment at `ref` as garbage
+    void release(const segment_ref& ref);
+
+    // Map the sealed file at `path` read-only and validate its header. On
+    // success, `data` is the mapping and `len` its length. The mapping is
+    // unmapped when the last copy of `data` is destroyed.
+    // @return ok    - The file is mapped.
+    // @return error - The file could not be mapped, or is not a sealed
+    //                 segment file of a supported version.
+    static status map_sealed(const std::string& path,
+                             std::shared_ptr<const uint8_t>& data,
+                             size_t& len);
+
+    // Total size of the segment files in bytes
+    uint64_t size() const;
+
+    // Number of bytes in the files that belong to released segments
+    uint64_t garbage() const;
+
+    // Number of segment files, and how many of them are sealed
+    size_t num_files() const;
+    size_t num_sealed() const;
+
+    // Prefix of the segment file names
+    const std::string& prefix() const;
+
+private:
+    struct segment_file {
+        segment_file();
+        ~segment_file();
+
+        // Open for as long as the file exists, so that readers that found
+        // the file before it was sealed can still read it
+        int fd_;
+        std::string path_;
+        // Offset of the end of the last segment
+        uint64_t end_;
+        uint32_t num_segments_;
+        uint64_t garbage_;
+        // Set once the file is sealed
+        std::shared_ptr<const uint8_t> map_;
+        size_t map_len_;
+    };
+
+    // Create the next active file
+    status create_file();
+
+    // Seal the active file and map it
+    status seal();
+
+    // Delete the file at `idx` if it's sealed and holds nothing but garbage.
+    // `mutex_` must be held.
+    void delete_if_garbage(const size_t idx);
+
+    std::string prefix_;
+    uint64_t seal_size_;
+
+    // Serializes writers. Held while writing and sealing, so that readers
+    // are not blocked by the disk.
+    std::mutex write_mutex_;
+
+    // Protects everything below, and the contents of the files except
+    // `fd_` and `path_`, which don't change while a file is in `files_`
+    mutable std::mutex mutex_;
+    // Null once deleted. The active file is the last one.
+    std::vector<std::shared_ptr<segment_file>> files_;
+    uint64_t size_;
+    uint64_t garbage_;
+    size_t num_sealed_;
+};
+
+#endif
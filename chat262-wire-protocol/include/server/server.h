@@ -4,10 +4,27 @@
 #include "chat262_protocol.h"
 #include "common.h"
 #include "database.h"
+#include "dedupe_cache.h"
+#include "handover.h"
+#include "journal.h"
+#include "raft.h"
+#include "replication_log.h"
+#include "replicator.h"
+#include "shard_router.h"
+#include "tailer.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
 #include <netinet/in.h>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 class server {
 public:
@@ -33,6 +50,37 @@ private:
     struct cmdline_args {
         bool help_;
         uint32_t n_ip_addr_;
+        std::string str_ip_addr_;
+        database::config db_cfg_;
+        // Addresses of the followers, in network byte order and as written
+        std::vector<std::pair<uint32_t, std::string>> followers_;
+        bool sync_replication_;
+        size_t log_bytes_;
+        bool backup_;
+        // Address of the primary of a backup
+        std::pair<uint32_t, std::string> backup_of_;
+        // Addresses of the other servers of the Raft cluster
+        std::vector<std::pair<uint32_t, std::string>> peers_;
+        // Path of the file that keeps the term and vote of a Raft server, or
+        // an empty string
+        std::string raft_state_path_;
+        bool tail_log_;
+        // Addresses of the read replicas that may tail the log
+        std::vector<std::pair<uint32_t, std::string>> replicas_;
+        // Address of the primary of a read replica, or an empty string
+        std::pair<uint32_t, std::string> primary_;
+        // Addresses of the other shards of a sharded cluster
+        std::vector<std::pair<uint32_t, std::string>> shards_;
+        // Path of the journal, or an empty string
+        std::string journal_path_;
+        // Path of the dump to load on start, or an empty string
+        std::string load_path_;
+        // Path of the dump to write on SIGUSR2, or an empty string
+        std::string dump_path_;
+        // Path of the Unix socket for hot restarts, or an empty string
+        std::string handover_path_;
+        // Addresses of the proxies that may relay requests
+        std::vector<std::pair<uint32_t, std::string>> proxies_;
     };
     // Parse command-line arguments (`argc`, `argv`).
     // Returns the filled `cmdline_args` structure on success.
@@ -42,16 +90,81 @@ private:
     // Print usage information to standard error
     void usage(char const* prog) const;
 
-    // Open the server socket for incoming connections
+    // Open the server socket for incoming connections, unless it was taken
+    // over from the previous server
     status start_listening();
 
+    // Take over from the running server on the handover socket `fd`: receive
+    // its listening socket and connections into `conns`, and load the dump
+    // of its database.
+    // @return ok    - The listening socket is the server socket, and the
+    //                 database holds the users and chats of the running
+    //                 server.
+    // @return error - The running server went away, or the dump could not
+    //                 be loaded. The received descriptors are closed.
+    status take_over(int fd, std::vector<handed_connection>& conns);
+
+    // Listen for the next server on the handover socket, and hand over to it
+    // when it connects
+    // @return ok    - The server listens for the next server.
+    // @return error - The handover socket could not be created.
+    status start_handover_listener();
+
+    // Hand the listening socket, the connections and a dump of the database
+    // over to the new server on `fd`. Exits the process once the new server
+    // took over, and returns if the handover failed, with the connections
+    // carrying on.
+    void hand_over(int fd);
+
+    // If the server listens for the next server, wait until `fd` is
+    // readable, and park the connection `conn`, or the accepting thread if
+    // it is null, while a handover is under way
+    void wait_readable(int fd, const handed_connection* conn);
+
+    // Park the connection `conn`, or the accepting thread if it is null,
+    // until a handover that is under way fails
+    void park(const handed_connection* conn);
+
+    // Dump the server statistics to stdout whenever the process receives
+    // SIGUSR1, and write the dump file whenever it receives SIGUSR2. The
+    // signal handlers are installed once per process.
+    // @return ok    - The server is registered for dumping statistics.
+    // @return error - The signal handlers could not be installed.
+    status start_stats_reporter();
+
+    // Print the statistics of this server to `out`.
+    void dump_stats(FILE* out);
+
+    // Write all users and chats to the dump file, if the server has one. The
+    // dump is written next to it first, and then replaces it, so the file
+    // always holds a complete dump.
+    void write_dump();
+
     // Forever accept incoming connections
     __attribute__((noreturn)) void start_accepting();
 
     // Handle the accepted connection. Runs in a separate thread.
     void handle_client(int client_fd, sockaddr_in client_addr);
 
-    // Send the message `msg` to the `client_fd`.
+    // Handle the connection `conn` that was taken over from the previous
+    // server, with the state it had there. Runs in a separate thread.
+    void resume_client(handed_connection conn);
+
+    // Handle the requests on `client_fd` until the connection ends, and
+    // close it
+    void serve_client(int client_fd, const char* client_ip);
+
+    // Handle the request of type `type` with the body `body_data`, and
+    // respond to the client.
+    // Returns the same as the handler of the request type.
+    status handle_request(int client_fd,
+                          const uint16_t type,
+                          const std::vector<uint8_t>& body_data);
+
+    // Send the message `msg` to the `client_fd` with the version of the
+    // connection. If the connection negotiated `feature_compression`, a large
+    // body is compressed first. While a proxy request is handled, the message
+    // is kept as the response to the relayed request instead.
     // @return ok         - The message was successfully sent
     // @return send_error - The send failed. This is possibly due to a closed
     //                      connection.
@@ -158,6 +271,210 @@ private:
     // @param[in] body_data - The bytes making up the request body.
     status handle_delete(int client_fd, const std::vector<uint8_t>& body_data);
 
+    // Handle a replicate request from the primary, apply the mutations and
+    // acknowledge them. Only a backup accepts replicate requests.
+    // @return ok           - The request was successfully parsed, and the
+    //                        response was successfully sent.
+    // @return body_error   - The primary sent an improperly formed request
+    //                        body, or a mutation with an unknown operation.
+    // @return send_error   - There was an error in sending the response.
+    // @param[in] client_fd - The socket descriptor for the primary connection.
+    // @param[in] body_data - The bytes making up the request body.
+    status handle_replicate(int client_fd,
+                            const std::vector<uint8_t>& body_data);
+
+    // Handle a vote request from a candidate of the Raft cluster and respond
+    // with the vote. Only a server of a Raft cluster accepts vote requests.
+    // @return ok           - The request was successfully parsed, and the
+    //                        response was successfully sent.
+    // @return body_error   - The candidate sent an improperly formed request
+    //                        body.
+    // @return send_error   - There was an error in sending the response.
+    // @param[in] client_fd - The socket descriptor for the candidate
+    //                        connection.
+    // @param[in] body_data - The bytes making up the request body.
+    status handle_vote(int client_fd, const std::vector<uint8_t>& body_data);
+
+    // Handle an append request from the leader of the Raft cluster and
+    // respond whether the entries were appended. Only a server of a Raft
+    // cluster accepts append requests.
+    // @return ok           - The request was successfully parsed, and the
+    //                        response was successfully sent.
+    // @return body_error   - The leader sent an improperly formed request
+    //                        body.
+    // @return send_error   - There was an error in sending the response.
+    // @param[in] client_fd - The socket descriptor for the leader connection.
+    // @param[in] body_data - The bytes making up the request body.
+    status handle_append(int client_fd, const std::vector<uint8_t>& body_data);
+
+    // Handle a snapshot chunk from the leader of the Raft cluster and respond
+    // with the number of mutations received. Only a server of a Raft cluster
+    // accepts snapshot requests.
+    // @return ok           - The request was successfully parsed, and the
+    //                        response was successfully sent.
+    // @return body_error   - The leader sent an improperly formed request
+    //                        body.
+    // @return send_error   - There was an error in sending the response.
+    // @param[in] client_fd - The socket descriptor for the leader connection.
+    // @param[in] body_data - The bytes making up the request body.
+    status handle_snapshot(int client_fd,
+                           const std::vector<uint8_t>& body_data);
+
+    // Handle a tail request from a read replica, and respond with the
+    // mutations it asked for, waiting for new ones if there are none yet, or
+    // with a chunk of a snapshot if it needs mutations that were dropped from
+    // the log. Only a server that keeps a log for read replicas accepts tail
+    // requests.
+    // @return ok            - The request was successfully parsed, and the
+    //                         response was successfully sent.
+    // @return body_error    - The replica sent an improperly formed request
+    //                         body.
+    // @return receive_error - A snapshot could not be taken.
+    // @return send_error    - There was an error in sending the response.
+    // @param[in] client_fd  - The socket descriptor for the replica
+    //                         connection.
+    // @param[in] body_data  - The bytes making up the request body.
+    status handle_tail(int client_fd, const std::vector<uint8_t>& body_data);
+
+    // Handle a sync request, wait until the server applied the write of the
+    // token, and respond with how far the server is.
+    // @return ok           - The request was successfully parsed, and the
+    //                        response was successfully sent.
+    // @return body_error   - The client sent an improperly formed request
+    //                        body.
+    // @return send_error   - There was an error in sending the response.
+    // @param[in] client_fd - The socket descriptor for the client connection.
+    // @param[in] body_data - The bytes making up the request body.
+    status handle_sync(int client_fd, const std::vector<uint8_t>& body_data);
+
+    // Handle a forwarded write from another shard of the cluster, apply it
+    // to the users of this shard and respond with the outcome. Only a shard
+    // accepts forward requests.
+    // @return ok           - The request was successfully parsed, and the
+    //                        response was successfully sent.
+    // @return body_error   - The shard sent an improperly formed request
+    //                        body, or a mutation with an operation that is
+    //                        not forwarded.
+    // @return send_error   - There was an error in sending the response.
+    // @param[in] client_fd - The socket descriptor for the shard connection.
+    // @param[in] body_data - The bytes making up the request body.
+    status handle_forward(int client_fd, const std::vector<uint8_t>& body_data);
+
+    // Handle a search of another shard of the cluster, and respond with the
+    // matching users of this shard. Only a shard accepts shard accounts
+    // requests.
+    // @return ok           - The request was successfully parsed, and the
+    //                        response was successfully sent.
+    // @return body_error   - The shard sent an improperly formed request
+    //                        body.
+    // @return send_error   - There was an error in sending the response.
+    // @param[in] client_fd - The socket descriptor for the shard connection.
+    // @param[in] body_data - The bytes making up the request body.
+    status handle_shard_accounts(int client_fd,
+                                 const std::vector<uint8_t>& body_data);
+
+    // Handle a request that a proxy relays for one of its clients: handle the
+    // relayed request as if the client's user were logged in on a connection
+    // of its own, and respond with the response to it and the user that is
+    // logged in afterwards.
+    // @return ok           - The request was successfully parsed, and the
+    //                        response was successfully sent.
+    // @return body_error   - The proxy sent an improperly formed request
+    //                        body, or relayed a request that is not a
+    //                        complete message.
+    // @return send_error   - There was an error in sending the response.
+    // @param[in] client_fd - The socket descriptor for the proxy connection.
+    // @param[in] body_data - The bytes making up the request body.
+    status handle_proxy(int client_fd, const std::vector<uint8_t>& body_data);
+
+    // Handle a request to move a user of this shard to another shard, move
+    // it and respond with the outcome. Only a shard accepts migrate
+    // requests.
+    // @return ok            - The request was successfully parsed, and the
+    //                         response was successfully sent.
+    // @return body_error    - The client sent an improperly formed request
+    //                         body.
+    // @return receive_error - The other shard could not be reached.
+    // @return send_error    - There was an error in sending the response.
+    // @param[in] client_fd  - The socket descriptor for the client
+    //                         connection.
+    // @param[in] body_data  - The bytes making up the request body.
+    status handle_migrate(int client_fd, const std::vector<uint8_t>& body_data);
+
+    // Handle a batch of the chats of a user that another shard moves to this
+    // one, apply it and respond with the outcome. The last batch hands the
+    // user over to this shard. Only a shard accepts import requests.
+    // @return ok           - The request was successfully parsed, and the
+    //                        response was successfully sent.
+    // @return body_error   - The shard sent an improperly formed request
+    //                        body, or a mutation that is not of the user.
+    // @return send_error   - There was an error in sending the response.
+    // @param[in] client_fd - The socket descriptor for the shard connection.
+    // @param[in] body_data - The bytes making up the request body.
+    status handle_import(int client_fd, const std::vector<uint8_t>& body_data);
+
+    // Handle a request for the shard of a user, and respond with the shard
+    // that this shard knows of. Only a shard accepts locate requests.
+    // @return ok           - The request was successfully parsed, and the
+    //                        response was successfully sent.
+    // @return body_error   - The client sent an improperly formed request
+    //                        body.
+    // @return send_error   - There was an error in sending the response.
+    // @param[in] client_fd - The socket descriptor for the client connection.
+    // @param[in] body_data - The bytes making up the request body.
+    status handle_locate(int client_fd, const std::vector<uint8_t>& body_data);
+
+    // Handle a request that carries a request ID. A registration, send text
+    // or delete request with the ID of one of the last writes of the logged
+    // in user, on any connection, or of the connection if no user is logged
+    // in, is answered with the response to that write, and is not handled
+    // again. Any other request is handled as if it had no ID.
+    // @return ok           - The request was successfully parsed, and the
+    //                        response was successfully sent.
+    // @return body_error   - The client sent an improperly formed request
+    //                        body.
+    // @return send_error   - There was an error in sending the response.
+    // @param[in] client_fd - The socket descriptor for the client connection.
+    // @param[in] type      - The message type, with `msgflag_request_id` set.
+    // @param[in] body_data - The bytes making up the request body, request
+    //                        ID included.
+    status handle_identified(int client_fd,
+                             const uint16_t type,
+                             const std::vector<uint8_t>& body_data);
+
+    // Send the text `txt` of the logged in user to `recipient`, a user of
+    // another shard, and store the sender's copy once the recipient's shard
+    // stored its copy. Stores the status code of the response into
+    // `stat_code`.
+    // @return ok            - The text was handled, successfully or not.
+    // @return receive_error - The recipient's shard could not be reached.
+    status send_remote_txt(const std::string& recipient,
+                           const std::string& txt,
+                           uint32_t& stat_code);
+
+    // If the server keeps a journal, wait until the last mutation of this
+    // connection is synced to it
+    // @return ok    - The mutation is durable, or there is no journal.
+    // @return error - The journal could not be written. The write must not
+    //                 be answered.
+    status wait_for_journal();
+
+    // If the server replicates synchronously, wait until the connected
+    // followers applied the last mutation of this connection
+    void wait_for_followers();
+
+    // Handle a hello request, switch the connection to the latest version
+    // that both sides know and to the requested features that the server
+    // supports, and respond with them.
+    // @return ok           - The request was successfully parsed, and the
+    //                        response was successfully sent.
+    // @return body_error   - The client sent an improperly formed request
+    //                        body.
+    // @return send_error   - There was an error in sending the response.
+    // @param[in] client_fd - The socket descriptor for the client connection.
+    // @param[in] body_data - The bytes making up the request body.
+    status handle_hello(int client_fd, const std::vector<uint8_t>& body_data);
+
     // Send a wrong version response to the client.
     // @return ok           - The response was successfully sent.
     // @return send_error   - There was an error in sending the response.
@@ -187,6 +504,115 @@ private:
 
     // IP address in string format
     std::string str_ip_addr_;
+
+    // Responses sent with a compressed body, and their body bytes before and
+    // after compression
+    mutable std::atomic<uint64_t> compressed_msgs_;
+    mutable std::atomic<uint64_t> compressed_raw_bytes_;
+    mutable std::atomic<uint64_t> compressed_wire_bytes_;
+
+    // Mutations not yet applied by all followers, or kept for read replicas,
+    // and the replicators that ship them, one for every follower
+    replication_log log_;
+    std::vector<std::unique_ptr<replicator>> replicators_;
+
+    // Writes are answered only once the connected followers applied them
+    bool sync_replication_;
+
+    // The server is the backup of a primary. It applies the mutations of the
+    // primary and refuses writes from clients.
+    bool backup_;
+    // Address of the primary, in network byte order. Replicate requests from
+    // anywhere else are refused.
+    uint32_t n_primary_addr_;
+
+    // Replicate requests applied as a backup, and the sequence number up to
+    // which all mutations are applied
+    std::atomic<uint64_t> replicated_batches_;
+    std::atomic<uint64_t> replicated_seq_;
+
+    // The server of the Raft cluster, or null if the server is not in one
+    std::unique_ptr<raft_node> raft_;
+
+    // The log is kept for read replicas to tail
+    bool tail_log_;
+    // Addresses of the read replicas, in network byte order. The log holds
+    // every password and text, so tail requests from anywhere else are
+    // refused.
+    std::vector<uint32_t> replicas_;
+
+    // Tail requests served to read replicas, and the mutations and snapshots
+    // sent in them
+    std::atomic<uint64_t> tail_requests_;
+    std::atomic<uint64_t> tail_mutations_;
+    std::atomic<uint64_t> tail_snapshots_;
+
+    // Sync requests, and those that timed out before the write of the token
+    // was applied
+    std::atomic<uint64_t> syncs_;
+    std::atomic<uint64_t> stale_syncs_;
+
+    // The tailer of the primary if the server is a read replica, or null.
+    // A read replica refuses writes from clients.
+    std::unique_ptr<tailer> tailer_;
+
+    // The router to the other shards if the server is a shard of a sharded
+    // cluster, or null. A shard only registers and logs in its own users.
+    std::unique_ptr<shard_router> router_;
+
+    // The journal that makes the writes durable, or null
+    std::unique_ptr<journal> journal_;
+
+    // Path of the dump file written on SIGUSR2, or an empty string
+    std::string dump_path_;
+
+    // Addresses of the proxies that may relay requests, in network byte
+    // order. Relayed requests log in without a password, so they are refused
+    // from anywhere else.
+    std::vector<uint32_t> proxies_;
+
+    // Requests relayed by proxies
+    std::atomic<uint64_t> proxied_reqs_;
+
+    // Writes with request IDs that were answered from the dedupe cache
+    // instead of being handled again
+    std::atomic<uint64_t> replayed_reqs_;
+
+    // Responses to the last writes with request IDs of every user, kept
+    // across connections so that a write retried on a new connection is not
+    // applied twice. The writes of one user with request IDs are handled one
+    // at a time, so that a retry waits for the first to be answered.
+    struct user_dedupe {
+        std::mutex mutex_;
+        dedupe_cache cache_;
+    };
+    std::mutex user_dedupe_mutex_;
+    std::unordered_map<std::string, user_dedupe> user_dedupe_;
+
+    // Path of the Unix socket for hot restarts, or an empty string, and the
+    // socket that listens on it for the next server, or -1
+    std::string handover_path_;
+    int handover_fd_;
+
+    // Pipe that wakes the connections and the accepting thread, so that they
+    // park when a handover starts
+    int handover_wake_[2];
+
+    // Connections open, the parked connections, whether the accepting thread
+    // is parked, and whether a handover is under way
+    std::mutex handover_mutex_;
+    std::condition_variable handover_cv_;
+    size_t active_conns_;
+    std::vector<handed_connection> parked_;
+    bool acceptor_parked_;
+    bool handing_over_;
+
+    // Connections taken over from the previous server and how long it took,
+    // and handovers to a next server that failed, which resume the parked
+    // threads
+    size_t taken_over_conns_;
+    std::chrono::steady_clock::duration take_over_time_;
+    std::atomic<uint64_t> failed_handovers_;
 };
 
 #endif
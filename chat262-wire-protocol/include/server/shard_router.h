@@ -0,0 +1,274 @@
+#ifndef _SHARD_ROUTER_H_
+#define _SHARD_ROUTER_H_
+
+#include "chat262_protocol.h"
+#include "common.h"
+#include "database.h"
+#include "shard_ring.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Routes the requests of a shard of a sharded cluster to the other shards,
+// over connections of the Chat 262 Protocol.
+//
+// Users are partitioned across the shards by a `chat262::shard_ring` of the
+// shard addresses, and every user's chats live on the user's shard. A text to
+// a user of another shard is forwarded there as a mutation, and the sender's
+// copy is stored locally once the recipient's shard stored its copy. A
+// deletion is forwarded to every other shard, which deletes the chats of its
+// users with the deleted user. A search is scattered to all shards at once,
+// and the sorted results are merged.
+//
+// Requests from the connection threads of the server go out on connections
+// borrowed from a pool per shard, so a shard never waits for another
+// connection thread to get a response, and connections are only opened when
+// more threads forward at the same time than ever before.
+//
+// A user can be moved to another shard while it is in use. Its chats are
+// copied to the other shard while the user keeps writing, and the writes
+// made meanwhile are copied after them, in rounds that get shorter. Then the
+// user is frozen: new requests of the user wait, and the ones in flight are
+// waited for. The last writes are copied, the other shard takes the user
+// over, and every shard is told about the move. A moved user overrides the
+// ring, and a shard that gets a text for a user that moved on relays it to
+// the user's new shard.
+class shard_router {
+public:
+    struct stats {
+        uint64_t forwarded_txts_;
+        uint64_t forwarded_deletions_;
+        uint64_t searches_;
+        uint64_t lookups_;
+        // Requests that failed because a shard could not be reached
+        uint64_t failures_;
+        uint64_t connects_;
+        // Time from sending a forward request to its response, and from
+        // scattering a search to merging the results, in nanoseconds
+        uint64_t total_forward_ns_;
+        uint64_t max_forward_ns_;
+        uint64_t total_search_ns_;
+        uint64_t max_search_ns_;
+        // Users moved to and from this shard, and moves that failed
+        uint64_t migrations_in_;
+        uint64_t migrations_out_;
+        uint64_t failed_migrations_;
+        // Bytes sent to move users, time spent copying them, and time their
+        // requests were paused, in nanoseconds
+        uint64_t migrated_bytes_;
+        uint64_t total_copy_ns_;
+        uint64_t total_pause_ns_;
+        uint64_t max_pause_ns_;
+    };
+
+    // Marks a request of a user in flight while in scope, if there is a
+    // router
+    class pin {
+    public:
+        pin(shard_router* router, const std::string& username);
+        ~pin();
+
+        // Prevent copy/move
+        pin(const pin&) = delete;
+        pin(pin&&) = delete;
+        pin& operator=(const pin&) = delete;
+        pin& operator=(pin&&) = delete;
+
+    private:
+        shard_router* const router_;
+        const std::string username_;
+    };
+
+    // Most idle connections kept open to one shard
+    static constexpr size_t max_idle = 64;
+
+    // Largest batch of mutations sent at once to move a user, in bytes
+    static constexpr size_t migration_batch = 256 * 1024;
+
+    // Most rounds of copying the writes made to a moving user while it was
+    // copied, and the number of writes small enough to copy while the user
+    // is paused
+    static constexpr int max_catch_up_rounds = 4;
+    static constexpr size_t catch_up_threshold = 64;
+
+    // Construct the router of the shard on `n_ip_addr` (in network byte
+    // order), whose database is `db`, in the cluster with the other shards
+    // `peers`, given by their addresses in network byte order and as written
+    shard_router(database& db,
+                 const uint32_t n_ip_addr,
+                 const std::vector<std::pair<uint32_t, std::string>>& peers);
+    ~shard_router();
+
+    // Prevent copy/move
+    shard_router(const shard_router&) = delete;
+    shard_router(shard_router&&) = delete;
+    shard_router& operator=(const shard_router&) = delete;
+    shard_router& operator=(shard_router&&) = delete;
+
+    // Check if `n_ip_addr` (in network byte order) is another shard
+    bool is_peer(const uint32_t n_ip_addr) const;
+
+    // Check if `username` belongs to this shard
+    bool owns(const std::string& username) const;
+
+    // Address of the shard of `username`, in network byte order
+    uint32_t owner_of(const std::string& username) const;
+
+    // Check if `username` was moved off its shard of the ring
+    bool moved(const std::string& username) const;
+
+    // Record that `username` moved to the shard on `n_ip_addr`
+    void set_owner(const std::string& username, const uint32_t n_ip_addr);
+
+    // Record that `username` moved to this shard
+    void adopt(const std::string& username);
+
+    // Mark a request of `username` in flight, once the user is not frozen
+    void enter(const std::string& username);
+
+    // Mark a request of `username` done
+    void leave(const std::string& username);
+
+    // Wait until `username` is not frozen
+    void await(const std::string& username);
+
+    // Move `username` to the shard on `n_ip_addr`, and store the outcome
+    // into `stat_code`: `status_code_wrong_shard` if the user doesn't belong
+    // to this shard or there is no such shard, and `status_code_user_noexist`
+    // if the user doesn't exist. On success, the number of bytes sent, the
+    // time spent copying the user and the time its requests were paused are
+    // stored into `bytes`, `copy_ns` and `pause_ns`.
+    // @return ok    - The outcome is in `stat_code`.
+    // @return error - The shard could not be reached. The user stays here.
+    status migrate(const std::string& username,
+                   const uint32_t n_ip_addr,
+                   uint32_t& stat_code,
+                   uint64_t& bytes,
+                   uint64_t& copy_ns,
+                   uint64_t& pause_ns);
+
+    // Forward the text `m` to the shard of its recipient `m.arg_`, and store
+    // the recipient's response into `stat_code`.
+    // @return ok    - The shard responded.
+    // @return error - The shard could not be reached.
+    status forward_txt(const chat262::mutation& m, uint32_t& stat_code);
+
+    // Forward the deletion `m` to every other shard.
+    // @return ok    - Every shard applied the deletion.
+    // @return error - Some shard could not be reached. The others applied
+    //                 the deletion.
+    status forward_deletion(const chat262::mutation& m);
+
+    // Store the usernames of all shards that match `pattern` into
+    // `usernames`, in sorted order.
+    // @return ok    - Every shard responded.
+    // @return error - Some shard could not be reached.
+    status search(const std::string& pattern,
+                  std::vector<std::string>& usernames);
+
+    // Ask the shard of `username` if the user exists, and store the answer
+    // into `exists`.
+    // @return ok    - The shard responded.
+    // @return error - The shard could not be reached.
+    status lookup(const std::string& username, bool& exists);
+
+    stats get_stats() const;
+
+private:
+    // Another shard, and the idle connections to it
+    struct peer {
+        uint32_t n_ip_addr_;
+        std::string str_ip_addr_;
+        std::vector<int> idle_;
+    };
+
+    // Find the other shard on `n_ip_addr`.
+    // @return A pointer to the shard, or `nullptr` if there is no such shard.
+    peer* find_peer(const uint32_t n_ip_addr);
+
+    // Borrow an idle connection to `p` into `fd`, or open a new one.
+    // `fresh` is set if the connection is new.
+    // @return ok    - `fd` is connected.
+    // @return error - The shard could not be reached.
+    status take_connection(peer& p, int& fd, bool& fresh);
+
+    // Return the connection `fd` to `p` after a complete exchange
+    void give_back(peer& p, const int fd);
+
+    // Receive the response of type `type` to the request sent on `fd`
+    // into `body`. The connection is given back to `p` on success, and
+    // closed otherwise.
+    status receive(peer& p,
+                   const int fd,
+                   const uint16_t type,
+                   std::vector<uint8_t>& body);
+
+    // Send `msg` to `p` and receive its response of type `type` into `body`.
+    // A borrowed connection that turns out to be closed (because the shard
+    // restarted, say) is dropped, and the request is sent again on the next
+    // one, up to a new connection.
+    // @return ok    - The response was received.
+    // @return error - The shard could not be reached.
+    status call(peer& p,
+                const std::shared_ptr<chat262::message>& msg,
+                const uint16_t type,
+                std::vector<uint8_t>& body);
+
+    // Record a failure to reach `p`
+    void record_failure(const peer& p);
+
+    // Freeze `username`, and wait until its requests in flight are done
+    void freeze(const std::string& username);
+
+    // Let the requests of `username` go on
+    void thaw(const std::string& username);
+
+    // Send `mutations` of `username` to `p`, in batches, the last of which
+    // is marked `done`. `stat_code` is set to the response of `p`, and the
+    // bytes sent are added to `bytes`.
+    // @return ok    - The shard responded.
+    // @return error - The shard could not be reached.
+    status import(peer& p,
+                  const std::string& username,
+                  const std::vector<chat262::mutation>& mutations,
+                  const bool done,
+                  uint32_t& stat_code,
+                  uint64_t& bytes);
+
+    // Tell every other shard than `p` that `username` moved to `p`
+    void announce_move(const peer& p, const std::string& username);
+
+    database& db_;
+    const uint32_t n_ip_addr_;
+    const chat262::shard_ring ring_;
+
+    // Protects the idle connections and the statistics
+    mutable std::mutex mutex_;
+    std::vector<peer> peers_;
+    stats stats_;
+
+    // Only one user at a time moves off this shard
+    std::mutex migrate_mutex_;
+
+    // Protects the fields below
+    mutable std::mutex owners_mutex_;
+    // Signaled when a user is thawed, and when a request of a frozen user
+    // is done
+    std::condition_variable owners_cv_;
+    // Shards of the users that moved, by username
+    std::unordered_map<std::string, uint32_t> owners_;
+    // Users whose requests wait
+    std::unordered_set<std::string> frozen_;
+    // Requests in flight, by username
+    std::unordered_map<std::string, size_t> active_;
+};
+
+#endif
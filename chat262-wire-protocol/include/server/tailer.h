@@ -0,0 +1,113 @@
+#ifndef _TAILER_H_
+#define _TAILER_H_
+
+#include "chat262_protocol.h"
+#include "common.h"
+#include "database.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Tails the replication log of a primary server into the database of a read
+// replica, over a connection of the Chat 262 Protocol.
+//
+// Unlike a replicator, which pushes the log to backups that the primary knows
+// about, a tailer pulls it: the primary doesn't know its replicas, and never
+// waits for them. The tailer asks for the mutations after the last one it
+// applied, and the primary answers as soon as there are some, or after
+// `poll_wait` with none. While the replica keeps up, every mutation thus
+// reaches it about one round trip after it was applied on the primary.
+//
+// If the mutations the replica needs were dropped from the primary's log (the
+// replica is new, or fell too far behind), the primary sends a snapshot of its
+// database instead, in chunks, and the replica tails the log from the end of
+// the snapshot on.
+//
+// Every successful write on the primary is numbered with the sequence number
+// of its mutation, which clients that negotiated `feature_read_tokens` get as
+// a read token. The replica has applied a write once it applied its sequence
+// number (see `database::wait_applied`).
+class tailer {
+public:
+    struct stats {
+        bool connected_;
+        // Sequence number up to which the replica applied all mutations, and
+        // of the last mutation of the primary, as of the last response
+        uint64_t applied_;
+        uint64_t primary_seq_;
+        uint64_t connects_;
+        uint64_t polls_;
+        uint64_t mutations_;
+        uint64_t bytes_;
+        uint64_t snapshots_;
+        uint64_t snapshot_mutations_;
+        // Time from sending a tail request to its response, in nanoseconds.
+        // Requests that waited for new mutations count too.
+        uint64_t total_rtt_ns_;
+        uint64_t max_rtt_ns_;
+    };
+
+    // How long the primary waits for new mutations before it answers a tail
+    // request with none
+    static constexpr std::chrono::milliseconds poll_wait{100};
+
+    // Construct a tailer from the replica on `n_replica_addr` of the primary
+    // on `n_ip_addr` (both in network byte order), written `str_ip_addr`,
+    // into `db`
+    tailer(database& db,
+           const uint32_t n_replica_addr,
+           const uint32_t n_ip_addr,
+           const std::string& str_ip_addr);
+    ~tailer();
+
+    // Prevent copy/move
+    tailer(const tailer&) = delete;
+    tailer(tailer&&) = delete;
+    tailer& operator=(const tailer&) = delete;
+    tailer& operator=(tailer&&) = delete;
+
+    // Start the thread that connects to the primary and tails its log
+    void start();
+
+    const std::string& address() const;
+
+    // Returns the number of milliseconds since the replica last had applied
+    // every mutation of the primary, as of sending a tail request. This bounds
+    // how stale its data is. Returns `UINT32_MAX` if it never caught up.
+    uint32_t staleness_ms() const;
+
+    stats get_stats() const;
+
+private:
+    // Body of the tailer thread. Connects to the primary until stopped.
+    void run();
+
+    // Tail the log over the connected `fd` until the connection breaks or
+    // the tailer is stopped
+    void tail(int fd);
+
+    database& db_;
+    const uint32_t n_replica_addr_;
+    const uint32_t n_ip_addr_;
+    const std::string str_ip_addr_;
+    std::thread thread_;
+
+    mutable std::mutex mutex_;
+    // Signaled when the tailer is stopped
+    std::condition_variable cv_;
+    bool stop_;
+    // Descriptor of the connection, or -1
+    int fd_;
+    // Whether and when the replica last had applied every mutation of the
+    // primary
+    bool caught_up_;
+    std::chrono::steady_clock::time_point caught_up_at_;
+    stats stats_;
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _TRACEPOINTS_H_
+#define _TRACEPOINTS_H_
+
+// Static tracepoints for `bpftrace` and `perf`. All probes belong to the
+// `chat262` provider:
+//
+// request__start(int fd, uint16_t type, uint32_t body_len)
+// request__end(int fd, uint16_t type, int status)
+// db__entry(int op, const char* op_name)
+// db__exit(int op, const char* op_name)
+// send__msg(int fd, uint16_t type, uint64_t len)
+// recv__body(int fd, uint64_t len)
+//
+// If <sys/sdt.h> is available, every probe compiles to a single `nop` and a
+// note in the ELF file, so it costs nothing until a tracer attaches to it.
+// Otherwise, the probes compile to nothing at all.
+
+#ifdef CHAT262_HAVE_SDT
+
+    #include <sys/sdt.h>
+
+    #define CHAT262_TRACE1(name, a)       DTRACE_PROBE1(chat262, name, a)
+    #define CHAT262_TRACE2(name, a, b)    DTRACE_PROBE2(chat262, name, a, b)
+    #define CHAT262_TRACE3(name, a, b, c) DTRACE_PROBE3(chat262, name, a, b, c)
+
+#else
+
+    #define CHAT262_TRACE1(name, a)                                            \
+        do {                                                                   \
+            (void) (a);                                                        \
+        } while (0)
+    #define CHAT262_TRACE2(name, a, b)                                         \
+        do {                                                                   \
+            (void) (a);                                                        \
+            (void) (b);                                                        \
+        } while (0)
+    #define CHAT262_TRACE3(name, a, b, c)                                      \
+        do {                                                                   \
+            (void) (a);                                                        \
+            (void) (b);                                                        \
+            (void) (c);                                                        \
+        } while (0)
+
+#endif
+
+#endif
@@ -1,9 +1,12 @@
 #include "chat262_protocol.h"
 
 #include "endianness.h"
+#include "lz_block.h"
+#include "schema.h"
 
 #include <cstdlib>
 #include <cstring>
+#include <utility>
 
 namespace chat262 {
 
@@ -41,6 +44,58 @@ const char* message_type_lookup(const uint16_t msg_type) {
         return "Delete account request";
     case msgtype_delete_response:
         return "Delete account response";
+    case msgtype_hello_request:
+        return "Hello request";
+    case msgtype_hello_response:
+        return "Hello response";
+    case msgtype_replicate_request:
+        return "Replicate request";
+    case msgtype_replicate_response:
+        return "Replicate response";
+    case msgtype_vote_request:
+        return "Vote request";
+    case msgtype_vote_response:
+        return "Vote response";
+    case msgtype_append_request:
+        return "Append request";
+    case msgtype_append_response:
+        return "Append response";
+    case msgtype_snapshot_request:
+        return "Snapshot request";
+    case msgtype_snapshot_response:
+        return "Snapshot response";
+    case msgtype_tail_request:
+        return "Tail request";
+    case msgtype_tail_response:
+        return "Tail response";
+    case msgtype_sync_request:
+        return "Sync request";
+    case msgtype_sync_response:
+        return "Sync response";
+    case msgtype_forward_request:
+        return "Forward request";
+    case msgtype_forward_response:
+        return "Forward response";
+    case msgtype_shard_accounts_request:
+        return "Shard accounts request";
+    case msgtype_shard_accounts_response:
+        return "Shard accounts response";
+    case msgtype_proxy_request:
+        return "Proxy request";
+    case msgtype_proxy_response:
+        return "Proxy response";
+    case msgtype_migrate_request:
+        return "Migrate request";
+    case msgtype_migrate_response:
+        return "Migrate response";
+    case msgtype_import_request:
+        return "Import request";
+    case msgtype_import_response:
+        return "Import response";
+    case msgtype_locate_request:
+        return "Locate request";
+    case msgtype_locate_response:
+        return "Locate response";
     case msgtype_wrong_version_response:
         return "Wrong version response";
     case msgtype_invalid_type_response:
@@ -66,6 +121,16 @@ const char* status_code_lookup(const uint32_t stat_code) {
         return "Invalid username";
     case status_code_password_invalid:
         return "Invalid password";
+    case status_code_quota_exceeded:
+        return "Storage quota exceeded";
+    case status_code_read_only:
+        return "Server is read-only";
+    case status_code_not_leader:
+        return "Server is not the leader";
+    case status_code_stale:
+        return "Server is behind";
+    case status_code_wrong_shard:
+        return "User belongs to another shard";
     default:
         return "Unknown";
     }
@@ -83,825 +148,954 @@ status message_header::deserialize(const std::vector<uint8_t>& data,
     return status::ok;
 }
 
+// Bodies of all messages, except the compressed body, whose tail is not made
+// of fields
+using registration_request_schema =
+    schema::message_schema<msgtype_registration_request,
+                           schema::bytes,
+                           schema::bytes>;
+using registration_response_schema =
+    schema::message_schema<msgtype_registration_response, schema::u32>;
+using registration_token_response_schema =
+    schema::response_schema<msgtype_registration_response, schema::u64>;
+using login_request_schema =
+    schema::message_schema<msgtype_login_request, schema::bytes, schema::bytes>;
+using login_response_schema =
+    schema::message_schema<msgtype_login_response, schema::u32>;
+using logout_request_schema = schema::message_schema<msgtype_logout_request>;
+using logout_response_schema =
+    schema::message_schema<msgtype_logout_response, schema::u32>;
+using accounts_request_schema =
+    schema::message_schema<msgtype_accounts_request, schema::bytes>;
+using accounts_response_schema =
+    schema::response_schema<msgtype_accounts_response, schema::string_list>;
+using send_txt_request_schema =
+    schema::message_schema<msgtype_send_txt_request,
+                           schema::bytes,
+                           schema::bytes>;
+using send_txt_response_schema =
+    schema::message_schema<msgtype_send_txt_response, schema::u32>;
+using send_txt_token_response_schema =
+    schema::response_schema<msgtype_send_txt_response, schema::u64>;
+using recv_txt_request_schema =
+    schema::message_schema<msgtype_recv_txt_request, schema::bytes>;
+using recv_txt_response_schema =
+    schema::response_schema<msgtype_recv_txt_response, schema::text_list>;
+using correspondents_request_schema =
+    schema::message_schema<msgtype_correspondents_request>;
+using correspondents_response_schema =
+    schema::response_schema<msgtype_correspondents_response,
+                            schema::string_list>;
+using delete_request_schema = schema::message_schema<msgtype_delete_request>;
+using delete_response_schema =
+    schema::message_schema<msgtype_delete_response, schema::u32>;
+using delete_token_response_schema =
+    schema::response_schema<msgtype_delete_response, schema::u64>;
+using wrong_version_response_schema =
+    schema::message_schema<msgtype_wrong_version_response, schema::u16>;
+using invalid_type_response_schema =
+    schema::message_schema<msgtype_invalid_type_response>;
+using invalid_body_response_schema =
+    schema::message_schema<msgtype_invalid_body_response>;
+using hello_request_schema =
+    schema::message_schema<msgtype_hello_request, schema::u16, schema::u32>;
+using hello_response_schema =
+    schema::message_schema<msgtype_hello_response, schema::u16, schema::u32>;
+using replicate_request_schema =
+    schema::message_schema<msgtype_replicate_request,
+                           schema::u64,
+                           schema::mutation_list>;
+using replicate_response_schema =
+    schema::message_schema<msgtype_replicate_response, schema::u64>;
+using vote_request_schema = schema::message_schema<msgtype_vote_request,
+                                                   schema::u64,
+                                                   schema::u32,
+                                                   schema::u64,
+                                                   schema::u64>;
+using vote_response_schema =
+    schema::message_schema<msgtype_vote_response, schema::u64, schema::u32>;
+using append_request_schema =
+    schema::message_schema<msgtype_append_request,
+                           schema::u64,
+                           schema::u32,
+                           schema::u64,
+                           schema::u64,
+                           schema::u64,
+                           schema::u64_list,
+                           schema::mutation_list>;
+using append_response_schema = schema::message_schema<msgtype_append_response,
+                                                      schema::u64,
+                                                      schema::u32,
+                                                      schema::u64>;
+using snapshot_request_schema =
+    schema::message_schema<msgtype_snapshot_request,
+                           schema::u64,
+                           schema::u32,
+                           schema::u64,
+                           schema::u64,
+                           schema::u64,
+                           schema::u32,
+                           schema::mutation_list>;
+using snapshot_response_schema =
+    schema::message_schema<msgtype_snapshot_response, schema::u64, schema::u64>;
+using tail_request_schema = schema::message_schema<msgtype_tail_request,
+                                                   schema::u64,
+                                                   schema::u64,
+                                                   schema::u32>;
+using tail_response_schema = schema::message_schema<msgtype_tail_response,
+                                                    schema::u64,
+                                                    schema::u64,
+                                                    schema::u32,
+                                                    schema::u32,
+                                                    schema::mutation_list>;
+using sync_request_schema =
+    schema::message_schema<msgtype_sync_request, schema::u64, schema::u32>;
+using sync_response_schema = schema::message_schema<msgtype_sync_response,
+                                                    schema::u32,
+                                                    schema::u64,
+                                                    schema::u32>;
+using forward_request_schema = schema::message_schema<msgtype_forward_request,
+                                                      schema::u32,
+                                                      schema::bytes,
+                                                      schema::bytes,
+                                                      schema::bytes>;
+using forward_response_schema =
+    schema::message_schema<msgtype_forward_response, schema::u32>;
+using shard_accounts_request_schema =
+    schema::message_schema<msgtype_shard_accounts_request, schema::bytes>;
+using shard_accounts_response_schema =
+    schema::response_schema<msgtype_shard_accounts_response,
+                            schema::string_list>;
+using proxy_request_schema = schema::message_schema<msgtype_proxy_request,
+                                                    schema::u32,
+                                                    schema::bytes,
+                                                    schema::bytes>;
+using proxy_response_schema = schema::
+    message_schema<msgtype_proxy_response, schema::bytes, schema::bytes>;
+using migrate_request_schema = schema::
+    message_schema<msgtype_migrate_request, schema::u32, schema::bytes>;
+using migrate_response_schema =
+    schema::response_schema<msgtype_migrate_response,
+                            schema::u64,
+                            schema::u64,
+                            schema::u64>;
+using import_request_schema = schema::message_schema<msgtype_import_request,
+                                                     schema::u32,
+                                                     schema::bytes,
+                                                     schema::mutation_list>;
+using import_response_schema =
+    schema::message_schema<msgtype_import_response, schema::u32>;
+using locate_request_schema =
+    schema::message_schema<msgtype_locate_request, schema::bytes>;
+using locate_response_schema =
+    schema::response_schema<msgtype_locate_response, schema::u32>;
+
+// The sizes of the fixed parts are part of the protocol
+static_assert(registration_request_schema::head_size == 8);
+static_assert(registration_response_schema::head_size == 4);
+static_assert(logout_request_schema::head_size == 0);
+static_assert(accounts_request_schema::head_size == 4);
+static_assert(wrong_version_response_schema::head_size == 2);
+static_assert(hello_request_schema::head_size == 6);
+static_assert(hello_response_schema::head_size == 6);
+static_assert(replicate_request_schema::head_size == 12);
+static_assert(replicate_response_schema::head_size == 8);
+static_assert(vote_request_schema::head_size == 28);
+static_assert(vote_response_schema::head_size == 12);
+static_assert(append_request_schema::head_size == 44);
+static_assert(append_response_schema::head_size == 20);
+static_assert(snapshot_request_schema::head_size == 44);
+static_assert(snapshot_response_schema::head_size == 16);
+static_assert(tail_request_schema::head_size == 20);
+static_assert(tail_response_schema::head_size == 28);
+static_assert(sync_request_schema::head_size == 12);
+static_assert(sync_response_schema::head_size == 16);
+static_assert(forward_request_schema::head_size == 16);
+static_assert(proxy_request_schema::head_size == 12);
+static_assert(proxy_response_schema::head_size == 8);
+static_assert(migrate_request_schema::head_size == 8);
+static_assert(import_request_schema::head_size == 12);
+
 std::shared_ptr<message> registration_request::serialize(
     const std::string& username,
     const std::string& password) {
-    uint32_t body_len =
-        2 * sizeof(uint32_t) + username.length() + password.length();
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_registration_request);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-    uint32_t user_len_le = e_htole32(static_cast<uint32_t>(username.length()));
-    uint32_t pass_len_le = e_htole32(static_cast<uint32_t>(password.length()));
-    memcpy(msg->body_, &user_len_le, sizeof(uint32_t));
-    memcpy(msg->body_ + 4, &pass_len_le, sizeof(uint32_t));
-    memcpy(msg->body_ + 8, username.c_str(), username.length());
-    memcpy(msg->body_ + 8 + username.length(),
-           password.c_str(),
-           password.length());
-    return msg;
+    return registration_request_schema::serialize(username, password);
 }
 
 status registration_request::deserialize(const std::vector<uint8_t>& data,
                                          std::string& username,
                                          std::string& password) {
-    // Ensure we can at least read username and password length
-    if (data.size() < 2 * sizeof(uint32_t)) {
-        return status::body_error;
-    }
-    const uint8_t* msg_body = data.data();
-
-    uint32_t user_len_le;
-    memcpy(&user_len_le, msg_body, sizeof(uint32_t));
-    uint32_t user_len = e_le32toh(user_len_le);
-
-    uint32_t pass_len_le;
-    memcpy(&pass_len_le, msg_body + 4, sizeof(uint32_t));
-    uint32_t pass_len = e_le32toh(pass_len_le);
-
-    // Cannot proceed if there is a mismatch of size
-    if (2 * sizeof(uint32_t) + user_len + pass_len != data.size()) {
-        return status::body_error;
-    }
-
-    username.assign(msg_body + 8, msg_body + 8 + user_len);
-    password.assign(msg_body + 8 + user_len,
-                    msg_body + 8 + user_len + pass_len);
-    return status::ok;
+    return registration_request_schema::deserialize(data, username, password);
 }
 
 std::shared_ptr<message> registration_response::serialize(
     const uint32_t stat_code) {
-    uint32_t body_len = sizeof(uint32_t);
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_registration_response);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-    uint32_t stat_code_le = e_htole32(stat_code);
-    memcpy(msg->body_, &stat_code_le, sizeof(uint32_t));
-    return msg;
+    return registration_response_schema::serialize(stat_code);
 }
 
 status registration_response::deserialize(const std::vector<uint8_t>& data,
                                           uint32_t& stat_code) {
-    // We know the size upfront
-    if (data.size() != sizeof(uint32_t)) {
-        return status::body_error;
-    }
-    const uint8_t* msg_body = data.data();
+    return registration_response_schema::deserialize(data, stat_code);
+}
 
-    uint32_t stat_code_le;
-    memcpy(&stat_code_le, msg_body, sizeof(uint32_t));
-    stat_code = e_le32toh(stat_code_le);
-    return status::ok;
+std::shared_ptr<message> registration_response::serialize(
+    const uint32_t stat_code,
+    const uint64_t token) {
+    return registration_token_response_schema::serialize(stat_code, token);
+}
+
+status registration_response::deserialize(const std::vector<uint8_t>& data,
+                                          uint32_t& stat_code,
+                                          uint64_t& token) {
+    return registration_token_response_schema::deserialize(data,
+                                                           stat_code,
+                                                           token);
 }
 
 std::shared_ptr<message> login_request::serialize(const std::string& username,
                                                   const std::string& password) {
-    uint32_t body_len =
-        2 * sizeof(uint32_t) + username.length() + password.length();
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_login_request);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-    uint32_t user_len_le = e_htole32(static_cast<uint32_t>(username.length()));
-    uint32_t pass_len_le = e_htole32(static_cast<uint32_t>(password.length()));
-    memcpy(msg->body_, &user_len_le, sizeof(uint32_t));
-    memcpy(msg->body_ + 4, &pass_len_le, sizeof(uint32_t));
-    memcpy(msg->body_ + 8, username.c_str(), username.length());
-    memcpy(msg->body_ + 8 + username.length(),
-           password.c_str(),
-           password.length());
-    return msg;
+    return login_request_schema::serialize(username, password);
 }
 
 status login_request::deserialize(const std::vector<uint8_t>& data,
                                   std::string& username,
                                   std::string& password) {
-    // Ensure we can at least read username and password length
-    if (data.size() < 2 * sizeof(uint32_t)) {
-        return status::body_error;
-    }
-    const uint8_t* msg_body = data.data();
-
-    uint32_t user_len_le;
-    memcpy(&user_len_le, msg_body, sizeof(uint32_t));
-    uint32_t user_len = e_le32toh(user_len_le);
-
-    uint32_t pass_len_le;
-    memcpy(&pass_len_le, msg_body + 4, sizeof(uint32_t));
-    uint32_t pass_len = e_le32toh(pass_len_le);
-
-    // Cannot proceed if there is a mismatch of size
-    if (2 * sizeof(uint32_t) + user_len + pass_len != data.size()) {
-        return status::body_error;
-    }
-
-    username.assign(msg_body + 8, msg_body + 8 + user_len);
-    password.assign(msg_body + 8 + user_len,
-                    msg_body + 8 + user_len + pass_len);
-    return status::ok;
+    return login_request_schema::deserialize(data, username, password);
 }
 
 std::shared_ptr<message> login_response::serialize(const uint32_t stat_code) {
-    uint32_t body_len = sizeof(uint32_t);
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_login_response);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-    uint32_t stat_code_le = e_htole32(stat_code);
-    memcpy(msg->body_, &stat_code_le, sizeof(uint32_t));
-    return msg;
+    return login_response_schema::serialize(stat_code);
 }
 
 status login_response::deserialize(const std::vector<uint8_t>& data,
                                    uint32_t& stat_code) {
-    // We know the size upfront
-    if (data.size() != sizeof(uint32_t)) {
-        return status::body_error;
-    }
-    const uint8_t* msg_body = data.data();
-
-    uint32_t stat_code_le;
-    memcpy(&stat_code_le, msg_body, sizeof(uint32_t));
-    stat_code = e_le32toh(stat_code_le);
-    return status::ok;
+    return login_response_schema::deserialize(data, stat_code);
 }
 
 std::shared_ptr<message> logout_request::serialize() {
-    std::shared_ptr<message> msg(
-        static_cast<message*>(malloc(sizeof(message_header))),
-        free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_logout_request);
-    msg->hdr_.body_len_ = e_htole32(static_cast<uint32_t>(0));
-    return msg;
+    return logout_request_schema::serialize();
 }
 
 status logout_request::deserialize(const std::vector<uint8_t>& data) {
-    if (data.size() != 0) {
-        return status::body_error;
-    }
-    return status::ok;
+    return logout_request_schema::deserialize(data);
 }
 
 std::shared_ptr<message> logout_response::serialize(const uint32_t stat_code) {
-    uint32_t body_len = sizeof(uint32_t);
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_logout_response);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-    uint32_t stat_code_le = e_htole32(stat_code);
-    memcpy(msg->body_, &stat_code_le, sizeof(uint32_t));
-    return msg;
+    return logout_response_schema::serialize(stat_code);
 }
 
 status logout_response::deserialize(const std::vector<uint8_t>& data,
                                     uint32_t& stat_code) {
-    // We know the size upfront
-    if (data.size() != sizeof(uint32_t)) {
-        return status::body_error;
-    }
-    const uint8_t* msg_body = data.data();
-
-    uint32_t stat_code_le;
-    memcpy(&stat_code_le, msg_body, sizeof(uint32_t));
-    stat_code = e_le32toh(stat_code_le);
-    return status::ok;
+    return logout_response_schema::deserialize(data, stat_code);
 }
 
 std::shared_ptr<message> accounts_request::serialize(
     const std::string& pattern) {
-    uint32_t body_len = sizeof(uint32_t) + pattern.length();
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_accounts_request);
-    msg->hdr_.body_len_ = e_htole32(static_cast<uint32_t>(body_len));
-
-    uint32_t pattern_len_le =
-        e_htole32(static_cast<uint32_t>(pattern.length()));
-    memcpy(msg->body_, &pattern_len_le, sizeof(uint32_t));
-    memcpy(msg->body_ + 4, pattern.c_str(), pattern.length());
-
-    return msg;
+    return accounts_request_schema::serialize(pattern);
 }
 
 status accounts_request::deserialize(const std::vector<uint8_t>& data,
                                      std::string& pattern) {
-    if (data.size() < sizeof(uint32_t)) {
-        return status::body_error;
-    }
-    const uint8_t* msg_body = data.data();
-
-    uint32_t pattern_len_le;
-    memcpy(&pattern_len_le, msg_body, sizeof(uint32_t));
-    uint32_t pattern_len = e_le32toh(pattern_len_le);
-
-    if (sizeof(uint32_t) + pattern_len != data.size()) {
-        return status::body_error;
-    }
-
-    pattern.assign(msg_body + 4, msg_body + 4 + pattern_len);
-    return status::ok;
+    return accounts_request_schema::deserialize(data, pattern);
 }
 
 std::shared_ptr<message> accounts_response::serialize(
     const uint32_t stat_code,
     const std::vector<std::string>& usernames) {
-    uint32_t body_len = sizeof(uint32_t);
-    // Add usernames to body length only if status code is ok
-    if (stat_code == status_code_ok) {
-        body_len += sizeof(uint32_t) + usernames.size() * sizeof(uint32_t);
-        for (const std::string& u : usernames) {
-            body_len += u.length();
-        }
-    }
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_accounts_response);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-
-    // The status code is always serialized
-    uint32_t stat_code_le = e_htole32(stat_code);
-    memcpy(msg->body_, &stat_code_le, sizeof(uint32_t));
-
-    if (stat_code == status_code_ok) {
-        // Copy the number of acconts
-        uint32_t num_accounts_le =
-            e_htole32(static_cast<uint32_t>(usernames.size()));
-        memcpy(msg->body_ + 4, &num_accounts_le, sizeof(uint32_t));
-
-        // Points to the next username length to copy
-        uint8_t* u_lengths_ptr = msg->body_ + 8;
-        // Points to the next username to copy
-        uint8_t* u_ptr = u_lengths_ptr + usernames.size() * sizeof(uint32_t);
-        for (const std::string& u : usernames) {
-            uint32_t u_length = static_cast<uint32_t>(u.length());
-            uint32_t u_length_le = e_htole32(u_length);
-            // Copy the username length
-            memcpy(u_lengths_ptr, &u_length_le, sizeof(uint32_t));
-            u_lengths_ptr += sizeof(uint32_t);
-            // Copy the username
-            memcpy(u_ptr, u.c_str(), u_length);
-            u_ptr += u_length;
-        }
-    }
-    return msg;
+    return accounts_response_schema::serialize(stat_code, usernames);
 }
 
 status accounts_response::deserialize(const std::vector<uint8_t>& data,
                                       uint32_t& stat_code,
                                       std::vector<std::string>& usernames) {
-    // Make sure we can read the status code
-    if (data.size() < sizeof(uint32_t)) {
-        return status::body_error;
-    }
-
-    const uint8_t* msg_body = data.data();
-    // Copy the status code
-    uint32_t stat_code_le;
-    memcpy(&stat_code_le, msg_body, sizeof(uint32_t));
-    msg_body += sizeof(uint32_t);
-    uint32_t stat_code_h = e_le32toh(stat_code_le);
-    // If the status code is not OK, we're done
-    if (stat_code_h != status_code_ok) {
-        stat_code = stat_code_h;
-        return status::ok;
-    }
-
-    // Make sure we can read the number of accounts
-    if (data.size() < 2 * sizeof(uint32_t)) {
-        return status::body_error;
-    }
-
-    // Copy the number of accounts
-    uint32_t num_accounts_le;
-    memcpy(&num_accounts_le, msg_body, sizeof(uint32_t));
-    msg_body += sizeof(uint32_t);
-    uint32_t num_accounts_h = e_le32toh(num_accounts_le);
-
-    // Make sure we can read the username lengths
-    if (data.size() <
-        2 * sizeof(uint32_t) + num_accounts_h * sizeof(uint32_t)) {
-        return status::body_error;
-    }
-
-    // Store all username lengths and compute total username length
-    std::vector<uint32_t> u_lens;
-    u_lens.resize(num_accounts_h);
-    uint32_t total_u_len = 0;
-    for (uint32_t i = 0; i != num_accounts_h;
-         ++i, msg_body += sizeof(uint32_t)) {
-        const uint8_t* u_len_ptr = msg_body;
-        uint32_t u_len_le;
-        memcpy(&u_len_le, u_len_ptr, sizeof(uint32_t));
-        u_lens[i] = e_le32toh(u_len_le);
-        total_u_len += u_lens[i];
-    }
-
-    // Make sure we can read all usernames
-    if (data.size() != 2 * sizeof(uint32_t) +
-                           num_accounts_h * sizeof(uint32_t) + total_u_len) {
-        return status::body_error;
-    }
-
-    // Copy all usernames
-    usernames.resize(num_accounts_h);
-    for (uint32_t i = 0; i != num_accounts_h; ++i) {
-        const uint8_t* u_ptr = msg_body;
-        usernames[i].assign(u_ptr, u_ptr + u_lens[i]);
-        msg_body += u_lens[i];
-    }
-    stat_code = stat_code_h;
-
-    return status::ok;
+    return accounts_response_schema::deserialize(data, stat_code, usernames);
 }
 
 std::shared_ptr<message> send_txt_request::serialize(
     const std::string& recipient,
     const std::string& txt) {
-    uint32_t body_len =
-        2 * sizeof(uint32_t) + recipient.length() + txt.length();
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_send_txt_request);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-    uint32_t recipient_len_le =
-        e_htole32(static_cast<uint32_t>(recipient.length()));
-    uint32_t txt_len_le = e_htole32(static_cast<uint32_t>(txt.length()));
-    memcpy(msg->body_, &recipient_len_le, sizeof(uint32_t));
-    memcpy(msg->body_ + 4, &txt_len_le, sizeof(uint32_t));
-    memcpy(msg->body_ + 8, recipient.c_str(), recipient.length());
-    memcpy(msg->body_ + 8 + recipient.length(), txt.c_str(), txt.length());
-    return msg;
+    return send_txt_request_schema::serialize(recipient, txt);
 }
 
 status send_txt_request::deserialize(const std::vector<uint8_t>& data,
                                      std::string& recipient,
                                      std::string& txt) {
-    if (data.size() < 2 * sizeof(uint32_t)) {
-        return status::body_error;
-    }
-    const uint8_t* msg_body = data.data();
-
-    uint32_t recipient_len_le;
-    memcpy(&recipient_len_le, msg_body, sizeof(uint32_t));
-    uint32_t recipient_len = e_le32toh(recipient_len_le);
-
-    uint32_t txt_len_le;
-    memcpy(&txt_len_le, msg_body + 4, sizeof(uint32_t));
-    uint32_t txt_len = e_le32toh(txt_len_le);
-
-    // Cannot proceed if there is a mismatch of size
-    if (2 * sizeof(uint32_t) + recipient_len + txt_len != data.size()) {
-        return status::body_error;
-    }
-
-    recipient.assign(msg_body + 8, msg_body + 8 + recipient_len);
-    txt.assign(msg_body + 8 + recipient_len,
-               msg_body + 8 + recipient_len + txt_len);
-    return status::ok;
+    return send_txt_request_schema::deserialize(data, recipient, txt);
 }
 
 std::shared_ptr<message> send_txt_response::serialize(
     const uint32_t stat_code) {
-    uint32_t body_len = sizeof(uint32_t);
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_send_txt_response);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-    uint32_t stat_code_le = e_htole32(stat_code);
-    memcpy(msg->body_, &stat_code_le, sizeof(uint32_t));
-    return msg;
+    return send_txt_response_schema::serialize(stat_code);
 }
 
 status send_txt_response::deserialize(const std::vector<uint8_t>& data,
                                       uint32_t& stat_code) {
-    // We know the size upfront
-    if (data.size() != sizeof(uint32_t)) {
-        return status::body_error;
-    }
-    const uint8_t* msg_body = data.data();
+    return send_txt_response_schema::deserialize(data, stat_code);
+}
 
-    uint32_t stat_code_le;
-    memcpy(&stat_code_le, msg_body, sizeof(uint32_t));
-    stat_code = e_le32toh(stat_code_le);
-    return status::ok;
+std::shared_ptr<message> send_txt_response::serialize(const uint32_t stat_code,
+                                                      const uint64_t token) {
+    return send_txt_token_response_schema::serialize(stat_code, token);
+}
+
+status send_txt_response::deserialize(const std::vector<uint8_t>& data,
+                                      uint32_t& stat_code,
+                                      uint64_t& token) {
+    return send_txt_token_response_schema::deserialize(data, stat_code, token);
 }
 
 std::shared_ptr<message> recv_txt_request::serialize(
     const std::string& username) {
-    uint32_t body_len = sizeof(uint32_t) + username.length();
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_recv_txt_request);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-    uint32_t sender_len_le =
-        e_htole32(static_cast<uint32_t>(username.length()));
-    memcpy(msg->body_, &sender_len_le, sizeof(uint32_t));
-    memcpy(msg->body_ + 4, username.c_str(), username.length());
-    return msg;
+    return recv_txt_request_schema::serialize(username);
 }
 
 status recv_txt_request::deserialize(const std::vector<uint8_t>& data,
                                      std::string& sender) {
-    if (data.size() < sizeof(uint32_t)) {
-        return status::body_error;
-    }
-    const uint8_t* msg_body = data.data();
-
-    uint32_t sender_len_le;
-    memcpy(&sender_len_le, msg_body, sizeof(uint32_t));
-    uint32_t sender_len = e_le32toh(sender_len_le);
-
-    // Cannot proceed if there is a mismatch of size
-    if (sizeof(uint32_t) + sender_len != data.size()) {
-        return status::body_error;
-    }
-
-    sender.assign(msg_body + 4, msg_body + 4 + sender_len);
-    return status::ok;
+    return recv_txt_request_schema::deserialize(data, sender);
 }
 
 std::shared_ptr<message> recv_txt_response::serialize(const uint32_t stat_code,
                                                       const chat& c) {
-    uint32_t body_len = sizeof(uint32_t);
-    if (stat_code == status_code_ok) {
-        body_len += sizeof(uint32_t) +
-                    c.texts_.size() * (sizeof(uint8_t) + sizeof(uint32_t));
-        for (const text& txt : c.texts_) {
-            body_len += txt.content_.length();
-        }
-    }
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_recv_txt_response);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-
-    // The status code is always serialized
-    uint32_t stat_code_le = e_htole32(stat_code);
-    memcpy(msg->body_, &stat_code_le, sizeof(uint32_t));
-
-    // The rest is serialized only if status code is OK
-    if (stat_code == status_code_ok) {
-        // Copy the number of texts
-        uint32_t num_accounts_le =
-            e_htole32(static_cast<uint32_t>(c.texts_.size()));
-        memcpy(msg->body_ + 4, &num_accounts_le, sizeof(uint32_t));
-
-        // Points to the next sender identifier to copy
-        uint8_t* sender_ptr = msg->body_ + 8;
-        // Points to the next text length to copy
-        uint8_t* txt_lens_ptr = sender_ptr + c.texts_.size() * sizeof(uint8_t);
-        // Points to the next text to copy
-        uint8_t* txt_ptr = txt_lens_ptr + c.texts_.size() * sizeof(uint32_t);
-        for (const text& txt : c.texts_) {
-            memcpy(sender_ptr, &(txt.sender_), sizeof(uint8_t));
-            sender_ptr += sizeof(uint8_t);
-
-            uint32_t txt_len = static_cast<uint32_t>(txt.content_.length());
-            uint32_t txt_len_le = e_htole32(txt_len);
-
-            memcpy(txt_lens_ptr, &txt_len_le, sizeof(uint32_t));
-            txt_lens_ptr += sizeof(uint32_t);
-
-            memcpy(txt_ptr, txt.content_.c_str(), txt_len);
-            txt_ptr += txt_len;
-        }
-    }
-    return msg;
+    return recv_txt_response_schema::serialize(stat_code, c);
+}
+
+std::shared_ptr<message> recv_txt_response::serialize(const uint32_t stat_code,
+                                                      const chat_view& v) {
+    return recv_txt_response_schema::serialize(stat_code, v);
 }
 
 status recv_txt_response::deserialize(const std::vector<uint8_t>& data,
                                       uint32_t& stat_code,
                                       chat& c) {
-    // Make sure we can read the status code
-    if (data.size() < sizeof(uint32_t)) {
-        return status::body_error;
-    }
+    return recv_txt_response_schema::deserialize(data, stat_code, c);
+}
 
-    const uint8_t* msg_body = data.data();
-    // Copy the status code
-    uint32_t stat_code_le;
-    memcpy(&stat_code_le, msg_body, sizeof(uint32_t));
-    msg_body += sizeof(uint32_t);
-    uint32_t stat_code_h = e_le32toh(stat_code_le);
-    // If the status code is not OK, we're done
-    if (stat_code_h != status_code_ok) {
-        stat_code = stat_code_h;
-        return status::ok;
-    }
+std::shared_ptr<message> correspondents_request::serialize() {
+    return correspondents_request_schema::serialize();
+}
 
-    // Make sure we can read the number of texts
-    if (data.size() < 2 * sizeof(uint32_t)) {
-        return status::body_error;
+status correspondents_request::deserialize(const std::vector<uint8_t>& data) {
+    return correspondents_request_schema::deserialize(data);
+}
+
+std::shared_ptr<message> correspondents_response::serialize(
+    const uint32_t stat_code,
+    const std::vector<std::string>& usernames) {
+    return correspondents_response_schema::serialize(stat_code, usernames);
+}
+
+status correspondents_response::deserialize(
+    const std::vector<uint8_t>& data,
+    uint32_t& stat_code,
+    std::vector<std::string>& usernames) {
+    return correspondents_response_schema::deserialize(data,
+                                                       stat_code,
+                                                       usernames);
+}
+
+std::shared_ptr<message> delete_request::serialize() {
+    return delete_request_schema::serialize();
+}
+
+status delete_request::deserialize(const std::vector<uint8_t>& data) {
+    return delete_request_schema::deserialize(data);
+}
+
+std::shared_ptr<message> delete_response::serialize(const uint32_t stat_code) {
+    return delete_response_schema::serialize(stat_code);
+}
+
+status delete_response::deserialize(const std::vector<uint8_t>& data,
+                                    uint32_t& stat_code) {
+    return delete_response_schema::deserialize(data, stat_code);
+}
+
+std::shared_ptr<message> delete_response::serialize(const uint32_t stat_code,
+                                                    const uint64_t token) {
+    return delete_token_response_schema::serialize(stat_code, token);
+}
+
+status delete_response::deserialize(const std::vector<uint8_t>& data,
+                                    uint32_t& stat_code,
+                                    uint64_t& token) {
+    return delete_token_response_schema::deserialize(data, stat_code, token);
+}
+
+std::shared_ptr<message> wrong_version_response::serialize(
+    const uint16_t correct_version) {
+    return wrong_version_response_schema::serialize(correct_version);
+}
+
+status wrong_version_response::deserialize(const std::vector<uint8_t>& data,
+                                           uint16_t& correct_version) {
+    return wrong_version_response_schema::deserialize(data, correct_version);
+}
+
+std::shared_ptr<message> invalid_type_response::serialize() {
+    return invalid_type_response_schema::serialize();
+}
+
+status invalid_type_response::deserialize(const std::vector<uint8_t>& data) {
+    return invalid_type_response_schema::deserialize(data);
+}
+
+std::shared_ptr<message> invalid_body_response::serialize() {
+    return invalid_body_response_schema::serialize();
+}
+
+status invalid_body_response::deserialize(const std::vector<uint8_t>& data) {
+    return invalid_body_response_schema::deserialize(data);
+}
+
+std::shared_ptr<message> hello_request::serialize(const uint16_t max_version,
+                                                  const uint32_t features) {
+    return hello_request_schema::serialize(max_version, features);
+}
+
+status hello_request::deserialize(const std::vector<uint8_t>& data,
+                                  uint16_t& max_version,
+                                  uint32_t& features) {
+    return hello_request_schema::deserialize(data, max_version, features);
+}
+
+std::shared_ptr<message> hello_response::serialize(
+    const uint16_t chosen_version,
+    const uint32_t features) {
+    return hello_response_schema::serialize(chosen_version, features);
+}
+
+status hello_response::deserialize(const std::vector<uint8_t>& data,
+                                   uint16_t& chosen_version,
+                                   uint32_t& features) {
+    return hello_response_schema::deserialize(data, chosen_version, features);
+}
+
+std::shared_ptr<message> replicate_request::serialize(
+    const uint64_t first_seq,
+    const std::vector<mutation>& mutations) {
+    return replicate_request_schema::serialize(first_seq, mutations);
+}
+
+status replicate_request::deserialize(const std::vector<uint8_t>& data,
+                                      uint64_t& first_seq,
+                                      std::vector<mutation>& mutations) {
+    return replicate_request_schema::deserialize(data, first_seq, mutations);
+}
+
+std::shared_ptr<message> replicate_response::serialize(
+    const uint64_t last_seq) {
+    return replicate_response_schema::serialize(last_seq);
+}
+
+status replicate_response::deserialize(const std::vector<uint8_t>& data,
+                                       uint64_t& last_seq) {
+    return replicate_response_schema::deserialize(data, last_seq);
+}
+
+std::shared_ptr<message> vote_request::serialize(
+    const uint64_t term,
+    const uint32_t candidate,
+    const uint64_t last_log_index,
+    const uint64_t last_log_term) {
+    return vote_request_schema::serialize(term,
+                                          candidate,
+                                          last_log_index,
+                                          last_log_term);
+}
+
+status vote_request::deserialize(const std::vector<uint8_t>& data,
+                                 uint64_t& term,
+                                 uint32_t& candidate,
+                                 uint64_t& last_log_index,
+                                 uint64_t& last_log_term) {
+    return vote_request_schema::deserialize(data,
+                                            term,
+                                            candidate,
+                                            last_log_index,
+                                            last_log_term);
+}
+
+std::shared_ptr<message> vote_response::serialize(const uint64_t term,
+                                                  const bool granted) {
+    return vote_response_schema::serialize(term,
+                                           static_cast<uint32_t>(granted));
+}
+
+status vote_response::deserialize(const std::vector<uint8_t>& data,
+                                  uint64_t& term,
+                                  bool& granted) {
+    uint32_t granted_h;
+    status s = vote_response_schema::deserialize(data, term, granted_h);
+    if (s == status::ok) {
+        granted = granted_h != 0;
     }
+    return s;
+}
 
-    // Copy the number of texts
-    uint32_t num_txts_le;
-    memcpy(&num_txts_le, msg_body, sizeof(uint32_t));
-    msg_body += sizeof(uint32_t);
-    uint32_t num_txts_h = e_le32toh(num_txts_le);
+std::shared_ptr<message> append_request::serialize(
+    const uint64_t term,
+    const uint32_t leader,
+    const uint64_t prev_log_index,
+    const uint64_t prev_log_term,
+    const uint64_t leader_commit,
+    const std::vector<uint64_t>& terms,
+    const std::vector<mutation>& mutations) {
+    return append_request_schema::serialize(term,
+                                            leader,
+                                            prev_log_index,
+                                            prev_log_term,
+                                            leader_commit,
+                                            terms,
+                                            mutations);
+}
 
-    // Make sure we can read senders and text lengths
-    if (data.size() < 2 * sizeof(uint32_t) +
-                          num_txts_h * (sizeof(uint8_t) + sizeof(uint32_t))) {
+status append_request::deserialize(const std::vector<uint8_t>& data,
+                                   uint64_t& term,
+                                   uint32_t& leader,
+                                   uint64_t& prev_log_index,
+                                   uint64_t& prev_log_term,
+                                   uint64_t& leader_commit,
+                                   std::vector<uint64_t>& terms,
+                                   std::vector<mutation>& mutations) {
+    // Every entry has a term and a mutation, so the numbers of terms and of
+    // mutations, which are the last two heads, must be equal
+    if (data.size() >= append_request_schema::head_size &&
+        schema::get32(data.data() + 36) != schema::get32(data.data() + 40)) {
         return status::body_error;
     }
+    return append_request_schema::deserialize(data,
+                                              term,
+                                              leader,
+                                              prev_log_index,
+                                              prev_log_term,
+                                              leader_commit,
+                                              terms,
+                                              mutations);
+}
+
+std::shared_ptr<message> append_response::serialize(
+    const uint64_t term,
+    const bool success,
+    const uint64_t match_index) {
+    return append_response_schema::serialize(term,
+                                             static_cast<uint32_t>(success),
+                                             match_index);
+}
 
-    // Store all senders and text lengths, and compute total text length
-    std::vector<uint8_t> senders;
-    std::vector<uint32_t> txt_lens;
-    senders.resize(num_txts_h);
-    txt_lens.resize(num_txts_h);
-    uint32_t total_txt_len = 0;
-    const uint8_t* sender_ptr = msg_body;
-    const uint8_t* txt_lens_ptr = msg_body + num_txts_h * sizeof(uint8_t);
-    for (uint32_t i = 0; i != num_txts_h;
-         ++i, sender_ptr += sizeof(uint8_t), txt_lens_ptr += sizeof(uint32_t)) {
-        memcpy(&(senders[i]), sender_ptr, sizeof(uint8_t));
-        uint32_t txt_len_le;
-        memcpy(&txt_len_le, txt_lens_ptr, sizeof(uint32_t));
-        txt_lens[i] = e_le32toh(txt_len_le);
-        total_txt_len += txt_lens[i];
+status append_response::deserialize(const std::vector<uint8_t>& data,
+                                    uint64_t& term,
+                                    bool& success,
+                                    uint64_t& match_index) {
+    uint32_t success_h;
+    status s =
+        append_response_schema::deserialize(data, term, success_h, match_index);
+    if (s == status::ok) {
+        success = success_h != 0;
     }
-    msg_body += num_txts_h * (sizeof(uint8_t) + sizeof(uint32_t));
+    return s;
+}
 
-    // Make sure we can read all texts
-    if (data.size() != 2 * sizeof(uint32_t) +
-                           num_txts_h * (sizeof(uint8_t) + sizeof(uint32_t)) +
-                           total_txt_len) {
-        return status::body_error;
+std::shared_ptr<message> snapshot_request::serialize(
+    const uint64_t term,
+    const uint32_t leader,
+    const uint64_t last_index,
+    const uint64_t last_term,
+    const uint64_t offset,
+    const bool done,
+    const std::vector<mutation>& mutations) {
+    return snapshot_request_schema::serialize(term,
+                                              leader,
+                                              last_index,
+                                              last_term,
+                                              offset,
+                                              static_cast<uint32_t>(done),
+                                              mutations);
+}
+
+status snapshot_request::deserialize(const std::vector<uint8_t>& data,
+                                     uint64_t& term,
+                                     uint32_t& leader,
+                                     uint64_t& last_index,
+                                     uint64_t& last_term,
+                                     uint64_t& offset,
+                                     bool& done,
+                                     std::vector<mutation>& mutations) {
+    uint32_t done_h;
+    status s = snapshot_request_schema::deserialize(data,
+                                                    term,
+                                                    leader,
+                                                    last_index,
+                                                    last_term,
+                                                    offset,
+                                                    done_h,
+                                                    mutations);
+    if (s == status::ok) {
+        done = done_h != 0;
     }
+    return s;
+}
+
+std::shared_ptr<message> snapshot_response::serialize(
+    const uint64_t term,
+    const uint64_t received) {
+    return snapshot_response_schema::serialize(term, received);
+}
+
+status snapshot_response::deserialize(const std::vector<uint8_t>& data,
+                                      uint64_t& term,
+                                      uint64_t& received) {
+    return snapshot_response_schema::deserialize(data, term, received);
+}
 
-    // Copy all senders and texts
-    c.texts_.resize(num_txts_h);
-    for (uint32_t i = 0; i != num_txts_h; ++i) {
-        c.texts_[i].sender_ = senders[i];
-        c.texts_[i].content_.assign(msg_body, msg_body + txt_lens[i]);
-        msg_body += txt_lens[i];
+std::shared_ptr<message> tail_request::serialize(
+    const uint64_t next_seq,
+    const uint64_t snapshot_offset,
+    const uint32_t max_wait_ms) {
+    return tail_request_schema::serialize(next_seq,
+                                          snapshot_offset,
+                                          max_wait_ms);
+}
+
+status tail_request::deserialize(const std::vector<uint8_t>& data,
+                                 uint64_t& next_seq,
+                                 uint64_t& snapshot_offset,
+                                 uint32_t& max_wait_ms) {
+    return tail_request_schema::deserialize(data,
+                                            next_seq,
+                                            snapshot_offset,
+                                            max_wait_ms);
+}
+
+std::shared_ptr<message> tail_response::serialize(
+    const uint64_t first_seq,
+    const uint64_t last_seq,
+    const bool snapshot,
+    const bool done,
+    const std::vector<mutation>& mutations) {
+    return tail_response_schema::serialize(first_seq,
+                                           last_seq,
+                                           static_cast<uint32_t>(snapshot),
+                                           static_cast<uint32_t>(done),
+                                           mutations);
+}
+
+status tail_response::deserialize(const std::vector<uint8_t>& data,
+                                  uint64_t& first_seq,
+                                  uint64_t& last_seq,
+                                  bool& snapshot,
+                                  bool& done,
+                                  std::vector<mutation>& mutations) {
+    uint32_t snapshot_h;
+    uint32_t done_h;
+    status s = tail_response_schema::deserialize(data,
+                                                 first_seq,
+                                                 last_seq,
+                                                 snapshot_h,
+                                                 done_h,
+                                                 mutations);
+    if (s == status::ok) {
+        snapshot = snapshot_h != 0;
+        done = done_h != 0;
     }
-    stat_code = stat_code_h;
+    return s;
+}
 
-    return status::ok;
+std::shared_ptr<message> sync_request::serialize(const uint64_t token,
+                                                 const uint32_t max_wait_ms) {
+    return sync_request_schema::serialize(token, max_wait_ms);
 }
 
-std::shared_ptr<message> correspondents_request::serialize() {
-    std::shared_ptr<message> msg(
-        static_cast<message*>(malloc(sizeof(message_header))),
-        free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_correspondents_request);
-    msg->hdr_.body_len_ = e_htole32(static_cast<uint32_t>(0));
-    return msg;
+status sync_request::deserialize(const std::vector<uint8_t>& data,
+                                 uint64_t& token,
+                                 uint32_t& max_wait_ms) {
+    return sync_request_schema::deserialize(data, token, max_wait_ms);
 }
 
-status correspondents_request::deserialize(const std::vector<uint8_t>& data) {
-    if (data.size() != 0) {
-        return status::body_error;
+std::shared_ptr<message> sync_response::serialize(
+    const uint32_t stat_code,
+    const uint64_t applied,
+    const uint32_t staleness_ms) {
+    return sync_response_schema::serialize(stat_code, applied, staleness_ms);
+}
+
+status sync_response::deserialize(const std::vector<uint8_t>& data,
+                                  uint32_t& stat_code,
+                                  uint64_t& applied,
+                                  uint32_t& staleness_ms) {
+    return sync_response_schema::deserialize(data,
+                                             stat_code,
+                                             applied,
+                                             staleness_ms);
+}
+
+std::shared_ptr<message> forward_request::serialize(const mutation& m) {
+    return forward_request_schema::serialize(static_cast<uint32_t>(m.op_),
+                                             m.username_,
+                                             m.arg_,
+                                             m.txt_);
+}
+
+status forward_request::deserialize(const std::vector<uint8_t>& data,
+                                    mutation& m) {
+    uint32_t op;
+    std::string username;
+    std::string arg;
+    std::string txt;
+    status s =
+        forward_request_schema::deserialize(data, op, username, arg, txt);
+    if (s != status::ok) {
+        return s;
+    }
+    if (op > 0xFF) {
+        return status::error;
     }
+    m.op_ = static_cast<uint8_t>(op);
+    m.username_ = std::move(username);
+    m.arg_ = std::move(arg);
+    m.txt_ = std::move(txt);
     return status::ok;
 }
 
-std::shared_ptr<message> correspondents_response::serialize(
+std::shared_ptr<message> forward_response::serialize(
+    const uint32_t stat_code) {
+    return forward_response_schema::serialize(stat_code);
+}
+
+status forward_response::deserialize(const std::vector<uint8_t>& data,
+                                     uint32_t& stat_code) {
+    return forward_response_schema::deserialize(data, stat_code);
+}
+
+std::shared_ptr<message> shard_accounts_request::serialize(
+    const std::string& pattern) {
+    return shard_accounts_request_schema::serialize(pattern);
+}
+
+status shard_accounts_request::deserialize(const std::vector<uint8_t>& data,
+                                           std::string& pattern) {
+    return shard_accounts_request_schema::deserialize(data, pattern);
+}
+
+std::shared_ptr<message> shard_accounts_response::serialize(
     const uint32_t stat_code,
     const std::vector<std::string>& usernames) {
-    uint32_t body_len = sizeof(uint32_t);
-    // Add usernames to body length only if status code is ok
-    if (stat_code == status_code_ok) {
-        body_len += sizeof(uint32_t) + usernames.size() * sizeof(uint32_t);
-        for (const std::string& u : usernames) {
-            body_len += u.length();
-        }
-    }
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_correspondents_response);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-
-    // The status code is always serialized
-    uint32_t stat_code_le = e_htole32(stat_code);
-    memcpy(msg->body_, &stat_code_le, sizeof(uint32_t));
-
-    if (stat_code == status_code_ok) {
-        // Copy the number of acconts
-        uint32_t num_accounts_le =
-            e_htole32(static_cast<uint32_t>(usernames.size()));
-        memcpy(msg->body_ + 4, &num_accounts_le, sizeof(uint32_t));
-
-        // Points to the next username length to copy
-        uint8_t* u_lengths_ptr = msg->body_ + 8;
-        // Points to the next username to copy
-        uint8_t* u_ptr = u_lengths_ptr + usernames.size() * sizeof(uint32_t);
-        for (const std::string& u : usernames) {
-            uint32_t u_length = static_cast<uint32_t>(u.length());
-            uint32_t u_length_le = e_htole32(u_length);
-            // Copy the username length
-            memcpy(u_lengths_ptr, &u_length_le, sizeof(uint32_t));
-            u_lengths_ptr += sizeof(uint32_t);
-            // Copy the username
-            memcpy(u_ptr, u.c_str(), u_length);
-            u_ptr += u_length;
-        }
-    }
-    return msg;
+    return shard_accounts_response_schema::serialize(stat_code, usernames);
 }
 
-status correspondents_response::deserialize(
+status shard_accounts_response::deserialize(
     const std::vector<uint8_t>& data,
     uint32_t& stat_code,
     std::vector<std::string>& usernames) {
-    // Make sure we can read the status code
-    if (data.size() < sizeof(uint32_t)) {
-        return status::body_error;
-    }
+    return shard_accounts_response_schema::deserialize(data,
+                                                       stat_code,
+                                                       usernames);
+}
 
-    const uint8_t* msg_body = data.data();
-    // Copy the status code
-    uint32_t stat_code_le;
-    memcpy(&stat_code_le, msg_body, sizeof(uint32_t));
-    msg_body += sizeof(uint32_t);
-    uint32_t stat_code_h = e_le32toh(stat_code_le);
-    // If the status code is not OK, we're done
-    if (stat_code_h != status_code_ok) {
-        stat_code = stat_code_h;
-        return status::ok;
-    }
+std::shared_ptr<message> proxy_request::serialize(
+    const uint32_t features,
+    const std::string& username,
+    const std::string& request) {
+    return proxy_request_schema::serialize(features, username, request);
+}
 
-    // Make sure we can read the number of accounts
-    if (data.size() < 2 * sizeof(uint32_t)) {
-        return status::body_error;
-    }
+status proxy_request::deserialize(const std::vector<uint8_t>& data,
+                                  uint32_t& features,
+                                  std::string& username,
+                                  std::string& request) {
+    return proxy_request_schema::deserialize(data,
+                                             features,
+                                             username,
+                                             request);
+}
 
-    // Copy the number of accounts
-    uint32_t num_accounts_le;
-    memcpy(&num_accounts_le, msg_body, sizeof(uint32_t));
-    msg_body += sizeof(uint32_t);
-    uint32_t num_accounts_h = e_le32toh(num_accounts_le);
+std::shared_ptr<message> proxy_response::serialize(
+    const std::string& username,
+    const std::string& response) {
+    return proxy_response_schema::serialize(username, response);
+}
 
-    // Make sure we can read the username lengths
-    if (data.size() <
-        2 * sizeof(uint32_t) + num_accounts_h * sizeof(uint32_t)) {
-        return status::body_error;
-    }
+status proxy_response::deserialize(const std::vector<uint8_t>& data,
+                                   std::string& username,
+                                   std::string& response) {
+    return proxy_response_schema::deserialize(data, username, response);
+}
 
-    // Store all username lengths and compute total username length
-    std::vector<uint32_t> u_lens;
-    u_lens.resize(num_accounts_h);
-    uint32_t total_u_len = 0;
-    for (uint32_t i = 0; i != num_accounts_h;
-         ++i, msg_body += sizeof(uint32_t)) {
-        const uint8_t* u_len_ptr = msg_body;
-        uint32_t u_len_le;
-        memcpy(&u_len_le, u_len_ptr, sizeof(uint32_t));
-        u_lens[i] = e_le32toh(u_len_le);
-        total_u_len += u_lens[i];
-    }
+std::shared_ptr<message> migrate_request::serialize(
+    const uint32_t shard,
+    const std::string& username) {
+    return migrate_request_schema::serialize(shard, username);
+}
 
-    // Make sure we can read all usernames
-    if (data.size() != 2 * sizeof(uint32_t) +
-                           num_accounts_h * sizeof(uint32_t) + total_u_len) {
-        return status::body_error;
-    }
+status migrate_request::deserialize(const std::vector<uint8_t>& data,
+                                    uint32_t& shard,
+                                    std::string& username) {
+    return migrate_request_schema::deserialize(data, shard, username);
+}
 
-    // Copy all usernames
-    usernames.resize(num_accounts_h);
-    for (uint32_t i = 0; i != num_accounts_h; ++i) {
-        const uint8_t* u_ptr = msg_body;
-        usernames[i].assign(u_ptr, u_ptr + u_lens[i]);
-        msg_body += u_lens[i];
-    }
-    stat_code = stat_code_h;
+std::shared_ptr<message> migrate_response::serialize(
+    const uint32_t stat_code) {
+    // Nothing follows a status code that is not OK
+    return migrate_response_schema::serialize(stat_code, 0, 0, 0);
+}
 
-    return status::ok;
+std::shared_ptr<message> migrate_response::serialize(
+    const uint32_t stat_code,
+    const uint64_t bytes,
+    const uint64_t copy_us,
+    const uint64_t pause_us) {
+    return migrate_response_schema::serialize(stat_code,
+                                              bytes,
+                                              copy_us,
+                                              pause_us);
 }
 
-std::shared_ptr<message> delete_request::serialize() {
-    std::shared_ptr<message> msg(
-        static_cast<message*>(malloc(sizeof(message_header))),
-        free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_delete_request);
-    msg->hdr_.body_len_ = e_htole32(static_cast<uint32_t>(0));
-    return msg;
+status migrate_response::deserialize(const std::vector<uint8_t>& data,
+                                     uint32_t& stat_code,
+                                     uint64_t& bytes,
+                                     uint64_t& copy_us,
+                                     uint64_t& pause_us) {
+    return migrate_response_schema::deserialize(data,
+                                                stat_code,
+                                                bytes,
+                                                copy_us,
+                                                pause_us);
 }
 
-status delete_request::deserialize(const std::vector<uint8_t>& data) {
-    if (data.size() != 0) {
-        return status::body_error;
+std::shared_ptr<message> import_request::serialize(
+    const bool done,
+    const std::string& username,
+    const std::vector<mutation>& mutations) {
+    return import_request_schema::serialize(static_cast<uint32_t>(done),
+                                            username,
+                                            mutations);
+}
+
+status import_request::deserialize(const std::vector<uint8_t>& data,
+                                   bool& done,
+                                   std::string& username,
+                                   std::vector<mutation>& mutations) {
+    uint32_t done_h;
+    status s = import_request_schema::deserialize(data,
+                                                  done_h,
+                                                  username,
+                                                  mutations);
+    if (s == status::ok) {
+        done = done_h != 0;
     }
-    return status::ok;
+    return s;
 }
 
-std::shared_ptr<message> delete_response::serialize(const uint32_t stat_code) {
-    uint32_t body_len = sizeof(uint32_t);
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_delete_response);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-    uint32_t stat_code_le = e_htole32(stat_code);
-    memcpy(msg->body_, &stat_code_le, sizeof(uint32_t));
-    return msg;
+std::shared_ptr<message> import_response::serialize(
+    const uint32_t stat_code) {
+    return import_response_schema::serialize(stat_code);
 }
 
-status delete_response::deserialize(const std::vector<uint8_t>& data,
+status import_response::deserialize(const std::vector<uint8_t>& data,
                                     uint32_t& stat_code) {
-    if (data.size() != sizeof(uint32_t)) {
-        return status::body_error;
-    }
-    const uint8_t* msg_body = data.data();
+    return import_response_schema::deserialize(data, stat_code);
+}
 
-    uint32_t stat_code_le;
-    memcpy(&stat_code_le, msg_body, sizeof(uint32_t));
-    stat_code = e_le32toh(stat_code_le);
-    return status::ok;
+std::shared_ptr<message> locate_request::serialize(
+    const std::string& username) {
+    return locate_request_schema::serialize(username);
 }
 
-std::shared_ptr<message> wrong_version_response::serialize(
-    const uint16_t correct_version) {
-    uint32_t body_len = sizeof(uint16_t);
-    size_t total_len = sizeof(message_header) + body_len;
-    std::shared_ptr<message> msg(static_cast<message*>(malloc(total_len)),
-                                 free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_wrong_version_response);
-    msg->hdr_.body_len_ = e_htole32(body_len);
-    uint16_t version_le = e_htole16(correct_version);
-    memcpy(msg->body_, &version_le, sizeof(uint16_t));
-    return msg;
+status locate_request::deserialize(const std::vector<uint8_t>& data,
+                                   std::string& username) {
+    return locate_request_schema::deserialize(data, username);
 }
 
-status wrong_version_response::deserialize(const std::vector<uint8_t>& data,
-                                           uint16_t& correct_version) {
-    if (data.size() != sizeof(uint16_t)) {
-        return status::body_error;
-    }
-    const uint8_t* msg_body = data.data();
+std::shared_ptr<message> locate_response::serialize(const uint32_t stat_code,
+                                                    const uint32_t shard) {
+    return locate_response_schema::serialize(stat_code, shard);
+}
 
-    uint16_t version_le;
-    memcpy(&version_le, msg_body, sizeof(uint16_t));
-    correct_version = e_le16toh(version_le);
-    return status::ok;
+status locate_response::deserialize(const std::vector<uint8_t>& data,
+                                    uint32_t& stat_code,
+                                    uint32_t& shard) {
+    return locate_response_schema::deserialize(data, stat_code, shard);
 }
 
-std::shared_ptr<message> invalid_type_response::serialize() {
-    std::shared_ptr<message> msg(
-        static_cast<message*>(malloc(sizeof(message_header))),
+std::shared_ptr<message> compressed_body::compress(
+    const std::shared_ptr<message>& msg) {
+    const uint32_t raw_len = e_le32toh(msg->hdr_.body_len_);
+    if (raw_len < min_raw_len) {
+        return msg;
+    }
+    lz_block block;
+    if (lz_compress(msg->body_, raw_len, raw_len - raw_len / 8, block) !=
+        status::ok) {
+        return msg;
+    }
+
+    uint32_t body_len = sizeof(uint32_t) + block.data_.size();
+    size_t total_len = sizeof(message_header) + body_len;
+    std::shared_ptr<message> compressed(
+        static_cast<message*>(malloc(total_len)),
         free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_invalid_type_response);
-    msg->hdr_.body_len_ = e_htole32(static_cast<uint32_t>(0));
-    return msg;
+    compressed->hdr_.version_ = msg->hdr_.version_;
+    compressed->hdr_.type_ =
+        e_htole16(e_le16toh(msg->hdr_.type_) | msgflag_compressed);
+    compressed->hdr_.body_len_ = e_htole32(body_len);
+    uint32_t raw_len_le = e_htole32(raw_len);
+    memcpy(compressed->body_, &raw_len_le, sizeof(uint32_t));
+    memcpy(compressed->body_ + 4, block.data_.data(), block.data_.size());
+    return compressed;
 }
 
-status invalid_type_response::deserialize(const std::vector<uint8_t>& data) {
-    if (data.size() != 0) {
+status compressed_body::decompress(const std::vector<uint8_t>& data,
+                                   std::vector<uint8_t>& body) {
+    if (data.size() < sizeof(uint32_t)) {
+        return status::body_error;
+    }
+    uint32_t raw_len_le;
+    memcpy(&raw_len_le, data.data(), sizeof(uint32_t));
+    const uint32_t raw_len = e_le32toh(raw_len_le);
+
+    // Every compressed byte expands to at most 255 bytes, so a larger length
+    // is a lie that we shouldn't allocate for
+    lz_block block;
+    block.data_.assign(data.begin() + 4, data.end());
+    if (raw_len / 255 > block.data_.size()) {
+        return status::body_error;
+    }
+    block.raw_len_ = raw_len;
+    body.resize(raw_len);
+    if (lz_decompress(block, body.data()) != status::ok) {
         return status::body_error;
     }
     return status::ok;
 }
 
-std::shared_ptr<message> invalid_body_response::serialize() {
-    std::shared_ptr<message> msg(
-        static_cast<message*>(malloc(sizeof(message_header))),
+std::shared_ptr<message> identified_request::attach(
+    const std::shared_ptr<message>& msg,
+    const uint64_t request_id) {
+    const uint32_t raw_len = e_le32toh(msg->hdr_.body_len_);
+    uint32_t body_len = sizeof(uint64_t) + raw_len;
+    size_t total_len = sizeof(message_header) + body_len;
+    std::shared_ptr<message> identified(
+        static_cast<message*>(malloc(total_len)),
         free);
-    msg->hdr_.version_ = e_htole16(version);
-    msg->hdr_.type_ = e_htole16(msgtype_invalid_body_response);
-    msg->hdr_.body_len_ = e_htole32(static_cast<uint32_t>(0));
-    return msg;
+    identified->hdr_.version_ = msg->hdr_.version_;
+    identified->hdr_.type_ =
+        e_htole16(e_le16toh(msg->hdr_.type_) | msgflag_request_id);
+    identified->hdr_.body_len_ = e_htole32(body_len);
+    uint64_t request_id_le = e_htole64(request_id);
+    memcpy(identified->body_, &request_id_le, sizeof(uint64_t));
+    memcpy(identified->body_ + sizeof(uint64_t), msg->body_, raw_len);
+    return identified;
 }
 
-status invalid_body_response::deserialize(const std::vector<uint8_t>& data) {
-    if (data.size() != 0) {
+status identified_request::detach(const std::vector<uint8_t>& data,
+                                  uint64_t& request_id,
+                                  std::vector<uint8_t>& body) {
+    if (data.size() < sizeof(uint64_t)) {
         return status::body_error;
     }
+    uint64_t request_id_le;
+    memcpy(&request_id_le, data.data(), sizeof(uint64_t));
+    request_id = e_le64toh(request_id_le);
+    body.assign(data.begin() + sizeof(uint64_t), data.end());
     return status::ok;
 }
 
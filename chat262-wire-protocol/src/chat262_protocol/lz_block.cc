@@ -0,0 +1,238 @@
+#include "lz_block.h"
+
+#include <cstring>
+
+// Shortest back-reference
+static constexpr uint32_t min_match = 4;
+// The last bytes of a block are always literals
+static constexpr uint32_t last_literals = 5;
+// A back-reference must start at least this many bytes before the end
+static constexpr uint32_t match_limit = 12;
+// Largest distance of a back-reference
+static constexpr uint32_t max_offset = 65535;
+// Lengths of at least 15 continue in the following bytes
+static constexpr uint32_t run_mask = 15;
+
+// The hash table holds 2^hash_bits positions
+static constexpr unsigned hash_bits = 12;
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static uint32_t hash(const uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - hash_bits);
+}
+
+// Write the continuation bytes of a length that did not fit into its token
+static void put_length(uint8_t* out, size_t& op, uint32_t len) {
+    while (len >= 255) {
+        out[op++] = 255;
+        len -= 255;
+    }
+    out[op++] = static_cast<uint8_t>(len);
+}
+
+// Write `lit_len` literals from `lit` followed by a back-reference of
+// `match_len` bytes at `offset`, or by nothing if this is the last sequence.
+// Returns false if the sequence doesn't fit into `cap` bytes.
+static bool put_sequence(uint8_t* out,
+                         size_t& op,
+                         const size_t cap,
+                         const uint8_t* lit,
+                         const uint32_t lit_len,
+                         const uint32_t offset,
+                         const uint32_t match_len,
+                         const bool last) {
+    size_t needed = 1 + lit_len / 255 + 1 + lit_len;
+    if (!last) {
+        needed += 2 + match_len / 255 + 1;
+    }
+    if (op + needed > cap) {
+        return false;
+    }
+
+    const size_t token_pos = op++;
+    uint8_t token;
+    if (lit_len >= run_mask) {
+        token = run_mask << 4;
+        put_length(out, op, lit_len - run_mask);
+    } else {
+        token = static_cast<uint8_t>(lit_len << 4);
+    }
+    memcpy(out + op, lit, lit_len);
+    op += lit_len;
+
+    if (!last) {
+        out[op++] = static_cast<uint8_t>(offset & 0xFF);
+        out[op++] = static_cast<uint8_t>(offset >> 8);
+        const uint32_t ml = match_len - min_match;
+        if (ml >= run_mask) {
+            token |= run_mask;
+            put_length(out, op, ml - run_mask);
+        } else {
+            token |= static_cast<uint8_t>(ml);
+        }
+    }
+    out[token_pos] = token;
+    return true;
+}
+
+status lz_compress(const uint8_t* src,
+                   const uint32_t len,
+                   const uint32_t max_compressed_len,
+                   lz_block& block) {
+    block.raw_len_ = len;
+    block.data_.resize(max_compressed_len);
+    uint8_t* out = block.data_.data();
+    size_t op = 0;
+
+    uint32_t anchor = 0;
+    if (len > match_limit) {
+        uint32_t table[1 << hash_bits] = {};
+        const uint32_t limit = len - match_limit;
+        uint32_t ip = 1;
+        while (ip < limit) {
+            const uint32_t seq = read32(src + ip);
+            const uint32_t h = hash(seq);
+            uint32_t cand = table[h];
+            table[h] = ip;
+            if (ip - cand > max_offset || read32(src + cand) != seq) {
+                // Skip ahead faster through bytes that don't compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && cand > 0 && src[ip - 1] == src[cand - 1]) {
+                --ip;
+                --cand;
+            }
+            uint32_t end = ip + min_match;
+            while (end < len - last_literals &&
+                   src[end] == src[cand + (end - ip)]) {
+                ++end;
+            }
+            if (!put_sequence(out,
+                              op,
+                              max_compressed_len,
+                              src + anchor,
+                              ip - anchor,
+                              ip - cand,
+                              end - ip,
+                              false)) {
+                return status::error;
+            }
+            ip = end;
+            anchor = ip;
+            if (ip < limit) {
+                table[hash(read32(src + ip - 2))] = ip - 2;
+            }
+        }
+    }
+    if (!put_sequence(out,
+                      op,
+                      max_compressed_len,
+                      src + anchor,
+                      len - anchor,
+                      0,
+                      0,
+                      true)) {
+        return status::error;
+    }
+
+    block.data_.resize(op);
+    block.data_.shrink_to_fit();
+    return status::ok;
+}
+
+// Read the continuation bytes of a length into `len`. Returns false if the
+// input ends first.
+static bool get_length(const uint8_t*& ip, const uint8_t* end, size_t& len) {
+    uint8_t byte;
+    do {
+        if (ip == end) {
+            return false;
+        }
+        byte = *ip++;
+        len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+status lz_decompress(const lz_block& block, uint8_t* dst) {
+    const uint8_t* ip = block.data_.data();
+    const uint8_t* const ip_end = ip + block.data_.size();
+    uint8_t* op = dst;
+    uint8_t* const op_end = dst + block.raw_len_;
+
+    while (true) {
+        if (ip == ip_end) {
+            return status::error;
+        }
+        const uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == run_mask && !get_length(ip, ip_end, lit_len)) {
+            return status::error;
+        }
+        if (lit_len > static_cast<size_t>(ip_end - ip) ||
+            lit_len > static_cast<size_t>(op_end - op)) {
+            return status::error;
+        }
+        // Short copies of a fixed size are much faster than a `memcpy` of a
+        // variable size. The extra bytes are overwritten later.
+        if (lit_len <= 16 && ip_end - ip >= 16 && op_end - op >= 16) {
+            memcpy(op, ip, 16);
+        } else {
+            memcpy(op, ip, lit_len);
+        }
+        ip += lit_len;
+        op += lit_len;
+
+        // The last sequence has no back-reference
+        if (ip == ip_end) {
+            break;
+        }
+
+        if (ip_end - ip < 2) {
+            return status::error;
+        }
+        const size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+        ip += 2;
+        if (offset == 0 || offset > static_cast<size_t>(op - dst)) {
+            return status::error;
+        }
+        size_t match_len = token & run_mask;
+        if (match_len == run_mask && !get_length(ip, ip_end, match_len)) {
+            return status::error;
+        }
+        match_len += min_match;
+        if (match_len > static_cast<size_t>(op_end - op)) {
+            return status::error;
+        }
+
+        // The match may overlap the bytes it produces
+        const uint8_t* match = op - offset;
+        if (offset >= 8 &&
+            static_cast<size_t>(op_end - op) >= match_len + 8) {
+            uint8_t* const match_end = op + match_len;
+            while (op < match_end) {
+                memcpy(op, match, 8);
+                op += 8;
+                match += 8;
+            }
+            op = match_end;
+        } else if (offset >= match_len) {
+            memcpy(op, match, match_len);
+            op += match_len;
+        } else {
+            for (size_t i = 0; i != match_len; ++i) {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    return op == op_end ? status::ok : status::error;
+}
@@ -0,0 +1,62 @@
+#include "shard_ring.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+
+namespace chat262 {
+
+// Spread the bits of `x` over the whole 64 bits (the finalizer of
+// SplitMix64)
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EB;
+    x ^= x >> 31;
+    return x;
+}
+
+shard_ring::shard_ring(const std::vector<uint32_t>& shards) : shards_(shards) {
+    std::sort(shards_.begin(), shards_.end());
+    shards_.erase(std::unique(shards_.begin(), shards_.end()), shards_.end());
+
+    // The point `i` of the shard on a.b.c.d is at the position of the 64-bit
+    // number a.b.c.d.i, with the address in the high half
+    points_.reserve(shards_.size() * points_per_shard);
+    for (const uint32_t shard : shards_) {
+        const uint64_t high = static_cast<uint64_t>(ntohl(shard)) << 32;
+        for (uint32_t i = 0; i != points_per_shard; ++i) {
+            points_.push_back({mix(high | i), shard});
+        }
+    }
+    std::sort(points_.begin(), points_.end());
+}
+
+uint32_t shard_ring::shard_of(const std::string& username) const {
+    if (points_.empty()) {
+        return 0;
+    }
+    auto it = std::lower_bound(points_.begin(),
+                               points_.end(),
+                               std::make_pair(position(username), uint32_t(0)));
+    if (it == points_.end()) {
+        it = points_.begin();
+    }
+    return (*it).second;
+}
+
+const std::vector<uint32_t>& shard_ring::shards() const {
+    return shards_;
+}
+
+uint64_t shard_ring::position(const std::string& username) {
+    // 64-bit FNV-1a, mixed
+    uint64_t h = 0xCBF29CE484222325;
+    for (const char c : username) {
+        h ^= static_cast<uint8_t>(c);
+        h *= 0x100000001B3;
+    }
+    return mix(h);
+}
+
+}  // namespace chat262
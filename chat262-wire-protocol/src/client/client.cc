@@ -23,6 +23,9 @@ status client::connect_server(const uint32_t n_ip_addr) {
     }
 
     n_ip_addr_ = n_ip_addr;
+    version_ = chat262::version;
+    features_ = 0;
+    token_ = 0;
     server_fd_ = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd_ < 0) {
         std::cerr << "Could not create a socket: " << strerror(errno) << "\n";
@@ -47,6 +50,63 @@ status client::connect_server(const uint32_t n_ip_addr) {
     return status::ok;
 }
 
+status client::hello(const uint16_t max_version,
+                     const uint32_t wanted,
+                     uint16_t& chosen,
+                     uint32_t& enabled) {
+    auto msg = chat262::hello_request::serialize(max_version, wanted);
+    status s = send_msg(msg);
+    if (s != status::ok) {
+        return s;
+    }
+
+    chat262::message_header msg_hdr;
+    s = recv_hdr(msg_hdr);
+    if (s != status::ok) {
+        return s;
+    }
+    std::vector<uint8_t> body;
+    // Servers from before hello requests don't know the type
+    if (msg_hdr.version_ == chat262::version &&
+        msg_hdr.type_ == chat262::msgtype_invalid_type_response) {
+        s = recv_body(msg_hdr, body);
+        if (s != status::ok) {
+            return s;
+        }
+        s = chat262::invalid_type_response::deserialize(body);
+        if (s != status::ok) {
+            return s;
+        }
+        chosen = chat262::version;
+        enabled = 0;
+        version_ = chosen;
+        features_ = enabled;
+        return status::ok;
+    }
+    s = validate_hdr(msg_hdr, chat262::msgtype_hello_response);
+    if (s != status::ok) {
+        return s;
+    }
+
+    s = recv_body(msg_hdr, body);
+    if (s != status::ok) {
+        return s;
+    }
+
+    s = chat262::hello_response::deserialize(body, chosen, enabled);
+    if (s != status::ok) {
+        return s;
+    }
+    // Never use a version or a feature we didn't offer
+    if (chosen < chat262::version || chosen > max_version ||
+        chosen > chat262::latest_version || (enabled & ~wanted) != 0) {
+        return status::body_error;
+    }
+    version_ = chosen;
+    features_ = enabled;
+    return status::ok;
+}
+
 status client::login(const std::string& username,
                      const std::string& password,
                      uint32_t& stat_code) {
@@ -67,7 +127,7 @@ status client::login(const std::string& username,
     }
 
     std::vector<uint8_t> body;
-    s = recv_body(msg_hdr.body_len_, body);
+    s = recv_body(msg_hdr, body);
     if (s != status::ok) {
         return s;
     }
@@ -99,12 +159,18 @@ status client::registration(const std::string& username,
     }
 
     std::vector<uint8_t> body;
-    s = recv_body(msg_hdr.body_len_, body);
+    s = recv_body(msg_hdr, body);
     if (s != status::ok) {
         return s;
     }
 
-    s = chat262::registration_response::deserialize(body, stat_code);
+    if ((features_ & chat262::feature_read_tokens) != 0) {
+        s = chat262::registration_response::deserialize(body,
+                                                        stat_code,
+                                                        token_);
+    } else {
+        s = chat262::registration_response::deserialize(body, stat_code);
+    }
     if (s != status::ok) {
         return s;
     }
@@ -129,7 +195,7 @@ status client::logout(uint32_t& stat_code) {
     }
 
     std::vector<uint8_t> body;
-    s = recv_body(msg_hdr.body_len_, body);
+    s = recv_body(msg_hdr, body);
     if (s != status::ok) {
         return s;
     }
@@ -161,7 +227,7 @@ status client::list_accounts(const std::string& pattern,
     }
 
     std::vector<uint8_t> body;
-    s = recv_body(msg_hdr.body_len_, body);
+    s = recv_body(msg_hdr, body);
     if (s != status::ok) {
         return s;
     }
@@ -176,7 +242,24 @@ status client::list_accounts(const std::string& pattern,
 status client::send_txt(const std::string& recipient,
                         const std::string& txt,
                         uint32_t& stat_code) {
-    auto msg = chat262::send_txt_request::serialize(recipient, txt);
+    return exchange_send_txt(
+        chat262::send_txt_request::serialize(recipient, txt),
+        stat_code);
+}
+
+status client::send_txt(const std::string& recipient,
+                        const std::string& txt,
+                        const uint64_t request_id,
+                        uint32_t& stat_code) {
+    return exchange_send_txt(
+        chat262::identified_request::attach(
+            chat262::send_txt_request::serialize(recipient, txt),
+            request_id),
+        stat_code);
+}
+
+status client::exchange_send_txt(const std::shared_ptr<chat262::message>& msg,
+                                 uint32_t& stat_code) {
     status s = send_msg(msg);
     if (s != status::ok) {
         return s;
@@ -193,12 +276,16 @@ status client::send_txt(const std::string& recipient,
     }
 
     std::vector<uint8_t> body;
-    s = recv_body(msg_hdr.body_len_, body);
+    s = recv_body(msg_hdr, body);
     if (s != status::ok) {
         return s;
     }
 
-    s = chat262::send_txt_response::deserialize(body, stat_code);
+    if ((features_ & chat262::feature_read_tokens) != 0) {
+        s = chat262::send_txt_response::deserialize(body, stat_code, token_);
+    } else {
+        s = chat262::send_txt_response::deserialize(body, stat_code);
+    }
     if (s != status::ok) {
         return s;
     }
@@ -225,7 +312,7 @@ status client::recv_txt(const std::string& sender,
     }
 
     std::vector<uint8_t> body;
-    s = recv_body(msg_hdr.body_len_, body);
+    s = recv_body(msg_hdr, body);
     if (s != status::ok) {
         return s;
     }
@@ -256,7 +343,7 @@ status client::recv_correspondents(uint32_t& stat_code,
     }
 
     std::vector<uint8_t> body;
-    s = recv_body(msg_hdr.body_len_, body);
+    s = recv_body(msg_hdr, body);
     if (s != status::ok) {
         return s;
     }
@@ -288,12 +375,16 @@ status client::delete_account(uint32_t& stat_code) {
     }
 
     std::vector<uint8_t> body;
-    s = recv_body(msg_hdr.body_len_, body);
+    s = recv_body(msg_hdr, body);
     if (s != status::ok) {
         return s;
     }
 
-    s = chat262::delete_response::deserialize(body, stat_code);
+    if ((features_ & chat262::feature_read_tokens) != 0) {
+        s = chat262::delete_response::deserialize(body, stat_code, token_);
+    } else {
+        s = chat262::delete_response::deserialize(body, stat_code);
+    }
     if (s != status::ok) {
         return s;
     }
@@ -301,12 +392,17 @@ status client::delete_account(uint32_t& stat_code) {
 }
 
 status client::send_msg(std::shared_ptr<chat262::message> msg) const {
+    msg->hdr_.version_ = e_htole16(version_);
     size_t total_sent = 0;
     ssize_t sent = 0;
     size_t total_len =
         sizeof(chat262::message_header) + e_le32toh(msg->hdr_.body_len_);
+    const uint8_t* msg_data = reinterpret_cast<const uint8_t*>(msg.get());
     while (total_sent != total_len) {
-        sent = send(server_fd_, msg.get(), total_len, 0);
+        sent = send(server_fd_,
+                    msg_data + total_sent,
+                    total_len - total_sent,
+                    0);
         if (sent < 0) {
             return status::send_error;
         }
@@ -322,8 +418,8 @@ status client::recv_hdr(chat262::message_header& hdr) const {
     ssize_t readed = 0;
     while (total_read != sizeof(chat262::message_header)) {
         readed = recv(server_fd_,
-                      hdr_data.data(),
-                      sizeof(chat262::message_header),
+                      hdr_data.data() + total_read,
+                      sizeof(chat262::message_header) - total_read,
                       0);
         if (readed < 0) {
             return status::receive_error;
@@ -337,12 +433,17 @@ status client::recv_hdr(chat262::message_header& hdr) const {
     return status::ok;
 }
 
-status client::recv_body(uint32_t body_len, std::vector<uint8_t>& data) const {
+status client::recv_body(const chat262::message_header& hdr,
+                         std::vector<uint8_t>& data) const {
+    const uint32_t body_len = hdr.body_len_;
     data.resize(body_len);
     size_t total_read = 0;
     ssize_t readed = 0;
     while (total_read != body_len) {
-        readed = recv(server_fd_, data.data(), body_len, 0);
+        readed = recv(server_fd_,
+                      data.data() + total_read,
+                      body_len - total_read,
+                      0);
         if (readed < 0) {
             return status::receive_error;
         } else if (readed == 0) {
@@ -350,13 +451,137 @@ status client::recv_body(uint32_t body_len, std::vector<uint8_t>& data) const {
         }
         total_read += readed;
     }
+    if ((hdr.type_ & chat262::msgflag_compressed) != 0) {
+        std::vector<uint8_t> compressed;
+        compressed.swap(data);
+        return chat262::compressed_body::decompress(compressed, data);
+    }
     return status::ok;
 }
 
 status client::validate_hdr(const chat262::message_header& hdr,
                             const chat262::message_type& expected) const {
-    if (hdr.version_ != chat262::version || hdr.type_ != expected) {
+    if (hdr.version_ != version_) {
+        return status::header_error;
+    }
+    if ((hdr.type_ & chat262::msgflag_compressed) != 0 &&
+        (features_ & chat262::feature_compression) == 0) {
+        return status::header_error;
+    }
+    if ((hdr.type_ & ~chat262::msgflag_compressed) != expected) {
         return status::header_error;
     }
     return status::ok;
 }
+
+uint64_t client::last_token() const {
+    return token_;
+}
+
+status client::sync(const uint64_t token,
+                    const uint32_t max_wait_ms,
+                    uint32_t& stat_code,
+                    uint64_t& applied,
+                    uint32_t& staleness_ms) {
+    auto msg = chat262::sync_request::serialize(token, max_wait_ms);
+    status s = send_msg(msg);
+    if (s != status::ok) {
+        return s;
+    }
+
+    chat262::message_header msg_hdr;
+    s = recv_hdr(msg_hdr);
+    if (s != status::ok) {
+        return s;
+    }
+    s = validate_hdr(msg_hdr, chat262::msgtype_sync_response);
+    if (s != status::ok) {
+        return s;
+    }
+
+    std::vector<uint8_t> body;
+    s = recv_body(msg_hdr, body);
+    if (s != status::ok) {
+        return s;
+    }
+
+    s = chat262::sync_response::deserialize(body,
+                                            stat_code,
+                                            applied,
+                                            staleness_ms);
+    if (s != status::ok) {
+        return s;
+    }
+    return status::ok;
+}
+
+status client::migrate(const std::string& username,
+                       const uint32_t n_ip_addr,
+                       uint32_t& stat_code,
+                       uint64_t& bytes,
+                       uint64_t& copy_us,
+                       uint64_t& pause_us) {
+    auto msg = chat262::migrate_request::serialize(n_ip_addr, username);
+    status s = send_msg(msg);
+    if (s != status::ok) {
+        return s;
+    }
+
+    chat262::message_header msg_hdr;
+    s = recv_hdr(msg_hdr);
+    if (s != status::ok) {
+        return s;
+    }
+    s = validate_hdr(msg_hdr, chat262::msgtype_migrate_response);
+    if (s != status::ok) {
+        return s;
+    }
+
+    std::vector<uint8_t> body;
+    s = recv_body(msg_hdr, body);
+    if (s != status::ok) {
+        return s;
+    }
+
+    s = chat262::migrate_response::deserialize(body,
+                                               stat_code,
+                                               bytes,
+                                               copy_us,
+                                               pause_us);
+    if (s != status::ok) {
+        return s;
+    }
+    return status::ok;
+}
+
+status client::locate(const std::string& username,
+                      uint32_t& stat_code,
+                      uint32_t& n_ip_addr) {
+    auto msg = chat262::locate_request::serialize(username);
+    status s = send_msg(msg);
+    if (s != status::ok) {
+        return s;
+    }
+
+    chat262::message_header msg_hdr;
+    s = recv_hdr(msg_hdr);
+    if (s != status::ok) {
+        return s;
+    }
+    s = validate_hdr(msg_hdr, chat262::msgtype_locate_response);
+    if (s != status::ok) {
+        return s;
+    }
+
+    std::vector<uint8_t> body;
+    s = recv_body(msg_hdr, body);
+    if (s != status::ok) {
+        return s;
+    }
+
+    s = chat262::locate_response::deserialize(body, stat_code, n_ip_addr);
+    if (s != status::ok) {
+        return s;
+    }
+    return status::ok;
+}
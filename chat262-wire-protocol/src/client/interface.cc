@@ -55,6 +55,16 @@ status interface::start(const uint32_t n_ip_addr) {
     if (s != status::ok) {
         return s;
     }
+    // Large chats and account lists are sent compressed, if the server can
+    uint16_t version;
+    uint32_t features;
+    s = client_.hello(chat262::latest_version,
+                      chat262::feature_compression,
+                      version,
+                      features);
+    if (s != status::ok) {
+        return s;
+    }
 
     // Begin with the initial screen
     next_ = screen_type::login_registration;
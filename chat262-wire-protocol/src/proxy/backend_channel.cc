@@ -0,0 +1,136 @@
+#include "backend_channel.h"
+
+#include "logger.h"
+#include "peer_io.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+backend_channel::backend_channel(const uint32_t n_proxy_addr,
+                                 const uint32_t n_ip_addr,
+                                 const std::string& str_ip_addr)
+    : n_proxy_addr_(n_proxy_addr),
+      n_ip_addr_(n_ip_addr),
+      str_ip_addr_(str_ip_addr),
+      fd_(-1),
+      reading_(false),
+      broken_(false) {
+}
+
+backend_channel::~backend_channel() {
+    if (fd_ != -1) {
+        close(fd_);
+    }
+}
+
+status backend_channel::call(const std::shared_ptr<chat262::message>& msg,
+                             chat262::message_header& hdr,
+                             std::vector<uint8_t>& body,
+                             std::chrono::steady_clock::time_point& received) {
+    pending p;
+    p.done_ = false;
+    p.result_ = status::error;
+    {
+        const std::lock_guard<std::mutex> send_lock(send_mutex_);
+        if (open() != status::ok) {
+            return status::error;
+        }
+        {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(&p);
+        }
+        if (send_all(fd_, msg) != status::ok) {
+            // Whoever reads next fails every queued request, this one
+            // included
+            shutdown(fd_, SHUT_RDWR);
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!p.done_) {
+        if (!reading_) {
+            read_response(lock);
+        } else {
+            p.cv_.wait(lock);
+        }
+    }
+    // Pass the reading on to the oldest waiting request
+    if (!reading_ && !queue_.empty()) {
+        queue_.front()->cv_.notify_one();
+    }
+    if (p.result_ != status::ok) {
+        return p.result_;
+    }
+    hdr = p.hdr_;
+    body = std::move(p.body_);
+    received = p.received_;
+    return status::ok;
+}
+
+const std::string& backend_channel::address() const {
+    return str_ip_addr_;
+}
+
+status backend_channel::open() {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (fd_ != -1 && !broken_) {
+            return status::ok;
+        }
+    }
+
+    // Nobody reads a broken connection, since all its requests failed. The
+    // server takes relayed requests only from the address of the proxy.
+    int fd;
+    if (connect_peer(n_ip_addr_, n_proxy_addr_, fd) != status::ok) {
+        logger::log_err("Could not reach the backend %s\n",
+                        str_ip_addr_.c_str());
+        return status::error;
+    }
+    const std::lock_guard<std::mutex> lock(mutex_);
+    if (fd_ != -1) {
+        close(fd_);
+    }
+    fd_ = fd;
+    broken_ = false;
+    return status::ok;
+}
+
+void backend_channel::read_response(std::unique_lock<std::mutex>& lock) {
+    reading_ = true;
+    const int fd = fd_;
+    lock.unlock();
+    chat262::message_header hdr;
+    std::vector<uint8_t> body;
+    const status s = recv_message(fd, hdr, body);
+    const std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    lock.lock();
+    reading_ = false;
+
+    if (s != status::ok || queue_.empty()) {
+        // A response that nobody waits for means that the connection is out
+        // of step, so it is dropped all the same
+        logger::log_err("Lost the connection to the backend %s\n",
+                        str_ip_addr_.c_str());
+        shutdown(fd, SHUT_RDWR);
+        broken_ = true;
+        for (pending* p : queue_) {
+            p->done_ = true;
+            p->cv_.notify_one();
+        }
+        queue_.clear();
+        return;
+    }
+
+    // The waiting session may return as soon as it is notified, so `p` is
+    // only touched while the lock is held
+    pending* p = queue_.front();
+    queue_.pop_front();
+    p->hdr_ = hdr;
+    p->body_ = std::move(body);
+    p->received_ = now;
+    p->result_ = status::ok;
+    p->done_ = true;
+    p->cv_.notify_one();
+}
@@ -0,0 +1,11 @@
+#include "common.h"
+#include "proxy.h"
+
+int main(int argc, char** argv) {
+    proxy p;
+    if (p.run(argc, argv) == status::ok) {
+        return EXIT_SUCCESS;
+    } else {
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,558 @@
+#include "proxy.h"
+
+#include "endianness.h"
+#include "logger.h"
+#include "peer_io.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <iostream>
+#include <signal.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+// The SIGUSR1 handler only writes a byte into this pipe, which is
+// async-signal-safe. The stats thread reads from the other end and does the
+// actual dumping.
+static int stats_pipe[2] = {-1, -1};
+
+// Features that the proxy enables when a client asks for them. The server
+// compresses the responses, and the proxy relays the requests of a client one
+// at a time, in order. Read tokens are left out, since a client would have to
+// sync on a server that the proxy hides.
+static constexpr uint32_t supported_features = chat262::feature_compression |
+                                               chat262::feature_pipelining;
+
+static void handle_sigusr1(int) {
+    const uint8_t byte = 0;
+    ssize_t written = write(stats_pipe[1], &byte, sizeof(byte));
+    (void) written;
+}
+
+// Nanoseconds from `start` to `end`
+static uint64_t elapsed_ns(const steady_clock::time_point& start,
+                           const steady_clock::time_point& end) {
+    return static_cast<uint64_t>(
+        duration_cast<nanoseconds>(end - start).count());
+}
+
+// Send `msg`, which the proxy answers itself, to `fd` with `version`
+static status send_local(const int fd,
+                         const std::shared_ptr<chat262::message>& msg,
+                         const uint16_t version) {
+    msg->hdr_.version_ = e_htole16(version);
+    return send_all(fd, msg);
+}
+
+// Send all of `data` to `fd`
+static status send_bytes(const int fd, const std::string& data) {
+    size_t total_sent = 0;
+    while (total_sent != data.size()) {
+        const ssize_t sent = send(fd,
+                                  data.data() + total_sent,
+                                  data.size() - total_sent,
+                                  0);
+        if (sent < 0) {
+            return status::send_error;
+        }
+        total_sent += sent;
+    }
+    return status::ok;
+}
+
+proxy::proxy()
+    : proxy_fd_(-1), n_ip_addr_(0), stats_{0, 0, 0, 0, 0, 0, 0, 0} {
+}
+
+proxy::~proxy() {
+    if (proxy_fd_ != -1) {
+        close(proxy_fd_);
+    }
+}
+
+status proxy::run(int argc, char const* const* argv) {
+    cmdline_args args;
+    try {
+        args = parse_args(argc, argv);
+    } catch (std::exception& e) {
+        std::cerr << e.what() << "\n";
+        usage(argv[0]);
+        return status::error;
+    }
+
+    if (args.help_) {
+        usage(argv[0]);
+        return status::ok;
+    }
+
+    n_ip_addr_ = args.n_ip_addr_;
+    str_ip_addr_ = args.str_ip_addr_;
+    for (const auto& backend : args.backends_) {
+        backend_addrs_.push_back(backend.first);
+        channels_.emplace_back();
+        for (size_t i = 0; i != args.channels_; ++i) {
+            channels_.back().push_back(std::make_unique<backend_channel>(
+                n_ip_addr_, backend.first, backend.second));
+        }
+    }
+    ring_ = std::make_unique<chat262::shard_ring>(backend_addrs_);
+
+    status s = start_listening();
+    if (s != status::ok) {
+        return s;
+    }
+
+    s = start_stats_reporter();
+    if (s != status::ok) {
+        return s;
+    }
+
+    start_accepting();
+
+    return status::ok;
+}
+
+proxy::stats proxy::get_stats() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+proxy::cmdline_args proxy::parse_args(const int argc,
+                                      char const* const* argv) const {
+    cmdline_args args;
+    args.help_ = false;
+    args.channels_ = 4;
+
+    // `getopt` keeps its state in globals, so start from scratch in case
+    // arguments were parsed before
+    optind = 1;
+    int opt;
+    while ((opt = getopt(argc, const_cast<char* const*>(argv), "hB:n:")) !=
+           -1) {
+        switch (opt) {
+        case 'h':
+            args.help_ = true;
+            return args;
+        case 'B': {
+            uint32_t n_backend_addr;
+            if (inet_pton(AF_INET, optarg, &n_backend_addr) != 1) {
+                throw std::invalid_argument("Invalid server IP address");
+            }
+            for (const auto& backend : args.backends_) {
+                if (backend.first == n_backend_addr) {
+                    throw std::invalid_argument("Duplicate server IP address");
+                }
+            }
+            args.backends_.push_back({n_backend_addr, optarg});
+            break;
+        }
+        case 'n':
+            args.channels_ = std::stoul(optarg);
+            break;
+        default:
+            throw std::invalid_argument("Invalid option");
+        }
+    }
+
+    if (optind != argc - 1) {
+        throw std::invalid_argument("Wrong number of arguments");
+    }
+    if (args.backends_.empty()) {
+        throw std::invalid_argument("At least one server (-B) is required");
+    }
+    if (args.channels_ == 0) {
+        throw std::invalid_argument("At least one connection per server is "
+                                    "required");
+    }
+    // Parse the IP address
+    if (inet_pton(AF_INET, argv[optind], &(args.n_ip_addr_)) != 1) {
+        throw std::invalid_argument("Invalid IP address");
+    }
+    args.str_ip_addr_ = argv[optind];
+    return args;
+}
+
+void proxy::usage(char const* prog) const {
+    std::cerr << "usage: " << prog
+              << " [-h] [-n connections] -B ip address [-B ip address ...]\n"
+                 "       <ip address>\n"
+                 "\n"
+                 "Start the Chat262 proxy on IP address <ip address>.\n"
+                 "The address should be in the xxx.xxx.xxx.xxx format.\n"
+                 "\n"
+                 "Options:\n"
+                 "\t-h\t\t Display this message and exit.\n"
+                 "\t-B ip address\t Relay requests to the server on\n"
+                 "\t\t\t <ip address>. Given once for every server.\n"
+                 "\t\t\t Users are spread over the servers by their\n"
+                 "\t\t\t usernames, like over the shards of a cluster.\n"
+                 "\t\t\t The server must run with -P and the address\n"
+                 "\t\t\t of the proxy.\n"
+                 "\t-n connections\t Connections to every server, shared by\n"
+                 "\t\t\t all clients (default 4).\n";
+}
+
+status proxy::start_listening() {
+    // Ignore SIGPIPE when writing to a closed socket
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &act, nullptr) < 0) {
+        std::cerr << "Could not ignore SIGPIPE: " << strerror(errno) << "\n";
+        return status::error;
+    }
+
+    proxy_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (proxy_fd_ < 0) {
+        logger::log_err("Could not create socket: %s\n", strerror(errno));
+        return status::error;
+    }
+
+    // Allow reuse of this address immediately. Otherwise, we might have to
+    // wait.
+    static constexpr int enable_addr_reuse = 1;
+    if (setsockopt(proxy_fd_,
+                   SOL_SOCKET,
+                   SO_REUSEADDR,
+                   &enable_addr_reuse,
+                   sizeof(enable_addr_reuse)) < 0) {
+        logger::log_err("Could not enable address reuse: %s\n",
+                        strerror(errno));
+        return status::error;
+    }
+
+    sockaddr_in proxy_addr;
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
+    proxy_addr.sin_family = AF_INET;
+    proxy_addr.sin_port = htons(chat262::port);
+    proxy_addr.sin_addr.s_addr = n_ip_addr_;
+    if (bind(proxy_fd_, (const sockaddr*) &proxy_addr, sizeof(proxy_addr)) <
+        0) {
+        logger::log_err("Could not bind the socket: %s\n", strerror(errno));
+        return status::error;
+    }
+
+    if (listen(proxy_fd_, 32) < 0) {
+        logger::log_err("Could not listen on the socket: %s\n",
+                        strerror(errno));
+        return status::error;
+    }
+    logger::log_out("Listening on %s:%" PRIu16 "\n",
+                    str_ip_addr_.c_str(),
+                    chat262::port);
+    return status::ok;
+}
+
+status proxy::start_stats_reporter() {
+    if (pipe(stats_pipe) < 0) {
+        logger::log_err("Could not create the stats pipe: %s\n",
+                        strerror(errno));
+        return status::error;
+    }
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = handle_sigusr1;
+    act.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &act, nullptr) < 0) {
+        logger::log_err("Could not handle SIGUSR1: %s\n", strerror(errno));
+        return status::error;
+    }
+
+    std::thread t([this]() {
+        uint8_t byte;
+        while (read(stats_pipe[0], &byte, sizeof(byte)) > 0) {
+            dump_stats(stdout);
+            fflush(stdout);
+        }
+    });
+    t.detach();
+    return status::ok;
+}
+
+void proxy::dump_stats(FILE* out) {
+    logger::log_out("Statistics for the proxy on %s:%" PRIu16 "\n",
+                    str_ip_addr_.c_str(),
+                    chat262::port);
+    const stats ps = get_stats();
+    fprintf(out, "Proxy:\n");
+    fprintf(out, "  %-24s %zu, %zu connections each\n", "servers",
+            channels_.size(), channels_.front().size());
+    fprintf(out, "  %-24s %" PRIu64 "\n", "sessions", ps.sessions_);
+    fprintf(out,
+            "  %-24s %" PRIu64 ", %" PRIu64 " failed, %" PRIu64
+            " relocated\n",
+            "relayed requests",
+            ps.relayed_,
+            ps.failures_,
+            ps.relocations_);
+    fprintf(out,
+            "  %-24s avg %.1f us, max %.1f us\n",
+            "time in proxy",
+            ps.relayed_ == 0 ? 0.0 : ps.total_proxy_ns_ / 1e3 / ps.relayed_,
+            ps.max_proxy_ns_ / 1e3);
+    fprintf(out,
+            "  %-24s avg %.1f us, max %.1f us\n",
+            "server round trip",
+            ps.relayed_ == 0 ? 0.0 : ps.total_backend_ns_ / 1e3 / ps.relayed_,
+            ps.max_backend_ns_ / 1e3);
+}
+
+void proxy::start_accepting() {
+    sockaddr_in client_addr;
+    memset(&client_addr, 0, sizeof(client_addr));
+    socklen_t client_addr_len = sizeof(client_addr);
+
+    for (uint64_t session = 0;; ++session) {
+        int client_fd =
+            accept(proxy_fd_, (sockaddr*) &client_addr, &client_addr_len);
+        std::thread t(&proxy::handle_client,
+                      this,
+                      client_fd,
+                      client_addr,
+                      session);
+        t.detach();
+    }
+}
+
+void proxy::handle_client(int client_fd,
+                          sockaddr_in client_addr,
+                          const uint64_t session) {
+    // Make sure the connection was properly accepted
+    if (client_fd < 0) {
+        logger::log_err("Could not accept: %s\n", strerror(errno));
+        return;
+    }
+    char client_ip[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET,
+                   &client_addr.sin_addr,
+                   client_ip,
+                   sizeof(client_ip))) {
+        logger::log_err("%s", "Could not read client's IP\n");
+        close(client_fd);
+        return;
+    }
+    logger::log_out("Accepted connection from %s\n", client_ip);
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.sessions_;
+    }
+
+    // The state of the session, which the servers don't keep
+    uint16_t version = chat262::version;
+    uint32_t features = 0;
+    std::string username;
+
+    while (true) {
+        std::vector<uint8_t> hdr_data;
+        chat262::message_header hdr;
+        if (recv_all(client_fd, sizeof(hdr), hdr_data) != status::ok ||
+            chat262::message_header::deserialize(hdr_data, hdr) !=
+                status::ok) {
+            break;
+        }
+        // Like the server, a hello may always use the initial version
+        if (hdr.version_ != version &&
+            !(hdr.version_ == chat262::version &&
+              hdr.type_ == chat262::msgtype_hello_request)) {
+            logger::log_err("Unsupported protocol version %" PRIu16 "\n",
+                            hdr.version_);
+            send_local(client_fd,
+                       chat262::wrong_version_response::serialize(version),
+                       version);
+            break;
+        }
+        std::vector<uint8_t> body;
+        if (recv_all(client_fd, hdr.body_len_, body) != status::ok) {
+            break;
+        }
+        const steady_clock::time_point start = steady_clock::now();
+
+        if (hdr.type_ == chat262::msgtype_hello_request) {
+            uint16_t max_version;
+            uint32_t requested;
+            if (chat262::hello_request::deserialize(body,
+                                                    max_version,
+                                                    requested) !=
+                status::ok) {
+                if (send_local(client_fd,
+                               chat262::invalid_body_response::serialize(),
+                               version) != status::ok) {
+                    break;
+                }
+                continue;
+            }
+            // Speak the latest version both sides know, as the server does
+            const uint16_t chosen_version =
+                std::max(std::min(max_version, chat262::latest_version),
+                         chat262::version);
+            const uint32_t enabled = chosen_version == chat262::version
+                                         ? 0
+                                         : requested & supported_features;
+            if (send_local(client_fd,
+                           chat262::hello_response::serialize(chosen_version,
+                                                              enabled),
+                           version) != status::ok) {
+                break;
+            }
+            version = chosen_version;
+            features = enabled;
+            continue;
+        }
+
+        // Registrations go to the server of the new user, and don't change
+        // the logged in user. Logins go to the server of the user logging in,
+        // and all other requests to the server of the logged in user.
+        std::string relayed_user = username;
+        bool keeps_user = false;
+        std::string named_user;
+        std::string password;
+        size_t backend = username.empty() ? 0 : backend_of(username);
+        if (hdr.type_ == chat262::msgtype_registration_request) {
+            relayed_user.clear();
+            keeps_user = true;
+            if (chat262::registration_request::deserialize(body,
+                                                           named_user,
+                                                           password) ==
+                status::ok) {
+                backend = backend_of(named_user);
+            }
+        } else if (hdr.type_ == chat262::msgtype_login_request &&
+                   chat262::login_request::deserialize(body,
+                                                       named_user,
+                                                       password) ==
+                       status::ok) {
+            backend = backend_of(named_user);
+        }
+        const std::string routed = named_user.empty() ? username : named_user;
+
+        std::string request(hdr_data.begin(), hdr_data.end());
+        request.append(body.begin(), body.end());
+        const std::shared_ptr<chat262::message> msg =
+            chat262::proxy_request::serialize(features, relayed_user, request);
+        const steady_clock::time_point sent = steady_clock::now();
+
+        chat262::message_header response_hdr;
+        std::vector<uint8_t> response_body;
+        steady_clock::time_point received;
+        std::string response;
+        bool failed = false;
+        for (int relocations = 0;; ++relocations) {
+            std::vector<std::unique_ptr<backend_channel>>& backend_channels =
+                channels_[backend];
+            backend_channel& channel =
+                *backend_channels[session % backend_channels.size()];
+            if (channel.call(msg, response_hdr, response_body, received) !=
+                    status::ok ||
+                response_hdr.type_ != chat262::msgtype_proxy_response ||
+                chat262::proxy_response::deserialize(response_body,
+                                                     relayed_user,
+                                                     response) !=
+                    status::ok) {
+                record_failure(channel);
+                failed = true;
+                break;
+            }
+            if (!response.empty()) {
+                break;
+            }
+            // The user moved to another server
+            if (relocations == max_relocations ||
+                relocate(channel, routed, backend) != status::ok) {
+                record_failure(channel);
+                failed = true;
+                break;
+            }
+        }
+        if (failed) {
+            // The client can't be answered, which it learns from the closed
+            // connection
+            break;
+        }
+        if (!keeps_user) {
+            username = std::move(relayed_user);
+        }
+        if (send_bytes(client_fd, response) != status::ok) {
+            break;
+        }
+        const steady_clock::time_point end = steady_clock::now();
+        record_request(elapsed_ns(start, sent) + elapsed_ns(received, end),
+                       elapsed_ns(sent, received));
+    }
+    shutdown(client_fd, SHUT_RDWR);
+    close(client_fd);
+    logger::log_out("Terminated connection from %s\n", client_ip);
+}
+
+size_t proxy::backend_of(const std::string& username) const {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        auto it = moved_.find(username);
+        if (it != moved_.end()) {
+            return (*it).second;
+        }
+    }
+    const uint32_t n_ip_addr = ring_->shard_of(username);
+    return std::find(backend_addrs_.begin(), backend_addrs_.end(), n_ip_addr) -
+           backend_addrs_.begin();
+}
+
+status proxy::relocate(backend_channel& channel,
+                       const std::string& username,
+                       size_t& backend) {
+    chat262::message_header hdr;
+    std::vector<uint8_t> body;
+    steady_clock::time_point received;
+    uint32_t stat_code;
+    uint32_t n_ip_addr;
+    if (channel.call(chat262::locate_request::serialize(username),
+                     hdr,
+                     body,
+                     received) != status::ok ||
+        hdr.type_ != chat262::msgtype_locate_response ||
+        chat262::locate_response::deserialize(body, stat_code, n_ip_addr) !=
+            status::ok ||
+        stat_code != chat262::status_code_ok) {
+        return status::error;
+    }
+    const size_t index =
+        std::find(backend_addrs_.begin(), backend_addrs_.end(), n_ip_addr) -
+        backend_addrs_.begin();
+    if (index == backend_addrs_.size()) {
+        return status::error;
+    }
+    logger::log_out("User \"%s\" moved to %s\n",
+                    username.c_str(),
+                    channels_[index].front()->address().c_str());
+    backend = index;
+    const std::lock_guard<std::mutex> lock(mutex_);
+    moved_[username] = index;
+    ++stats_.relocations_;
+    return status::ok;
+}
+
+void proxy::record_request(const uint64_t proxy_ns,
+                           const uint64_t backend_ns) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.relayed_;
+    stats_.total_proxy_ns_ += proxy_ns;
+    stats_.max_proxy_ns_ = std::max(stats_.max_proxy_ns_, proxy_ns);
+    stats_.total_backend_ns_ += backend_ns;
+    stats_.max_backend_ns_ = std::max(stats_.max_backend_ns_, backend_ns);
+}
+
+void proxy::record_failure(const backend_channel& channel) {
+    logger::log_err("Could not relay a request to %s\n",
+                    channel.address().c_str());
+    const std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.failures_;
+}
@@ -0,0 +1,78 @@
+#include "block_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+block_cache::block_cache() : stats_{0, 0, 0, 0, 0, 0, 0, 0} {
+}
+
+void block_cache::set_capacity(const size_t bytes) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    stats_.capacity_ = bytes;
+    shrink();
+}
+
+status block_cache::get(const std::shared_ptr<const lz_block>& block,
+                        std::shared_ptr<const uint8_t>& data) {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(block.get());
+        if (it != index_.end()) {
+            lru_.splice(lru_.begin(), lru_, (*it).second);
+            data = (*(*it).second).data_;
+            ++stats_.hits_;
+            return status::ok;
+        }
+    }
+
+    // Two threads may decompress the same block at the same time, and the
+    // second one finds it cached below
+    const steady_clock::time_point start = steady_clock::now();
+    std::shared_ptr<uint8_t> raw(
+        static_cast<uint8_t*>(malloc(std::max<size_t>(block->raw_len_, 1))),
+        free);
+    const status s = lz_decompress(*block, raw.get());
+    const uint64_t ns = static_cast<uint64_t>(
+        duration_cast<nanoseconds>(steady_clock::now() - start).count());
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.misses_;
+    stats_.total_ns_ += ns;
+    stats_.max_ns_ = std::max(stats_.max_ns_, ns);
+    if (s != status::ok) {
+        ++stats_.errors_;
+        return status::error;
+    }
+    data = raw;
+
+    if (block->raw_len_ > stats_.capacity_ ||
+        index_.find(block.get()) != index_.end()) {
+        return status::ok;
+    }
+    lru_.push_front({block, raw});
+    index_[block.get()] = lru_.begin();
+    ++stats_.blocks_;
+    stats_.bytes_ += block->raw_len_;
+    shrink();
+    return status::ok;
+}
+
+block_cache::stats block_cache::get_stats() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void block_cache::shrink() {
+    while (stats_.bytes_ > stats_.capacity_) {
+        const entry& e = lru_.back();
+        stats_.bytes_ -= e.block_->raw_len_;
+        --stats_.blocks_;
+        index_.erase(e.block_.get());
+        lru_.pop_back();
+    }
+}
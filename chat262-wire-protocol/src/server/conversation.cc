@@ -0,0 +1,263 @@
+#include "conversation.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+conversation::conversation() :
+    last_timestamp_ms_(0),
+    stored_bytes_(0),
+    sent_bytes_(0),
+    last_access_(std::chrono::steady_clock::now()) {
+}
+
+void conversation::append(const uint8_t sender, const std::string& txt) {
+    const uint32_t len = static_cast<uint32_t>(txt.length());
+    memcpy(append_entry(sender, len), txt.data(), len);
+    stored_bytes_ += stored_size(len);
+    if (sender == text::sender_you) {
+        sent_bytes_ += stored_size(len);
+    }
+    touch();
+}
+
+void conversation::append(const uint8_t sender,
+                          const std::string& txt,
+                          const uint64_t timestamp_ms) {
+    append(sender, txt);
+
+    uint64_t delta = timestamp_ms - last_timestamp_ms_;
+    last_timestamp_ms_ = timestamp_ms;
+    do {
+        uint8_t byte = delta & 0x7F;
+        delta >>= 7;
+        if (delta != 0) {
+            byte |= 0x80;
+        }
+        timestamps_.push_back(byte);
+    } while (delta != 0);
+}
+
+void conversation::append_all(const chat_view& v) {
+    entries_.reserve(entries_.size() + v.senders_.size());
+    append_view(v);
+    for (size_t i = 0; i != v.lengths_.size(); ++i) {
+        stored_bytes_ += stored_size(v.lengths_[i]);
+        if (v.senders_[i] == text::sender_you) {
+            sent_bytes_ += stored_size(v.lengths_[i]);
+        }
+    }
+    touch();
+}
+
+size_t conversation::num_texts() const {
+    size_t n = entries_.size();
+    for (const segment_store::segment_ref& ref : evicted_) {
+        n += ref.num_txts_;
+    }
+    return n;
+}
+
+size_t conversation::num_resident_texts() const {
+    return entries_.size();
+}
+
+void conversation::view(chat_view& v,
+                        std::vector<compressed_run>& compressed) const {
+    v.senders_.resize(entries_.size());
+    v.lengths_.resize(entries_.size());
+    for (size_t i = 0; i != entries_.size(); ++i) {
+        v.senders_[i] = (entries_[i] & sender_bit) ? text::sender_other
+                                                   : text::sender_you;
+        v.lengths_[i] = entries_[i] & ~sender_bit;
+    }
+    v.runs_.clear();
+    v.runs_.reserve(chunks_.size());
+    compressed.clear();
+    for (const chunk& ch : chunks_) {
+        if (ch.block_ != nullptr) {
+            compressed.push_back({v.runs_.size(), ch.block_});
+            v.runs_.push_back({nullptr, ch.used_});
+        } else if (ch.used_ != 0) {
+            v.runs_.push_back({ch.data_, ch.used_});
+        }
+    }
+}
+
+void conversation::touch() {
+    last_access_ = std::chrono::steady_clock::now();
+}
+
+std::chrono::steady_clock::time_point conversation::last_access() const {
+    return last_access_;
+}
+
+bool conversation::evicted() const {
+    return !evicted_.empty();
+}
+
+const std::vector<segment_store::segment_ref>&
+conversation::evicted_segments() const {
+    return evicted_;
+}
+
+void conversation::evict(const segment_store::segment_ref& ref) {
+    evicted_.push_back(ref);
+    std::vector<uint32_t>().swap(entries_);
+    std::vector<chunk>().swap(chunks_);
+}
+
+void conversation::fault_in(const std::vector<chat_view>& segments) {
+    // The texts in memory keep their chunks, which go after the chunks of
+    // the faulted in texts
+    std::vector<uint32_t> resident_entries;
+    std::vector<chunk> resident_chunks;
+    resident_entries.swap(entries_);
+    resident_chunks.swap(chunks_);
+    std::vector<segment_store::segment_ref>().swap(evicted_);
+
+    for (const chat_view& v : segments) {
+        append_view(v);
+    }
+    if (!chunks_.empty() && !resident_chunks.empty()) {
+        chunks_.back().sealed_at_ = std::chrono::steady_clock::now();
+    }
+    entries_.insert(entries_.end(),
+                    resident_entries.begin(),
+                    resident_entries.end());
+    chunks_.insert(chunks_.end(),
+                   std::make_move_iterator(resident_chunks.begin()),
+                   std::make_move_iterator(resident_chunks.end()));
+    touch();
+}
+
+uint8_t* conversation::append_entry(const uint8_t sender, const uint32_t len) {
+    if (chunks_.empty() ||
+        chunks_.back().capacity_ - chunks_.back().used_ < len) {
+        uint32_t capacity = min_chunk_size;
+        if (!chunks_.empty()) {
+            capacity = std::min(2 * chunks_.back().capacity_, max_chunk_size);
+        }
+        capacity = std::max(capacity, len);
+
+        chunk ch;
+        ch.data_ = std::shared_ptr<uint8_t>(
+            static_cast<uint8_t*>(malloc(capacity)),
+            free);
+        ch.capacity_ = capacity;
+        ch.used_ = 0;
+        ch.incompressible_ = false;
+        if (!chunks_.empty()) {
+            chunks_.back().sealed_at_ = std::chrono::steady_clock::now();
+        }
+        chunks_.push_back(std::move(ch));
+    }
+
+    chunk& ch = chunks_.back();
+    uint8_t* dest = ch.data_.get() + ch.used_;
+    ch.used_ += len;
+    entries_.push_back(sender == text::sender_other ? (len | sender_bit) : len);
+    return dest;
+}
+
+void conversation::append_view(const chat_view& v) {
+    // Texts may straddle runs, so copy from a cursor over all runs
+    size_t run_idx = 0;
+    size_t run_pos = 0;
+    for (size_t i = 0; i != v.senders_.size(); ++i) {
+        uint8_t* dest = append_entry(v.senders_[i], v.lengths_[i]);
+        size_t left = v.lengths_[i];
+        while (left != 0) {
+            const chat_view::run& r = v.runs_[run_idx];
+            const size_t n = std::min(left, r.len_ - run_pos);
+            memcpy(dest, r.data_.get() + run_pos, n);
+            dest += n;
+            left -= n;
+            run_pos += n;
+            if (run_pos == r.len_) {
+                ++run_idx;
+                run_pos = 0;
+            }
+        }
+    }
+}
+
+void conversation::compressible_chunks(
+    const std::chrono::steady_clock::time_point& sealed_before,
+    std::vector<chunk_ref>& chunks) const {
+    for (size_t i = 0; i + 1 < chunks_.size(); ++i) {
+        const chunk& ch = chunks_[i];
+        if (ch.data_ != nullptr && !ch.incompressible_ &&
+            ch.used_ >= min_compress_len && ch.sealed_at_ < sealed_before) {
+            chunks.push_back({i, ch.data_, ch.used_});
+        }
+    }
+}
+
+void conversation::compress(const chunk_ref& ref,
+                            const std::shared_ptr<const lz_block>& block) {
+    if (ref.idx_ >= chunks_.size() ||
+        chunks_[ref.idx_].data_.get() != ref.data_.get()) {
+        return;
+    }
+    chunk& ch = chunks_[ref.idx_];
+    if (block == nullptr) {
+        ch.incompressible_ = true;
+        return;
+    }
+    ch.block_ = block;
+    ch.data_.reset();
+}
+
+void conversation::compression_stats(size_t& num_chunks,
+                                     size_t& raw_bytes,
+                                     size_t& compressed_bytes) const {
+    for (const chunk& ch : chunks_) {
+        if (ch.block_ != nullptr) {
+            ++num_chunks;
+            raw_bytes += ch.block_->raw_len_;
+            compressed_bytes += ch.block_->data_.size();
+        }
+    }
+}
+
+void conversation::timestamps(std::vector<uint64_t>& timestamps_ms) const {
+    timestamps_ms.clear();
+    if (timestamps_.empty()) {
+        return;
+    }
+    timestamps_ms.reserve(entries_.size());
+    uint64_t timestamp_ms = 0;
+    uint64_t delta = 0;
+    unsigned shift = 0;
+    for (uint8_t byte : timestamps_) {
+        delta |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        shift += 7;
+        if ((byte & 0x80) == 0) {
+            timestamp_ms += delta;
+            timestamps_ms.push_back(timestamp_ms);
+            delta = 0;
+            shift = 0;
+        }
+    }
+}
+
+size_t conversation::stored_bytes() const {
+    return stored_bytes_;
+}
+
+size_t conversation::sent_bytes() const {
+    return sent_bytes_;
+}
+
+size_t conversation::memory_usage() const {
+    size_t bytes = entries_.capacity() * sizeof(uint32_t) +
+                   chunks_.capacity() * sizeof(chunk) + timestamps_.capacity() +
+                   evicted_.capacity() * sizeof(segment_store::segment_ref);
+    for (const chunk& ch : chunks_) {
+        bytes += ch.block_ != nullptr ? ch.block_->data_.capacity()
+                                      : ch.capacity_;
+    }
+    return bytes;
+}
@@ -1,8 +1,121 @@
 #include "database.h"
 
+#include "dump_file.h"
+#include "tracepoints.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <mutex>
+#include <utility>
+
+// Fires the `db__entry` tracepoint on construction and the `db__exit`
+// tracepoint on destruction, so that every return path is covered.
+class op_tracer {
+public:
+    explicit op_tracer(const lock_site op) : op_(op) {
+        CHAT262_TRACE2(db__entry, static_cast<int>(op_), lock_site_lookup(op_));
+    }
+    ~op_tracer() {
+        CHAT262_TRACE2(db__exit, static_cast<int>(op_), lock_site_lookup(op_));
+    }
+
+private:
+    const lock_site op_;
+};
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+// Append the texts of `src` to `dest`
+static void append_view(chat_view& dest, const chat_view& src) {
+    dest.senders_.insert(dest.senders_.end(),
+                         src.senders_.begin(),
+                         src.senders_.end());
+    dest.lengths_.insert(dest.lengths_.end(),
+                         src.lengths_.begin(),
+                         src.lengths_.end());
+    dest.runs_.insert(dest.runs_.end(), src.runs_.begin(), src.runs_.end());
+}
+
+database::database() :
+    cfg_{false,
+         0,
+         0,
+         0,
+         std::chrono::seconds(0),
+         "",
+         0,
+         std::chrono::seconds(0),
+         0},
+    total_bytes_(0),
+    peak_bytes_(0),
+    rejected_txts_(0),
+    stop_tiering_(false),
+    evictions_{0, 0, 0, 0},
+    fault_ins_{0, 0, 0, 0},
+    mapped_reads_{0, 0, 0, 0},
+    compressions_{0, 0, 0, 0},
+    incompressible_chunks_(0),
+    log_(nullptr),
+    journal_(nullptr),
+    applied_seq_(0) {
+}
+
+database::~database() {
+    if (tiering_thread_.joinable()) {
+        {
+            const std::lock_guard<std::mutex> lock(tiering_mutex_);
+            stop_tiering_ = true;
+        }
+        tiering_cv_.notify_one();
+        tiering_thread_.join();
+    }
+}
+
+void database::set_replication_log(replication_log* log) {
+    log_ = log;
+}
+
+void database::set_journal(journal* j) {
+    journal_ = j;
+}
+
+status database::replay(const std::vector<chat262::mutation>& mutations) {
+    const op_tracer trace(lock_site::apply);
+    const profiled_lock_guard lock(mutex_, lock_site::apply);
+    for (const chat262::mutation& m : mutations) {
+        if (apply_mutation(m, false) == status::body_error) {
+            return status::error;
+        }
+    }
+    return status::ok;
+}
+
+void database::configure(const config& cfg) {
+    cfg_ = cfg;
+    cache_.set_capacity(cfg_.block_cache_bytes_);
+}
+
+status database::start_tiering() {
+    const bool evict = cfg_.evict_after_.count() != 0;
+    if (!evict && cfg_.compress_after_.count() == 0) {
+        return status::ok;
+    }
+    if (evict && segments_.open(cfg_.segment_path_,
+                                cfg_.segment_file_size_) != status::ok) {
+        return status::error;
+    }
+    tiering_thread_ = std::thread(&database::run_tiering, this);
+    return status::ok;
+}
+
 status database::login(const std::string& username,
                        const std::string& password) {
-    const std::lock_guard<std::mutex> lock(mutex_);
+    const op_tracer trace(lock_site::login);
+    const profiled_lock_guard lock(mutex_, lock_site::login);
 
     // Check if the thread is already logged in
     if (threads_.find(std::this_thread::get_id()) != threads_.end()) {
@@ -10,43 +123,50 @@ status database::login(const std::string& username,
     }
 
     // Check if the user exists
-    auto it = users_.find(username);
-    if (it == users_.end()) {
+    auto it = ids_.find(username);
+    if (it == ids_.end() || users_[(*it).second].deleted_ ||
+        users_[(*it).second].remote_) {
         return status::error;
     }
 
     // Check if the password is correct
-    user& u = (*it).second;
+    const user& u = users_[(*it).second];
     if (password != u.password_) {
         return status::error;
     }
     // This thread is now dedicated to this user and the user is logged in
-    threads_.insert({std::this_thread::get_id(), username});
+    threads_.insert({std::this_thread::get_id(), (*it).second});
 
     return status::ok;
 }
 
-status database::registration(const std::string& username,
-                              const std::string& password) {
-    const std::lock_guard<std::mutex> lock(mutex_);
+status database::login_as(const std::string& username) {
+    const op_tracer trace(lock_site::login);
+    const profiled_lock_guard lock(mutex_, lock_site::login);
 
-    // Check if the username already exists or has existed before
-    if (users_.find(username) != users_.end() ||
-        historical_users_.find(username) != historical_users_.end()) {
+    if (threads_.find(std::this_thread::get_id()) != threads_.end()) {
+        return status::error;
+    }
+    auto it = ids_.find(username);
+    if (it == ids_.end() || users_[(*it).second].deleted_ ||
+        users_[(*it).second].remote_) {
         return status::error;
     }
+    threads_.insert({std::this_thread::get_id(), (*it).second});
+    return status::ok;
+}
 
-    user u;
-    u.username_ = username;
-    u.password_ = password;
-    users_.insert({username, u});
-    historical_users_.insert(username);
+status database::registration(const std::string& username,
+                              const std::string& password) {
+    const op_tracer trace(lock_site::registration);
+    const profiled_lock_guard lock(mutex_, lock_site::registration);
 
-    return status::ok;
+    return add_user(username, password);
 }
 
 status database::logout() {
-    const std::lock_guard<std::mutex> lock(mutex_);
+    const op_tracer trace(lock_site::logout);
+    const profiled_lock_guard lock(mutex_, lock_site::logout);
 
     // Check if the thread is already logged out
     auto thread_it = threads_.find(std::this_thread::get_id());
@@ -59,99 +179,276 @@ status database::logout() {
 }
 
 bool database::is_logged_in() {
-    const std::lock_guard<std::mutex> lock(mutex_);
+    const op_tracer trace(lock_site::is_logged_in);
+    const profiled_lock_guard lock(mutex_, lock_site::is_logged_in);
 
     return threads_.find(std::this_thread::get_id()) != threads_.end();
 }
 
+status database::current_username(std::string& username) {
+    const op_tracer trace(lock_site::is_logged_in);
+    const profiled_lock_guard lock(mutex_, lock_site::is_logged_in);
+
+    const user* u = current_user();
+    if (u == nullptr) {
+        return status::error;
+    }
+    username = *u->username_;
+    return status::ok;
+}
+
 std::vector<std::string> database::get_usernames(const std::string& pattern) {
-    const std::lock_guard<std::mutex> lock(mutex_);
+    const op_tracer trace(lock_site::get_usernames);
+    const profiled_lock_guard lock(mutex_, lock_site::get_usernames);
 
-    std::vector<std::string> usernames;
-    for (const auto& it : users_) {
-        if (wildcard_match(pattern, it.first)) {
-            usernames.push_back(it.first);
+    // Users are stored in registration order, so sort only the matches
+    std::vector<const std::string*> matches;
+    for (const user& u : users_) {
+        if (!u.deleted_ && !u.remote_ &&
+            wildcard_match(pattern, *u.username_)) {
+            matches.push_back(u.username_);
         }
     }
+    std::sort(matches.begin(),
+              matches.end(),
+              [](const std::string* a, const std::string* b) {
+                  return *a < *b;
+              });
+
+    std::vector<std::string> usernames;
+    usernames.reserve(matches.size());
+    for (const std::string* username : matches) {
+        usernames.push_back(*username);
+    }
     return usernames;
 }
 
 status database::send_txt(const std::string& recipient_username,
                           const std::string& txt) {
-    const std::lock_guard<std::mutex> lock(mutex_);
+    const op_tracer trace(lock_site::send_txt);
+    const profiled_lock_guard lock(mutex_, lock_site::send_txt);
 
-    auto thread_it = threads_.find(std::this_thread::get_id());
-    if (thread_it == threads_.end()) {
+    user* sender = current_user();
+    if (sender == nullptr) {
         return status::error;
     }
-    user& sender = users_.at((*thread_it).second);
+    return store_txt(sender, recipient_username, txt, true);
+}
 
-    auto recipient_it = users_.find(recipient_username);
-    if (recipient_it == users_.end()) {
+status database::store_txt(user* sender,
+                           const std::string& recipient_username,
+                           const std::string& txt,
+                           const bool enforce_limits) {
+    user* recipient = find_user(recipient_username);
+    if (recipient == nullptr || recipient->remote_) {
         return status::error;
     }
-    user& recipient = (*recipient_it).second;
+    const user_id sender_id = static_cast<user_id>(sender - users_.data());
+    const user_id recipient_id =
+        static_cast<user_id>(recipient - users_.data());
 
-    if (sender.chats_.find(recipient_username) == sender.chats_.end()) {
-        sender.chats_.insert({recipient_username, {}});
+    // Check the limits before anything is allocated. Sending to oneself
+    // stores both copies in the same chat.
+    const size_t cost = conversation::stored_size(txt.length());
+    bool allowed = txt.length() <= conversation::max_txt_len;
+    if (sender == recipient) {
+        allowed = allowed && within_quota(*sender, recipient_id, 2 * cost);
+    } else {
+        allowed = allowed && within_quota(*sender, recipient_id, cost);
     }
-    if (recipient.chats_.find(sender.username_) == recipient.chats_.end()) {
-        recipient.chats_.insert({sender.username_, {}});
+    if (cfg_.max_total_bytes_ != 0 &&
+        total_bytes_ + 2 * cost > cfg_.max_total_bytes_) {
+        allowed = false;
+    }
+    if (enforce_limits && !allowed) {
+        ++rejected_txts_;
+        return status::quota_error;
     }
 
-    text sender_txt;
-    sender_txt.sender_ = text::sender_you;
-    sender_txt.content_ = txt;
-    sender.chats_.at(recipient_username).texts_.push_back(sender_txt);
-
-    text recipient_txt;
-    recipient_txt.sender_ = text::sender_other;
-    recipient_txt.content_ = txt;
-    recipient.chats_.at(sender.username_).texts_.push_back(recipient_txt);
+    append_txt(*sender, recipient_id, text::sender_you, txt);
+    append_txt(*recipient, sender_id, text::sender_other, txt);
 
+    record({chat262::mutation::op_send_txt,
+            *sender->username_,
+            recipient_username,
+            txt});
     return status::ok;
 }
 
-status database::recv_txt(const std::string& sender_username, chat& c) {
-    const std::lock_guard<std::mutex> lock(mutex_);
+status database::recv_txt(const std::string& sender_username,
+                          chat_view& v) {
+    const op_tracer trace(lock_site::recv_txt);
 
-    auto thread_it = threads_.find(std::this_thread::get_id());
-    if (thread_it == threads_.end()) {
-        return status::error;
+    std::vector<conversation::compressed_run> compressed;
+    const status s = view_chat(sender_username, v, compressed);
+    if (s != status::ok) {
+        return s;
+    }
+    if (decompress_runs(v, compressed) != status::ok) {
+        return status::receive_error;
     }
-    const user& recipient = users_.at((*thread_it).second);
+    return status::ok;
+}
 
-    if (users_.find(sender_username) == users_.end()) {
-        return status::error;
+status database::view_chat(
+    const std::string& sender_username,
+    chat_view& v,
+    std::vector<conversation::compressed_run>& compressed) {
+    user_id recipient_id;
+    user_id sender_id;
+    // The chat is evicted if this is not empty
+    std::vector<segment_store::segment_ref> refs;
+    chat_view resident;
+    std::vector<conversation::compressed_run> resident_compressed;
+    {
+        const profiled_lock_guard lock(mutex_, lock_site::recv_txt);
+
+        user* recipient = current_user();
+        if (recipient == nullptr) {
+            return status::error;
+        }
+        const user* sender = find_user(sender_username);
+        if (sender == nullptr) {
+            return status::error;
+        }
+        recipient_id = static_cast<user_id>(recipient - users_.data());
+        sender_id = static_cast<user_id>(sender - users_.data());
+
+        auto chat_it = recipient->chats_.find(sender_id);
+        if (chat_it == recipient->chats_.end()) {
+            v = chat_view();
+            return status::ok;
+        }
+        conversation& c = (*chat_it).second;
+        c.touch();
+        if (!c.evicted()) {
+            c.view(v, compressed);
+            return status::ok;
+        }
+        refs = c.evicted_segments();
+        c.view(resident, resident_compressed);
     }
 
-    if (recipient.chats_.find(sender_username) == recipient.chats_.end()) {
-        c.texts_.clear();
-    } else {
-        c = recipient.chats_.at(sender_username);
+    return view_evicted_chat(recipient_id,
+                             sender_id,
+                             std::move(refs),
+                             std::move(resident),
+                             std::move(resident_compressed),
+                             v,
+                             compressed);
+}
+
+status database::view_evicted_chat(
+    const user_id recipient_id,
+    const user_id sender_id,
+    std::vector<segment_store::segment_ref> refs,
+    chat_view resident,
+    std::vector<conversation::compressed_run> resident_compressed,
+    chat_view& v,
+    std::vector<conversation::compressed_run>& compressed) {
+    // Read the chat back without holding the lock, and try again if it
+    // changed in the meantime
+    while (true) {
+        const steady_clock::time_point start = steady_clock::now();
+        std::vector<chat_view> segments(refs.size());
+        status s = status::ok;
+        for (size_t i = 0; i != refs.size() && s == status::ok; ++i) {
+            s = segments_.read(refs[i], segments[i]);
+        }
+
+        // Sealed segments never change, so if all of them are sealed, they
+        // make up the chat together with the texts in memory at the time the
+        // segments were looked up
+        bool sealed = true;
+        for (size_t i = 0; i != refs.size() && sealed; ++i) {
+            sealed = segments_.is_sealed(refs[i]);
+        }
+        if (s == status::ok && sealed) {
+            v = chat_view();
+            for (const chat_view& segment : segments) {
+                append_view(v, segment);
+            }
+            compressed = resident_compressed;
+            for (conversation::compressed_run& run : compressed) {
+                run.run_ += v.runs_.size();
+            }
+            append_view(v, resident);
+            const uint64_t ns = static_cast<uint64_t>(
+                duration_cast<nanoseconds>(steady_clock::now() - start)
+                    .count());
+            const profiled_lock_guard lock(mutex_, lock_site::fault_in);
+            mapped_reads_.record(ns);
+            return status::ok;
+        }
+        const uint64_t ns = static_cast<uint64_t>(
+            duration_cast<nanoseconds>(steady_clock::now() - start).count());
+
+        const profiled_lock_guard lock(mutex_, lock_site::fault_in);
+        if (s != status::ok) {
+            ++fault_ins_.errors_;
+            return status::receive_error;
+        }
+
+        // Either user may have been deleted, which deletes the chat
+        auto chat_it = users_[recipient_id].chats_.find(sender_id);
+        if (chat_it == users_[recipient_id].chats_.end()) {
+            v = chat_view();
+            return status::ok;
+        }
+        conversation& c = (*chat_it).second;
+        // Another thread may have faulted the chat in, or more of it may
+        // have been evicted
+        if (c.evicted_segments() != refs) {
+            if (!c.evicted()) {
+                c.view(v, compressed);
+                return status::ok;
+            }
+            refs = c.evicted_segments();
+            c.view(resident, resident_compressed);
+            continue;
+        }
+
+        c.fault_in(segments);
+        for (const segment_store::segment_ref& ref : refs) {
+            segments_.release(ref);
+        }
+        fault_ins_.record(ns);
+        c.view(v, compressed);
+        return status::ok;
     }
+}
 
+status database::decompress_runs(
+    chat_view& v,
+    const std::vector<conversation::compressed_run>& compressed) {
+    for (const conversation::compressed_run& run : compressed) {
+        if (cache_.get(run.block_, v.runs_[run.run_].data_) != status::ok) {
+            return status::error;
+        }
+    }
     return status::ok;
 }
 
 status database::get_correspondents(std::vector<std::string>& usernames) {
-    const std::lock_guard<std::mutex> lock(mutex_);
+    const op_tracer trace(lock_site::get_correspondents);
+    const profiled_lock_guard lock(mutex_, lock_site::get_correspondents);
 
-    auto thread_it = threads_.find(std::this_thread::get_id());
-    if (thread_it == threads_.end()) {
+    const user* this_user = current_user();
+    if (this_user == nullptr) {
         return status::error;
     }
-    const user& this_user = users_.at((*thread_it).second);
 
     usernames.clear();
-    for (const auto& chat_it : this_user.chats_) {
-        usernames.push_back(chat_it.first);
+    usernames.reserve(this_user->chats_.size());
+    for (const auto& chat_it : this_user->chats_) {
+        usernames.push_back(*users_[chat_it.first].username_);
     }
     return status::ok;
 }
 
 status database::delete_user() {
-    const std::lock_guard<std::mutex> lock(mutex_);
+    const op_tracer trace(lock_site::delete_user);
+    const profiled_lock_guard lock(mutex_, lock_site::delete_user);
 
     // Check if the thread is already logged out
     auto thread_it = threads_.find(std::this_thread::get_id());
@@ -159,22 +456,1315 @@ status database::delete_user() {
         return status::error;
     }
 
-    const std::string& username = (*thread_it).second;
-    const user& u = users_.at(username);
+    // Log out the thread, and every other thread logged in as the user
+    remove_user((*thread_it).second);
+    return status::ok;
+}
+
+status database::check_remote_txt(const std::string& recipient_username,
+                                  const std::string& txt) {
+    const op_tracer trace(lock_site::send_txt);
+    const profiled_lock_guard lock(mutex_, lock_site::send_txt);
 
-    // For every correspondent, delete their chat with the current user
-    for (auto& chat_it : u.chats_) {
-        const std::string& correspondent_username = chat_it.first;
-        user& correspondent = users_.at(correspondent_username);
-        correspondent.chats_.erase(username);
+    const user* sender = current_user();
+    if (sender == nullptr) {
+        return status::error;
     }
-    // Delete the current user
-    users_.erase(username);
-    // Log out the thread
-    threads_.erase(thread_it);
+    // Until the recipient is recorded, the sender has no chat with it
+    auto it = ids_.find(recipient_username);
+    const user_id recipient_id = it == ids_.end()
+                                     ? static_cast<user_id>(users_.size())
+                                     : (*it).second;
+    const size_t cost = conversation::stored_size(txt.length());
+    if (txt.length() > conversation::max_txt_len ||
+        !within_quota(*sender, recipient_id, cost) ||
+        (cfg_.max_total_bytes_ != 0 &&
+         total_bytes_ + cost > cfg_.max_total_bytes_)) {
+        ++rejected_txts_;
+        return status::quota_error;
+    }
+    return status::ok;
+}
+
+status database::store_remote_txt(const std::string& recipient_username,
+                                  const std::string& txt) {
+    const op_tracer trace(lock_site::send_txt);
+    const profiled_lock_guard lock(mutex_, lock_site::send_txt);
+
+    // Recording the recipient may move the records, so the sender is looked
+    // up after it. The recipient may have moved to this shard meanwhile.
+    const user* recipient = find_remote_user(recipient_username);
+    if (recipient == nullptr) {
+        recipient = find_user(recipient_username);
+    }
+    user* sender = current_user();
+    if (sender == nullptr || recipient == nullptr) {
+        return status::error;
+    }
+    append_txt(*sender,
+               static_cast<user_id>(recipient - users_.data()),
+               text::sender_you,
+               txt);
+    return status::ok;
+}
+
+status database::deliver_remote_txt(const std::string& sender_username,
+                                    const std::string& recipient_username,
+                                    const std::string& txt) {
+    const op_tracer trace(lock_site::send_txt);
+    const profiled_lock_guard lock(mutex_, lock_site::send_txt);
+
+    // A text to a user that moved here meanwhile may come back from its old
+    // shard, from a user of this shard
+    const user* sender = find_remote_user(sender_username);
+    if (sender == nullptr) {
+        sender = find_user(sender_username);
+    }
+    user* recipient = find_user(recipient_username);
+    if (sender == nullptr || recipient == nullptr || recipient->remote_) {
+        return status::error;
+    }
+    const user_id sender_id = static_cast<user_id>(sender - users_.data());
+    const size_t cost = conversation::stored_size(txt.length());
+    if (txt.length() > conversation::max_txt_len ||
+        (cfg_.max_total_bytes_ != 0 &&
+         total_bytes_ + cost > cfg_.max_total_bytes_)) {
+        ++rejected_txts_;
+        return status::quota_error;
+    }
+    append_txt(*recipient, sender_id, text::sender_other, txt);
+    return status::ok;
+}
+
+void database::remove_remote_user(const std::string& username) {
+    const op_tracer trace(lock_site::delete_user);
+    const profiled_lock_guard lock(mutex_, lock_site::delete_user);
+
+    auto it = ids_.find(username);
+    if (it == ids_.end()) {
+        return;
+    }
+    const user_id id = (*it).second;
+    const user& u = users_[id];
+    if (!u.remote_ || u.deleted_) {
+        return;
+    }
+    remove_remote(id);
+}
+
+// Append a send text mutation for each of the first `num_texts` texts of `v`,
+// the chat of `username` with `correspondent`, to `mutations`. A chat with
+// oneself holds every text twice, so only the sent copies are taken.
+static void append_sends(const chat_view& v,
+                         const std::string& username,
+                         const std::string& correspondent,
+                         const size_t num_texts,
+                         std::vector<chat262::mutation>& mutations) {
+    const bool self = username == correspondent;
+    size_t run = 0;
+    size_t off = 0;
+    for (size_t i = 0; i != num_texts; ++i) {
+        std::string txt;
+        txt.reserve(v.lengths_[i]);
+        size_t left = v.lengths_[i];
+        while (left != 0) {
+            const chat_view::run& r = v.runs_[run];
+            const size_t len = std::min(left, r.len_ - off);
+            txt.append(reinterpret_cast<const char*>(r.data_.get()) + off,
+                       len);
+            off += len;
+            left -= len;
+            if (off == r.len_) {
+                ++run;
+                off = 0;
+            }
+        }
+
+        if (v.senders_[i] == text::sender_you) {
+            mutations.push_back({chat262::mutation::op_send_txt,
+                                 username,
+                                 correspondent,
+                                 std::move(txt)});
+        } else if (!self) {
+            mutations.push_back({chat262::mutation::op_send_txt,
+                                 correspondent,
+                                 username,
+                                 std::move(txt)});
+        }
+    }
+}
+
+status database::export_user(const std::string& username,
+                             std::vector<chat262::mutation>& mutations) {
+    const op_tracer trace(lock_site::migrate);
+
+    // A chat of the user, and the number of texts it had when the export
+    // started. Later texts are kept as writes to the user.
+    struct chat_ref {
+        user_id correspondent_;
+        std::string correspondent_name_;
+        size_t num_texts_;
+        std::vector<segment_store::segment_ref> refs_;
+        chat_view v_;
+        std::vector<conversation::compressed_run> compressed_;
+    };
+    std::vector<chat_ref> chats;
+    user_id id;
+    mutations.clear();
+    {
+        const profiled_lock_guard lock(mutex_, lock_site::migrate);
+        const user* u = find_user(username);
+        if (u == nullptr || u->remote_) {
+            return status::error;
+        }
+        id = static_cast<user_id>(u - users_.data());
+        if (!exports_.insert({id, {}}).second) {
+            return status::error;
+        }
+
+        mutations.push_back(
+            {chat262::mutation::op_registration, username, u->password_, ""});
+        for (const auto& chat_it : u->chats_) {
+            chat_ref ref;
+            ref.correspondent_ = chat_it.first;
+            ref.correspondent_name_ = *users_[chat_it.first].username_;
+            const conversation& c = chat_it.second;
+            ref.num_texts_ = c.num_texts();
+            if (c.evicted()) {
+                ref.refs_ = c.evicted_segments();
+            }
+            c.view(ref.v_, ref.compressed_);
+            chats.push_back(std::move(ref));
+        }
+    }
+
+    for (chat_ref& ref : chats) {
+        status s = status::ok;
+        if (!ref.refs_.empty()) {
+            s = view_evicted_chat(id,
+                                  ref.correspondent_,
+                                  std::move(ref.refs_),
+                                  std::move(ref.v_),
+                                  std::move(ref.compressed_),
+                                  ref.v_,
+                                  ref.compressed_);
+        }
+        if (s != status::ok ||
+            decompress_runs(ref.v_, ref.compressed_) != status::ok) {
+            cancel_export(username);
+            return status::receive_error;
+        }
+        // A chat that was read back from the segments may have grown, or
+        // have been deleted with the correspondent
+        append_sends(ref.v_,
+                     username,
+                     ref.correspondent_name_,
+                     std::min(ref.num_texts_, ref.v_.senders_.size()),
+                     mutations);
+        ref.v_ = chat_view();
+        ref.compressed_.clear();
+    }
+    return status::ok;
+}
+
+void database::take_exported(const std::string& username,
+                             std::vector<chat262::mutation>& mutations) {
+    const op_tracer trace(lock_site::migrate);
+    const profiled_lock_guard lock(mutex_, lock_site::migrate);
+
+    mutations.clear();
+    auto it = ids_.find(username);
+    if (it == ids_.end()) {
+        return;
+    }
+    auto export_it = exports_.find((*it).second);
+    if (export_it != exports_.end()) {
+        mutations.swap((*export_it).second);
+    }
+}
+
+void database::cancel_export(const std::string& username) {
+    const op_tracer trace(lock_site::migrate);
+    const profiled_lock_guard lock(mutex_, lock_site::migrate);
+
+    auto it = ids_.find(username);
+    if (it != ids_.end()) {
+        exports_.erase((*it).second);
+    }
+}
+
+status database::seal_user(const std::string& username,
+                           std::vector<chat262::mutation>& mutations) {
+    const op_tracer trace(lock_site::migrate);
+    const profiled_lock_guard lock(mutex_, lock_site::migrate);
+
+    mutations.clear();
+    auto it = ids_.find(username);
+    if (it == ids_.end()) {
+        return status::error;
+    }
+    const user_id id = (*it).second;
+    auto export_it = exports_.find(id);
+    if (export_it == exports_.end()) {
+        return status::error;
+    }
+    mutations.swap((*export_it).second);
+    exports_.erase(export_it);
+    user& u = users_[id];
+    if (u.deleted_) {
+        return status::error;
+    }
+
+    // Nothing can log in as a remote user or write to it, and the logged in
+    // threads must log in again on the other shard
+    u.remote_ = true;
+    for (auto thread_it = threads_.begin(); thread_it != threads_.end();) {
+        if ((*thread_it).second == id) {
+            thread_it = threads_.erase(thread_it);
+        } else {
+            ++thread_it;
+        }
+    }
+    return status::ok;
+}
+
+void database::unseal_user(const std::string& username) {
+    const op_tracer trace(lock_site::migrate);
+    const profiled_lock_guard lock(mutex_, lock_site::migrate);
+
+    auto it = ids_.find(username);
+    if (it != ids_.end() && !users_[(*it).second].deleted_) {
+        users_[(*it).second].remote_ = false;
+    }
+}
+
+void database::drop_user(const std::string& username) {
+    const op_tracer trace(lock_site::migrate);
+    const profiled_lock_guard lock(mutex_, lock_site::migrate);
+
+    auto it = ids_.find(username);
+    if (it == ids_.end()) {
+        return;
+    }
+    user& u = users_[(*it).second];
+    while (!u.chats_.empty()) {
+        remove_chat(u, (*u.chats_.begin()).first);
+    }
+}
+
+status database::import_user(const std::string& username,
+                             const std::vector<chat262::mutation>& mutations) {
+    const op_tracer trace(lock_site::migrate);
+    const profiled_lock_guard lock(mutex_, lock_site::migrate);
+
+    for (const chat262::mutation& m : mutations) {
+        // Recording a correspondent may move the records, so the user is
+        // looked up for every mutation
+        user* u = find_remote_user(username);
+        if (u == nullptr) {
+            return status::error;
+        }
+        const user_id id = static_cast<user_id>(u - users_.data());
+
+        switch (m.op_) {
+        case chat262::mutation::op_registration:
+            if (m.username_ != username) {
+                return status::body_error;
+            }
+            // An earlier import of the user may have been cut short
+            while (!u->chats_.empty()) {
+                remove_chat(*u, (*u->chats_.begin()).first);
+            }
+            u->password_ = m.arg_;
+            break;
+        case chat262::mutation::op_send_txt: {
+            const bool sent = m.username_ == username;
+            if (!sent && m.arg_ != username) {
+                return status::body_error;
+            }
+            const std::string& other = sent ? m.arg_ : m.username_;
+            auto it = ids_.find(other);
+            if (it == ids_.end()) {
+                find_remote_user(other);
+                it = ids_.find(other);
+            }
+            const user_id correspondent = (*it).second;
+            // The chat was deleted along with the correspondent
+            if (users_[correspondent].deleted_) {
+                break;
+            }
+            user& imported = users_[id];
+            if (correspondent == id) {
+                append_txt(imported, id, text::sender_you, m.txt_);
+                append_txt(imported, id, text::sender_other, m.txt_);
+            } else {
+                append_txt(imported,
+                           correspondent,
+                           sent ? text::sender_you : text::sender_other,
+                           m.txt_);
+            }
+            break;
+        }
+        case chat262::mutation::op_delete_user: {
+            if (m.username_ == username) {
+                return status::body_error;
+            }
+            auto it = ids_.find(m.username_);
+            if (it == ids_.end()) {
+                break;
+            }
+            // A remote correspondent is deleted here as it is when its own
+            // shard forwards the deletion
+            const user& correspondent = users_[(*it).second];
+            if (correspondent.remote_ && !correspondent.deleted_) {
+                remove_remote((*it).second);
+            } else {
+                remove_chat(*u, (*it).second);
+            }
+            break;
+        }
+        default:
+            return status::body_error;
+        }
+    }
+    return status::ok;
+}
+
+status database::adopt_user(const std::string& username) {
+    const op_tracer trace(lock_site::migrate);
+    const profiled_lock_guard lock(mutex_, lock_site::migrate);
+
+    user* u = find_user(username);
+    if (u == nullptr || !u->remote_) {
+        return status::error;
+    }
+    u->remote_ = false;
+    return status::ok;
+}
+
+status database::apply(const uint64_t first_seq,
+                       const std::vector<chat262::mutation>& mutations,
+                       uint64_t& last_seq) {
+    const op_tracer trace(lock_site::apply);
+    const profiled_lock_guard lock(mutex_, lock_site::apply);
+
+    status s = status::ok;
+    // Mutations before `applied_seq_` are skipped, and nothing is applied
+    // after a gap. The primary applied the mutations successfully, so they
+    // only fail here if they are malformed.
+    uint64_t applied = applied_seq_;
+    for (uint64_t seq = std::max(first_seq, applied + 1);
+         seq == applied + 1 && seq - first_seq < mutations.size();
+         ++seq) {
+        if (apply_mutation(mutations[seq - first_seq], false) ==
+            status::body_error) {
+            s = status::error;
+            break;
+        }
+        applied = seq;
+    }
+    if (applied != applied_seq_) {
+        {
+            const std::lock_guard<std::mutex> applied_lock(applied_mutex_);
+            applied_seq_ = applied;
+        }
+        applied_cv_.notify_all();
+    }
+    last_seq = applied;
+    return s;
+}
+
+status database::wait_applied(const uint64_t seq,
+                              const std::chrono::milliseconds& timeout,
+                              uint64_t& applied) {
+    std::unique_lock<std::mutex> lock(applied_mutex_);
+    const bool done = applied_cv_.wait_for(lock, timeout, [&]() {
+        return applied_seq_ >= seq;
+    });
+    applied = applied_seq_;
+    return done ? status::ok : status::error;
+}
+
+status database::execute(const chat262::mutation& m) {
+    const op_tracer trace(lock_site::apply);
+    const profiled_lock_guard lock(mutex_, lock_site::apply);
+
+    return apply_mutation(m, true);
+}
+
+status database::snapshot(std::vector<chat262::mutation>& mutations,
+                          uint64_t& last_seq) {
+    const op_tracer trace(lock_site::snapshot);
+
+    std::vector<chat_copy> chats;
+    std::vector<const std::string*> usernames;
+    mutations.clear();
+    {
+        const profiled_lock_guard lock(mutex_, lock_site::snapshot);
+        last_seq = log_ != nullptr ? log_->last_seq() : applied_seq_;
+
+        // Deleted users are registered and deleted again, so that their
+        // usernames stay taken
+        for (const user& u : users_) {
+            mutations.push_back({chat262::mutation::op_registration,
+                                 *u.username_,
+                                 u.password_,
+                                 ""});
+            usernames.push_back(u.username_);
+        }
+        for (const user& u : users_) {
+            if (u.deleted_) {
+                mutations.push_back(
+                    {chat262::mutation::op_delete_user, *u.username_, "", ""});
+            }
+        }
+        view_all_chats(chats);
+    }
+
+    // Usernames are only freed by `restore`, so they can be read without the
+    // lock
+    for (chat_copy& c : chats) {
+        if (complete_view(c) != status::ok) {
+            return status::receive_error;
+        }
+        append_sends(c.v_,
+                     *usernames[c.owner_id_],
+                     *usernames[c.correspondent_id_],
+                     c.v_.senders_.size(),
+                     mutations);
+        // Free the copies of the texts as soon as possible
+        c.v_ = chat_view();
+        c.compressed_.clear();
+    }
+    return status::ok;
+}
+
+void database::view_all_chats(std::vector<chat_copy>& chats) {
+    for (user_id id = 0; id != users_.size(); ++id) {
+        for (const auto& chat_it : users_[id].chats_) {
+            if (chat_it.first < id) {
+                continue;
+            }
+            chat_copy c;
+            c.owner_id_ = id;
+            c.correspondent_id_ = chat_it.first;
+            const conversation& conv = chat_it.second;
+            if (conv.evicted()) {
+                c.refs_ = conv.evicted_segments();
+            }
+            conv.view(c.v_, c.compressed_);
+            chats.push_back(std::move(c));
+        }
+    }
+}
+
+status database::complete_view(chat_copy& c) {
+    if (!c.refs_.empty() &&
+        view_evicted_chat(c.owner_id_,
+                          c.correspondent_id_,
+                          std::move(c.refs_),
+                          std::move(c.v_),
+                          std::move(c.compressed_),
+                          c.v_,
+                          c.compressed_) != status::ok) {
+        return status::receive_error;
+    }
+    if (decompress_runs(c.v_, c.compressed_) != status::ok) {
+        return status::receive_error;
+    }
+    return status::ok;
+}
+
+void database::restore(const std::vector<chat262::mutation>& mutations,
+                       const uint64_t last_seq) {
+    const op_tracer trace(lock_site::snapshot);
+    const profiled_lock_guard lock(mutex_, lock_site::snapshot);
+
+    // Deleting all users releases their evicted chats
+    for (user_id id = 0; id != users_.size(); ++id) {
+        if (!users_[id].deleted_) {
+            remove_user(id);
+        }
+    }
+    threads_.clear();
+    users_.clear();
+    ids_.clear();
+
+    // The snapshot was taken within the limits of the server that took it
+    for (const chat262::mutation& m : mutations) {
+        apply_mutation(m, false);
+    }
+    {
+        const std::lock_guard<std::mutex> applied_lock(applied_mutex_);
+        applied_seq_ = last_seq;
+    }
+    applied_cv_.notify_all();
+}
+
+status database::load_dump(const std::string& path,
+                           const size_t num_threads) {
+    const op_tracer trace(lock_site::load);
+
+    dump_reader reader;
+    if (reader.open(path) != status::ok) {
+        return status::error;
+    }
+    // One lock for the whole load, which the threads below build the chats
+    // under
+    const profiled_lock_guard lock(mutex_, lock_site::load);
+    if (!users_.empty() || cfg_.record_timestamps_ ||
+        reader.num_users() > UINT32_MAX) {
+        return status::error;
+    }
+    // Nothing was recorded anywhere, so a malformed dump is simply dropped
+    auto discard = [&]() {
+        users_.clear();
+        ids_.clear();
+        return status::error;
+    };
+
+    const user_id num_users = static_cast<user_id>(reader.num_users());
+    users_.reserve(num_users);
+    ids_.reserve(num_users);
+    std::string username;
+    std::string password;
+    bool deleted;
+    for (user_id id = 0; id != num_users; ++id) {
+        if (reader.next_user(username, password, deleted) != status::ok) {
+            return discard();
+        }
+        auto inserted = ids_.insert({std::move(username), id});
+        if (!inserted.second) {
+            return discard();
+        }
+        user u;
+        u.username_ = &(*inserted.first).first;
+        u.password_ = std::move(password);
+        u.deleted_ = deleted;
+        u.remote_ = false;
+        u.stored_bytes_ = 0;
+        u.sent_bytes_ = 0;
+        users_.push_back(std::move(u));
+    }
+
+    // Check the participants of all chats, and list the chats of every user,
+    // as offsets into `user_chats`
+    const uint64_t num_chats = reader.num_chats();
+    std::vector<uint64_t> first_chat(static_cast<size_t>(num_users) + 1, 0);
+    std::vector<std::pair<uint32_t, uint32_t>> participants(num_chats);
+    for (uint64_t i = 0; i != num_chats; ++i) {
+        uint32_t& owner = participants[i].first;
+        uint32_t& correspondent = participants[i].second;
+        if (reader.read_participants(i, owner, correspondent) != status::ok ||
+            owner >= num_users || correspondent >= num_users ||
+            users_[owner].deleted_ || users_[correspondent].deleted_) {
+            return discard();
+        }
+        ++first_chat[owner + 1];
+        if (correspondent != owner) {
+            ++first_chat[correspondent + 1];
+        }
+    }
+    for (user_id id = 0; id != num_users; ++id) {
+        first_chat[id + 1] += first_chat[id];
+    }
+    std::vector<uint64_t> user_chats(first_chat[num_users]);
+    {
+        std::vector<uint64_t> next(first_chat.begin(), first_chat.end() - 1);
+        for (uint64_t i = 0; i != num_chats; ++i) {
+            user_chats[next[participants[i].first]++] = i;
+            if (participants[i].second != participants[i].first) {
+                user_chats[next[participants[i].second]++] = i;
+            }
+        }
+    }
+
+    // Every user's chats are built by one thread, so the threads never touch
+    // the same map. A chat is read once for each of its participants. Threads
+    // take the users in blocks, so that they don't fight over the counter.
+    constexpr user_id users_per_block = 256;
+    std::atomic<user_id> next_block(0);
+    std::atomic<bool> failed(false);
+    auto build = [&]() {
+        chat_view v;
+        while (!failed.load(std::memory_order_relaxed)) {
+            const uint64_t first =
+                static_cast<uint64_t>(
+                    next_block.fetch_add(1, std::memory_order_relaxed)) *
+                users_per_block;
+            if (first >= num_users) {
+                return;
+            }
+            const user_id last = static_cast<user_id>(
+                std::min<uint64_t>(first + users_per_block, num_users));
+            for (user_id id = static_cast<user_id>(first); id != last; ++id) {
+                user& u = users_[id];
+                u.chats_.reserve(first_chat[id + 1] - first_chat[id]);
+                for (uint64_t j = first_chat[id]; j != first_chat[id + 1];
+                     ++j) {
+                    const uint64_t i = user_chats[j];
+                    const bool owner = participants[i].first == id;
+                    auto chat_it = u.chats_.emplace(
+                        owner ? participants[i].second : participants[i].first,
+                        conversation());
+                    if (!chat_it.second ||
+                        reader.read_chat(i, v) != status::ok) {
+                        failed = true;
+                        return;
+                    }
+                    // The correspondent sees the texts with the senders
+                    // swapped
+                    if (!owner) {
+                        for (uint8_t& sender : v.senders_) {
+                            sender = sender == text::sender_you
+                                         ? text::sender_other
+                                         : text::sender_you;
+                        }
+                    }
+                    conversation& c = (*chat_it.first).second;
+                    c.append_all(v);
+                    u.stored_bytes_ += c.stored_bytes();
+                    u.sent_bytes_ +=
+                        sent_bytes(u, (*chat_it.first).first, c);
+                }
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < num_threads; ++t) {
+        threads.emplace_back(build);
+    }
+    build();
+    for (std::thread& t : threads) {
+        t.join();
+    }
+    if (failed) {
+        return discard();
+    }
+
+    for (const user& u : users_) {
+        total_bytes_ += u.stored_bytes_;
+    }
+    peak_bytes_ = total_bytes_;
     return status::ok;
 }
 
+status database::export_dump(const std::string& path) {
+    const op_tracer trace(lock_site::snapshot);
+
+    struct user_copy {
+        const std::string* username_;
+        std::string password_;
+        bool deleted_;
+    };
+    std::vector<user_copy> users;
+    std::vector<chat_copy> chats;
+    {
+        const profiled_lock_guard lock(mutex_, lock_site::snapshot);
+        users.reserve(users_.size());
+        for (const user& u : users_) {
+            users.push_back({u.username_, u.password_, u.deleted_});
+        }
+        view_all_chats(chats);
+    }
+
+    // Usernames are only freed by `restore`, so they can be read without the
+    // lock
+    dump_writer writer;
+    if (writer.open(path) != status::ok) {
+        return status::error;
+    }
+    for (const user_copy& u : users) {
+        if (writer.add_user(*u.username_, u.password_, u.deleted_) !=
+            status::ok) {
+            return status::error;
+        }
+    }
+    for (chat_copy& c : chats) {
+        if (complete_view(c) != status::ok) {
+            return status::receive_error;
+        }
+        if (writer.add_chat(c.owner_id_, c.correspondent_id_, c.v_) !=
+            status::ok) {
+            return status::error;
+        }
+        // Free the copies of the texts as soon as possible
+        c.v_ = chat_view();
+        c.compressed_.clear();
+    }
+    return writer.close();
+}
+
+void database::tiering_stats::record(const uint64_t ns) {
+    ++count_;
+    total_ns_ += ns;
+    max_ns_ = std::max(max_ns_, ns);
+}
+
+static void print_latency_header(FILE* out) {
+    fprintf(out,
+            "  %-24s %10s %14s %14s %8s\n",
+            "",
+            "count",
+            "avg us",
+            "max us",
+            "errors");
+}
+
+static void print_latency(FILE* out,
+                          const char* name,
+                          const uint64_t count,
+                          const uint64_t total_ns,
+                          const uint64_t max_ns,
+                          const uint64_t errors) {
+    fprintf(out,
+            "  %-24s %10" PRIu64 " %14.1f %14.1f %8" PRIu64 "\n",
+            name,
+            count,
+            count == 0 ? 0.0 : total_ns / 1e3 / count,
+            max_ns / 1e3,
+            errors);
+}
+
+void database::tiering_stats::print(FILE* out, const char* name) const {
+    print_latency(out, name, count_, total_ns_, max_ns_, errors_);
+}
+
+static void print_limit(FILE* out, const char* name, const size_t limit) {
+    if (limit == 0) {
+        fprintf(out, "  %-24s unlimited\n", name);
+    } else {
+        fprintf(out, "  %-24s %zu bytes\n", name, limit);
+    }
+}
+
+void database::dump_stats(FILE* out) {
+    {
+        const profiled_lock_guard lock(mutex_, lock_site::dump_stats);
+
+        size_t num_users = 0;
+        size_t num_remote_users = 0;
+        size_t num_chats = 0;
+        size_t num_evicted_chats = 0;
+        size_t reserved_bytes = 0;
+        size_t num_compressed = 0;
+        size_t compressed_raw_bytes = 0;
+        size_t compressed_bytes = 0;
+        // Users storing the most, largest first
+        std::vector<const user*> top;
+        static constexpr size_t num_top = 5;
+        for (const user& u : users_) {
+            if (u.deleted_) {
+                continue;
+            }
+            if (u.remote_) {
+                ++num_remote_users;
+                continue;
+            }
+            ++num_users;
+            num_chats += u.chats_.size();
+            for (const auto& chat_it : u.chats_) {
+                reserved_bytes += chat_it.second.memory_usage();
+                chat_it.second.compression_stats(num_compressed,
+                                                 compressed_raw_bytes,
+                                                 compressed_bytes);
+                if (chat_it.second.evicted()) {
+                    ++num_evicted_chats;
+                }
+            }
+            top.push_back(&u);
+        }
+        const size_t n = std::min(num_top, top.size());
+        std::partial_sort(top.begin(),
+                          top.begin() + n,
+                          top.end(),
+                          [](const user* a, const user* b) {
+                              return a->stored_bytes_ > b->stored_bytes_;
+                          });
+
+        fprintf(out, "Database memory:\n");
+        fprintf(out, "  %-24s %zu\n", "users", num_users);
+        if (num_remote_users != 0) {
+            fprintf(out, "  %-24s %zu\n", "remote users", num_remote_users);
+        }
+        fprintf(out, "  %-24s %zu\n", "chats", num_chats);
+        fprintf(out, "  %-24s %zu bytes\n", "stored", total_bytes_);
+        fprintf(out, "  %-24s %zu bytes\n", "peak stored", peak_bytes_);
+        fprintf(out, "  %-24s %zu bytes\n", "reserved for chats",
+                reserved_bytes);
+        print_limit(out, "limit", cfg_.max_total_bytes_);
+        print_limit(out, "limit per user", cfg_.max_user_bytes_);
+        print_limit(out, "limit per chat", cfg_.max_chat_bytes_);
+        fprintf(out, "  %-24s %" PRIu64 "\n", "rejected texts",
+                rejected_txts_);
+        for (size_t i = 0; i != n; ++i) {
+            fprintf(out,
+                    "  %-24s %s: %zu bytes in %zu chats\n",
+                    i == 0 ? "largest users" : "",
+                    top[i]->username_->c_str(),
+                    top[i]->stored_bytes_,
+                    top[i]->chats_.size());
+        }
+
+        if (segments_.is_open()) {
+            fprintf(out, "Tiered storage:\n");
+            fprintf(out, "  %-24s %s.*\n", "segment files",
+                    segments_.prefix().c_str());
+            fprintf(out, "  %-24s %" PRId64 " s\n", "evict after",
+                    static_cast<int64_t>(cfg_.evict_after_.count()));
+            fprintf(out, "  %-24s %zu\n", "evicted chats", num_evicted_chats);
+            fprintf(out, "  %-24s %zu (%zu sealed)\n", "files",
+                    segments_.num_files(), segments_.num_sealed());
+            fprintf(out, "  %-24s %" PRIu64 " bytes\n", "file size",
+                    segments_.size());
+            fprintf(out, "  %-24s %" PRIu64 " bytes\n", "garbage",
+                    segments_.garbage());
+            print_latency_header(out);
+            evictions_.print(out, "evictions");
+            fault_ins_.print(out, "fault-ins");
+            mapped_reads_.print(out, "mapped reads");
+        }
+
+        if (cfg_.compress_after_.count() != 0) {
+            const block_cache::stats cs = cache_.get_stats();
+            fprintf(out, "Compression:\n");
+            fprintf(out, "  %-24s %" PRId64 " s\n", "compress after",
+                    static_cast<int64_t>(cfg_.compress_after_.count()));
+            fprintf(out, "  %-24s %zu\n", "compressed chunks",
+                    num_compressed);
+            fprintf(out,
+                    "  %-24s %zu -> %zu bytes (ratio %.2f)\n",
+                    "compressed bytes",
+                    compressed_raw_bytes,
+                    compressed_bytes,
+                    compressed_bytes == 0
+                        ? 0.0
+                        : static_cast<double>(compressed_raw_bytes) /
+                              compressed_bytes);
+            fprintf(out, "  %-24s %" PRIu64 "\n", "incompressible chunks",
+                    incompressible_chunks_);
+            fprintf(out,
+                    "  %-24s %zu of %zu bytes in %zu blocks\n",
+                    "block cache",
+                    cs.bytes_,
+                    cs.capacity_,
+                    cs.blocks_);
+            fprintf(out, "  %-24s %" PRIu64 " hits, %" PRIu64 " misses\n",
+                    "block cache lookups", cs.hits_, cs.misses_);
+            print_latency_header(out);
+            compressions_.print(out, "compressions");
+            print_latency(out,
+                          "decompressions",
+                          cs.misses_,
+                          cs.total_ns_,
+                          cs.max_ns_,
+                          cs.errors_);
+        }
+    }
+
+    fprintf(out, "Database lock profile:\n");
+    mutex_.dump(out);
+}
+
+void database::run_tiering() {
+    // Check a few times per period, so chats are evicted and chunks are
+    // compressed soon after they become due
+    const bool evict = cfg_.evict_after_.count() != 0;
+    const bool compress = cfg_.compress_after_.count() != 0;
+    std::chrono::seconds period = evict ? cfg_.evict_after_
+                                        : cfg_.compress_after_;
+    if (evict && compress) {
+        period = std::min(cfg_.evict_after_, cfg_.compress_after_);
+    }
+    const std::chrono::milliseconds interval =
+        std::max(std::chrono::milliseconds(100),
+                 duration_cast<std::chrono::milliseconds>(period) / 4);
+    std::unique_lock<std::mutex> lock(tiering_mutex_);
+    while (!tiering_cv_.wait_for(lock, interval, [this]() {
+        return stop_tiering_;
+    })) {
+        lock.unlock();
+        if (evict) {
+            evict_idle_chats();
+        }
+        if (compress) {
+            compress_cold_chunks(cfg_.compress_after_);
+        }
+        lock.lock();
+    }
+}
+
+void database::compress_cold_chunks(const steady_clock::duration& min_age) {
+    struct candidate {
+        user_id owner_;
+        user_id correspondent_;
+        conversation::chunk_ref chunk_;
+        std::shared_ptr<const lz_block> block_;
+        uint64_t ns_;
+    };
+
+    // Collect the chunks that are due
+    std::vector<candidate> candidates;
+    {
+        const profiled_lock_guard lock(mutex_, lock_site::compress);
+        const steady_clock::time_point sealed_before =
+            steady_clock::now() - min_age;
+        std::vector<conversation::chunk_ref> chunks;
+        for (size_t id = 0; id != users_.size(); ++id) {
+            for (const auto& chat_it : users_[id].chats_) {
+                chunks.clear();
+                chat_it.second.compressible_chunks(sealed_before, chunks);
+                for (conversation::chunk_ref& ref : chunks) {
+                    candidates.push_back({static_cast<user_id>(id),
+                                          chat_it.first,
+                                          std::move(ref),
+                                          nullptr,
+                                          0});
+                }
+            }
+        }
+    }
+    if (candidates.empty()) {
+        return;
+    }
+
+    // Sealed chunks never change, so they are compressed without holding
+    // the lock. Chunks that don't shrink by at least 1/8 stay as they are.
+    for (candidate& cand : candidates) {
+        const steady_clock::time_point start = steady_clock::now();
+        std::shared_ptr<lz_block> block = std::make_shared<lz_block>();
+        const uint32_t len = cand.chunk_.len_;
+        if (lz_compress(cand.chunk_.data_.get(), len, len - len / 8, *block) ==
+            status::ok) {
+            cand.block_ = std::move(block);
+        }
+        cand.ns_ = static_cast<uint64_t>(
+            duration_cast<nanoseconds>(steady_clock::now() - start).count());
+    }
+
+    const profiled_lock_guard lock(mutex_, lock_site::compress);
+    for (candidate& cand : candidates) {
+        // The chat may have been deleted in the meantime
+        auto chat_it = users_[cand.owner_].chats_.find(cand.correspondent_);
+        if (chat_it == users_[cand.owner_].chats_.end()) {
+            continue;
+        }
+        (*chat_it).second.compress(cand.chunk_, cand.block_);
+        compressions_.record(cand.ns_);
+        if (cand.block_ == nullptr) {
+            ++incompressible_chunks_;
+        }
+    }
+}
+
+void database::evict_idle_chats() {
+    struct candidate {
+        user_id owner_;
+        user_id correspondent_;
+        chat_view view_;
+        std::vector<conversation::compressed_run> compressed_;
+        steady_clock::time_point last_access_;
+    };
+
+    // Take views of all idle chats
+    std::vector<candidate> candidates;
+    {
+        const profiled_lock_guard lock(mutex_, lock_site::evict);
+        const steady_clock::time_point now = steady_clock::now();
+        for (size_t id = 0; id != users_.size(); ++id) {
+            for (const auto& chat_it : users_[id].chats_) {
+                const conversation& c = chat_it.second;
+                if (c.num_resident_texts() == 0 ||
+                    now - c.last_access() < cfg_.evict_after_) {
+                    continue;
+                }
+                candidates.push_back({static_cast<user_id>(id),
+                                      chat_it.first,
+                                      chat_view(),
+                                      {},
+                                      c.last_access()});
+                c.view(candidates.back().view_,
+                       candidates.back().compressed_);
+            }
+        }
+    }
+
+    for (candidate& cand : candidates) {
+        const steady_clock::time_point start = steady_clock::now();
+        segment_store::segment_ref ref;
+        status s = decompress_runs(cand.view_, cand.compressed_);
+        if (s == status::ok) {
+            s = segments_.write(cand.view_, ref);
+        }
+        const uint64_t ns = static_cast<uint64_t>(
+            duration_cast<nanoseconds>(steady_clock::now() - start).count());
+        // Drop the view right away, so the chunks can be freed on eviction
+        cand.view_ = chat_view();
+        cand.compressed_.clear();
+
+        const profiled_lock_guard lock(mutex_, lock_site::evict);
+        if (s != status::ok) {
+            ++evictions_.errors_;
+            continue;
+        }
+        // Only evict the chat if it wasn't used (or deleted) in the meantime
+        auto chat_it = users_[cand.owner_].chats_.find(cand.correspondent_);
+        if (chat_it == users_[cand.owner_].chats_.end() ||
+            (*chat_it).second.last_access() != cand.last_access_) {
+            segments_.release(ref);
+            continue;
+        }
+        (*chat_it).second.evict(ref);
+        evictions_.record(ns);
+    }
+}
+
+status database::add_user(const std::string& username,
+                          const std::string& password) {
+    // Check if the username already exists or has existed before
+    const user_id id = static_cast<user_id>(users_.size());
+    auto inserted = ids_.insert({username, id});
+    if (!inserted.second) {
+        return status::error;
+    }
+
+    user u;
+    u.username_ = &(*inserted.first).first;
+    u.password_ = password;
+    u.deleted_ = false;
+    u.remote_ = false;
+    u.stored_bytes_ = 0;
+    u.sent_bytes_ = 0;
+    users_.push_back(std::move(u));
+
+    record({chat262::mutation::op_registration, username, password, ""});
+    return status::ok;
+}
+
+void database::remove_user(const user_id id) {
+    user& u = users_[id];
+    // For every correspondent, delete their chat with the user. A remote
+    // correspondent's chat is on its shard, unless the correspondent is
+    // moving between shards.
+    for (const auto& chat_it : u.chats_) {
+        user& correspondent = users_[chat_it.first];
+        if (&correspondent == &u) {
+            continue;
+        }
+        if (!exports_.empty()) {
+            keep_exported(chat_it.first,
+                          {chat262::mutation::op_delete_user,
+                           *u.username_,
+                           "",
+                           ""});
+        }
+        remove_chat(correspondent, id);
+    }
+    for (const auto& chat_it : u.chats_) {
+        for (const segment_store::segment_ref& ref :
+             chat_it.second.evicted_segments()) {
+            segments_.release(ref);
+        }
+    }
+    total_bytes_ -= u.stored_bytes_;
+    u.stored_bytes_ = 0;
+    u.sent_bytes_ = 0;
+    // Only the username is kept, so that it cannot be registered again
+    u.deleted_ = true;
+    std::string().swap(u.password_);
+    std::unordered_map<user_id, conversation>().swap(u.chats_);
+    for (auto thread_it = threads_.begin(); thread_it != threads_.end();) {
+        if ((*thread_it).second == id) {
+            thread_it = threads_.erase(thread_it);
+        } else {
+            ++thread_it;
+        }
+    }
+
+    record({chat262::mutation::op_delete_user, *u.username_, "", ""});
+}
+
+void database::record(const chat262::mutation& m) {
+    if (log_ != nullptr) {
+        log_->append(m);
+    }
+    if (journal_ != nullptr) {
+        journal_->append(m);
+    }
+}
+
+status database::apply_mutation(const chat262::mutation& m,
+                                const bool enforce_limits) {
+    user* u;
+    switch (m.op_) {
+    case chat262::mutation::op_registration:
+        return add_user(m.username_, m.arg_);
+    case chat262::mutation::op_send_txt:
+        u = find_user(m.username_);
+        if (u == nullptr) {
+            return status::error;
+        }
+        return store_txt(u, m.arg_, m.txt_, enforce_limits);
+    case chat262::mutation::op_delete_user:
+        u = find_user(m.username_);
+        if (u == nullptr) {
+            return status::error;
+        }
+        remove_user(static_cast<user_id>(u - users_.data()));
+        return status::ok;
+    case chat262::mutation::op_noop:
+        return status::ok;
+    default:
+        return status::body_error;
+    }
+}
+
+void database::remove_chat(user& u, const user_id correspondent) {
+    auto chat_it = u.chats_.find(correspondent);
+    if (chat_it == u.chats_.end()) {
+        return;
+    }
+    const conversation& c = (*chat_it).second;
+    for (const segment_store::segment_ref& ref : c.evicted_segments()) {
+        segments_.release(ref);
+    }
+    u.stored_bytes_ -= c.stored_bytes();
+    u.sent_bytes_ -= sent_bytes(u, correspondent, c);
+    total_bytes_ -= c.stored_bytes();
+    u.chats_.erase(chat_it);
+}
+
+void database::remove_remote(const user_id id) {
+    // A remote user holds no chats, unless it's being imported, so look for
+    // the chats with it in the records of all users
+    for (user_id owner = 0; owner != users_.size(); ++owner) {
+        user& correspondent = users_[owner];
+        if (owner == id || correspondent.chats_.count(id) == 0) {
+            continue;
+        }
+        if (!exports_.empty()) {
+            keep_exported(owner,
+                          {chat262::mutation::op_delete_user,
+                           *users_[id].username_,
+                           "",
+                           ""});
+        }
+        remove_chat(correspondent, id);
+    }
+    user& u = users_[id];
+    while (!u.chats_.empty()) {
+        remove_chat(u, (*u.chats_.begin()).first);
+    }
+    u.deleted_ = true;
+}
+
+void database::keep_exported(const user_id id, chat262::mutation m) {
+    auto it = exports_.find(id);
+    if (it != exports_.end()) {
+        (*it).second.push_back(std::move(m));
+    }
+}
+
+database::user* database::find_remote_user(const std::string& username) {
+    const user_id id = static_cast<user_id>(users_.size());
+    auto inserted = ids_.insert({username, id});
+    if (inserted.second) {
+        user u;
+        u.username_ = &(*inserted.first).first;
+        u.deleted_ = false;
+        u.remote_ = true;
+        u.stored_bytes_ = 0;
+        u.sent_bytes_ = 0;
+        users_.push_back(std::move(u));
+    }
+    user& u = users_[(*inserted.first).second];
+    return u.remote_ && !u.deleted_ ? &u : nullptr;
+}
+
+void database::append_txt(user& u,
+                          const user_id correspondent,
+                          const uint8_t sender,
+                          const std::string& txt) {
+    conversation& c = u.chats_[correspondent];
+    if (cfg_.record_timestamps_) {
+        const uint64_t now_ms = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch())
+                .count());
+        c.append(sender, txt, now_ms);
+    } else {
+        c.append(sender, txt);
+    }
+    const size_t cost = conversation::stored_size(txt.length());
+    const user_id id = static_cast<user_id>(&u - users_.data());
+    u.stored_bytes_ += cost;
+    if (sender == text::sender_you || correspondent == id) {
+        u.sent_bytes_ += cost;
+    }
+    total_bytes_ += cost;
+    peak_bytes_ = std::max(peak_bytes_, total_bytes_);
+
+    if (!exports_.empty()) {
+        // A text to oneself is appended twice, and kept once
+        if (sender == text::sender_you) {
+            keep_exported(id,
+                          {chat262::mutation::op_send_txt,
+                           *u.username_,
+                           *users_[correspondent].username_,
+                           txt});
+        } else if (correspondent != id) {
+            keep_exported(id,
+                          {chat262::mutation::op_send_txt,
+                           *users_[correspondent].username_,
+                           *u.username_,
+                           txt});
+        }
+    }
+}
+
+database::user* database::find_user(const std::string& username) {
+    auto it = ids_.find(username);
+    if (it == ids_.end()) {
+        return nullptr;
+    }
+    user& u = users_[(*it).second];
+    return u.deleted_ ? nullptr : &u;
+}
+
+database::user* database::current_user() {
+    auto thread_it = threads_.find(std::this_thread::get_id());
+    if (thread_it == threads_.end()) {
+        return nullptr;
+    }
+    return &users_[(*thread_it).second];
+}
+
+bool database::within_quota(const user& u,
+                            const user_id correspondent,
+                            const size_t cost) const {
+    if (cfg_.max_user_bytes_ != 0 &&
+        u.sent_bytes_ + cost > cfg_.max_user_bytes_) {
+        return false;
+    }
+    if (cfg_.max_chat_bytes_ != 0) {
+        auto chat_it = u.chats_.find(correspondent);
+        const size_t chat_bytes =
+            chat_it == u.chats_.end()
+                ? 0
+                : sent_bytes(u, correspondent, (*chat_it).second);
+        if (chat_bytes + cost > cfg_.max_chat_bytes_) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t database::sent_bytes(const user& u,
+                            const user_id correspondent,
+                            const conversation& c) const {
+    return &users_[correspondent] == &u ? c.stored_bytes() : c.sent_bytes();
+}
+
 bool database::wildcard_match(const std::string& pattern,
                               const std::string& target) {
     size_t target_idx = 0;
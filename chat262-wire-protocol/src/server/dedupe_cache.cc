@@ -0,0 +1,31 @@
+#include "dedupe_cache.h"
+
+std::shared_ptr<chat262::message> dedupe_cache::find(
+    const uint64_t request_id) const {
+    auto it = responses_.find(request_id);
+    return it == responses_.end() ? nullptr : (*it).second;
+}
+
+void dedupe_cache::insert(const uint64_t request_id,
+                          const std::shared_ptr<chat262::message>& response) {
+    if (order_.size() == capacity) {
+        responses_.erase(order_.front());
+        order_.pop_front();
+    }
+    responses_[request_id] = response;
+    order_.push_back(request_id);
+}
+
+void dedupe_cache::clear() {
+    responses_.clear();
+    order_.clear();
+}
+
+std::vector<dedupe_cache::entry> dedupe_cache::entries() const {
+    std::vector<entry> result;
+    result.reserve(order_.size());
+    for (const uint64_t request_id : order_) {
+        result.emplace_back(request_id, responses_.at(request_id));
+    }
+    return result;
+}
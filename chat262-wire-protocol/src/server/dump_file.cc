@@ -0,0 +1,308 @@
+#include "dump_file.h"
+
+#include "conversation.h"
+#include "endianness.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr size_t header_size = sizeof(dump_header);
+
+// The buffer of a writer is written out once it holds this many bytes
+static constexpr size_t buffer_size = 1024 * 1024;
+
+// Bytes of a user ahead of its username and password
+static constexpr size_t user_fixed_size =
+    sizeof(uint8_t) + 2 * sizeof(uint32_t);
+
+// Bytes of a chat ahead of its segment
+static constexpr size_t chat_fixed_size = 2 * sizeof(uint32_t);
+
+static uint32_t get32(const uint8_t* data) {
+    uint32_t x;
+    memcpy(&x, data, sizeof(x));
+    return e_le32toh(x);
+}
+
+static uint64_t get64(const uint8_t* data) {
+    uint64_t x;
+    memcpy(&x, data, sizeof(x));
+    return e_le64toh(x);
+}
+
+dump_writer::dump_writer() : fd_(-1), offset_(0), num_users_(0) {
+}
+
+dump_writer::~dump_writer() {
+    if (fd_ != -1) {
+        ::close(fd_);
+    }
+}
+
+status dump_writer::open(const std::string& path) {
+    fd_ = ::open(path.c_str(),
+                 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0644);
+    if (fd_ < 0) {
+        return status::error;
+    }
+    buffer_.reserve(buffer_size);
+    // The header is written last, once the counts are known
+    buffer_.resize(header_size);
+    return status::ok;
+}
+
+status dump_writer::add_user(const std::string& username,
+                             const std::string& password,
+                             const bool deleted) {
+    const uint8_t deleted_byte = deleted ? 1 : 0;
+    const uint32_t username_len_le =
+        e_htole32(static_cast<uint32_t>(username.length()));
+    const uint32_t password_len_le =
+        e_htole32(static_cast<uint32_t>(password.length()));
+    ++num_users_;
+    if (put(&deleted_byte, sizeof(deleted_byte)) != status::ok ||
+        put(&username_len_le, sizeof(username_len_le)) != status::ok ||
+        put(&password_len_le, sizeof(password_len_le)) != status::ok ||
+        put(username.data(), username.length()) != status::ok) {
+        return status::error;
+    }
+    return put(password.data(), password.length());
+}
+
+status dump_writer::add_chat(const uint32_t owner,
+                             const uint32_t correspondent,
+                             const chat_view& v) {
+    chat_offsets_.push_back(offset_ + buffer_.size());
+    const uint32_t owner_le = e_htole32(owner);
+    const uint32_t correspondent_le = e_htole32(correspondent);
+    const uint32_t num_txts_le =
+        e_htole32(static_cast<uint32_t>(v.senders_.size()));
+    if (put(&owner_le, sizeof(owner_le)) != status::ok ||
+        put(&correspondent_le, sizeof(correspondent_le)) != status::ok ||
+        put(&num_txts_le, sizeof(num_txts_le)) != status::ok ||
+        put(v.senders_.data(), v.senders_.size()) != status::ok) {
+        return status::error;
+    }
+    for (const uint32_t len : v.lengths_) {
+        const uint32_t len_le = e_htole32(len);
+        if (put(&len_le, sizeof(len_le)) != status::ok) {
+            return status::error;
+        }
+    }
+    for (const chat_view::run& r : v.runs_) {
+        if (put(r.data_.get(), r.len_) != status::ok) {
+            return status::error;
+        }
+    }
+    return status::ok;
+}
+
+status dump_writer::close() {
+    for (const uint64_t offset : chat_offsets_) {
+        const uint64_t offset_le = e_htole64(offset);
+        if (put(&offset_le, sizeof(offset_le)) != status::ok) {
+            return status::error;
+        }
+    }
+    if (flush() != status::ok) {
+        return status::error;
+    }
+
+    dump_header hdr;
+    memcpy(hdr.magic_, dump_magic, sizeof(hdr.magic_));
+    hdr.version_ = e_htole16(dump_version);
+    hdr.flags_ = 0;
+    hdr.reserved_ = 0;
+    hdr.num_users_ = e_htole64(num_users_);
+    hdr.num_chats_ = e_htole64(chat_offsets_.size());
+    if (pwrite(fd_, &hdr, header_size, 0) !=
+            static_cast<ssize_t>(header_size) ||
+        fsync(fd_) != 0) {
+        return status::error;
+    }
+    const int fd = fd_;
+    fd_ = -1;
+    return ::close(fd) == 0 ? status::ok : status::error;
+}
+
+status dump_writer::put(const void* data, const size_t len) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    buffer_.insert(buffer_.end(), bytes, bytes + len);
+    return buffer_.size() >= buffer_size ? flush() : status::ok;
+}
+
+status dump_writer::flush() {
+    size_t total_written = 0;
+    while (total_written != buffer_.size()) {
+        const ssize_t written = write(fd_,
+                                      buffer_.data() + total_written,
+                                      buffer_.size() - total_written);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return status::error;
+        }
+        total_written += static_cast<size_t>(written);
+    }
+    offset_ += buffer_.size();
+    buffer_.clear();
+    return status::ok;
+}
+
+dump_reader::dump_reader()
+    : len_(0),
+      num_users_(0),
+      num_chats_(0),
+      user_offset_(0),
+      index_offset_(0) {
+}
+
+status dump_reader::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return status::error;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<uint64_t>(st.st_size) < header_size) {
+        ::close(fd);
+        return status::error;
+    }
+    const size_t map_len = static_cast<size_t>(st.st_size);
+    void* addr = mmap(nullptr, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping doesn't need the file descriptor
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        return status::error;
+    }
+    std::shared_ptr<const uint8_t> mapping(
+        static_cast<const uint8_t*>(addr),
+        [map_len](const uint8_t* p) {
+            munmap(const_cast<uint8_t*>(p), map_len);
+        });
+
+    dump_header hdr;
+    memcpy(&hdr, mapping.get(), header_size);
+    // The counts must fit in the file before anything is allocated for them
+    const uint64_t num_users = e_le64toh(hdr.num_users_);
+    const uint64_t num_chats = e_le64toh(hdr.num_chats_);
+    if (memcmp(hdr.magic_, dump_magic, sizeof(hdr.magic_)) != 0 ||
+        e_le16toh(hdr.version_) != dump_version ||
+        num_chats > (map_len - header_size) / sizeof(uint64_t) ||
+        num_users > (map_len - header_size) / user_fixed_size) {
+        return status::error;
+    }
+
+    data_ = std::move(mapping);
+    len_ = map_len;
+    num_users_ = num_users;
+    num_chats_ = num_chats;
+    user_offset_ = header_size;
+    index_offset_ = map_len - num_chats * sizeof(uint64_t);
+    return status::ok;
+}
+
+uint64_t dump_reader::num_users() const {
+    return num_users_;
+}
+
+uint64_t dump_reader::num_chats() const {
+    return num_chats_;
+}
+
+status dump_reader::next_user(std::string& username,
+                              std::string& password,
+                              bool& deleted) {
+    if (index_offset_ - user_offset_ < user_fixed_size) {
+        return status::error;
+    }
+    const uint8_t* p = data_.get() + user_offset_;
+    const uint64_t username_len = get32(p + sizeof(uint8_t));
+    const uint64_t password_len =
+        get32(p + sizeof(uint8_t) + sizeof(uint32_t));
+    if (index_offset_ - user_offset_ - user_fixed_size <
+        username_len + password_len) {
+        return status::error;
+    }
+    deleted = p[0] != 0;
+    p += user_fixed_size;
+    username.assign(reinterpret_cast<const char*>(p), username_len);
+    password.assign(reinterpret_cast<const char*>(p + username_len),
+                    password_len);
+    user_offset_ += user_fixed_size + username_len + password_len;
+    return status::ok;
+}
+
+status dump_reader::read_participants(const uint64_t idx,
+                                      uint32_t& owner,
+                                      uint32_t& correspondent) const {
+    const uint64_t offset =
+        get64(data_.get() + index_offset_ + idx * sizeof(uint64_t));
+    if (offset < header_size || offset > index_offset_ ||
+        index_offset_ - offset < chat_fixed_size) {
+        return status::error;
+    }
+    owner = get32(data_.get() + offset);
+    correspondent = get32(data_.get() + offset + sizeof(uint32_t));
+    return status::ok;
+}
+
+status dump_reader::read_chat(const uint64_t idx, chat_view& v) const {
+    const uint64_t offset =
+        get64(data_.get() + index_offset_ + idx * sizeof(uint64_t));
+    const uint64_t end =
+        idx + 1 == num_chats_
+            ? index_offset_
+            : get64(data_.get() + index_offset_ +
+                    (idx + 1) * sizeof(uint64_t));
+    if (offset < header_size || end > index_offset_ || end < offset ||
+        end - offset < chat_fixed_size + sizeof(uint32_t)) {
+        return status::error;
+    }
+
+    // Validate the layout of the segment before trusting any of the lengths
+    const uint8_t* segment = data_.get() + offset + chat_fixed_size;
+    const uint64_t segment_len = end - offset - chat_fixed_size;
+    const uint64_t num_txts = get32(segment);
+    const uint64_t index_len =
+        sizeof(uint32_t) + num_txts * (sizeof(uint8_t) + sizeof(uint32_t));
+    if (segment_len < index_len) {
+        return status::error;
+    }
+    const uint8_t* senders = segment + sizeof(uint32_t);
+    const uint8_t* lengths = senders + num_txts * sizeof(uint8_t);
+    v.senders_.assign(senders, senders + num_txts);
+    v.lengths_.resize(num_txts);
+    uint64_t total_txt_len = 0;
+    for (uint64_t i = 0; i != num_txts; ++i) {
+        if (v.senders_[i] != text::sender_you &&
+            v.senders_[i] != text::sender_other) {
+            return status::error;
+        }
+        v.lengths_[i] = get32(lengths + i * sizeof(uint32_t));
+        if (v.lengths_[i] > conversation::max_txt_len) {
+            return status::error;
+        }
+        total_txt_len += v.lengths_[i];
+    }
+    if (index_len + total_txt_len != segment_len) {
+        return status::error;
+    }
+
+    // The texts are one run, which doesn't own the mapping, so that the
+    // threads that read chats don't share a reference count
+    v.runs_.clear();
+    if (total_txt_len != 0) {
+        v.runs_.push_back({std::shared_ptr<const uint8_t>(
+                               std::shared_ptr<const uint8_t>(),
+                               segment + index_len),
+                           total_txt_len});
+    }
+    return status::ok;
+}
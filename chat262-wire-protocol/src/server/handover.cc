@@ -0,0 +1,388 @@
+#include "handover.h"
+
+#include "endianness.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utility>
+
+// Bytes of a connection message ahead of the username length
+static constexpr size_t conn_fixed_size =
+    sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint8_t);
+
+// Longest message: a connection or a user with a full dedupe cache, or the
+// path of the dump. The cache only holds short responses to writes.
+static constexpr size_t max_msg_size = 64 * 1024;
+
+static void put_u32(std::vector<uint8_t>& data, const uint32_t value) {
+    const uint32_t value_le = e_htole32(value);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value_le);
+    data.insert(data.end(), bytes, bytes + sizeof(value_le));
+}
+
+static void put_string(std::vector<uint8_t>& data, const std::string& str) {
+    put_u32(data, static_cast<uint32_t>(str.length()));
+    data.insert(data.end(), str.begin(), str.end());
+}
+
+static void put_dedupe(std::vector<uint8_t>& data,
+                       const std::vector<dedupe_cache::entry>& dedupe) {
+    put_u32(data, static_cast<uint32_t>(dedupe.size()));
+    for (const dedupe_cache::entry& e : dedupe) {
+        const uint64_t request_id_le = e_htole64(e.first);
+        const uint8_t* bytes =
+            reinterpret_cast<const uint8_t*>(&request_id_le);
+        data.insert(data.end(), bytes, bytes + sizeof(request_id_le));
+        // The header of a message is little-endian already
+        bytes = reinterpret_cast<const uint8_t*>(e.second.get());
+        data.insert(data.end(),
+                    bytes,
+                    bytes + sizeof(chat262::message_header) +
+                        e_le32toh(e.second->hdr_.body_len_));
+    }
+}
+
+// Copy `len` bytes at `pos` of `data` into `out`, and move `pos` past them.
+// @return ok         - The bytes were copied.
+// @return body_error - `data` ends before them.
+static status take(const std::vector<uint8_t>& data,
+                   size_t& pos,
+                   void* out,
+                   const size_t len) {
+    if (data.size() - pos < len) {
+        return status::body_error;
+    }
+    memcpy(out, data.data() + pos, len);
+    pos += len;
+    return status::ok;
+}
+
+static status take_u32(const std::vector<uint8_t>& data,
+                       size_t& pos,
+                       uint32_t& value) {
+    uint32_t value_le;
+    if (take(data, pos, &value_le, sizeof(value_le)) != status::ok) {
+        return status::body_error;
+    }
+    value = e_le32toh(value_le);
+    return status::ok;
+}
+
+static status take_string(const std::vector<uint8_t>& data,
+                          size_t& pos,
+                          std::string& str) {
+    uint32_t len;
+    if (take_u32(data, pos, len) != status::ok || data.size() - pos < len) {
+        return status::body_error;
+    }
+    str.assign(data.begin() + pos, data.begin() + pos + len);
+    pos += len;
+    return status::ok;
+}
+
+static status take_dedupe(const std::vector<uint8_t>& data,
+                          size_t& pos,
+                          std::vector<dedupe_cache::entry>& dedupe) {
+    uint32_t num_responses;
+    if (take_u32(data, pos, num_responses) != status::ok ||
+        num_responses > dedupe_cache::capacity) {
+        return status::body_error;
+    }
+    dedupe.clear();
+    for (uint32_t i = 0; i != num_responses; ++i) {
+        uint64_t request_id_le;
+        chat262::message_header hdr;
+        if (take(data, pos, &request_id_le, sizeof(request_id_le)) !=
+                status::ok ||
+            take(data, pos, &hdr, sizeof(hdr)) != status::ok) {
+            return status::body_error;
+        }
+        const uint32_t body_len = e_le32toh(hdr.body_len_);
+        if (data.size() - pos < body_len) {
+            return status::body_error;
+        }
+        std::shared_ptr<chat262::message> response(
+            static_cast<chat262::message*>(malloc(sizeof(hdr) + body_len)),
+            free);
+        response->hdr_ = hdr;
+        memcpy(response->body_, data.data() + pos, body_len);
+        pos += body_len;
+        dedupe.emplace_back(e_le64toh(request_id_le), std::move(response));
+    }
+    return status::ok;
+}
+
+// Fill `addr` with the Unix socket `path`.
+// @return ok    - `addr` is filled.
+// @return error - `path` is too long for a Unix socket.
+static status make_addr(const std::string& path, sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.length() >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return status::error;
+    }
+    memcpy(addr.sun_path, path.data(), path.length());
+    return status::ok;
+}
+
+// Send `data` in one message, with `pass_fd` attached, unless it is -1
+static status send_with_fd(int fd,
+                           const std::vector<uint8_t>& data,
+                           int pass_fd) {
+    if (data.size() > max_msg_size) {
+        return status::send_error;
+    }
+    iovec iov;
+    iov.iov_base = const_cast<uint8_t*>(data.data());
+    iov.iov_len = data.size();
+    alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (pass_fd != -1) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return sent == static_cast<ssize_t>(data.size()) ? status::ok
+                                                     : status::send_error;
+}
+
+// Receive one message into `data`, and the descriptor attached to it into
+// `passed_fd`. With `want_fd` false, the message must come without one.
+static status recv_with_fd(int fd,
+                           std::vector<uint8_t>& data,
+                           int& passed_fd,
+                           const bool want_fd = true) {
+    data.resize(max_msg_size);
+    iovec iov;
+    iov.iov_base = data.data();
+    iov.iov_len = data.size();
+    alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(int))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    do {
+        received = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0) {
+        return status::receive_error;
+    }
+    data.resize(static_cast<size_t>(received));
+
+    passed_fd = -1;
+    const cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&passed_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if ((passed_fd >= 0) != want_fd ||
+        (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0) {
+        if (passed_fd >= 0) {
+            close(passed_fd);
+        }
+        return status::receive_error;
+    }
+    return status::ok;
+}
+
+status listen_handover(const std::string& path, int& fd) {
+    sockaddr_un addr;
+    if (make_addr(path, addr) != status::ok) {
+        return status::error;
+    }
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return status::error;
+    }
+    // The socket file of the previous server is left behind
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) <
+            0 ||
+        listen(fd, 1) < 0) {
+        const int saved_errno = errno;
+        close(fd);
+        fd = -1;
+        errno = saved_errno;
+        return status::error;
+    }
+    return status::ok;
+}
+
+status connect_handover(const std::string& path, int& fd) {
+    sockaddr_un addr;
+    if (make_addr(path, addr) != status::ok) {
+        return status::error;
+    }
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return status::error;
+    }
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) <
+        0) {
+        close(fd);
+        fd = -1;
+        return status::error;
+    }
+    return status::ok;
+}
+
+status send_handover(int fd,
+                     int listen_fd,
+                     const std::string& dump_path,
+                     const std::vector<handed_connection>& conns,
+                     const std::vector<handed_user>& users) {
+    std::vector<uint8_t> data;
+    put_u32(data, static_cast<uint32_t>(conns.size()));
+    put_u32(data, static_cast<uint32_t>(users.size()));
+    data.insert(data.end(), dump_path.begin(), dump_path.end());
+    if (send_with_fd(fd, data, listen_fd) != status::ok) {
+        return status::send_error;
+    }
+
+    for (const handed_connection& conn : conns) {
+        data.resize(conn_fixed_size);
+        const uint16_t version_le = e_htole16(conn.version_);
+        const uint32_t features_le = e_htole32(conn.features_);
+        memcpy(data.data(), &version_le, sizeof(version_le));
+        memcpy(data.data() + sizeof(version_le),
+               &features_le,
+               sizeof(features_le));
+        data[sizeof(version_le) + sizeof(features_le)] =
+            conn.from_proxy_ ? 1 : 0;
+        put_string(data, conn.username_);
+        put_dedupe(data, conn.dedupe_);
+        if (send_with_fd(fd, data, conn.fd_) != status::ok) {
+            return status::send_error;
+        }
+    }
+    for (const handed_user& user : users) {
+        data.clear();
+        put_string(data, user.username_);
+        put_dedupe(data, user.dedupe_);
+        if (send_with_fd(fd, data, -1) != status::ok) {
+            return status::send_error;
+        }
+    }
+    return status::ok;
+}
+
+status recv_handover(int fd,
+                     int& listen_fd,
+                     std::string& dump_path,
+                     std::vector<handed_connection>& conns,
+                     std::vector<handed_user>& users) {
+    conns.clear();
+    users.clear();
+    std::vector<uint8_t> data;
+    if (recv_with_fd(fd, data, listen_fd) != status::ok) {
+        return status::receive_error;
+    }
+    size_t pos = 0;
+    uint32_t num_conns;
+    uint32_t num_users;
+    if (take_u32(data, pos, num_conns) != status::ok ||
+        take_u32(data, pos, num_users) != status::ok) {
+        close(listen_fd);
+        return status::receive_error;
+    }
+    dump_path.assign(data.begin() + pos, data.end());
+
+    auto discard = [&]() {
+        close(listen_fd);
+        for (const handed_connection& conn : conns) {
+            close(conn.fd_);
+        }
+        conns.clear();
+        users.clear();
+        return status::receive_error;
+    };
+    for (uint32_t i = 0; i != num_conns; ++i) {
+        handed_connection conn;
+        if (recv_with_fd(fd, data, conn.fd_) != status::ok) {
+            return discard();
+        }
+        if (data.size() < conn_fixed_size) {
+            close(conn.fd_);
+            return discard();
+        }
+        uint16_t version_le;
+        uint32_t features_le;
+        memcpy(&version_le, data.data(), sizeof(version_le));
+        memcpy(&features_le,
+               data.data() + sizeof(version_le),
+               sizeof(features_le));
+        conn.version_ = e_le16toh(version_le);
+        conn.features_ = e_le32toh(features_le);
+        conn.from_proxy_ = data[sizeof(version_le) + sizeof(features_le)] != 0;
+        pos = conn_fixed_size;
+        if (take_string(data, pos, conn.username_) != status::ok ||
+            take_dedupe(data, pos, conn.dedupe_) != status::ok ||
+            pos != data.size()) {
+            close(conn.fd_);
+            return discard();
+        }
+        conns.push_back(std::move(conn));
+    }
+    for (uint32_t i = 0; i != num_users; ++i) {
+        int no_fd;
+        handed_user user;
+        pos = 0;
+        if (recv_with_fd(fd, data, no_fd, false) != status::ok ||
+            take_string(data, pos, user.username_) != status::ok ||
+            take_dedupe(data, pos, user.dedupe_) != status::ok ||
+            pos != data.size()) {
+            return discard();
+        }
+        users.push_back(std::move(user));
+    }
+    return status::ok;
+}
+
+status confirm_handover(int fd) {
+    const uint8_t byte = 1;
+    ssize_t sent;
+    do {
+        sent = send(fd, &byte, sizeof(byte), MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return sent == sizeof(byte) ? status::ok : status::send_error;
+}
+
+status wait_handover_confirmed(int fd) {
+    uint8_t byte;
+    ssize_t received;
+    do {
+        received = recv(fd, &byte, sizeof(byte), 0);
+    } while (received < 0 && errno == EINTR);
+    return received == sizeof(byte) ? status::ok : status::receive_error;
+}
+
+void wait_handover_closed(int fd) {
+    uint8_t byte;
+    ssize_t received;
+    do {
+        received = recv(fd, &byte, sizeof(byte), 0);
+    } while (received > 0 || (received < 0 && errno == EINTR));
+}
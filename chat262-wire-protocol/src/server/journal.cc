@@ -0,0 +1,278 @@
+#include "journal.h"
+
+#include "endianness.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+// Sequence number of the last mutation appended by this thread. Every
+// connection is handled by its own thread, so this is also the last mutation
+// of the connection.
+static thread_local uint64_t thread_last_seq = 0;
+
+// Index of the power of two bucket that holds `val`
+static size_t bucket_of(const uint64_t val) {
+    size_t bucket = 0;
+    while (bucket + 1 < journal::num_buckets && (val >> bucket) > 1) {
+        ++bucket;
+    }
+    return bucket;
+}
+
+journal::journal()
+    : fd_(-1),
+      head_(nullptr),
+      next_seq_(1),
+      writer_idle_(false),
+      written_seq_(0),
+      durable_seq_(0),
+      stop_(false),
+      stats_{} {
+}
+
+journal::~journal() {
+    if (writer_.joinable()) {
+        {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        queued_cv_.notify_one();
+        writer_.join();
+    }
+    for (node* n : pending_) {
+        delete n;
+    }
+    node* n = head_.load();
+    while (n != nullptr) {
+        node* next = n->next_;
+        delete n;
+        n = next;
+    }
+    if (fd_ != -1) {
+        close(fd_);
+    }
+}
+
+status journal::open(const std::string& path,
+                     std::vector<chat262::mutation>& mutations) {
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+        return status::error;
+    }
+    std::vector<uint8_t> data;
+    uint8_t buf[64 * 1024];
+    ssize_t readed;
+    while ((readed = read(fd_, buf, sizeof(buf))) > 0) {
+        data.insert(data.end(), buf, buf + readed);
+    }
+    if (readed < 0) {
+        return status::error;
+    }
+
+    // Read batches until one is cut short, malformed, or not the next one
+    mutations.clear();
+    size_t offset = 0;
+    while (data.size() - offset >= sizeof(chat262::message_header)) {
+        const std::vector<uint8_t> hdr_data(
+            data.begin() + offset,
+            data.begin() + offset + sizeof(chat262::message_header));
+        chat262::message_header hdr;
+        if (chat262::message_header::deserialize(hdr_data, hdr) !=
+                status::ok ||
+            hdr.type_ != chat262::msgtype_replicate_request ||
+            data.size() - offset - sizeof(chat262::message_header) <
+                hdr.body_len_) {
+            break;
+        }
+        const size_t body_offset = offset + sizeof(chat262::message_header);
+        const std::vector<uint8_t> body(
+            data.begin() + body_offset,
+            data.begin() + body_offset + hdr.body_len_);
+        uint64_t first_seq;
+        std::vector<chat262::mutation> batch;
+        if (chat262::replicate_request::deserialize(body, first_seq, batch) !=
+                status::ok ||
+            first_seq != mutations.size() + 1) {
+            break;
+        }
+        std::move(batch.begin(), batch.end(), std::back_inserter(mutations));
+        offset = body_offset + hdr.body_len_;
+    }
+    if (offset != data.size()) {
+        logger::log_err("Dropping %zu bytes of a torn batch at the end of the "
+                        "journal %s\n",
+                        data.size() - offset,
+                        path.c_str());
+        if (ftruncate(fd_, offset) != 0 || fdatasync(fd_) != 0) {
+            return status::error;
+        }
+    }
+
+    next_seq_ = mutations.size() + 1;
+    written_seq_ = mutations.size();
+    durable_seq_ = mutations.size();
+    writer_ = std::thread(&journal::run_writer, this);
+    return status::ok;
+}
+
+uint64_t journal::append(chat262::mutation m) {
+    node* n = new node{std::move(m),
+                       next_seq_.fetch_add(1, std::memory_order_relaxed),
+                       steady_clock::now(),
+                       head_.load(std::memory_order_relaxed)};
+    while (!head_.compare_exchange_weak(n->next_, n)) {
+    }
+    // Both the push above and the check below are sequentially consistent.
+    // Either the writer thread sees the mutation before it goes idle, or this
+    // thread sees it idle and wakes it up.
+    if (writer_idle_.load()) {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        queued_cv_.notify_one();
+    }
+    thread_last_seq = n->seq_;
+    return n->seq_;
+}
+
+uint64_t journal::last_appended() {
+    return thread_last_seq;
+}
+
+status journal::wait_durable(const uint64_t seq) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    durable_cv_.wait(lock, [&]() {
+        return durable_seq_ >= seq || stats_.failed_;
+    });
+    return durable_seq_ >= seq ? status::ok : status::error;
+}
+
+journal::stats journal::get_stats() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void journal::run_writer() {
+    while (true) {
+        take_queued();
+        if (!pending_.empty() && pending_.front()->seq_ == written_seq_ + 1) {
+            if (write_batch() != status::ok) {
+                logger::log_err("Could not write the journal: %s\n",
+                                strerror(errno));
+                {
+                    const std::lock_guard<std::mutex> lock(mutex_);
+                    stats_.failed_ = true;
+                }
+                durable_cv_.notify_all();
+                return;
+            }
+            continue;
+        }
+
+        // Nothing to write until more mutations are queued
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stop_ && pending_.empty()) {
+            return;
+        }
+        writer_idle_ = true;
+        queued_cv_.wait(lock, [&]() {
+            return head_.load() != nullptr || stop_;
+        });
+        writer_idle_ = false;
+    }
+}
+
+void journal::take_queued() {
+    node* n = head_.exchange(nullptr);
+    if (n == nullptr) {
+        return;
+    }
+    const size_t old_size = pending_.size();
+    for (; n != nullptr; n = n->next_) {
+        pending_.push_back(n);
+    }
+    // The stack is newest first, and mutations may be queued out of order
+    std::sort(pending_.begin() + old_size,
+              pending_.end(),
+              [](const node* a, const node* b) { return a->seq_ < b->seq_; });
+    std::inplace_merge(
+        pending_.begin(),
+        pending_.begin() + old_size,
+        pending_.end(),
+        [](const node* a, const node* b) { return a->seq_ < b->seq_; });
+}
+
+status journal::write_batch() {
+    const uint64_t first_seq = written_seq_ + 1;
+    size_t num_mutations = 0;
+    while (num_mutations != pending_.size() &&
+           num_mutations != max_batch_mutations &&
+           pending_[num_mutations]->seq_ == first_seq + num_mutations) {
+        ++num_mutations;
+    }
+    std::vector<chat262::mutation> batch;
+    batch.reserve(num_mutations);
+    for (size_t i = 0; i != num_mutations; ++i) {
+        batch.push_back(std::move(pending_[i]->m_));
+    }
+
+    const std::shared_ptr<chat262::message> msg =
+        chat262::replicate_request::serialize(first_seq, batch);
+    const size_t len =
+        sizeof(chat262::message_header) + e_le32toh(msg->hdr_.body_len_);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(msg.get());
+    for (size_t written = 0; written != len;) {
+        const ssize_t n = write(fd_, bytes + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return status::error;
+        }
+        written += n;
+    }
+    const steady_clock::time_point sync_start = steady_clock::now();
+    if (fdatasync(fd_) != 0) {
+        return status::error;
+    }
+    const steady_clock::time_point synced = steady_clock::now();
+    const uint64_t sync_ns = static_cast<uint64_t>(
+        duration_cast<nanoseconds>(synced - sync_start).count());
+
+    written_seq_ = first_seq + num_mutations - 1;
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        durable_seq_ = written_seq_;
+        ++stats_.batches_;
+        stats_.mutations_ += num_mutations;
+        stats_.bytes_ += len;
+        stats_.total_sync_ns_ += sync_ns;
+        stats_.max_sync_ns_ = std::max(stats_.max_sync_ns_, sync_ns);
+        ++stats_.batch_hist_[bucket_of(num_mutations)];
+        for (size_t i = 0; i != num_mutations; ++i) {
+            const uint64_t commit_ns = static_cast<uint64_t>(
+                duration_cast<nanoseconds>(synced - pending_[i]->queued_)
+                    .count());
+            stats_.total_commit_ns_ += commit_ns;
+            stats_.max_commit_ns_ =
+                std::max(stats_.max_commit_ns_, commit_ns);
+            ++stats_.commit_hist_[bucket_of(commit_ns)];
+        }
+    }
+    durable_cv_.notify_all();
+
+    for (size_t i = 0; i != num_mutations; ++i) {
+        delete pending_[i];
+    }
+    pending_.erase(pending_.begin(), pending_.begin() + num_mutations);
+    return status::ok;
+}
@@ -0,0 +1,147 @@
+#include "lock_profiler.h"
+
+#include <cinttypes>
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+const char* lock_site_lookup(const lock_site site) {
+    switch (site) {
+    case lock_site::login:
+        return "login";
+    case lock_site::registration:
+        return "registration";
+    case lock_site::logout:
+        return "logout";
+    case lock_site::is_logged_in:
+        return "is_logged_in";
+    case lock_site::get_usernames:
+        return "get_usernames";
+    case lock_site::send_txt:
+        return "send_txt";
+    case lock_site::recv_txt:
+        return "recv_txt";
+    case lock_site::get_correspondents:
+        return "get_correspondents";
+    case lock_site::delete_user:
+        return "delete_user";
+    case lock_site::dump_stats:
+        return "dump_stats";
+    case lock_site::fault_in:
+        return "fault_in";
+    case lock_site::evict:
+        return "evict";
+    case lock_site::compress:
+        return "compress";
+    case lock_site::apply:
+        return "apply";
+    case lock_site::snapshot:
+        return "snapshot";
+    case lock_site::migrate:
+        return "migrate";
+    case lock_site::load:
+        return "load";
+    default:
+        return "unknown";
+    }
+}
+
+#ifdef CHAT262_LOCK_PROFILING
+
+profiled_mutex::profiled_mutex() {
+    for (site_stats& s : stats_) {
+        s.acquisitions_ = 0;
+        s.wait_ns_ = 0;
+        s.max_wait_ns_ = 0;
+        s.hold_ns_ = 0;
+        s.max_hold_ns_ = 0;
+        for (std::atomic<uint64_t>& b : s.wait_hist_) {
+            b = 0;
+        }
+    }
+}
+
+void profiled_mutex::lock(const lock_site site) {
+    steady_clock::time_point start = steady_clock::now();
+    mutex_.lock();
+    acquired_at_ = steady_clock::now();
+
+    uint64_t wait_ns = static_cast<uint64_t>(
+        duration_cast<nanoseconds>(acquired_at_ - start).count());
+    size_t bucket = 0;
+    while (bucket + 1 < num_buckets && (wait_ns >> bucket) > 1) {
+        ++bucket;
+    }
+
+    // Relaxed ordering is enough, these are only counters
+    site_stats& s = stats_[static_cast<size_t>(site)];
+    s.acquisitions_.fetch_add(1, std::memory_order_relaxed);
+    s.wait_ns_.fetch_add(wait_ns, std::memory_order_relaxed);
+    s.wait_hist_[bucket].fetch_add(1, std::memory_order_relaxed);
+    update_max(s.max_wait_ns_, wait_ns);
+}
+
+void profiled_mutex::unlock(const lock_site site) {
+    uint64_t hold_ns = static_cast<uint64_t>(
+        duration_cast<nanoseconds>(steady_clock::now() - acquired_at_)
+            .count());
+    site_stats& s = stats_[static_cast<size_t>(site)];
+    s.hold_ns_.fetch_add(hold_ns, std::memory_order_relaxed);
+    update_max(s.max_hold_ns_, hold_ns);
+    mutex_.unlock();
+}
+
+void profiled_mutex::dump(FILE* out) const {
+    fprintf(out,
+            "%-20s %12s %12s %12s %12s %12s\n",
+            "site",
+            "acquired",
+            "avg wait ns",
+            "max wait ns",
+            "avg hold ns",
+            "max hold ns");
+    for (size_t i = 0; i != static_cast<size_t>(lock_site::num_sites); ++i) {
+        const site_stats& s = stats_[i];
+        uint64_t n = s.acquisitions_.load(std::memory_order_relaxed);
+        if (n == 0) {
+            continue;
+        }
+        fprintf(out,
+                "%-20s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64
+                " %12" PRIu64 "\n",
+                lock_site_lookup(static_cast<lock_site>(i)),
+                n,
+                s.wait_ns_.load(std::memory_order_relaxed) / n,
+                s.max_wait_ns_.load(std::memory_order_relaxed),
+                s.hold_ns_.load(std::memory_order_relaxed) / n,
+                s.max_hold_ns_.load(std::memory_order_relaxed));
+
+        // Wait time histogram, skipping empty buckets
+        fprintf(out, "%-20s", "  wait histogram");
+        for (size_t b = 0; b != num_buckets; ++b) {
+            uint64_t count = s.wait_hist_[b].load(std::memory_order_relaxed);
+            if (count == 0) {
+                continue;
+            }
+            // The last bucket is open-ended
+            bool last = b + 1 == num_buckets;
+            fprintf(out,
+                    " %s%" PRIu64 "ns:%" PRIu64,
+                    last ? ">=" : "<",
+                    static_cast<uint64_t>(1) << (last ? b : b + 1),
+                    count);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+void profiled_mutex::update_max(std::atomic<uint64_t>& max,
+                                const uint64_t val) {
+    uint64_t curr = max.load(std::memory_order_relaxed);
+    while (val > curr &&
+           !max.compare_exchange_weak(curr, val, std::memory_order_relaxed)) {
+    }
+}
+
+#endif
@@ -0,0 +1,94 @@
+#include "peer_io.h"
+
+#include "endianness.h"
+
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+status connect_peer(const uint32_t n_ip_addr,
+                    const uint32_t n_local_addr,
+                    int& fd) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return status::error;
+    }
+    static constexpr int enable_nodelay = 1;
+    setsockopt(fd,
+               IPPROTO_TCP,
+               TCP_NODELAY,
+               &enable_nodelay,
+               sizeof(enable_nodelay));
+
+    if (n_local_addr != htonl(INADDR_ANY)) {
+        sockaddr_in local_addr;
+        memset(&local_addr, 0, sizeof(local_addr));
+        local_addr.sin_family = AF_INET;
+        local_addr.sin_addr.s_addr = n_local_addr;
+        if (bind(fd, (const sockaddr*) &local_addr, sizeof(local_addr)) < 0) {
+            close(fd);
+            return status::error;
+        }
+    }
+
+    sockaddr_in peer_addr;
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_port = htons(chat262::port);
+    peer_addr.sin_addr.s_addr = n_ip_addr;
+    if (connect(fd, (const sockaddr*) &peer_addr, sizeof(peer_addr)) < 0) {
+        close(fd);
+        return status::error;
+    }
+    return status::ok;
+}
+
+status send_all(int fd, const std::shared_ptr<chat262::message>& msg) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(msg.get());
+    const size_t total_len =
+        sizeof(chat262::message_header) + e_le32toh(msg->hdr_.body_len_);
+    size_t total_sent = 0;
+    while (total_sent != total_len) {
+        ssize_t sent = send(fd,
+                            data + total_sent,
+                            total_len - total_sent,
+                            MSG_NOSIGNAL);
+        if (sent < 0) {
+            return status::send_error;
+        }
+        total_sent += sent;
+    }
+    return status::ok;
+}
+
+status recv_all(int fd, const size_t len, std::vector<uint8_t>& data) {
+    data.resize(len);
+    size_t total_read = 0;
+    while (total_read != len) {
+        ssize_t readed =
+            recv(fd, data.data() + total_read, len - total_read, 0);
+        if (readed < 0) {
+            return status::receive_error;
+        } else if (readed == 0) {
+            return status::closed_connection;
+        }
+        total_read += readed;
+    }
+    return status::ok;
+}
+
+status recv_message(int fd,
+                    chat262::message_header& hdr,
+                    std::vector<uint8_t>& body) {
+    status s = recv_all(fd, sizeof(chat262::message_header), body);
+    if (s != status::ok) {
+        return s;
+    }
+    s = chat262::message_header::deserialize(body, hdr);
+    if (s != status::ok) {
+        return s;
+    }
+    return recv_all(fd, hdr.body_len_, body);
+}
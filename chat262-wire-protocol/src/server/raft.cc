@@ -0,0 +1,1001 @@
+#include "raft.h"
+
+#include "endianness.h"
+#include "logger.h"
+#include "peer_io.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+// How long to wait between attempts to reach a peer. Shorter than the
+// election timeout, so that a restarted server hears from the leader before
+// it starts an election.
+static constexpr std::chrono::milliseconds reconnect_interval(50);
+
+// The state file holds the term, little-endian, and the address voted for in
+// it, in network byte order
+static constexpr size_t state_size = sizeof(uint64_t) + sizeof(uint32_t);
+
+// Approximate memory taken by an entry with `m` in the log
+static size_t entry_size(const chat262::mutation& m) {
+    return sizeof(uint64_t) + sizeof(chat262::mutation) +
+           m.username_.length() + m.arg_.length() + m.txt_.length();
+}
+
+static std::string address_string(const uint32_t n_ip_addr) {
+    char str[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET, &n_ip_addr, str, sizeof(str))) {
+        return "?";
+    }
+    return str;
+}
+
+raft_node::raft_node(database& db)
+    : db_(db),
+      n_ip_addr_(0),
+      log_capacity_(0),
+      stop_(false),
+      role_(role_follower),
+      term_(0),
+      voted_for_(0),
+      state_fd_(-1),
+      state_failed_(false),
+      awaiting_snapshot_(false),
+      catching_up_(false),
+      leader_(0),
+      votes_(0),
+      rng_(std::random_device()()),
+      base_index_(0),
+      base_term_(0),
+      log_bytes_(0),
+      commit_index_(0),
+      last_applied_(0),
+      incoming_{0, 0, {}},
+      stats_() {
+}
+
+raft_node::~raft_node() {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        for (std::unique_ptr<peer>& p : peers_) {
+            if (p->fd_ != -1) {
+                shutdown(p->fd_, SHUT_RDWR);
+            }
+        }
+    }
+    peer_cv_.notify_all();
+    commit_cv_.notify_all();
+    applied_cv_.notify_all();
+    timer_cv_.notify_all();
+    for (std::unique_ptr<peer>& p : peers_) {
+        if (p->thread_.joinable()) {
+            p->thread_.join();
+        }
+    }
+    if (timer_thread_.joinable()) {
+        timer_thread_.join();
+    }
+    if (applier_thread_.joinable()) {
+        applier_thread_.join();
+    }
+    if (state_fd_ != -1) {
+        close(state_fd_);
+    }
+}
+
+status raft_node::open_state(const std::string& path) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    state_fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (state_fd_ < 0) {
+        return status::error;
+    }
+    uint8_t data[state_size];
+    const ssize_t readed = pread(state_fd_, data, sizeof(data), 0);
+    if (readed < 0) {
+        return status::error;
+    }
+    // A new server
+    if (readed == 0) {
+        return status::ok;
+    }
+    if (readed != sizeof(data)) {
+        errno = EINVAL;
+        return status::error;
+    }
+    uint64_t term_le;
+    memcpy(&term_le, data, sizeof(term_le));
+    memcpy(&voted_for_, data + sizeof(term_le), sizeof(voted_for_));
+    term_ = e_le64toh(term_le);
+    awaiting_snapshot_ = true;
+    catching_up_ = true;
+    logger::log_out("Restarted in term %" PRIu64
+                    ", waiting for the leader to catch this server up\n",
+                    term_);
+    return status::ok;
+}
+
+void raft_node::start(const config& cfg) {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        n_ip_addr_ = cfg.n_ip_addr_;
+        log_capacity_ = cfg.log_capacity_;
+        for (const std::pair<uint32_t, std::string>& addr : cfg.peers_) {
+            std::unique_ptr<peer> p(new peer());
+            p->n_ip_addr_ = addr.first;
+            p->str_ip_addr_ = addr.second;
+            p->fd_ = -1;
+            p->broken_ = false;
+            p->next_index_ = 1;
+            p->match_index_ = 0;
+            p->generation_ = 0;
+            p->vote_term_ = 0;
+            p->commit_sent_ = 0;
+            p->snapshot_offset_ = 0;
+            p->snapshot_sent_ = false;
+            p->stats_ = {addr.second, false, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+            peers_.push_back(std::move(p));
+        }
+        reset_election_deadline();
+    }
+
+    for (std::unique_ptr<peer>& p : peers_) {
+        p->thread_ = std::thread(&raft_node::run_peer, this, std::ref(*p));
+    }
+    timer_thread_ = std::thread(&raft_node::run_timer, this);
+    applier_thread_ = std::thread(&raft_node::run_applier, this);
+}
+
+bool raft_node::is_peer(const uint32_t n_ip_addr) const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    for (const std::unique_ptr<peer>& p : peers_) {
+        if (p->n_ip_addr_ == n_ip_addr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+status raft_node::propose(const chat262::mutation& m, status& result) {
+    const steady_clock::time_point start = steady_clock::now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (stop_ || role_ != role_leader) {
+        return status::error;
+    }
+    const uint64_t index = append_entry(term_, m);
+    proposals_[index] = {term_, false, false, status::ok};
+    ++stats_.proposals_;
+    // A single server is its own majority
+    advance_commit();
+    peer_cv_.notify_all();
+
+    applied_cv_.wait_until(lock, start + propose_timeout, [&]() {
+        const proposal& p = proposals_[index];
+        return stop_ || p.done_ || p.lost_;
+    });
+    const proposal p = proposals_[index];
+    proposals_.erase(index);
+    if (!p.done_) {
+        ++stats_.failed_proposals_;
+        return status::error;
+    }
+
+    const uint64_t ns = static_cast<uint64_t>(
+        duration_cast<nanoseconds>(steady_clock::now() - start).count());
+    stats_.total_commit_ns_ += ns;
+    stats_.max_commit_ns_ = std::max(stats_.max_commit_ns_, ns);
+    result = p.result_;
+    return status::ok;
+}
+
+void raft_node::handle_vote(const uint64_t term,
+                            const uint32_t candidate,
+                            const uint64_t last_log_index,
+                            const uint64_t last_log_term,
+                            uint64_t& resp_term,
+                            bool& granted) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    if (term > term_) {
+        become_follower(term);
+    }
+    granted = false;
+    // A server that restarted may lack committed entries that it helped
+    // commit, so it doesn't vote until it holds them again
+    if (term == term_ && !catching_up_ && !state_failed_ &&
+        (voted_for_ == 0 || voted_for_ == candidate)) {
+        // Only vote for a candidate whose log is at least as up to date
+        const uint64_t last = last_index();
+        const uint64_t last_term = term_at(last);
+        if (last_log_term > last_term ||
+            (last_log_term == last_term && last_log_index >= last)) {
+            voted_for_ = candidate;
+            // The vote must survive a restart before it is cast
+            granted = save_state() == status::ok;
+            if (granted) {
+                reset_election_deadline();
+            }
+        }
+    }
+    resp_term = term_;
+}
+
+void raft_node::handle_append(const uint64_t term,
+                              const uint32_t leader,
+                              const uint64_t prev_log_index,
+                              const uint64_t prev_log_term,
+                              const uint64_t leader_commit,
+                              const std::vector<uint64_t>& terms,
+                              const std::vector<chat262::mutation>& mutations,
+                              uint64_t& resp_term,
+                              bool& success,
+                              uint64_t& match_index) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    success = false;
+    match_index = 0;
+    if (term < term_) {
+        resp_term = term_;
+        return;
+    }
+    if (term > term_ || role_ != role_follower) {
+        become_follower(term);
+    }
+    if (leader_ != leader) {
+        leader_ = leader;
+        logger::log_out("Following %s in term %" PRIu64 "\n",
+                        address_string(leader).c_str(),
+                        term_);
+    }
+    reset_election_deadline();
+    resp_term = term_;
+    // A server that restarted takes nothing but a snapshot, so that it
+    // acknowledges no entries while it lacks the ones before them
+    if (awaiting_snapshot_) {
+        return;
+    }
+
+    const uint64_t last = last_index();
+    if (prev_log_index > last) {
+        match_index = last;
+        return;
+    }
+    // The applied entries up to `base_index_` match those of every leader
+    if (prev_log_index > base_index_ &&
+        term_at(prev_log_index) != prev_log_term) {
+        // Skip the entire conflicting term at once
+        const uint64_t conflicting = term_at(prev_log_index);
+        uint64_t first = prev_log_index;
+        while (first - 1 > base_index_ && term_at(first - 1) == conflicting) {
+            --first;
+        }
+        match_index = first - 1;
+        return;
+    }
+
+    for (size_t i = 0; i != mutations.size(); ++i) {
+        const uint64_t index = prev_log_index + 1 + i;
+        if (index <= base_index_) {
+            continue;
+        }
+        if (index <= last_index()) {
+            if (term_at(index) == terms[i]) {
+                continue;
+            }
+            truncate(index);
+        }
+        append_entry(terms[i], mutations[i]);
+    }
+    success = true;
+    match_index = prev_log_index + mutations.size();
+    const uint64_t commit = std::min(leader_commit, match_index);
+    if (commit > commit_index_) {
+        commit_index_ = commit;
+        commit_cv_.notify_all();
+    }
+    // Once the log holds an entry of this term that the leader committed, it
+    // holds every entry committed before, including those that this server
+    // acknowledged before it restarted
+    if (catching_up_ && leader_commit <= match_index &&
+        leader_commit >= base_index_ && term_at(leader_commit) == term_) {
+        catching_up_ = false;
+        logger::log_out("Caught up with the leader in term %" PRIu64 "\n",
+                        term_);
+    }
+}
+
+void raft_node::handle_snapshot(const uint64_t term,
+                                const uint32_t leader,
+                                const uint64_t last_index,
+                                const uint64_t last_term,
+                                const uint64_t offset,
+                                const bool done,
+                                const std::vector<chat262::mutation>& mutations,
+                                uint64_t& resp_term,
+                                uint64_t& received) {
+    snapshot s;
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        received = 0;
+        if (term < term_) {
+            resp_term = term_;
+            return;
+        }
+        if (term > term_ || role_ != role_follower) {
+            become_follower(term);
+        }
+        leader_ = leader;
+        reset_election_deadline();
+        resp_term = term_;
+
+        if (offset == 0) {
+            incoming_ = {last_index, last_term, {}};
+        }
+        // A chunk of another snapshot, or after a missing chunk
+        if (incoming_.last_index_ != last_index ||
+            incoming_.last_term_ != last_term ||
+            incoming_.mutations_.size() != offset) {
+            incoming_ = {0, 0, {}};
+            return;
+        }
+        incoming_.mutations_.insert(
+            incoming_.mutations_.end(), mutations.begin(), mutations.end());
+        received = incoming_.mutations_.size();
+        if (!done) {
+            return;
+        }
+        s = std::move(incoming_);
+        incoming_ = {0, 0, {}};
+    }
+
+    install_snapshot(s);
+    const std::lock_guard<std::mutex> lock(mutex_);
+    awaiting_snapshot_ = false;
+    reset_election_deadline();
+}
+
+raft_node::stats raft_node::get_stats() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    stats s = stats_;
+    s.role_ = role_;
+    s.term_ = term_;
+    s.catching_up_ = catching_up_;
+    s.leader_ = leader_;
+    s.first_index_ = base_index_ + 1;
+    s.last_index_ = last_index();
+    s.commit_index_ = commit_index_;
+    s.last_applied_ = last_applied_;
+    s.log_bytes_ = log_bytes_;
+    for (const std::unique_ptr<peer>& p : peers_) {
+        peer_stats ps = p->stats_;
+        ps.connected_ = p->fd_ != -1;
+        ps.next_index_ = p->next_index_;
+        ps.match_index_ = p->match_index_;
+        s.peers_.push_back(ps);
+    }
+    return s;
+}
+
+void raft_node::run_peer(peer& p) {
+    while (true) {
+        int fd;
+        // The others take Raft requests only from the servers' addresses
+        if (connect_peer(p.n_ip_addr_, n_ip_addr_, fd) == status::ok) {
+            bool stopped = false;
+            {
+                const std::lock_guard<std::mutex> lock(mutex_);
+                if (stop_) {
+                    stopped = true;
+                } else {
+                    p.fd_ = fd;
+                    p.broken_ = false;
+                    // Whatever was in flight on the previous connection is
+                    // lost
+                    p.in_flight_.clear();
+                    ++p.generation_;
+                    p.vote_term_ = 0;
+                    p.next_index_ = p.match_index_ + 1;
+                    // The peer may have restarted and lost its log, so only
+                    // what it acknowledges on this connection counts
+                    p.match_index_ = 0;
+                    p.snapshot_offset_ = 0;
+                    p.snapshot_sent_ = false;
+                    p.last_sent_ = steady_clock::time_point();
+                }
+            }
+            if (stopped) {
+                close(fd);
+                return;
+            }
+            logger::log_out("Connected to peer %s\n", p.str_ip_addr_.c_str());
+            send_requests(p, fd);
+            {
+                const std::lock_guard<std::mutex> lock(mutex_);
+                p.fd_ = -1;
+            }
+            close(fd);
+            logger::log_err("Lost connection to peer %s\n",
+                            p.str_ip_addr_.c_str());
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        peer_cv_.wait_for(lock, reconnect_interval, [&]() {
+            return stop_;
+        });
+        if (stop_) {
+            return;
+        }
+    }
+}
+
+void raft_node::send_requests(peer& p, int fd) {
+    std::thread responses(
+        &raft_node::receive_responses, this, std::ref(p), fd);
+
+    while (true) {
+        std::shared_ptr<chat262::message> msg;
+        bool need_snapshot = false;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!stop_ && !p.broken_) {
+                msg = next_request(p, need_snapshot);
+                if (msg != nullptr || need_snapshot) {
+                    break;
+                }
+                const steady_clock::time_point now = steady_clock::now();
+                steady_clock::time_point wake = now + heartbeat_interval;
+                if (role_ == role_leader &&
+                    p.last_sent_ + heartbeat_interval > now) {
+                    wake = p.last_sent_ + heartbeat_interval;
+                }
+                peer_cv_.wait_until(lock, wake);
+            }
+            if (stop_ || p.broken_) {
+                break;
+            }
+        }
+
+        if (need_snapshot) {
+            if (take_snapshot(p) != status::ok) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                peer_cv_.wait_for(lock, reconnect_interval);
+            }
+            continue;
+        }
+        if (send_all(fd, msg) != status::ok) {
+            break;
+        }
+    }
+
+    shutdown(fd, SHUT_RDWR);
+    responses.join();
+}
+
+std::shared_ptr<chat262::message> raft_node::next_request(
+    peer& p,
+    bool& need_snapshot) {
+    if (p.in_flight_.size() >= window) {
+        return nullptr;
+    }
+    const steady_clock::time_point now = steady_clock::now();
+
+    if (role_ == role_candidate) {
+        if (p.vote_term_ == term_) {
+            return nullptr;
+        }
+        p.vote_term_ = term_;
+        p.in_flight_.push_back({chat262::msgtype_vote_request,
+                                term_,
+                                0,
+                                0,
+                                false,
+                                p.generation_,
+                                now});
+        const uint64_t last = last_index();
+        return chat262::vote_request::serialize(
+            term_, n_ip_addr_, last, term_at(last));
+    }
+    if (role_ != role_leader) {
+        return nullptr;
+    }
+
+    if (p.snapshot_ != nullptr || p.next_index_ <= base_index_) {
+        if (p.snapshot_ == nullptr) {
+            // The last snapshot still connects to the log
+            if (snapshot_ == nullptr || snapshot_->last_index_ < base_index_) {
+                need_snapshot = true;
+                return nullptr;
+            }
+            p.snapshot_ = snapshot_;
+            p.snapshot_offset_ = 0;
+            p.snapshot_sent_ = false;
+        }
+        if (p.snapshot_sent_) {
+            return nullptr;
+        }
+
+        const std::vector<chat262::mutation>& all = p.snapshot_->mutations_;
+        const uint64_t offset = p.snapshot_offset_;
+        std::vector<chat262::mutation> chunk;
+        size_t bytes = 0;
+        for (uint64_t i = offset; i < all.size() &&
+                                  chunk.size() != max_batch_entries &&
+                                  bytes < max_batch_bytes;
+             ++i) {
+            bytes += entry_size(all[i]);
+            chunk.push_back(all[i]);
+        }
+        p.snapshot_offset_ = offset + chunk.size();
+        p.snapshot_sent_ = p.snapshot_offset_ == all.size();
+        p.in_flight_.push_back({chat262::msgtype_snapshot_request,
+                                term_,
+                                p.snapshot_->last_index_,
+                                p.snapshot_offset_,
+                                p.snapshot_sent_,
+                                p.generation_,
+                                now});
+        p.last_sent_ = now;
+        if (offset == 0) {
+            ++p.stats_.snapshots_;
+        }
+        p.stats_.snapshot_mutations_ += chunk.size();
+        return chat262::snapshot_request::serialize(term_,
+                                                    n_ip_addr_,
+                                                    p.snapshot_->last_index_,
+                                                    p.snapshot_->last_term_,
+                                                    offset,
+                                                    p.snapshot_sent_,
+                                                    chunk);
+    }
+
+    // Send an empty append request for a heartbeat, or to tell an idle
+    // follower that its entries were committed
+    const uint64_t last = last_index();
+    const bool heartbeat =
+        now >= p.last_sent_ + heartbeat_interval ||
+        (p.in_flight_.empty() && p.commit_sent_ < commit_index_);
+    if (p.next_index_ > last && !heartbeat) {
+        return nullptr;
+    }
+
+    std::vector<uint64_t> terms;
+    std::vector<chat262::mutation> mutations;
+    size_t bytes = 0;
+    for (uint64_t index = p.next_index_;
+         index <= last && mutations.size() != max_batch_entries &&
+         bytes < max_batch_bytes;
+         ++index) {
+        const entry& e = entries_[index - base_index_ - 1];
+        bytes += entry_size(e.m_);
+        terms.push_back(e.term_);
+        mutations.push_back(e.m_);
+    }
+    const uint64_t prev = p.next_index_ - 1;
+    p.next_index_ += mutations.size();
+    p.in_flight_.push_back({chat262::msgtype_append_request,
+                            term_,
+                            p.next_index_ - 1,
+                            0,
+                            false,
+                            p.generation_,
+                            now});
+    p.last_sent_ = now;
+    p.commit_sent_ = commit_index_;
+    ++p.stats_.appends_;
+    p.stats_.entries_ += mutations.size();
+    return chat262::append_request::serialize(term_,
+                                              n_ip_addr_,
+                                              prev,
+                                              term_at(prev),
+                                              commit_index_,
+                                              terms,
+                                              mutations);
+}
+
+status raft_node::take_snapshot(peer& p) {
+    const std::lock_guard<std::mutex> apply_lock(apply_mutex_);
+    std::shared_ptr<snapshot> s(new snapshot());
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (stop_ || role_ != role_leader) {
+            return status::error;
+        }
+        if (snapshot_ != nullptr && snapshot_->last_index_ >= base_index_) {
+            return status::ok;
+        }
+        s->last_index_ = last_applied_;
+        s->last_term_ = term_at(last_applied_);
+    }
+    // The applier waits for `apply_mutex_`, so the database stays at the
+    // last applied entry. Entries are applied with `database::execute`, so
+    // the database has no sequence numbers of its own.
+    uint64_t seq;
+    if (db_.snapshot(s->mutations_, seq) != status::ok) {
+        logger::log_err("Could not take a snapshot for peer %s\n",
+                        p.str_ip_addr_.c_str());
+        return status::error;
+    }
+    logger::log_out("Took a snapshot of %zu mutations at index %" PRIu64
+                    " for peer %s\n",
+                    s->mutations_.size(),
+                    s->last_index_,
+                    p.str_ip_addr_.c_str());
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    snapshot_ = std::move(s);
+    return status::ok;
+}
+
+void raft_node::receive_responses(peer& p, int fd) {
+    std::vector<uint8_t> data;
+    while (true) {
+        chat262::message_header hdr;
+        if (recv_message(fd, hdr, data) != status::ok) {
+            break;
+        }
+
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (p.in_flight_.empty()) {
+            logger::log_err("Peer %s sent an unexpected %s\n",
+                            p.str_ip_addr_.c_str(),
+                            chat262::message_type_lookup(hdr.type_));
+            break;
+        }
+        const request r = p.in_flight_.front();
+        p.in_flight_.pop_front();
+        // Every response type is its request type plus 100
+        if (hdr.type_ != r.type_ + 100) {
+            logger::log_err("Peer %s sent %s to %s\n",
+                            p.str_ip_addr_.c_str(),
+                            chat262::message_type_lookup(hdr.type_),
+                            chat262::message_type_lookup(r.type_));
+            break;
+        }
+
+        uint64_t term;
+        if (r.type_ == chat262::msgtype_vote_request) {
+            bool granted;
+            if (chat262::vote_response::deserialize(data, term, granted) !=
+                status::ok) {
+                break;
+            }
+            if (term > term_) {
+                become_follower(term);
+            } else if (role_ == role_candidate && r.term_ == term_ &&
+                       granted) {
+                ++votes_;
+                if (votes_ == majority()) {
+                    become_leader();
+                }
+            }
+        } else if (r.type_ == chat262::msgtype_append_request) {
+            bool success;
+            uint64_t match;
+            if (chat262::append_response::deserialize(
+                    data, term, success, match) != status::ok) {
+                break;
+            }
+            const uint64_t ns = static_cast<uint64_t>(
+                duration_cast<nanoseconds>(steady_clock::now() - r.sent_)
+                    .count());
+            p.stats_.total_rtt_ns_ += ns;
+            p.stats_.max_rtt_ns_ = std::max(p.stats_.max_rtt_ns_, ns);
+            if (term > term_) {
+                become_follower(term);
+            } else if (role_ == role_leader && r.term_ == term_) {
+                if (success) {
+                    p.match_index_ = std::max(p.match_index_, match);
+                    advance_commit();
+                } else if (r.generation_ == p.generation_) {
+                    // Go back to the first entry the follower may lack. A
+                    // follower that matches nothing, such as one that
+                    // restarted, gets a snapshot.
+                    p.next_index_ = match == 0 ? 0 : match + 1;
+                    p.match_index_ = std::min(p.match_index_, match);
+                    ++p.generation_;
+                    ++p.stats_.rewinds_;
+                }
+            }
+        } else {
+            uint64_t received;
+            if (chat262::snapshot_response::deserialize(
+                    data, term, received) != status::ok) {
+                break;
+            }
+            if (term > term_) {
+                become_follower(term);
+            } else if (role_ == role_leader && r.term_ == term_ &&
+                       r.generation_ == p.generation_ && r.done_) {
+                if (received == r.received_) {
+                    p.match_index_ = std::max(p.match_index_, r.last_index_);
+                    p.next_index_ = r.last_index_ + 1;
+                    advance_commit();
+                } else {
+                    // The follower missed a chunk. Send the snapshot again.
+                    ++p.generation_;
+                }
+                p.snapshot_ = nullptr;
+            }
+        }
+        peer_cv_.notify_all();
+    }
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    p.broken_ = true;
+    peer_cv_.notify_all();
+}
+
+void raft_node::run_timer() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+        const steady_clock::time_point now = steady_clock::now();
+        if (role_ != role_leader && now >= election_deadline_) {
+            start_election();
+        }
+        const steady_clock::time_point wake =
+            role_ == role_leader ? now + election_timeout : election_deadline_;
+        timer_cv_.wait_until(lock, wake, [&]() {
+            return stop_;
+        });
+    }
+}
+
+void raft_node::run_applier() {
+    std::vector<entry> batch;
+    std::vector<status> results;
+    while (true) {
+        uint64_t first;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            commit_cv_.wait(lock, [&]() {
+                return stop_ || commit_index_ > last_applied_;
+            });
+            if (stop_) {
+                return;
+            }
+            first = last_applied_ + 1;
+            const uint64_t last =
+                std::min(commit_index_, last_applied_ + max_batch_entries);
+            batch.assign(entries_.begin() + (first - base_index_ - 1),
+                         entries_.begin() + (last - base_index_));
+        }
+
+        const std::lock_guard<std::mutex> apply_lock(apply_mutex_);
+        {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            // A snapshot was installed in the meantime
+            if (last_applied_ != first - 1) {
+                continue;
+            }
+        }
+        results.clear();
+        for (const entry& e : batch) {
+            results.push_back(db_.execute(e.m_));
+        }
+
+        const std::lock_guard<std::mutex> lock(mutex_);
+        last_applied_ = first + batch.size() - 1;
+        for (size_t i = 0; i != batch.size(); ++i) {
+            const auto it = proposals_.find(first + i);
+            if (it == proposals_.end()) {
+                continue;
+            }
+            // Another leader replaced the proposed entry
+            if (it->second.term_ != batch[i].term_) {
+                it->second.lost_ = true;
+            } else {
+                it->second.done_ = true;
+                it->second.result_ = results[i];
+            }
+        }
+        compact();
+        applied_cv_.notify_all();
+    }
+}
+
+void raft_node::install_snapshot(const snapshot& s) {
+    const std::lock_guard<std::mutex> apply_lock(apply_mutex_);
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (s.last_index_ <= last_applied_) {
+            return;
+        }
+    }
+    db_.restore(s.mutations_, 0);
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    // Keep the entries after the snapshot if the log agrees with it
+    if (s.last_index_ <= last_index() &&
+        term_at(s.last_index_) == s.last_term_) {
+        while (base_index_ != s.last_index_) {
+            log_bytes_ -= entry_size(entries_.front().m_);
+            entries_.pop_front();
+            ++base_index_;
+        }
+    } else {
+        entries_.clear();
+        log_bytes_ = 0;
+    }
+    base_index_ = s.last_index_;
+    base_term_ = s.last_term_;
+    commit_index_ = std::max(commit_index_, s.last_index_);
+    last_applied_ = s.last_index_;
+    for (std::pair<const uint64_t, proposal>& p : proposals_) {
+        if (p.first <= s.last_index_ && !p.second.done_) {
+            p.second.lost_ = true;
+        }
+    }
+    ++stats_.snapshots_installed_;
+    applied_cv_.notify_all();
+    logger::log_out("Installed a snapshot of %zu mutations at index %" PRIu64
+                    "\n",
+                    s.mutations_.size(),
+                    s.last_index_);
+}
+
+size_t raft_node::majority() const {
+    return (peers_.size() + 1) / 2 + 1;
+}
+
+uint64_t raft_node::last_index() const {
+    return base_index_ + entries_.size();
+}
+
+uint64_t raft_node::term_at(const uint64_t index) const {
+    if (index == base_index_) {
+        return base_term_;
+    }
+    return entries_[index - base_index_ - 1].term_;
+}
+
+uint64_t raft_node::append_entry(const uint64_t term,
+                                 const chat262::mutation& m) {
+    entries_.push_back({term, m});
+    log_bytes_ += entry_size(m);
+    return last_index();
+}
+
+void raft_node::truncate(const uint64_t index) {
+    while (last_index() >= index) {
+        log_bytes_ -= entry_size(entries_.back().m_);
+        entries_.pop_back();
+    }
+    for (std::pair<const uint64_t, proposal>& p : proposals_) {
+        if (p.first >= index) {
+            p.second.lost_ = true;
+        }
+    }
+    applied_cv_.notify_all();
+}
+
+void raft_node::compact() {
+    uint64_t needed = last_applied_;
+    if (role_ == role_leader) {
+        for (const std::unique_ptr<peer>& p : peers_) {
+            needed = std::min(needed, p->match_index_);
+        }
+    } else {
+        // A follower keeps its applied entries in case it becomes the leader
+        needed = base_index_;
+    }
+    while (base_index_ < last_applied_ &&
+           (base_index_ < needed || log_bytes_ > log_capacity_)) {
+        log_bytes_ -= entry_size(entries_.front().m_);
+        base_term_ = entries_.front().term_;
+        entries_.pop_front();
+        ++base_index_;
+    }
+}
+
+void raft_node::advance_commit() {
+    if (role_ != role_leader) {
+        return;
+    }
+    std::vector<uint64_t> matches{last_index()};
+    for (const std::unique_ptr<peer>& p : peers_) {
+        matches.push_back(p->match_index_);
+    }
+    // The highest index stored by a majority
+    std::sort(matches.begin(), matches.end(), std::greater<uint64_t>());
+    const uint64_t index = matches[majority() - 1];
+    // Entries of earlier terms are committed by the entries of this term that
+    // follow them
+    if (index > commit_index_ && term_at(index) == term_) {
+        commit_index_ = index;
+        commit_cv_.notify_all();
+    }
+}
+
+status raft_node::save_state() {
+    uint8_t data[state_size];
+    const uint64_t term_le = e_htole64(term_);
+    memcpy(data, &term_le, sizeof(term_le));
+    memcpy(data + sizeof(term_le), &voted_for_, sizeof(voted_for_));
+    if (pwrite(state_fd_, data, sizeof(data), 0) !=
+            static_cast<ssize_t>(sizeof(data)) ||
+        fdatasync(state_fd_) != 0) {
+        if (!state_failed_) {
+            logger::log_err("Could not write the state file, no longer "
+                            "voting: %s\n",
+                            strerror(errno));
+        }
+        state_failed_ = true;
+        return status::error;
+    }
+    return status::ok;
+}
+
+void raft_node::reset_election_deadline() {
+    std::uniform_int_distribution<int64_t> timeout(
+        election_timeout.count(), 2 * election_timeout.count() - 1);
+    election_deadline_ = steady_clock::now() + milliseconds(timeout(rng_));
+}
+
+void raft_node::start_election() {
+    reset_election_deadline();
+    // A server that restarted waits for the leader to catch it up
+    if (catching_up_ || state_failed_) {
+        return;
+    }
+    ++term_;
+    voted_for_ = n_ip_addr_;
+    // The vote for itself must survive a restart before it asks for others
+    if (save_state() != status::ok) {
+        return;
+    }
+    role_ = role_candidate;
+    leader_ = 0;
+    votes_ = 1;
+    ++stats_.elections_;
+    logger::log_out("Starting an election for term %" PRIu64 "\n", term_);
+    if (votes_ == majority()) {
+        become_leader();
+    }
+    peer_cv_.notify_all();
+}
+
+void raft_node::become_follower(const uint64_t term) {
+    if (role_ == role_leader) {
+        logger::log_out("Stepping down in term %" PRIu64 "\n", term);
+    }
+    if (term > term_) {
+        term_ = term;
+        voted_for_ = 0;
+        leader_ = 0;
+        // A failure stops the server from voting, which is what the term is
+        // kept for
+        save_state();
+    }
+    role_ = role_follower;
+    votes_ = 0;
+}
+
+void raft_node::become_leader() {
+    role_ = role_leader;
+    leader_ = n_ip_addr_;
+    const uint64_t last = last_index();
+    for (std::unique_ptr<peer>& p : peers_) {
+        p->next_index_ = last + 1;
+        p->match_index_ = 0;
+        ++p->generation_;
+        p->snapshot_ = nullptr;
+        p->last_sent_ = steady_clock::time_point();
+    }
+    // The entries of earlier terms are committed once an entry of this term
+    // is
+    append_entry(term_, {chat262::mutation::op_noop, "", "", ""});
+    advance_commit();
+    peer_cv_.notify_all();
+    timer_cv_.notify_all();
+    logger::log_out("Became the leader of term %" PRIu64 "\n", term_);
+}
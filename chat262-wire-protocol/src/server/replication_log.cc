@@ -0,0 +1,164 @@
+#include "replication_log.h"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+// Sequence number of the last mutation appended by this thread. Every
+// connection is handled by its own thread, so this is also the last mutation
+// of the connection.
+static thread_local uint64_t thread_last_seq = 0;
+
+replication_log::replication_log()
+    : first_seq_(1),
+      bytes_(0),
+      capacity_(64 * 1024 * 1024),
+      retain_(false),
+      overflows_(0),
+      replication_timeouts_(0) {
+}
+
+void replication_log::set_capacity(const size_t bytes) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = bytes;
+    shrink();
+}
+
+void replication_log::set_retain(const bool retain) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    retain_ = retain;
+    shrink();
+}
+
+size_t replication_log::add_follower() {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    followers_.push_back({false, 0});
+    return followers_.size() - 1;
+}
+
+uint64_t replication_log::append(chat262::mutation m) {
+    uint64_t seq;
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        seq = first_seq_ + mutations_.size();
+        bytes_ += entry_size(m);
+        mutations_.push_back(std::move(m));
+        shrink();
+    }
+    appended_cv_.notify_all();
+    thread_last_seq = seq;
+    return seq;
+}
+
+uint64_t replication_log::last_appended() {
+    return thread_last_seq;
+}
+
+uint64_t replication_log::last_seq() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return first_seq_ + mutations_.size() - 1;
+}
+
+status replication_log::read(const uint64_t from,
+                             const size_t max_mutations,
+                             const size_t max_bytes,
+                             const std::chrono::milliseconds& timeout,
+                             std::vector<chat262::mutation>& batch) {
+    batch.clear();
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (from < first_seq_) {
+        return status::error;
+    }
+    appended_cv_.wait_for(lock, timeout, [&]() {
+        return from < first_seq_ + mutations_.size();
+    });
+    if (from < first_seq_) {
+        return status::error;
+    }
+
+    const uint64_t end = first_seq_ + mutations_.size();
+    size_t bytes = 0;
+    for (uint64_t seq = from;
+         seq < end && batch.size() != max_mutations && bytes < max_bytes;
+         ++seq) {
+        const chat262::mutation& m = mutations_[seq - first_seq_];
+        bytes += entry_size(m);
+        batch.push_back(m);
+    }
+    return status::ok;
+}
+
+void replication_log::set_connected(const size_t follower,
+                                    const bool connected) {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        followers_[follower].connected_ = connected;
+    }
+    acked_cv_.notify_all();
+}
+
+void replication_log::acknowledge(const size_t follower, const uint64_t seq) {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        follower_state& f = followers_[follower];
+        f.acked_ = std::max(f.acked_, seq);
+        shrink();
+    }
+    acked_cv_.notify_all();
+}
+
+uint64_t replication_log::acknowledged(const size_t follower) const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return followers_[follower].acked_;
+}
+
+status replication_log::wait_replicated(
+    const uint64_t seq,
+    const std::chrono::milliseconds& timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const bool replicated = acked_cv_.wait_for(lock, timeout, [&]() {
+        for (const follower_state& f : followers_) {
+            if (f.connected_ && f.acked_ < seq) {
+                return false;
+            }
+        }
+        return true;
+    });
+    if (!replicated) {
+        ++replication_timeouts_;
+        return status::error;
+    }
+    return status::ok;
+}
+
+replication_log::stats replication_log::get_stats() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return {first_seq_ + mutations_.size() - 1,
+            first_seq_,
+            mutations_.size(),
+            bytes_,
+            capacity_,
+            overflows_,
+            replication_timeouts_};
+}
+
+size_t replication_log::entry_size(const chat262::mutation& m) {
+    return sizeof(chat262::mutation) + m.username_.length() +
+           m.arg_.length() + m.txt_.length();
+}
+
+void replication_log::shrink() {
+    uint64_t acked = std::numeric_limits<uint64_t>::max();
+    for (const follower_state& f : followers_) {
+        acked = std::min(acked, f.acked_);
+    }
+    while (!mutations_.empty() &&
+           ((!retain_ && first_seq_ <= acked) || bytes_ > capacity_)) {
+        if (first_seq_ > acked) {
+            ++overflows_;
+        }
+        bytes_ -= entry_size(mutations_.front());
+        mutations_.pop_front();
+        ++first_seq_;
+    }
+}
@@ -0,0 +1,222 @@
+#include "replicator.h"
+
+#include "endianness.h"
+#include "logger.h"
+#include "peer_io.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+// How long to wait between attempts to reach the follower
+static constexpr std::chrono::milliseconds reconnect_interval(100);
+// How long a read of the log waits for new mutations before checking whether
+// the replicator was stopped
+static constexpr std::chrono::milliseconds read_interval(100);
+
+replicator::replicator(replication_log& log,
+                       const uint32_t n_primary_addr,
+                       const uint32_t n_ip_addr,
+                       const std::string& str_ip_addr)
+    : log_(log),
+      follower_(log.add_follower()),
+      n_primary_addr_(n_primary_addr),
+      n_ip_addr_(n_ip_addr),
+      str_ip_addr_(str_ip_addr),
+      stop_(false),
+      fd_(-1),
+      broken_(false),
+      next_seq_(1),
+      generation_(0),
+      stats_{false, false, 0, 0, 0, 0, 0, 0, 0, 0} {
+}
+
+replicator::~replicator() {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        if (fd_ != -1) {
+            shutdown(fd_, SHUT_RDWR);
+        }
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void replicator::start() {
+    thread_ = std::thread(&replicator::run, this);
+}
+
+const std::string& replicator::address() const {
+    return str_ip_addr_;
+}
+
+replicator::stats replicator::get_stats() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    stats s = stats_;
+    s.acked_ = log_.acknowledged(follower_);
+    return s;
+}
+
+void replicator::run() {
+    while (true) {
+        int fd;
+        if (connect_follower(fd) == status::ok) {
+            logger::log_out("Replicating to %s\n", str_ip_addr_.c_str());
+            log_.set_connected(follower_, true);
+            ship(fd);
+            log_.set_connected(follower_, false);
+            {
+                const std::lock_guard<std::mutex> lock(mutex_);
+                fd_ = -1;
+                stats_.connected_ = false;
+            }
+            close(fd);
+            logger::log_err("Stopped replicating to %s\n",
+                            str_ip_addr_.c_str());
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stats_.lost_) {
+            return;
+        }
+        cv_.wait_for(lock, reconnect_interval, [&]() {
+            return stop_;
+        });
+        if (stop_) {
+            return;
+        }
+    }
+}
+
+status replicator::connect_follower(int& fd) {
+    // The follower takes replicate requests only from the primary's address
+    if (connect_peer(n_ip_addr_, n_primary_addr_, fd) != status::ok) {
+        return status::error;
+    }
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    if (stop_) {
+        close(fd);
+        return status::error;
+    }
+    fd_ = fd;
+    broken_ = false;
+    // Whatever was in flight on the previous connection is lost
+    next_seq_ = log_.acknowledged(follower_) + 1;
+    ++generation_;
+    in_flight_.clear();
+    stats_.connected_ = true;
+    ++stats_.connects_;
+    return status::ok;
+}
+
+void replicator::ship(int fd) {
+    std::thread acks(&replicator::receive_acks, this, fd);
+
+    std::vector<chat262::mutation> mutations;
+    while (true) {
+        uint64_t from;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [&]() {
+                return stop_ || broken_ || in_flight_.size() < window;
+            });
+            if (stop_ || broken_) {
+                break;
+            }
+            from = next_seq_;
+        }
+
+        if (log_.read(from,
+                      max_batch_mutations,
+                      max_batch_bytes,
+                      read_interval,
+                      mutations) != status::ok) {
+            logger::log_err("Follower %s needs mutation %" PRIu64
+                            ", which was dropped from the log\n",
+                            str_ip_addr_.c_str(),
+                            from);
+            const std::lock_guard<std::mutex> lock(mutex_);
+            stats_.lost_ = true;
+            break;
+        }
+        if (mutations.empty()) {
+            continue;
+        }
+
+        std::shared_ptr<chat262::message> msg =
+            chat262::replicate_request::serialize(from, mutations);
+        {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            // The follower asked to go back while the batch was read
+            if (next_seq_ != from) {
+                continue;
+            }
+            next_seq_ = from + mutations.size();
+            in_flight_.push_back(
+                {next_seq_ - 1, generation_, steady_clock::now()});
+            ++stats_.batches_;
+            stats_.mutations_ += mutations.size();
+            stats_.bytes_ += e_le32toh(msg->hdr_.body_len_);
+        }
+        if (send_all(fd, msg) != status::ok) {
+            break;
+        }
+    }
+
+    shutdown(fd, SHUT_RDWR);
+    acks.join();
+}
+
+void replicator::receive_acks(int fd) {
+    std::vector<uint8_t> data;
+    while (true) {
+        chat262::message_header hdr;
+        if (recv_message(fd, hdr, data) != status::ok) {
+            break;
+        }
+        if (hdr.type_ != chat262::msgtype_replicate_response) {
+            logger::log_err("Follower %s sent %s instead of an "
+                            "acknowledgement\n",
+                            str_ip_addr_.c_str(),
+                            chat262::message_type_lookup(hdr.type_));
+            break;
+        }
+        uint64_t last_seq;
+        if (chat262::replicate_response::deserialize(data, last_seq) !=
+            status::ok) {
+            break;
+        }
+
+        log_.acknowledge(follower_, last_seq);
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (in_flight_.empty()) {
+            break;
+        }
+        const batch b = in_flight_.front();
+        in_flight_.pop_front();
+        const uint64_t ns = static_cast<uint64_t>(
+            duration_cast<nanoseconds>(steady_clock::now() - b.sent_).count());
+        stats_.total_rtt_ns_ += ns;
+        stats_.max_rtt_ns_ = std::max(stats_.max_rtt_ns_, ns);
+        if (last_seq < b.last_seq_ && b.generation_ == generation_) {
+            next_seq_ = last_seq + 1;
+            ++generation_;
+            ++stats_.rewinds_;
+        }
+        cv_.notify_all();
+    }
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    broken_ = true;
+    cv_.notify_all();
+}
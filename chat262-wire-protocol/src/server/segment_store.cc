@@ -0,0 +1,397 @@
+#include "segment_store.h"
+
+#include "chat262_protocol.h"
+#include "endianness.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr uint64_t header_size = sizeof(segment_store::file_header);
+
+// Write all `len` bytes of `data` at `offset`
+static status write_all(const int fd,
+                        const uint8_t* data,
+                        const uint64_t len,
+                        const uint64_t offset) {
+    uint64_t total_written = 0;
+    while (total_written < len) {
+        ssize_t written = pwrite(fd,
+                                 data + total_written,
+                                 len - total_written,
+                                 static_cast<off_t>(offset + total_written));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return status::error;
+        }
+        total_written += static_cast<uint64_t>(written);
+    }
+    return status::ok;
+}
+
+// Write the header of a file holding `num_segments` segments in `data_len`
+// bytes
+static status write_header(const int fd,
+                           const uint16_t flags,
+                           const uint32_t num_segments,
+                           const uint64_t data_len) {
+    segment_store::file_header hdr;
+    memcpy(hdr.magic_, segment_store::file_magic, sizeof(hdr.magic_));
+    hdr.version_ = e_htole16(segment_store::file_version);
+    hdr.flags_ = e_htole16(flags);
+    hdr.num_segments_ = e_htole32(num_segments);
+    hdr.data_len_ = e_htole64(data_len);
+    hdr.reserved_ = 0;
+    return write_all(fd,
+                     reinterpret_cast<const uint8_t*>(&hdr),
+                     header_size,
+                     0);
+}
+
+// Parse the segment of `num_txts` texts in the `len` bytes at `data` into `v`
+static status parse_segment(const std::shared_ptr<const uint8_t>& data,
+                            const uint64_t len,
+                            const uint64_t num_txts,
+                            chat_view& v) {
+    // Validate the layout before trusting any of the lengths
+    const uint64_t index_len =
+        sizeof(uint32_t) + num_txts * (sizeof(uint8_t) + sizeof(uint32_t));
+    if (len < index_len) {
+        return status::error;
+    }
+    uint32_t num_txts_le;
+    memcpy(&num_txts_le, data.get(), sizeof(uint32_t));
+    if (e_le32toh(num_txts_le) != num_txts) {
+        return status::error;
+    }
+
+    const uint8_t* senders_ptr = data.get() + sizeof(uint32_t);
+    const uint8_t* lengths_ptr = senders_ptr + num_txts * sizeof(uint8_t);
+    v.senders_.assign(senders_ptr, senders_ptr + num_txts);
+    v.lengths_.resize(num_txts);
+    uint64_t total_txt_len = 0;
+    for (uint64_t i = 0; i != num_txts; ++i) {
+        uint32_t txt_len_le;
+        memcpy(&txt_len_le,
+               lengths_ptr + i * sizeof(uint32_t),
+               sizeof(uint32_t));
+        v.lengths_[i] = e_le32toh(txt_len_le);
+        total_txt_len += v.lengths_[i];
+    }
+    if (index_len + total_txt_len != len) {
+        return status::error;
+    }
+
+    // The texts are one run, which keeps the whole buffer alive
+    v.runs_.clear();
+    if (total_txt_len != 0) {
+        v.runs_.push_back(
+            {std::shared_ptr<const uint8_t>(data, data.get() + index_len),
+             total_txt_len});
+    }
+    return status::ok;
+}
+
+static std::string file_path(const std::string& prefix, const size_t idx) {
+    return prefix + "." + std::to_string(idx);
+}
+
+segment_store::segment_file::segment_file() :
+    fd_(-1),
+    end_(header_size),
+    num_segments_(0),
+    garbage_(0),
+    map_len_(0) {
+}
+
+segment_store::segment_file::~segment_file() {
+    if (fd_ != -1) {
+        close(fd_);
+    }
+}
+
+segment_store::segment_store() :
+    seal_size_(0),
+    size_(0),
+    garbage_(0),
+    num_sealed_(0) {
+}
+
+segment_store::~segment_store() {
+}
+
+status segment_store::open(const std::string& prefix,
+                           const uint64_t seal_size) {
+    const std::lock_guard<std::mutex> write_lock(write_mutex_);
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        files_.clear();
+        size_ = 0;
+        garbage_ = 0;
+        num_sealed_ = 0;
+    }
+    prefix_ = prefix;
+    seal_size_ = seal_size;
+
+    // Segments are of no use after a restart, since the rest of the
+    // database is not persisted
+    for (size_t idx = 0; unlink(file_path(prefix_, idx).c_str()) == 0;
+         ++idx) {
+    }
+    return create_file();
+}
+
+bool segment_store::is_open() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return !files_.empty();
+}
+
+status segment_store::write(const chat_view& v, segment_ref& ref) {
+    // The segment is the body of a receive text response, minus the status
+    // code
+    std::shared_ptr<chat262::message> msg =
+        chat262::recv_txt_response::serialize(chat262::status_code_ok, v);
+    const uint8_t* data = msg->body_ + sizeof(uint32_t);
+    const uint64_t len = e_le32toh(msg->hdr_.body_len_) - sizeof(uint32_t);
+
+    const std::lock_guard<std::mutex> write_lock(write_mutex_);
+    std::shared_ptr<segment_file> active;
+    size_t active_idx;
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (files_.empty()) {
+            return status::error;
+        }
+        active = files_.back();
+        active_idx = files_.size() - 1;
+    }
+
+    // Only writers change `end_`, so it can be read without `mutex_`. A
+    // segment larger than the seal size gets a file of its own.
+    if (active->end_ != header_size && active->end_ + len > seal_size_) {
+        if (seal() != status::ok || create_file() != status::ok) {
+            return status::error;
+        }
+        const std::lock_guard<std::mutex> lock(mutex_);
+        active = files_.back();
+        active_idx = files_.size() - 1;
+    }
+
+    // A failed write leaves nothing behind that can be read, and the next
+    // write overwrites it
+    if (write_all(active->fd_, data, len, active->end_) != status::ok) {
+        return status::error;
+    }
+
+    ref.file_ = static_cast<uint32_t>(active_idx);
+    ref.num_txts_ = static_cast<uint32_t>(v.senders_.size());
+    ref.offset_ = active->end_;
+    ref.len_ = len;
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    active->end_ += len;
+    ++active->num_segments_;
+    size_ += len;
+    return status::ok;
+}
+
+status segment_store::read(const segment_ref& ref, chat_view& v) const {
+    std::shared_ptr<segment_file> f;
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (ref.file_ >= files_.size() || files_[ref.file_] == nullptr) {
+            return status::error;
+        }
+        f = files_[ref.file_];
+        if (f->map_ != nullptr) {
+            if (ref.offset_ < header_size ||
+                ref.offset_ + ref.len_ > f->map_len_) {
+                return status::error;
+            }
+            return parse_segment(
+                std::shared_ptr<const uint8_t>(f->map_,
+                                               f->map_.get() + ref.offset_),
+                ref.len_,
+                ref.num_txts_,
+                v);
+        }
+    }
+
+    // The file is active, so read a copy of the segment
+    std::shared_ptr<uint8_t> data(static_cast<uint8_t*>(malloc(ref.len_)),
+                                  free);
+    uint64_t total_read = 0;
+    while (total_read < ref.len_) {
+        ssize_t n = pread(f->fd_,
+                          data.get() + total_read,
+                          ref.len_ - total_read,
+                          static_cast<off_t>(ref.offset_ + total_read));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return status::error;
+        }
+        total_read += static_cast<uint64_t>(n);
+    }
+    return parse_segment(data, ref.len_, ref.num_txts_, v);
+}
+
+bool segment_store::is_sealed(const segment_ref& ref) const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return ref.file_ < files_.size() && files_[ref.file_] != nullptr &&
+           files_[ref.file_]->map_ != nullptr;
+}
+
+void segment_store::release(const segment_ref& ref) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    if (ref.file_ >= files_.size() || files_[ref.file_] == nullptr) {
+        return;
+    }
+    files_[ref.file_]->garbage_ += ref.len_;
+    garbage_ += ref.len_;
+    delete_if_garbage(ref.file_);
+}
+
+status segment_store::map_sealed(const std::string& path,
+                                 std::shared_ptr<const uint8_t>& data,
+                                 size_t& len) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return status::error;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<uint64_t>(st.st_size) < header_size) {
+        close(fd);
+        return status::error;
+    }
+    const size_t map_len = static_cast<size_t>(st.st_size);
+    void* addr = mmap(nullptr, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping doesn't need the file descriptor
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return status::error;
+    }
+    std::shared_ptr<const uint8_t> mapping(
+        static_cast<const uint8_t*>(addr),
+        [map_len](const uint8_t* p) {
+            munmap(const_cast<uint8_t*>(p), map_len);
+        });
+
+    file_header hdr;
+    memcpy(&hdr, mapping.get(), header_size);
+    if (memcmp(hdr.magic_, file_magic, sizeof(hdr.magic_)) != 0 ||
+        e_le16toh(hdr.version_) != file_version ||
+        (e_le16toh(hdr.flags_) & file_sealed) == 0 ||
+        header_size + e_le64toh(hdr.data_len_) != map_len) {
+        return status::error;
+    }
+
+    data = std::move(mapping);
+    len = map_len;
+    return status::ok;
+}
+
+uint64_t segment_store::size() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return size_;
+}
+
+uint64_t segment_store::garbage() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return garbage_;
+}
+
+size_t segment_store::num_files() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    size_t n = 0;
+    for (const std::shared_ptr<segment_file>& f : files_) {
+        if (f != nullptr) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+size_t segment_store::num_sealed() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return num_sealed_;
+}
+
+const std::string& segment_store::prefix() const {
+    return prefix_;
+}
+
+status segment_store::create_file() {
+    std::shared_ptr<segment_file> f = std::make_shared<segment_file>();
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        f->path_ = file_path(prefix_, files_.size());
+    }
+    f->fd_ = ::open(f->path_.c_str(),
+                    O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0600);
+    if (f->fd_ < 0) {
+        return status::error;
+    }
+    if (write_header(f->fd_, 0, 0, 0) != status::ok) {
+        unlink(f->path_.c_str());
+        return status::error;
+    }
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    files_.push_back(std::move(f));
+    size_ += header_size;
+    return status::ok;
+}
+
+status segment_store::seal() {
+    std::shared_ptr<segment_file> f;
+    size_t idx;
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        f = files_.back();
+        idx = files_.size() - 1;
+    }
+
+    // Map the file the same way an existing file would be opened, so that
+    // a sealed file that doesn't validate is never served
+    std::shared_ptr<const uint8_t> map;
+    size_t map_len;
+    if (write_header(f->fd_,
+                     file_sealed,
+                     f->num_segments_,
+                     f->end_ - header_size) != status::ok ||
+        fdatasync(f->fd_) != 0 ||
+        map_sealed(f->path_, map, map_len) != status::ok) {
+        return status::error;
+    }
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    f->map_ = std::move(map);
+    f->map_len_ = map_len;
+    ++num_sealed_;
+    delete_if_garbage(idx);
+    return status::ok;
+}
+
+void segment_store::delete_if_garbage(const size_t idx) {
+    segment_file& f = *files_[idx];
+    if (f.map_ == nullptr || f.garbage_ != f.end_ - header_size) {
+        return;
+    }
+    // Views of the file keep the mapping alive
+    unlink(f.path_.c_str());
+    size_ -= f.end_;
+    garbage_ -= f.garbage_;
+    --num_sealed_;
+    files_[idx].reset();
+}
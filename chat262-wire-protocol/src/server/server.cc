@@ -1,28 +1,197 @@
 #include "server.h"
 
 #include "chat262_protocol.h"
+#include "dedupe_cache.h"
 #include "endianness.h"
 #include "logger.h"
+#include "tracepoints.h"
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cerrno>
+#include <chrono>
 #include <cinttypes>
 #include <cstring>
+#include <fcntl.h>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdexcept>
 #include <sys/socket.h>
 #include <thread>
 #include <unistd.h>
+#include <vector>
+
+// All servers in this process, whose statistics are dumped on SIGUSR1. There
+// is usually just one, but tests run several servers in one process.
+static std::mutex stats_servers_mutex;
+static std::vector<server*> stats_servers;
+
+// The SIGUSR1 and SIGUSR2 handlers only write a byte into this pipe, which is
+// async-signal-safe. The stats thread reads from the other end and does the
+// actual dumping.
+static int stats_pipe[2] = {-1, -1};
+
+// Bytes written into `stats_pipe` by the signal handlers
+static constexpr uint8_t stats_request = 0;
+static constexpr uint8_t dump_request = 1;
+
+// Version and features negotiated on the connection that this thread handles.
+// Every connection is handled by its own thread.
+static thread_local uint16_t connection_version = chat262::version;
+static thread_local uint32_t connection_features = 0;
+
+// While this thread handles a request relayed by a proxy, the response to the
+// relayed request is kept here instead of being sent. Null otherwise.
+static thread_local std::shared_ptr<chat262::message>* proxied_response =
+    nullptr;
+
+// The connection that this thread handles came from a proxy
+static thread_local bool connection_from_proxy = false;
+
+// Address of the other side of the connection that this thread handles, in
+// network byte order
+static thread_local uint32_t connection_addr = 0;
+
+// Responses to the last writes with request IDs on the connection that this
+// thread handles while no user is logged in
+static thread_local dedupe_cache connection_dedupe;
+
+// While this thread handles a write with a request ID, the response to it is
+// also kept here, before it is compressed. Null otherwise.
+static thread_local std::shared_ptr<chat262::message>* kept_response =
+    nullptr;
+
+// Snapshot that the read replica on the connection that this thread handles
+// receives in chunks, and the sequence number of its last mutation
+static thread_local std::vector<chat262::mutation> connection_snapshot;
+static thread_local uint64_t connection_snapshot_seq = 0;
+
+// Features that the server enables when a client asks for them. Requests are
+// handled one at a time in the order they arrive, so pipelining needs nothing
+// else. Read tokens are 0 on a server that keeps no replication log.
+static constexpr uint32_t supported_features = chat262::feature_compression |
+                                               chat262::feature_pipelining |
+                                               chat262::feature_read_tokens |
+                                               chat262::feature_request_ids;
+
+// How long a synchronous write waits for the followers before it is answered
+// anyway
+static constexpr std::chrono::milliseconds replication_timeout(1000);
+
+// Longest waits of a tail request for new mutations, and of a sync request
+// for the write of its token, whatever the request asks for
+static constexpr std::chrono::milliseconds max_tail_wait(1000);
+static constexpr std::chrono::milliseconds max_sync_wait(10000);
+
+// Longest wait for the connections to finish their requests and park when a
+// handover starts
+static constexpr std::chrono::milliseconds max_park_wait(5000);
+
+// Form the OK response of type `Response` to a write of this connection, with
+// the read token of the write if the connection negotiated
+// `feature_read_tokens`. The token is the sequence number of the mutation of
+// the write in the replication log.
+template <typename Response>
+static std::shared_ptr<chat262::message> write_ok_response() {
+    if ((connection_features & chat262::feature_read_tokens) == 0) {
+        return Response::serialize(chat262::status_code_ok);
+    }
+    return Response::serialize(chat262::status_code_ok,
+                               replication_log::last_appended());
+}
+
+// Print the non-empty buckets of the power of two histogram `hist` of
+// `num_buckets` buckets on one line, labeled `label`, with `unit` after every
+// bucket bound
+static void print_histogram(FILE* out,
+                            const char* label,
+                            const uint64_t* hist,
+                            const size_t num_buckets,
+                            const char* unit) {
+    fprintf(out, "  %-24s", label);
+    for (size_t b = 0; b != num_buckets; ++b) {
+        if (hist[b] == 0) {
+            continue;
+        }
+        // The last bucket is open-ended
+        const bool last = b + 1 == num_buckets;
+        fprintf(out,
+                " %s%" PRIu64 "%s:%" PRIu64,
+                last ? ">=" : "<",
+                static_cast<uint64_t>(1) << (last ? b : b + 1),
+                unit,
+                hist[b]);
+    }
+    fprintf(out, "\n");
+}
+
+static void handle_sigusr1(int) {
+    ssize_t written =
+        write(stats_pipe[1], &stats_request, sizeof(stats_request));
+    (void) written;
+}
 
-server::server() : server_fd_(-1), n_ip_addr_(0) {
+static void handle_sigusr2(int) {
+    ssize_t written = write(stats_pipe[1], &dump_request, sizeof(dump_request));
+    (void) written;
+}
+
+server::server()
+    : server_fd_(-1),
+      n_ip_addr_(0),
+      compressed_msgs_(0),
+      compressed_raw_bytes_(0),
+      compressed_wire_bytes_(0),
+      sync_replication_(false),
+      backup_(false),
+      n_primary_addr_(0),
+      replicated_batches_(0),
+      replicated_seq_(0),
+      tail_log_(false),
+      tail_requests_(0),
+      tail_mutations_(0),
+      tail_snapshots_(0),
+      syncs_(0),
+      stale_syncs_(0),
+      proxied_reqs_(0),
+      replayed_reqs_(0),
+      handover_fd_(-1),
+      handover_wake_{-1, -1},
+      active_conns_(0),
+      acceptor_parked_(false),
+      handing_over_(false),
+      taken_over_conns_(0),
+      take_over_time_(0),
+      failed_handovers_(0) {
 }
 
 server::~server() {
+    {
+        const std::lock_guard<std::mutex> lock(stats_servers_mutex);
+        for (auto it = stats_servers.begin(); it != stats_servers.end();
+             ++it) {
+            if (*it == this) {
+                stats_servers.erase(it);
+                break;
+            }
+        }
+    }
     // If the socket descriptor was open, close it
     if (server_fd_ != -1) {
         close(server_fd_);
     }
+    if (handover_fd_ != -1) {
+        close(handover_fd_);
+    }
+    for (int fd : handover_wake_) {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
 }
 
 status server::run(int argc, char const* const* argv) {
@@ -41,49 +210,491 @@ status server::run(int argc, char const* const* argv) {
     }
 
     n_ip_addr_ = args.n_ip_addr_;
-    str_ip_addr_ = argv[1];
+    str_ip_addr_ = args.str_ip_addr_;
+    database_.configure(args.db_cfg_);
+    dump_path_ = args.dump_path_;
+    handover_path_ = args.handover_path_;
+    // A running server with the same handover socket is taken over, and the
+    // dump it hands over replaces the one to load
+    int predecessor_fd = -1;
+    std::vector<handed_connection> taken_over;
+    if (!handover_path_.empty() &&
+        connect_handover(handover_path_, predecessor_fd) == status::ok) {
+        if (take_over(predecessor_fd, taken_over) != status::ok) {
+            close(predecessor_fd);
+            return status::error;
+        }
+    } else if (!args.load_path_.empty()) {
+        const std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        const size_t num_threads =
+            std::max(std::thread::hardware_concurrency(), 1u);
+        if (database_.load_dump(args.load_path_, num_threads) != status::ok) {
+            logger::log_err("Could not load the dump %s\n",
+                            args.load_path_.c_str());
+            return status::error;
+        }
+        logger::log_out("Loaded the dump %s in %.3f s with %zu threads\n",
+                        args.load_path_.c_str(),
+                        std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start)
+                            .count(),
+                        num_threads);
+    }
+    if (!args.journal_path_.empty()) {
+        journal_ = std::make_unique<journal>();
+        std::vector<chat262::mutation> mutations;
+        if (journal_->open(args.journal_path_, mutations) != status::ok) {
+            logger::log_err("Could not open the journal %s: %s\n",
+                            args.journal_path_.c_str(),
+                            strerror(errno));
+            return status::error;
+        }
+        // The dump of the previous server already holds the mutations
+        if (predecessor_fd != -1) {
+            mutations.clear();
+        }
+        if (database_.replay(mutations) != status::ok) {
+            logger::log_err("The journal %s holds an unknown mutation\n",
+                            args.journal_path_.c_str());
+            return status::error;
+        }
+        logger::log_out("Restored %zu mutations from the journal %s\n",
+                        mutations.size(),
+                        args.journal_path_.c_str());
+        database_.set_journal(journal_.get());
+    }
+    sync_replication_ = args.sync_replication_;
+    backup_ = args.backup_;
+    n_primary_addr_ = args.backup_of_.first;
+    tail_log_ = args.tail_log_;
+    for (const auto& replica : args.replicas_) {
+        replicas_.push_back(replica.first);
+    }
+    for (const auto& proxy : args.proxies_) {
+        proxies_.push_back(proxy.first);
+    }
+    if (!args.followers_.empty() || tail_log_) {
+        log_.set_capacity(args.log_bytes_);
+        log_.set_retain(tail_log_);
+        database_.set_replication_log(&log_);
+        for (const auto& follower : args.followers_) {
+            replicators_.push_back(std::make_unique<replicator>(
+                log_, n_ip_addr_, follower.first, follower.second));
+        }
+    }
+    if (!args.peers_.empty()) {
+        raft_ = std::make_unique<raft_node>(database_);
+        if (raft_->open_state(args.raft_state_path_) != status::ok) {
+            logger::log_err("Could not open the state file %s: %s\n",
+                            args.raft_state_path_.c_str(),
+                            strerror(errno));
+            return status::error;
+        }
+    }
+    if (!args.primary_.second.empty()) {
+        tailer_ = std::make_unique<tailer>(database_,
+                                           n_ip_addr_,
+                                           args.primary_.first,
+                                           args.primary_.second);
+    }
+    if (!args.shards_.empty()) {
+        router_ = std::make_unique<shard_router>(database_,
+                                                 args.n_ip_addr_,
+                                                 args.shards_);
+    }
+    if (predecessor_fd != -1) {
+        // The previous server must be gone before its segment files are
+        // replaced
+        if (confirm_handover(predecessor_fd) != status::ok) {
+            logger::log_err("%s", "The previous server went away\n");
+            for (const handed_connection& conn : taken_over) {
+                close(conn.fd_);
+            }
+            close(predecessor_fd);
+            return status::error;
+        }
+        wait_handover_closed(predecessor_fd);
+        close(predecessor_fd);
+    }
+    if (database_.start_tiering() != status::ok) {
+        logger::log_err("Could not create the segment file %s.0: %s\n",
+                        args.db_cfg_.segment_path_.c_str(),
+                        strerror(errno));
+        return status::error;
+    }
 
     status s = start_listening();
     if (s != status::ok) {
         return s;
     }
 
+    s = start_stats_reporter();
+    if (s != status::ok) {
+        return s;
+    }
+
+    if (!handover_path_.empty()) {
+        s = start_handover_listener();
+        if (s != status::ok) {
+            return s;
+        }
+    }
+    for (handed_connection& conn : taken_over) {
+        {
+            const std::lock_guard<std::mutex> lock(handover_mutex_);
+            ++active_conns_;
+        }
+        std::thread t(&server::resume_client, this, std::move(conn));
+        t.detach();
+    }
+
+    for (std::unique_ptr<replicator>& r : replicators_) {
+        r->start();
+    }
+    if (raft_) {
+        raft_->start({n_ip_addr_, args.peers_, args.log_bytes_});
+    }
+    if (tailer_) {
+        tailer_->start();
+    }
     start_accepting();
 
     return status::ok;
 }
 
+// Parse a size in bytes, optionally followed by a K, M or G suffix
+static size_t parse_size(const char* str) {
+    size_t pos;
+    unsigned long long value = std::stoull(str, &pos);
+    const std::string suffix(str + pos);
+    if (suffix == "K") {
+        value <<= 10;
+    } else if (suffix == "M") {
+        value <<= 20;
+    } else if (suffix == "G") {
+        value <<= 30;
+    } else if (!suffix.empty()) {
+        throw std::invalid_argument("Invalid size \"" + std::string(str) +
+                                    "\"");
+    }
+    return static_cast<size_t>(value);
+}
+
 server::cmdline_args server::parse_args(const int argc,
                                         char const* const* argv) const {
-    if (argc != 2 && argc != 3) {
-        throw std::invalid_argument("Wrong number of arguments");
+    cmdline_args args;
+    args.help_ = false;
+    args.sync_replication_ = false;
+    args.log_bytes_ = 64 * 1024 * 1024;
+    args.backup_ = false;
+    args.backup_of_ = {0, ""};
+    args.tail_log_ = false;
+    args.primary_ = {0, ""};
+    args.db_cfg_ =
+        database::config{false,
+                         0,
+                         0,
+                         0,
+                         std::chrono::seconds(0),
+                         "",
+                         64 * 1024 * 1024,
+                         std::chrono::seconds(0),
+                         8 * 1024 * 1024};
+
+    // `getopt` keeps its state in globals, so start from scratch in case
+    // arguments were parsed before
+    optind = 1;
+    int opt;
+    while ((opt = getopt(argc,
+                         const_cast<char* const*>(argv),
+                         "hTu:c:m:e:f:s:z:Z:r:SL:b:p:v:t:R:H:j:l:x:U:P:")) !=
+           -1) {
+        switch (opt) {
+        case 'h':
+            args.help_ = true;
+            return args;
+        case 'T':
+            args.db_cfg_.record_timestamps_ = true;
+            break;
+        case 'u':
+            args.db_cfg_.max_user_bytes_ = parse_size(optarg);
+            break;
+        case 'c':
+            args.db_cfg_.max_chat_bytes_ = parse_size(optarg);
+            break;
+        case 'm':
+            args.db_cfg_.max_total_bytes_ = parse_size(optarg);
+            break;
+        case 'e':
+            args.db_cfg_.evict_after_ =
+                std::chrono::seconds(std::stoul(optarg));
+            break;
+        case 'f':
+            args.db_cfg_.segment_path_ = optarg;
+            break;
+        case 's':
+            args.db_cfg_.segment_file_size_ = parse_size(optarg);
+            break;
+        case 'z':
+            args.db_cfg_.compress_after_ =
+                std::chrono::seconds(std::stoul(optarg));
+            break;
+        case 'Z':
+            args.db_cfg_.block_cache_bytes_ = parse_size(optarg);
+            break;
+        case 'r': {
+            uint32_t n_follower_addr;
+            if (inet_pton(AF_INET, optarg, &n_follower_addr) != 1) {
+                throw std::invalid_argument("Invalid follower IP address");
+            }
+            args.followers_.push_back({n_follower_addr, optarg});
+            break;
+        }
+        case 'S':
+            args.sync_replication_ = true;
+            break;
+        case 'L':
+            args.log_bytes_ = parse_size(optarg);
+            break;
+        case 'b': {
+            uint32_t n_primary_addr;
+            if (inet_pton(AF_INET, optarg, &n_primary_addr) != 1) {
+                throw std::invalid_argument("Invalid primary IP address");
+            }
+            args.backup_ = true;
+            args.backup_of_ = {n_primary_addr, optarg};
+            break;
+        }
+        case 'p': {
+            uint32_t n_peer_addr;
+            if (inet_pton(AF_INET, optarg, &n_peer_addr) != 1) {
+                throw std::invalid_argument("Invalid peer IP address");
+            }
+            args.peers_.push_back({n_peer_addr, optarg});
+            break;
+        }
+        case 'v':
+            args.raft_state_path_ = optarg;
+            break;
+        case 't': {
+            uint32_t n_replica_addr;
+            if (inet_pton(AF_INET, optarg, &n_replica_addr) != 1) {
+                throw std::invalid_argument("Invalid replica IP address");
+            }
+            args.tail_log_ = true;
+            args.replicas_.push_back({n_replica_addr, optarg});
+            break;
+        }
+        case 'R': {
+            uint32_t n_primary_addr;
+            if (inet_pton(AF_INET, optarg, &n_primary_addr) != 1) {
+                throw std::invalid_argument("Invalid primary IP address");
+            }
+            args.primary_ = {n_primary_addr, optarg};
+            break;
+        }
+        case 'H': {
+            uint32_t n_shard_addr;
+            if (inet_pton(AF_INET, optarg, &n_shard_addr) != 1) {
+                throw std::invalid_argument("Invalid shard IP address");
+            }
+            args.shards_.push_back({n_shard_addr, optarg});
+            break;
+        }
+        case 'j':
+            args.journal_path_ = optarg;
+            break;
+        case 'l':
+            args.load_path_ = optarg;
+            break;
+        case 'x':
+            args.dump_path_ = optarg;
+            break;
+        case 'U':
+            args.handover_path_ = optarg;
+            break;
+        case 'P': {
+            uint32_t n_proxy_addr;
+            if (inet_pton(AF_INET, optarg, &n_proxy_addr) != 1) {
+                throw std::invalid_argument("Invalid proxy IP address");
+            }
+            args.proxies_.push_back({n_proxy_addr, optarg});
+            break;
+        }
+        default:
+            throw std::invalid_argument("Invalid option");
+        }
     }
 
-    cmdline_args args;
-    // Look for "-h"
-    if (strcmp(argv[1], "-h") == 0 ||
-        (argc == 3 && strcmp(argv[2], "-h") == 0)) {
-        args.help_ = true;
-        return args;
-    } else {
-        args.help_ = false;
+    if (optind != argc - 1) {
+        throw std::invalid_argument("Wrong number of arguments");
+    }
+    if (args.db_cfg_.evict_after_.count() != 0 &&
+        args.db_cfg_.segment_path_.empty()) {
+        throw std::invalid_argument("Eviction requires a segment file (-f)");
+    }
+    if (args.backup_ && (!args.followers_.empty() || args.tail_log_)) {
+        throw std::invalid_argument(
+            "A backup can't have followers or read replicas");
+    }
+    if (!args.peers_.empty() &&
+        (args.backup_ || !args.followers_.empty() || args.tail_log_)) {
+        throw std::invalid_argument("A server of a Raft cluster can't have "
+                                    "followers or read replicas, or be a "
+                                    "backup");
+    }
+    if (!args.peers_.empty() && args.raft_state_path_.empty()) {
+        throw std::invalid_argument("A server of a Raft cluster needs a "
+                                    "state file (-v)");
+    }
+    if (args.peers_.empty() && !args.raft_state_path_.empty()) {
+        throw std::invalid_argument("Only a server of a Raft cluster has a "
+                                    "state file (-v)");
+    }
+    if (!args.primary_.second.empty() &&
+        (args.backup_ || !args.followers_.empty() || args.tail_log_ ||
+         !args.peers_.empty())) {
+        throw std::invalid_argument("A read replica can't have followers or "
+                                    "read replicas, or be a backup or a "
+                                    "server of a Raft cluster");
+    }
+    if (!args.shards_.empty() &&
+        (args.backup_ || !args.followers_.empty() || args.tail_log_ ||
+         !args.peers_.empty() || !args.primary_.second.empty())) {
+        throw std::invalid_argument("A shard can't have followers or read "
+                                    "replicas, or be a backup, a server of a "
+                                    "Raft cluster or a read replica");
+    }
+    if (!args.journal_path_.empty() &&
+        (args.backup_ || !args.peers_.empty() ||
+         !args.primary_.second.empty() || !args.shards_.empty())) {
+        throw std::invalid_argument("A backup, a server of a Raft cluster, "
+                                    "a read replica or a shard can't keep a "
+                                    "journal");
+    }
+    if (!args.load_path_.empty() && !args.journal_path_.empty()) {
+        throw std::invalid_argument("The journal already holds the writes in "
+                                    "a dump, so a dump can't be loaded with "
+                                    "-j");
+    }
+    if (!args.load_path_.empty() && args.db_cfg_.record_timestamps_) {
+        throw std::invalid_argument("A dump holds no send times, so it can't "
+                                    "be loaded with -T");
+    }
+    if (!args.load_path_.empty() &&
+        (!args.followers_.empty() || args.tail_log_ || args.backup_ ||
+         !args.peers_.empty() || !args.primary_.second.empty() ||
+         !args.shards_.empty())) {
+        throw std::invalid_argument("A server with followers or read "
+                                    "replicas, a backup, a server of a Raft "
+                                    "cluster, a read replica or a shard "
+                                    "can't load a dump");
+    }
+    if (!args.dump_path_.empty() && !args.shards_.empty()) {
+        throw std::invalid_argument("A shard can't write a dump");
+    }
+    if (!args.handover_path_.empty() && args.db_cfg_.record_timestamps_) {
+        throw std::invalid_argument("A hot restart hands over no send times, "
+                                    "so it can't be used with -T");
+    }
+    if (!args.handover_path_.empty() &&
+        (!args.followers_.empty() || args.tail_log_ || args.backup_ ||
+         !args.peers_.empty() || !args.primary_.second.empty() ||
+         !args.shards_.empty())) {
+        throw std::invalid_argument("A server with followers or read "
+                                    "replicas, a backup, a server of a Raft "
+                                    "cluster, a read replica or a shard "
+                                    "can't be restarted hot");
     }
     // Parse the IP address
-    if (inet_pton(AF_INET, argv[1], &(args.n_ip_addr_)) != 1) {
+    if (inet_pton(AF_INET, argv[optind], &(args.n_ip_addr_)) != 1) {
         throw std::invalid_argument("Invalid IP address");
     }
+    args.str_ip_addr_ = argv[optind];
     return args;
 }
 
 void server::usage(char const* prog) const {
     std::cerr << "usage: " << prog
-              << " [-h] <ip address>\n"
+              << " [-h] [-T] [-u bytes] [-c bytes] [-m bytes]\n"
+                 "       [-e seconds -f prefix [-s bytes]] [-j path]\n"
+                 "       [-l path] [-x path] [-U path]\n"
+                 "       [-z seconds [-Z bytes]] [-P ip address]\n"
+                 "       [[-r ip address [-S]] [-t ip address] [-L bytes] |\n"
+                 "        -b ip address | -p ip address -v path [-L bytes] |\n"
+                 "        -R ip address | -H ip address]\n"
+                 "       <ip address>\n"
                  "\n"
                  "Start the Chat262 server on IP address <ip address>.\n"
                  "The address should be in the xxx.xxx.xxx.xxx format.\n"
                  "\n"
                  "Options:\n"
-                 "\t-h\t\t Display this message and exit.\n";
+                 "\t-h\t\t Display this message and exit.\n"
+                 "\t-T\t\t Record the time every text was sent.\n"
+                 "\t-u bytes\t Limit the bytes of the texts one user sent,\n"
+                 "\t\t\t in all chats.\n"
+                 "\t-c bytes\t Limit the bytes of the texts one user sent,\n"
+                 "\t\t\t in one chat.\n"
+                 "\t-m bytes\t Limit the bytes stored in the whole server.\n"
+                 "\t-e seconds\t Evict chats that are not used for <seconds>\n"
+                 "\t\t\t to the disk.\n"
+                 "\t-f prefix\t Prefix of the segment files that hold\n"
+                 "\t\t\t evicted chats, named <prefix>.0, <prefix>.1 and\n"
+                 "\t\t\t so on. They are deleted on start.\n"
+                 "\t-s bytes\t Size at which a segment file is sealed and\n"
+                 "\t\t\t mapped into memory (default 64M).\n"
+                 "\t-z seconds\t Compress texts in memory <seconds> after\n"
+                 "\t\t\t their chunk fills up.\n"
+                 "\t-Z bytes\t Cache up to <bytes> of decompressed texts\n"
+                 "\t\t\t (default 8M).\n"
+                 "\t-j path\t\t Journal registrations, texts and deletions\n"
+                 "\t\t\t to the file <path>, and answer them only once\n"
+                 "\t\t\t they are synced to it. The journal is read\n"
+                 "\t\t\t back on start.\n"
+                 "\t-l path\t\t Load the users and chats of the dump file\n"
+                 "\t\t\t <path> on start. Can't be used with -j.\n"
+                 "\t-x path\t\t Write all users and chats to the dump file\n"
+                 "\t\t\t <path> on SIGUSR2.\n"
+                 "\t-U path\t\t Hot restart: take over the listening socket,\n"
+                 "\t\t\t connections and data of the server that\n"
+                 "\t\t\t listens on the Unix socket <path>, instead of\n"
+                 "\t\t\t loading -l, and then listen on <path> for the\n"
+                 "\t\t\t next server to take over.\n"
+                 "\t-r ip address\t Replicate registrations, texts and\n"
+                 "\t\t\t deletions to the backup on <ip address>. May be\n"
+                 "\t\t\t given several times.\n"
+                 "\t-S\t\t Answer writes only once the connected backups\n"
+                 "\t\t\t applied them.\n"
+                 "\t-t ip address\t Keep a log of writes for the read replica\n"
+                 "\t\t\t on <ip address> to tail. Given once for every\n"
+                 "\t\t\t read replica.\n"
+                 "\t-L bytes\t Keep up to <bytes> of writes for backups and\n"
+                 "\t\t\t read replicas that fall behind (default 64M).\n"
+                 "\t-b ip address\t Run as a backup of the server on\n"
+                 "\t\t\t <ip address>: apply the writes it replicates,\n"
+                 "\t\t\t and refuse writes from clients.\n"
+                 "\t-p ip address\t Run as a server of a Raft cluster with\n"
+                 "\t\t\t the server on <ip address>. Given once for every\n"
+                 "\t\t\t other server of the cluster. Only the leader\n"
+                 "\t\t\t accepts writes. With -L, the log keeps up to\n"
+                 "\t\t\t <bytes> of applied writes.\n"
+                 "\t-v path\t\t Keep the term and vote of the Raft server in\n"
+                 "\t\t\t the file <path>. A server that finds them there\n"
+                 "\t\t\t restarted, and neither votes nor stands for\n"
+                 "\t\t\t election until the leader caught it up.\n"
+                 "\t-R ip address\t Run as a read replica of the server on\n"
+                 "\t\t\t <ip address>, which must run with -t: tail its\n"
+                 "\t\t\t writes, and refuse writes from clients.\n"
+                 "\t-H ip address\t Run as a shard of a cluster with the\n"
+                 "\t\t\t shard on <ip address>. Given once for every\n"
+                 "\t\t\t other shard of the cluster. Users are spread\n"
+                 "\t\t\t over the shards by their usernames.\n"
+                 "\t-P ip address\t Take requests relayed by the proxy on\n"
+                 "\t\t\t <ip address>. Given once for every proxy.\n"
+                 "\n"
+                 "Sizes may end with K, M or G. Sends that would exceed a\n"
+                 "limit are rejected. By default, there are no limits.\n";
 }
 
 status server::start_listening() {
@@ -96,6 +707,14 @@ status server::start_listening() {
         return status::error;
     }
 
+    if (server_fd_ != -1) {
+        logger::log_out("Listening on %s:%" PRIu16
+                        " with the socket of the previous server\n",
+                        str_ip_addr_.c_str(),
+                        chat262::port);
+        return status::ok;
+    }
+
     server_fd_ = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd_ < 0) {
         logger::log_err("Could not create socket: %s\n", strerror(errno));
@@ -137,14 +756,624 @@ status server::start_listening() {
     return status::ok;
 }
 
+status server::take_over(int fd, std::vector<handed_connection>& conns) {
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    logger::log_out("Taking over from the server on %s\n",
+                    handover_path_.c_str());
+    int listen_fd;
+    std::string dump_path;
+    std::vector<handed_user> users;
+    if (recv_handover(fd, listen_fd, dump_path, conns, users) != status::ok) {
+        logger::log_err("%s", "Could not receive the handover\n");
+        return status::error;
+    }
+    const size_t num_threads =
+        std::max(std::thread::hardware_concurrency(), 1u);
+    const status s = database_.load_dump(dump_path, num_threads);
+    remove(dump_path.c_str());
+    if (s != status::ok) {
+        logger::log_err("Could not load the dump %s\n", dump_path.c_str());
+        close(listen_fd);
+        for (const handed_connection& conn : conns) {
+            close(conn.fd_);
+        }
+        conns.clear();
+        return status::error;
+    }
+    // A write retried across the restart is answered from the cache of its
+    // user, as it would have been by the previous server
+    for (const handed_user& user : users) {
+        user_dedupe& ud = user_dedupe_[user.username_];
+        for (const dedupe_cache::entry& e : user.dedupe_) {
+            ud.cache_.insert(e.first, e.second);
+        }
+    }
+    server_fd_ = listen_fd;
+    taken_over_conns_ = conns.size();
+    take_over_time_ = std::chrono::steady_clock::now() - start;
+    logger::log_out("Took over %zu connections and loaded the dump in %.3f s "
+                    "with %zu threads\n",
+                    conns.size(),
+                    std::chrono::duration<double>(take_over_time_).count(),
+                    num_threads);
+    return status::ok;
+}
+
+status server::start_handover_listener() {
+    if (pipe2(handover_wake_, O_CLOEXEC) < 0) {
+        logger::log_err("Could not create the handover pipe: %s\n",
+                        strerror(errno));
+        return status::error;
+    }
+    if (listen_handover(handover_path_, handover_fd_) != status::ok) {
+        logger::log_err("Could not listen on %s: %s\n",
+                        handover_path_.c_str(),
+                        strerror(errno));
+        return status::error;
+    }
+    logger::log_out("Listening for the next server on %s\n",
+                    handover_path_.c_str());
+
+    std::thread t([this]() {
+        while (true) {
+            const int fd =
+                accept4(handover_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EINTR) {
+                    logger::log_err("Could not accept the next server: %s\n",
+                                    strerror(errno));
+                }
+                continue;
+            }
+            hand_over(fd);
+            close(fd);
+        }
+    });
+    t.detach();
+    return status::ok;
+}
+
+void server::hand_over(int fd) {
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    logger::log_out("%s", "Handing over to the next server\n");
+
+    // Wake the connections and the accepting thread, and wait until they
+    // finished their requests and parked
+    {
+        const std::lock_guard<std::mutex> lock(handover_mutex_);
+        handing_over_ = true;
+    }
+    const uint8_t byte = 0;
+    ssize_t written = write(handover_wake_[1], &byte, sizeof(byte));
+    (void) written;
+    std::vector<handed_connection> conns;
+    std::vector<handed_user> users;
+    bool parked;
+    {
+        std::unique_lock<std::mutex> lock(handover_mutex_);
+        parked = handover_cv_.wait_for(lock, max_park_wait, [this]() {
+            return acceptor_parked_ && parked_.size() == active_conns_;
+        });
+        conns = parked_;
+    }
+    if (parked) {
+        // The parked connections hold no user's lock
+        const std::lock_guard<std::mutex> lock(user_dedupe_mutex_);
+        for (auto& it : user_dedupe_) {
+            const std::lock_guard<std::mutex> user_lock(it.second.mutex_);
+            std::vector<dedupe_cache::entry> dedupe =
+                it.second.cache_.entries();
+            if (!dedupe.empty()) {
+                users.push_back({it.first, std::move(dedupe)});
+            }
+        }
+    }
+
+    // Nothing changes the database while everything is parked
+    const std::string dump_path = handover_path_ + ".dump";
+    status s = status::error;
+    if (!parked) {
+        logger::log_err("%s", "The connections did not park in time\n");
+    } else if (database_.export_dump(dump_path) != status::ok) {
+        logger::log_err("Could not write the dump %s\n", dump_path.c_str());
+    } else if (send_handover(fd, server_fd_, dump_path, conns, users) !=
+               status::ok) {
+        logger::log_err("%s", "Could not send the handover\n");
+    } else {
+        s = wait_handover_confirmed(fd);
+        if (s != status::ok) {
+            logger::log_err("%s", "The next server went away\n");
+        }
+    }
+    if (s == status::ok) {
+        logger::log_out("Handed over %zu connections in %.3f s, exiting\n",
+                        conns.size(),
+                        std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start)
+                            .count());
+        fflush(stdout);
+        _exit(0);
+    }
+
+    // Carry on. The wake byte is taken back before the connections resume,
+    // so that they don't park again.
+    remove(dump_path.c_str());
+    {
+        const std::lock_guard<std::mutex> lock(handover_mutex_);
+        uint8_t wake;
+        ssize_t received = read(handover_wake_[0], &wake, sizeof(wake));
+        (void) received;
+        parked_.clear();
+        acceptor_parked_ = false;
+        handing_over_ = false;
+        ++failed_handovers_;
+    }
+    handover_cv_.notify_all();
+}
+
+void server::wait_readable(int fd, const handed_connection* conn) {
+    if (handover_fd_ == -1) {
+        return;
+    }
+    while (true) {
+        pollfd fds[2];
+        fds[0].fd = fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = handover_wake_[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if ((fds[1].revents & POLLIN) == 0) {
+            // A request, a client, or the end of the connection
+            return;
+        }
+        park(conn);
+    }
+}
+
+void server::park(const handed_connection* conn) {
+    handed_connection parked_conn;
+    if (conn != nullptr) {
+        parked_conn = *conn;
+        // The user is looked up before the lock, since the database has locks
+        // of its own
+        if (database_.current_username(parked_conn.username_) != status::ok) {
+            parked_conn.username_.clear();
+        }
+        parked_conn.dedupe_ = connection_dedupe.entries();
+    }
+    std::unique_lock<std::mutex> lock(handover_mutex_);
+    if (!handing_over_) {
+        // The handover failed before the wake byte was taken back
+        return;
+    }
+    if (conn != nullptr) {
+        parked_.push_back(parked_conn);
+    } else {
+        acceptor_parked_ = true;
+    }
+    handover_cv_.notify_all();
+    // A thread that wakes only once the next handover started parks again
+    // for it
+    const uint64_t failed = failed_handovers_;
+    handover_cv_.wait(lock, [&]() { return failed_handovers_ != failed; });
+}
+
+status server::start_stats_reporter() {
+    static std::once_flag once;
+    static status once_status = status::ok;
+    std::call_once(once, []() {
+        if (pipe(stats_pipe) < 0) {
+            logger::log_err("Could not create the stats pipe: %s\n",
+                            strerror(errno));
+            once_status = status::error;
+            return;
+        }
+
+        struct sigaction act;
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = handle_sigusr1;
+        act.sa_flags = SA_RESTART;
+        if (sigaction(SIGUSR1, &act, nullptr) < 0) {
+            logger::log_err("Could not handle SIGUSR1: %s\n", strerror(errno));
+            once_status = status::error;
+            return;
+        }
+        act.sa_handler = handle_sigusr2;
+        if (sigaction(SIGUSR2, &act, nullptr) < 0) {
+            logger::log_err("Could not handle SIGUSR2: %s\n", strerror(errno));
+            once_status = status::error;
+            return;
+        }
+
+        std::thread t([]() {
+            uint8_t byte;
+            while (read(stats_pipe[0], &byte, sizeof(byte)) > 0) {
+                const std::lock_guard<std::mutex> lock(stats_servers_mutex);
+                for (server* srv : stats_servers) {
+                    if (byte == dump_request) {
+                        srv->write_dump();
+                    } else {
+                        srv->dump_stats(stdout);
+                    }
+                }
+                fflush(stdout);
+            }
+        });
+        t.detach();
+    });
+    if (once_status != status::ok) {
+        return once_status;
+    }
+
+    const std::lock_guard<std::mutex> lock(stats_servers_mutex);
+    stats_servers.push_back(this);
+    return status::ok;
+}
+
+void server::dump_stats(FILE* out) {
+    fprintf(out,
+            "Statistics for the server on %s:%" PRIu16 "\n",
+            str_ip_addr_.c_str(),
+            chat262::port);
+    database_.dump_stats(out);
+    if (journal_) {
+        const journal::stats js = journal_->get_stats();
+        fprintf(out, "Journal:\n");
+        fprintf(out,
+                "  %-24s %" PRIu64 " mutations in %" PRIu64
+                " batches, %" PRIu64 " bytes%s\n",
+                "written",
+                js.mutations_,
+                js.batches_,
+                js.bytes_,
+                js.failed_ ? " (failed)" : "");
+        if (js.batches_ != 0) {
+            fprintf(out,
+                    "  %-24s avg %.1f us, max %.1f us\n",
+                    "sync latency",
+                    js.total_sync_ns_ / 1e3 / js.batches_,
+                    js.max_sync_ns_ / 1e3);
+            fprintf(out,
+                    "  %-24s avg %.1f us, max %.1f us\n",
+                    "commit latency",
+                    js.total_commit_ns_ / 1e3 / js.mutations_,
+                    js.max_commit_ns_ / 1e3);
+            print_histogram(out,
+                            "batch sizes",
+                            js.batch_hist_,
+                            journal::num_buckets,
+                            "");
+            print_histogram(out,
+                            "commit latencies",
+                            js.commit_hist_,
+                            journal::num_buckets,
+                            "ns");
+        }
+    }
+
+    const uint64_t msgs = compressed_msgs_.load(std::memory_order_relaxed);
+    const uint64_t raw = compressed_raw_bytes_.load(std::memory_order_relaxed);
+    const uint64_t wire =
+        compressed_wire_bytes_.load(std::memory_order_relaxed);
+    if (!replicators_.empty()) {
+        const replication_log::stats ls = log_.get_stats();
+        fprintf(out, "Replication:\n");
+        fprintf(out, "  %-24s %s\n", "mode",
+                sync_replication_ ? "synchronous" : "asynchronous");
+        fprintf(out, "  %-24s %" PRIu64 "\n", "last mutation", ls.last_seq_);
+        fprintf(out,
+                "  %-24s %zu mutations, %zu of %zu bytes\n",
+                "log",
+                ls.mutations_,
+                ls.bytes_,
+                ls.capacity_);
+        fprintf(out, "  %-24s %" PRIu64 "\n", "overflowed mutations",
+                ls.overflows_);
+        fprintf(out, "  %-24s %" PRIu64 "\n", "replication timeouts",
+                ls.replication_timeouts_);
+        for (const std::unique_ptr<replicator>& r : replicators_) {
+            const replicator::stats rs = r->get_stats();
+            fprintf(out,
+                    "  %-24s %s, acked %" PRIu64 " (lag %" PRIu64 ")\n",
+                    r->address().c_str(),
+                    rs.lost_ ? "lost"
+                             : (rs.connected_ ? "connected" : "disconnected"),
+                    rs.acked_,
+                    ls.last_seq_ - std::min(rs.acked_, ls.last_seq_));
+            fprintf(out,
+                    "  %-24s %" PRIu64 " batches, %.1f mutations and %.1f "
+                    "bytes per batch\n",
+                    "",
+                    rs.batches_,
+                    rs.batches_ == 0
+                        ? 0.0
+                        : static_cast<double>(rs.mutations_) / rs.batches_,
+                    rs.batches_ == 0
+                        ? 0.0
+                        : static_cast<double>(rs.bytes_) / rs.batches_);
+            fprintf(out,
+                    "  %-24s avg %.1f us, max %.1f us round trip, %" PRIu64
+                    " connects, %" PRIu64 " rewinds\n",
+                    "",
+                    rs.batches_ == 0 ? 0.0
+                                     : rs.total_rtt_ns_ / 1e3 / rs.batches_,
+                    rs.max_rtt_ns_ / 1e3,
+                    rs.connects_,
+                    rs.rewinds_);
+        }
+    }
+    if (backup_) {
+        fprintf(out, "Backup:\n");
+        fprintf(out, "  %-24s %" PRIu64 "\n", "applied batches",
+                replicated_batches_.load(std::memory_order_relaxed));
+        fprintf(out, "  %-24s %" PRIu64 "\n", "applied up to",
+                replicated_seq_.load(std::memory_order_relaxed));
+        fprintf(out,
+                "  %-24s %" PRIu64 ", %" PRIu64 " stale\n",
+                "sync requests",
+                syncs_.load(std::memory_order_relaxed),
+                stale_syncs_.load(std::memory_order_relaxed));
+    }
+    if (tail_log_) {
+        const replication_log::stats ls = log_.get_stats();
+        fprintf(out, "Read replicas:\n");
+        fprintf(out, "  %-24s %" PRIu64 "\n", "last mutation", ls.last_seq_);
+        fprintf(out,
+                "  %-24s %zu mutations, %zu of %zu bytes\n",
+                "log",
+                ls.mutations_,
+                ls.bytes_,
+                ls.capacity_);
+        fprintf(out, "  %-24s %" PRIu64 "\n", "tail requests",
+                tail_requests_.load(std::memory_order_relaxed));
+        fprintf(out, "  %-24s %" PRIu64 "\n", "mutations sent",
+                tail_mutations_.load(std::memory_order_relaxed));
+        fprintf(out, "  %-24s %" PRIu64 "\n", "snapshots sent",
+                tail_snapshots_.load(std::memory_order_relaxed));
+    }
+    if (tailer_) {
+        const tailer::stats ts = tailer_->get_stats();
+        const uint32_t staleness_ms = tailer_->staleness_ms();
+        fprintf(out, "Read replica:\n");
+        fprintf(out,
+                "  %-24s %s, applied %" PRIu64 " (lag %" PRIu64 ")\n",
+                tailer_->address().c_str(),
+                ts.connected_ ? "connected" : "disconnected",
+                ts.applied_,
+                ts.primary_seq_ - std::min(ts.applied_, ts.primary_seq_));
+        if (staleness_ms == std::numeric_limits<uint32_t>::max()) {
+            fprintf(out, "  %-24s %s\n", "staleness", "unknown");
+        } else {
+            fprintf(out, "  %-24s %" PRIu32 " ms\n", "staleness",
+                    staleness_ms);
+        }
+        fprintf(out,
+                "  %-24s %" PRIu64 " polls, %.1f mutations and %.1f bytes "
+                "per poll\n",
+                "",
+                ts.polls_,
+                ts.polls_ == 0
+                    ? 0.0
+                    : static_cast<double>(ts.mutations_) / ts.polls_,
+                ts.polls_ == 0 ? 0.0
+                               : static_cast<double>(ts.bytes_) / ts.polls_);
+        fprintf(out,
+                "  %-24s avg %.1f us, max %.1f us round trip, %" PRIu64
+                " connects\n",
+                "",
+                ts.polls_ == 0 ? 0.0 : ts.total_rtt_ns_ / 1e3 / ts.polls_,
+                ts.max_rtt_ns_ / 1e3,
+                ts.connects_);
+        fprintf(out,
+                "  %-24s %" PRIu64 " installed, %" PRIu64 " mutations\n",
+                "snapshots",
+                ts.snapshots_,
+                ts.snapshot_mutations_);
+        fprintf(out,
+                "  %-24s %" PRIu64 ", %" PRIu64 " stale\n",
+                "sync requests",
+                syncs_.load(std::memory_order_relaxed),
+                stale_syncs_.load(std::memory_order_relaxed));
+    }
+    if (router_) {
+        const shard_router::stats ss = router_->get_stats();
+        fprintf(out, "Sharding:\n");
+        fprintf(out,
+                "  %-24s %" PRIu64 ", avg %.1f us, max %.1f us\n",
+                "forwarded texts",
+                ss.forwarded_txts_,
+                ss.forwarded_txts_ == 0
+                    ? 0.0
+                    : ss.total_forward_ns_ / 1e3 / ss.forwarded_txts_,
+                ss.max_forward_ns_ / 1e3);
+        fprintf(out, "  %-24s %" PRIu64 "\n", "forwarded deletions",
+                ss.forwarded_deletions_);
+        fprintf(out,
+                "  %-24s %" PRIu64 ", avg %.1f us, max %.1f us\n",
+                "scattered searches",
+                ss.searches_,
+                ss.searches_ == 0 ? 0.0
+                                  : ss.total_search_ns_ / 1e3 / ss.searches_,
+                ss.max_search_ns_ / 1e3);
+        fprintf(out, "  %-24s %" PRIu64 "\n", "user lookups", ss.lookups_);
+        fprintf(out,
+                "  %-24s %" PRIu64 ", %" PRIu64 " failed requests\n",
+                "connects",
+                ss.connects_,
+                ss.failures_);
+        fprintf(out,
+                "  %-24s %" PRIu64 " out, %" PRIu64 " in, %" PRIu64
+                " failed\n",
+                "migrations",
+                ss.migrations_out_,
+                ss.migrations_in_,
+                ss.failed_migrations_);
+        if (ss.migrations_out_ != 0) {
+            fprintf(out,
+                    "  %-24s %.1f MB at %.1f MB/s, pause avg %.1f us, "
+                    "max %.1f us\n",
+                    "migrated",
+                    ss.migrated_bytes_ / 1e6,
+                    ss.total_copy_ns_ == 0
+                        ? 0.0
+                        : ss.migrated_bytes_ * 1e3 / ss.total_copy_ns_,
+                    ss.total_pause_ns_ / 1e3 / ss.migrations_out_,
+                    ss.max_pause_ns_ / 1e3);
+        }
+    }
+    const uint64_t proxied = proxied_reqs_.load(std::memory_order_relaxed);
+    if (proxied != 0) {
+        fprintf(out, "Proxies:\n");
+        fprintf(out, "  %-24s %" PRIu64 "\n", "relayed requests", proxied);
+    }
+    const uint64_t replayed = replayed_reqs_.load(std::memory_order_relaxed);
+    if (replayed != 0) {
+        fprintf(out, "Request IDs:\n");
+        fprintf(out, "  %-24s %" PRIu64 "\n", "replayed responses", replayed);
+    }
+    if (raft_) {
+        static const char* const roles[] = {"follower", "candidate", "leader"};
+        const raft_node::stats rs = raft_->get_stats();
+        char leader[INET_ADDRSTRLEN] = "none";
+        if (rs.leader_ != 0) {
+            inet_ntop(AF_INET, &rs.leader_, leader, sizeof(leader));
+        }
+        fprintf(out, "Raft:\n");
+        fprintf(out,
+                "  %-24s %s in term %" PRIu64 ", leader %s%s\n",
+                "role",
+                roles[rs.role_],
+                rs.term_,
+                leader,
+                rs.catching_up_ ? ", catching up" : "");
+        fprintf(out,
+                "  %-24s %" PRIu64 " to %" PRIu64 ", %zu bytes\n",
+                "log",
+                rs.first_index_,
+                rs.last_index_,
+                rs.log_bytes_);
+        fprintf(out,
+                "  %-24s committed %" PRIu64 ", applied %" PRIu64 "\n",
+                "",
+                rs.commit_index_,
+                rs.last_applied_);
+        fprintf(out, "  %-24s %" PRIu64 "\n", "elections", rs.elections_);
+        fprintf(out,
+                "  %-24s %" PRIu64 ", %" PRIu64 " failed\n",
+                "proposals",
+                rs.proposals_,
+                rs.failed_proposals_);
+        const uint64_t committed = rs.proposals_ - rs.failed_proposals_;
+        fprintf(out,
+                "  %-24s avg %.1f us, max %.1f us\n",
+                "commit latency",
+                committed == 0 ? 0.0 : rs.total_commit_ns_ / 1e3 / committed,
+                rs.max_commit_ns_ / 1e3);
+        fprintf(out, "  %-24s %" PRIu64 "\n", "snapshots installed",
+                rs.snapshots_installed_);
+        for (const raft_node::peer_stats& ps : rs.peers_) {
+            fprintf(out,
+                    "  %-24s %s, next %" PRIu64 ", match %" PRIu64 "\n",
+                    ps.address_.c_str(),
+                    ps.connected_ ? "connected" : "disconnected",
+                    ps.next_index_,
+                    ps.match_index_);
+            fprintf(out,
+                    "  %-24s %" PRIu64 " appends, %.1f entries per append, "
+                    "%" PRIu64 " rewinds\n",
+                    "",
+                    ps.appends_,
+                    ps.appends_ == 0
+                        ? 0.0
+                        : static_cast<double>(ps.entries_) / ps.appends_,
+                    ps.rewinds_);
+            fprintf(out,
+                    "  %-24s avg %.1f us, max %.1f us round trip\n",
+                    "",
+                    ps.appends_ == 0 ? 0.0
+                                     : ps.total_rtt_ns_ / 1e3 / ps.appends_,
+                    ps.max_rtt_ns_ / 1e3);
+            fprintf(out,
+                    "  %-24s %" PRIu64 " snapshots, %" PRIu64 " mutations\n",
+                    "",
+                    ps.snapshots_,
+                    ps.snapshot_mutations_);
+        }
+    }
+
+    if (handover_fd_ != -1) {
+        fprintf(out, "Hot restart:\n");
+        fprintf(out,
+                "  %-24s %zu in %.3f s\n",
+                "connections taken over",
+                taken_over_conns_,
+                std::chrono::duration<double>(take_over_time_).count());
+        fprintf(out,
+                "  %-24s %" PRIu64 "\n",
+                "failed handovers",
+                failed_handovers_.load());
+    }
+
+    fprintf(out, "Wire compression:\n");
+    fprintf(out, "  %-24s %" PRIu64 "\n", "compressed responses", msgs);
+    fprintf(out,
+            "  %-24s %" PRIu64 " -> %" PRIu64 " bytes (ratio %.2f)\n",
+            "compressed bodies",
+            raw,
+            wire,
+            wire == 0 ? 0.0 : static_cast<double>(raw) / wire);
+}
+
+void server::write_dump() {
+    if (dump_path_.empty()) {
+        return;
+    }
+    const std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    const std::string tmp_path = dump_path_ + ".tmp";
+    const status s = database_.export_dump(tmp_path);
+    if (s != status::ok) {
+        logger::log_err("Could not write the dump %s: %s\n",
+                        tmp_path.c_str(),
+                        s == status::error ? strerror(errno)
+                                           : "a chat could not be read back");
+        remove(tmp_path.c_str());
+        return;
+    }
+    if (rename(tmp_path.c_str(), dump_path_.c_str()) != 0) {
+        logger::log_err("Could not replace the dump %s: %s\n",
+                        dump_path_.c_str(),
+                        strerror(errno));
+        remove(tmp_path.c_str());
+        return;
+    }
+    logger::log_out("Wrote the dump %s in %.3f s\n",
+                    dump_path_.c_str(),
+                    std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+}
+
 void server::start_accepting() {
     sockaddr_in client_addr;
     memset(&client_addr, 0, sizeof(client_addr));
     socklen_t client_addr_len = sizeof(client_addr);
 
     while (true) {
+        wait_readable(server_fd_, nullptr);
         int client_fd =
             accept(server_fd_, (sockaddr*) &client_addr, &client_addr_len);
+        if (client_fd >= 0) {
+            const std::lock_guard<std::mutex> lock(handover_mutex_);
+            ++active_conns_;
+        }
         std::thread t(&server::handle_client, this, client_fd, client_addr);
         t.detach();
     }
@@ -162,16 +1391,79 @@ void server::handle_client(int client_fd, sockaddr_in client_addr) {
                    client_ip,
                    sizeof(client_ip))) {
         logger::log_err("%s", "Could not read client's IP\n");
+        close(client_fd);
+        const std::lock_guard<std::mutex> lock(handover_mutex_);
+        --active_conns_;
+        handover_cv_.notify_all();
         return;
     }
     logger::log_out("Accepted connection from %s\n", client_ip);
+    connection_version = chat262::version;
+    connection_features = 0;
+    connection_from_proxy = false;
+    connection_addr = client_addr.sin_addr.s_addr;
+    connection_dedupe.clear();
+    if (backup_ || raft_ || router_) {
+        // Acknowledgements to the primary or the Raft leader, and responses
+        // to other shards, must not wait for more batches
+        static constexpr int enable_nodelay = 1;
+        setsockopt(client_fd,
+                   IPPROTO_TCP,
+                   TCP_NODELAY,
+                   &enable_nodelay,
+                   sizeof(enable_nodelay));
+    }
+    serve_client(client_fd, client_ip);
+}
+
+void server::resume_client(handed_connection conn) {
+    char client_ip[INET_ADDRSTRLEN];
+    sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    if (getpeername(conn.fd_, (sockaddr*) &client_addr, &client_addr_len) <
+            0 ||
+        !inet_ntop(AF_INET,
+                   &client_addr.sin_addr,
+                   client_ip,
+                   sizeof(client_ip))) {
+        strcpy(client_ip, "unknown");
+        client_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    logger::log_out("Resumed connection from %s\n", client_ip);
+    connection_version = conn.version_;
+    connection_features = conn.features_;
+    connection_from_proxy = conn.from_proxy_;
+    connection_addr = client_addr.sin_addr.s_addr;
+    connection_dedupe.clear();
+    for (const dedupe_cache::entry& e : conn.dedupe_) {
+        connection_dedupe.insert(e.first, e.second);
+    }
+    if (!conn.username_.empty() &&
+        database_.login_as(conn.username_) != status::ok) {
+        logger::log_err("Could not log %s back in\n", conn.username_.c_str());
+    }
+    serve_client(conn.fd_, client_ip);
+}
 
+void server::serve_client(int client_fd, const char* client_ip) {
     while (true) {
+        const handed_connection conn = {client_fd,
+                                        connection_version,
+                                        connection_features,
+                                        connection_from_proxy,
+                                        std::string(),
+                                        {}};
+        wait_readable(client_fd, &conn);
+
         chat262::message_header msg_hdr;
         status s = recv_hdr(client_fd, msg_hdr);
         if (s != status::ok) {
             break;
         }
+        CHAT262_TRACE3(request__start,
+                       client_fd,
+                       msg_hdr.type_,
+                       msg_hdr.body_len_);
 
         logger::log_out("Received header: version %" PRIu16 ", type %" PRIu16
                         " (%s), body len %" PRIu32 "\n",
@@ -181,53 +1473,44 @@ void server::handle_client(int client_fd, sockaddr_in client_addr) {
                         msg_hdr.body_len_);
 
         // If version is wrong, we do our best to let the client know, but we do
-        // break the connection
-        if (msg_hdr.version_ != chat262::version) {
+        // break the connection. A hello may always use the initial version, so
+        // that it works before anything is negotiated. Every request that
+        // started ends, even when the connection breaks, so that tracing
+        // scripts can pair the probes.
+        if (msg_hdr.version_ != connection_version &&
+            !(msg_hdr.version_ == chat262::version &&
+              msg_hdr.type_ == chat262::msgtype_hello_request)) {
             logger::log_err("Unsupported protocol version %" PRIu16 "\n",
                             msg_hdr.version_);
-            handle_wrong_version(client_fd);
+            s = handle_wrong_version(client_fd);
+            CHAT262_TRACE3(request__end,
+                           client_fd,
+                           msg_hdr.type_,
+                           static_cast<int>(s));
             break;
         }
 
         std::vector<uint8_t> body;
         s = recv_body(client_fd, msg_hdr.body_len_, body);
         if (s != status::ok) {
+            CHAT262_TRACE3(request__end,
+                           client_fd,
+                           msg_hdr.type_,
+                           static_cast<int>(s));
             break;
         }
 
         logger::log_out("%s", "Received the body\n");
 
-        switch (msg_hdr.type_) {
-        case chat262::msgtype_registration_request:
-            s = handle_registration(client_fd, body);
-            break;
-        case chat262::msgtype_login_request:
-            s = handle_login(client_fd, body);
-            break;
-        case chat262::msgtype_logout_request:
-            s = handle_logout(client_fd, body);
-            break;
-        case chat262::msgtype_accounts_request:
-            s = handle_list_accounts(client_fd, body);
-            break;
-        case chat262::msgtype_send_txt_request:
-            s = handle_send_txt(client_fd, body);
-            break;
-        case chat262::msgtype_recv_txt_request:
-            s = handle_recv_txt(client_fd, body);
-            break;
-        case chat262::msgtype_correspondents_request:
-            s = handle_correspondents(client_fd, body);
-            break;
-        case chat262::msgtype_delete_request:
-            s = handle_delete(client_fd, body);
-            break;
-        default:
-            logger::log_err("Unknown message type %" PRIu16 "\n",
-                            msg_hdr.type_);
-            s = handle_invalid_type(client_fd);
-            break;
+        if ((msg_hdr.type_ & chat262::msgflag_request_id) != 0) {
+            s = handle_identified(client_fd, msg_hdr.type_, body);
+        } else {
+            s = handle_request(client_fd, msg_hdr.type_, body);
         }
+        CHAT262_TRACE3(request__end,
+                       client_fd,
+                       msg_hdr.type_,
+                       static_cast<int>(s));
         // If we encountered an invalid body, we can tell the client about this
         if (s == status::body_error) {
             s = handle_invalid_body(client_fd);
@@ -245,20 +1528,156 @@ void server::handle_client(int client_fd, sockaddr_in client_addr) {
     shutdown(client_fd, SHUT_RDWR);
     close(client_fd);
     logger::log_out("Terminated connection from %s\n", client_ip);
+    const std::lock_guard<std::mutex> lock(handover_mutex_);
+    --active_conns_;
+    handover_cv_.notify_all();
 }
 
-status server::send_msg(int client_fd,
-                        std::shared_ptr<chat262::message> msg) const {
-    size_t total_sent = 0;
-    ssize_t sent = 0;
-    size_t total_len =
-        sizeof(chat262::message_header) + e_le32toh(msg->hdr_.body_len_);
-    while (total_sent != total_len) {
-        sent = send(client_fd, msg.get(), total_len, 0);
-        if (sent < 0) {
-            logger::log_err("Unable to send the message: %s\n",
-                            strerror(errno));
-            return status::send_error;
+status server::handle_request(int client_fd,
+                              const uint16_t type,
+                              const std::vector<uint8_t>& body_data) {
+    switch (type) {
+    case chat262::msgtype_registration_request:
+        return handle_registration(client_fd, body_data);
+    case chat262::msgtype_login_request:
+        return handle_login(client_fd, body_data);
+    case chat262::msgtype_logout_request:
+        return handle_logout(client_fd, body_data);
+    case chat262::msgtype_accounts_request:
+        return handle_list_accounts(client_fd, body_data);
+    case chat262::msgtype_send_txt_request:
+        return handle_send_txt(client_fd, body_data);
+    case chat262::msgtype_recv_txt_request:
+        return handle_recv_txt(client_fd, body_data);
+    case chat262::msgtype_correspondents_request:
+        return handle_correspondents(client_fd, body_data);
+    case chat262::msgtype_delete_request:
+        return handle_delete(client_fd, body_data);
+    case chat262::msgtype_hello_request:
+        return handle_hello(client_fd, body_data);
+    case chat262::msgtype_replicate_request:
+        return handle_replicate(client_fd, body_data);
+    case chat262::msgtype_vote_request:
+        return handle_vote(client_fd, body_data);
+    case chat262::msgtype_append_request:
+        return handle_append(client_fd, body_data);
+    case chat262::msgtype_snapshot_request:
+        return handle_snapshot(client_fd, body_data);
+    case chat262::msgtype_tail_request:
+        return handle_tail(client_fd, body_data);
+    case chat262::msgtype_sync_request:
+        return handle_sync(client_fd, body_data);
+    case chat262::msgtype_forward_request:
+        return handle_forward(client_fd, body_data);
+    case chat262::msgtype_shard_accounts_request:
+        return handle_shard_accounts(client_fd, body_data);
+    case chat262::msgtype_proxy_request:
+        return handle_proxy(client_fd, body_data);
+    case chat262::msgtype_migrate_request:
+        return handle_migrate(client_fd, body_data);
+    case chat262::msgtype_import_request:
+        return handle_import(client_fd, body_data);
+    case chat262::msgtype_locate_request:
+        return handle_locate(client_fd, body_data);
+    default:
+        logger::log_err("Unknown message type %" PRIu16 "\n", type);
+        return handle_invalid_type(client_fd);
+    }
+}
+
+status server::handle_identified(int client_fd,
+                                 const uint16_t type,
+                                 const std::vector<uint8_t>& body_data) {
+    if ((connection_features & chat262::feature_request_ids) == 0) {
+        logger::log_err("Unknown message type %" PRIu16 "\n", type);
+        return handle_invalid_type(client_fd);
+    }
+    uint64_t request_id;
+    std::vector<uint8_t> body;
+    if (chat262::identified_request::detach(body_data, request_id, body) !=
+        status::ok) {
+        return status::body_error;
+    }
+    const uint16_t request_type = type & ~chat262::msgflag_request_id;
+    // Reads are simply handled again
+    if (request_type != chat262::msgtype_registration_request &&
+        request_type != chat262::msgtype_send_txt_request &&
+        request_type != chat262::msgtype_delete_request) {
+        return handle_request(client_fd, request_type, body);
+    }
+
+    // The writes of a logged in user are remembered for the user, so that a
+    // retry on another connection is recognized too
+    dedupe_cache* cache = &connection_dedupe;
+    std::unique_lock<std::mutex> user_lock;
+    std::string username;
+    if (database_.current_username(username) == status::ok) {
+        user_dedupe* ud;
+        {
+            const std::lock_guard<std::mutex> lock(user_dedupe_mutex_);
+            ud = &user_dedupe_[username];
+        }
+        user_lock = std::unique_lock<std::mutex>(ud->mutex_);
+        cache = &ud->cache_;
+    }
+
+    const std::shared_ptr<chat262::message> cached = cache->find(request_id);
+    if (cached != nullptr) {
+        logger::log_out("Replaying the response to request %" PRIu64 "\n",
+                        request_id);
+        replayed_reqs_.fetch_add(1, std::memory_order_relaxed);
+        return send_msg(client_fd, cached);
+    }
+    std::shared_ptr<chat262::message> response;
+    kept_response = &response;
+    const status s = handle_request(client_fd, request_type, body);
+    kept_response = nullptr;
+    if (s == status::ok && response != nullptr) {
+        cache->insert(request_id, response);
+    }
+    return s;
+}
+
+status server::send_msg(int client_fd,
+                        std::shared_ptr<chat262::message> msg) const {
+    msg->hdr_.version_ = e_htole16(connection_version);
+    if (kept_response != nullptr) {
+        *kept_response = msg;
+    }
+    if ((connection_features & chat262::feature_compression) != 0) {
+        const uint32_t raw_len = e_le32toh(msg->hdr_.body_len_);
+        msg = chat262::compressed_body::compress(msg);
+        const uint32_t wire_len = e_le32toh(msg->hdr_.body_len_);
+        if ((e_le16toh(msg->hdr_.type_) & chat262::msgflag_compressed) != 0) {
+            compressed_msgs_.fetch_add(1, std::memory_order_relaxed);
+            compressed_raw_bytes_.fetch_add(raw_len,
+                                            std::memory_order_relaxed);
+            compressed_wire_bytes_.fetch_add(wire_len,
+                                             std::memory_order_relaxed);
+        }
+    }
+    if (proxied_response != nullptr) {
+        *proxied_response = msg;
+        return status::ok;
+    }
+    size_t total_sent = 0;
+    ssize_t sent = 0;
+    size_t total_len =
+        sizeof(chat262::message_header) + e_le32toh(msg->hdr_.body_len_);
+    CHAT262_TRACE3(send__msg,
+                   client_fd,
+                   e_le16toh(msg->hdr_.type_),
+                   static_cast<uint64_t>(total_len));
+    const uint8_t* msg_data = reinterpret_cast<const uint8_t*>(msg.get());
+    while (total_sent != total_len) {
+        sent = send(client_fd,
+                    msg_data + total_sent,
+                    total_len - total_sent,
+                    0);
+        if (sent < 0) {
+            logger::log_err("Unable to send the message: %s\n",
+                            strerror(errno));
+            return status::send_error;
         }
         total_sent += sent;
     }
@@ -272,8 +1691,8 @@ status server::recv_hdr(int client_fd, chat262::message_header& hdr) const {
     ssize_t readed = 0;
     while (total_read != sizeof(chat262::message_header)) {
         readed = recv(client_fd,
-                      hdr_data.data(),
-                      sizeof(chat262::message_header),
+                      hdr_data.data() + total_read,
+                      sizeof(chat262::message_header) - total_read,
                       0);
         if (readed < 0) {
             logger::log_err("Failed to receive the header: %s\n",
@@ -298,11 +1717,15 @@ status server::recv_hdr(int client_fd, chat262::message_header& hdr) const {
 status server::recv_body(int client_fd,
                          uint32_t body_len,
                          std::vector<uint8_t>& data) const {
+    CHAT262_TRACE2(recv__body, client_fd, static_cast<uint64_t>(body_len));
     data.resize(body_len);
     size_t total_read = 0;
     ssize_t readed = 0;
     while (total_read != body_len) {
-        readed = recv(client_fd, data.data(), body_len, 0);
+        readed = recv(client_fd,
+                      data.data() + total_read,
+                      body_len - total_read,
+                      0);
         if (readed < 0) {
             logger::log_err("Failed to receive the body: %s\n",
                             strerror(errno));
@@ -331,6 +1754,12 @@ status server::handle_registration(int client_fd,
     }
 
     std::shared_ptr<chat262::message> msg;
+    if (backup_ || tailer_) {
+        logger::log_out("%s", "Refusing registration on a read-only server\n");
+        msg = chat262::registration_response::serialize(
+            chat262::status_code_read_only);
+        return send_msg(client_fd, msg);
+    }
     if (username.length() < 4 || username.length() > 40 ||
         username.find_first_of("* ") != std::string::npos) {
         logger::log_out("Username \"%s\" is not valid\n", username.c_str());
@@ -343,15 +1772,46 @@ status server::handle_registration(int client_fd,
             chat262::status_code_password_invalid);
         return send_msg(client_fd, msg);
     }
+    if (router_ && !router_->owns(username)) {
+        // A user that moved here from its shard exists all the same
+        if (router_->moved(username)) {
+            logger::log_out("User \"%s\" moved to another shard\n",
+                            username.c_str());
+            msg = chat262::registration_response::serialize(
+                chat262::status_code_user_exists);
+            return send_msg(client_fd, msg);
+        }
+        logger::log_out("User \"%s\" belongs to another shard\n",
+                        username.c_str());
+        msg = chat262::registration_response::serialize(
+            chat262::status_code_wrong_shard);
+        return send_msg(client_fd, msg);
+    }
 
-    s = database_.registration(username, password);
+    if (raft_) {
+        if (raft_->propose({chat262::mutation::op_registration,
+                            username,
+                            password,
+                            ""},
+                           s) != status::ok) {
+            logger::log_out("%s", "Refusing registration, not the leader\n");
+            msg = chat262::registration_response::serialize(
+                chat262::status_code_not_leader);
+            return send_msg(client_fd, msg);
+        }
+    } else {
+        s = database_.registration(username, password);
+    }
     if (s == status::ok) {
         logger::log_out(
             "Registered user with username \"%s\" and password \"%s\"\n",
             username.c_str(),
             password.c_str());
-        msg =
-            chat262::registration_response::serialize(chat262::status_code_ok);
+        if (wait_for_journal() != status::ok) {
+            return status::error;
+        }
+        wait_for_followers();
+        msg = write_ok_response<chat262::registration_response>();
     } else {
         logger::log_out("Username \"%s\" already exists\n", username.c_str());
         msg = chat262::registration_response::serialize(
@@ -383,8 +1843,26 @@ status server::handle_login(int client_fd,
     if (database_.is_logged_in()) {
         database_.logout();
     }
+    if (router_ && !router_->owns(username)) {
+        logger::log_out("User \"%s\" belongs to another shard\n",
+                        username.c_str());
+        msg = chat262::login_response::serialize(
+            chat262::status_code_wrong_shard);
+        return send_msg(client_fd, msg);
+    }
 
     s = database_.login(username, password);
+    if (s != status::ok && router_) {
+        // The user may be moving to another shard
+        router_->await(username);
+        if (!router_->owns(username)) {
+            logger::log_out("User \"%s\" moved to another shard\n",
+                            username.c_str());
+            msg = chat262::login_response::serialize(
+                chat262::status_code_wrong_shard);
+            return send_msg(client_fd, msg);
+        }
+    }
     if (s == status::ok) {
         logger::log_out("%s", "Correct credentials\n");
         msg = chat262::login_response::serialize(chat262::status_code_ok);
@@ -442,7 +1920,13 @@ status server::handle_list_accounts(int client_fd,
         return send_msg(client_fd, msg);
     }
 
-    usernames = database_.get_usernames(pattern);
+    if (!router_) {
+        usernames = database_.get_usernames(pattern);
+    } else if (router_->search(pattern, usernames) != status::ok) {
+        // There is no status code for server failures, so give up on the
+        // connection
+        return status::receive_error;
+    }
     msg = chat262::accounts_response::serialize(chat262::status_code_ok,
                                                 usernames);
     return send_msg(client_fd, msg);
@@ -468,11 +1952,71 @@ status server::handle_send_txt(int client_fd,
             chat262::status_code_unauthorized);
         return send_msg(client_fd, msg);
     }
+    if (backup_ || tailer_) {
+        logger::log_out("%s", "Refusing a text on a read-only server\n");
+        msg = chat262::send_txt_response::serialize(
+            chat262::status_code_read_only);
+        return send_msg(client_fd, msg);
+    }
+
+    if (router_ && !router_->owns(recipient)) {
+        uint32_t stat_code;
+        s = send_remote_txt(recipient, txt, stat_code);
+        if (s != status::ok) {
+            return s;
+        }
+        msg = stat_code == chat262::status_code_ok
+                  ? write_ok_response<chat262::send_txt_response>()
+                  : chat262::send_txt_response::serialize(stat_code);
+        return send_msg(client_fd, msg);
+    }
 
-    s = database_.send_txt(recipient, txt);
+    if (raft_) {
+        std::string sender;
+        database_.current_username(sender);
+        if (raft_->propose(
+                {chat262::mutation::op_send_txt, sender, recipient, txt},
+                s) != status::ok) {
+            logger::log_out("%s", "Refusing a text, not the leader\n");
+            msg = chat262::send_txt_response::serialize(
+                chat262::status_code_not_leader);
+            return send_msg(client_fd, msg);
+        }
+    } else {
+        s = database_.send_txt(recipient, txt);
+    }
+    if (s == status::error && router_) {
+        // The sender or the recipient may be moving to another shard
+        router_->await(recipient);
+        if (!database_.is_logged_in()) {
+            msg = chat262::send_txt_response::serialize(
+                chat262::status_code_unauthorized);
+            return send_msg(client_fd, msg);
+        }
+        if (!router_->owns(recipient)) {
+            uint32_t stat_code;
+            s = send_remote_txt(recipient, txt, stat_code);
+            if (s != status::ok) {
+                return s;
+            }
+            msg = stat_code == chat262::status_code_ok
+                      ? write_ok_response<chat262::send_txt_response>()
+                      : chat262::send_txt_response::serialize(stat_code);
+            return send_msg(client_fd, msg);
+        }
+    }
     if (s == status::ok) {
         logger::log_out("Sent text to \"%s\"\n", recipient.c_str());
-        msg = chat262::send_txt_response::serialize(chat262::status_code_ok);
+        if (wait_for_journal() != status::ok) {
+            return status::error;
+        }
+        wait_for_followers();
+        msg = write_ok_response<chat262::send_txt_response>();
+    } else if (s == status::quota_error) {
+        logger::log_out("Storage quota exceeded for a text to \"%s\"\n",
+                        recipient.c_str());
+        msg = chat262::send_txt_response::serialize(
+            chat262::status_code_quota_exceeded);
     } else {
         logger::log_out("User \"%s\" does not exist\n", recipient.c_str());
         msg = chat262::send_txt_response::serialize(
@@ -494,24 +2038,40 @@ status server::handle_recv_txt(int client_fd,
                     sender.c_str());
 
     std::shared_ptr<chat262::message> msg;
-    chat c;
+    chat_view v;
 
     if (!database_.is_logged_in()) {
         msg = chat262::recv_txt_response::serialize(
             chat262::status_code_unauthorized,
-            c);
+            v);
         return send_msg(client_fd, msg);
     }
 
-    s = database_.recv_txt(sender, c);
+    s = database_.recv_txt(sender, v);
+    if (s == status::error && router_ && !router_->owns(sender)) {
+        // A user of another shard that never exchanged a text with the
+        // logged in user is not recorded here
+        bool exists;
+        if (router_->lookup(sender, exists) != status::ok) {
+            return status::receive_error;
+        }
+        s = exists ? status::ok : status::error;
+    }
+    if (s == status::receive_error) {
+        // There is no status code for server failures, so give up on the
+        // connection
+        logger::log_err("Could not read the chat with \"%s\" from the disk\n",
+                        sender.c_str());
+        return s;
+    }
     if (s == status::ok) {
         logger::log_out("Sending texts from \"%s\"\n", sender.c_str());
-        msg = chat262::recv_txt_response::serialize(chat262::status_code_ok, c);
+        msg = chat262::recv_txt_response::serialize(chat262::status_code_ok, v);
     } else {
         logger::log_out("User \"%s\" does not exist\n", sender.c_str());
         msg = chat262::recv_txt_response::serialize(
             chat262::status_code_user_noexist,
-            c);
+            v);
     }
     return send_msg(client_fd, msg);
 }
@@ -559,14 +2119,796 @@ status server::handle_delete(int client_fd,
             chat262::status_code_unauthorized);
         return send_msg(client_fd, msg);
     }
+    if (backup_ || tailer_) {
+        logger::log_out("%s", "Refusing a deletion on a read-only server\n");
+        msg = chat262::delete_response::serialize(
+            chat262::status_code_read_only);
+        return send_msg(client_fd, msg);
+    }
+
+    if (raft_) {
+        std::string username;
+        database_.current_username(username);
+        status result;
+        if (raft_->propose(
+                {chat262::mutation::op_delete_user, username, "", ""},
+                result) != status::ok) {
+            logger::log_out("%s", "Refusing a deletion, not the leader\n");
+            msg = chat262::delete_response::serialize(
+                chat262::status_code_not_leader);
+            return send_msg(client_fd, msg);
+        }
+        database_.logout();
+    } else if (router_) {
+        std::string username;
+        database_.current_username(username);
+        database_.delete_user();
+        // The user is deleted even if some shard can't be reached, whose
+        // users then keep their chats with the user
+        router_->forward_deletion(
+            {chat262::mutation::op_delete_user, username, "", ""});
+    } else {
+        database_.delete_user();
+    }
+    if (wait_for_journal() != status::ok) {
+        return status::error;
+    }
+    wait_for_followers();
+    msg = write_ok_response<chat262::delete_response>();
+    return send_msg(client_fd, msg);
+}
+
+status server::handle_replicate(int client_fd,
+                                const std::vector<uint8_t>& body_data) {
+    if (!backup_) {
+        logger::log_err("%s", "Replicate request, but this is not a backup\n");
+        return handle_invalid_type(client_fd);
+    }
+    if (connection_addr != n_primary_addr_) {
+        logger::log_err("%s", "Replicate request, but not from the primary\n");
+        return handle_invalid_type(client_fd);
+    }
+
+    uint64_t first_seq;
+    std::vector<chat262::mutation> mutations;
+    status s = chat262::replicate_request::deserialize(body_data,
+                                                       first_seq,
+                                                       mutations);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
+
+    uint64_t last_seq;
+    s = database_.apply(first_seq, mutations, last_seq);
+    if (s != status::ok) {
+        logger::log_err("Unknown mutation after sequence number %" PRIu64
+                        "\n",
+                        last_seq);
+        return status::body_error;
+    }
+    replicated_batches_.fetch_add(1, std::memory_order_relaxed);
+    replicated_seq_.store(last_seq, std::memory_order_relaxed);
+
+    std::shared_ptr<chat262::message> msg =
+        chat262::replicate_response::serialize(last_seq);
+    return send_msg(client_fd, msg);
+}
+
+status server::handle_vote(int client_fd,
+                           const std::vector<uint8_t>& body_data) {
+    if (!raft_) {
+        logger::log_err("%s", "Vote request, but this is not a Raft server\n");
+        return handle_invalid_type(client_fd);
+    }
+    if (!raft_->is_peer(connection_addr)) {
+        logger::log_err("%s", "Vote request, but not from a Raft server\n");
+        return handle_invalid_type(client_fd);
+    }
+
+    uint64_t term;
+    uint32_t candidate;
+    uint64_t last_log_index;
+    uint64_t last_log_term;
+    status s = chat262::vote_request::deserialize(
+        body_data, term, candidate, last_log_index, last_log_term);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
+
+    uint64_t resp_term;
+    bool granted;
+    raft_->handle_vote(
+        term, candidate, last_log_index, last_log_term, resp_term, granted);
+    std::shared_ptr<chat262::message> msg =
+        chat262::vote_response::serialize(resp_term, granted);
+    return send_msg(client_fd, msg);
+}
+
+status server::handle_append(int client_fd,
+                             const std::vector<uint8_t>& body_data) {
+    if (!raft_) {
+        logger::log_err("%s",
+                        "Append request, but this is not a Raft server\n");
+        return handle_invalid_type(client_fd);
+    }
+    if (!raft_->is_peer(connection_addr)) {
+        logger::log_err("%s", "Append request, but not from a Raft server\n");
+        return handle_invalid_type(client_fd);
+    }
+
+    uint64_t term;
+    uint32_t leader;
+    uint64_t prev_log_index;
+    uint64_t prev_log_term;
+    uint64_t leader_commit;
+    std::vector<uint64_t> terms;
+    std::vector<chat262::mutation> mutations;
+    status s = chat262::append_request::deserialize(body_data,
+                                                    term,
+                                                    leader,
+                                                    prev_log_index,
+                                                    prev_log_term,
+                                                    leader_commit,
+                                                    terms,
+                                                    mutations);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
+
+    uint64_t resp_term;
+    bool success;
+    uint64_t match_index;
+    raft_->handle_append(term,
+                         leader,
+                         prev_log_index,
+                         prev_log_term,
+                         leader_commit,
+                         terms,
+                         mutations,
+                         resp_term,
+                         success,
+                         match_index);
+    std::shared_ptr<chat262::message> msg =
+        chat262::append_response::serialize(resp_term, success, match_index);
+    return send_msg(client_fd, msg);
+}
+
+status server::handle_snapshot(int client_fd,
+                               const std::vector<uint8_t>& body_data) {
+    if (!raft_) {
+        logger::log_err("%s",
+                        "Snapshot request, but this is not a Raft server\n");
+        return handle_invalid_type(client_fd);
+    }
+    if (!raft_->is_peer(connection_addr)) {
+        logger::log_err("%s", "Snapshot request, but not from a Raft server\n");
+        return handle_invalid_type(client_fd);
+    }
+
+    uint64_t term;
+    uint32_t leader;
+    uint64_t last_index;
+    uint64_t last_term;
+    uint64_t offset;
+    bool done;
+    std::vector<chat262::mutation> mutations;
+    status s = chat262::snapshot_request::deserialize(body_data,
+                                                      term,
+                                                      leader,
+                                                      last_index,
+                                                      last_term,
+                                                      offset,
+                                                      done,
+                                                      mutations);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
+
+    uint64_t resp_term;
+    uint64_t received;
+    raft_->handle_snapshot(term,
+                           leader,
+                           last_index,
+                           last_term,
+                           offset,
+                           done,
+                           mutations,
+                           resp_term,
+                           received);
+    std::shared_ptr<chat262::message> msg =
+        chat262::snapshot_response::serialize(resp_term, received);
+    return send_msg(client_fd, msg);
+}
+
+status server::handle_tail(int client_fd,
+                           const std::vector<uint8_t>& body_data) {
+    if (!tail_log_) {
+        logger::log_err("%s",
+                        "Tail request, but this server keeps no log for "
+                        "read replicas\n");
+        return handle_invalid_type(client_fd);
+    }
+    if (std::find(replicas_.begin(), replicas_.end(), connection_addr) ==
+        replicas_.end()) {
+        logger::log_err("%s", "Tail request, but not from a read replica\n");
+        return handle_invalid_type(client_fd);
+    }
+
+    uint64_t next_seq;
+    uint64_t offset;
+    uint32_t max_wait_ms;
+    status s = chat262::tail_request::deserialize(body_data,
+                                                  next_seq,
+                                                  offset,
+                                                  max_wait_ms);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
+    tail_requests_.fetch_add(1, std::memory_order_relaxed);
+
+    std::vector<chat262::mutation> mutations;
+    std::shared_ptr<chat262::message> msg;
+    // Serve the log if it still has the mutations the replica asks for. A
+    // replica that is ahead of the log tailed an earlier run of this server.
+    if (offset == 0 && next_seq <= log_.last_seq() + 1 &&
+        log_.read(next_seq,
+                  replicator::max_batch_mutations,
+                  replicator::max_batch_bytes,
+                  std::min(std::chrono::milliseconds(max_wait_ms),
+                           max_tail_wait),
+                  mutations) == status::ok) {
+        tail_mutations_.fetch_add(mutations.size(), std::memory_order_relaxed);
+        msg = chat262::tail_response::serialize(next_seq,
+                                                log_.last_seq(),
+                                                false,
+                                                false,
+                                                mutations);
+        return send_msg(client_fd, msg);
+    }
+
+    if (offset == 0) {
+        logger::log_out("Taking a snapshot for a read replica that needs "
+                        "mutation %" PRIu64 "\n",
+                        next_seq);
+        if (database_.snapshot(connection_snapshot,
+                               connection_snapshot_seq) != status::ok) {
+            logger::log_err("%s",
+                            "Could not take a snapshot for a read replica\n");
+            connection_snapshot.clear();
+            return status::receive_error;
+        }
+        tail_snapshots_.fetch_add(1, std::memory_order_relaxed);
+    } else if (offset >= connection_snapshot.size()) {
+        logger::log_err("Snapshot offset %" PRIu64 " is past the snapshot\n",
+                        offset);
+        return status::body_error;
+    }
+
+    // Send the snapshot in chunks as large as the batches of a replicator
+    size_t end = offset;
+    size_t bytes = 0;
+    while (end != connection_snapshot.size() &&
+           end - offset != replicator::max_batch_mutations &&
+           bytes < replicator::max_batch_bytes) {
+        const chat262::mutation& m = connection_snapshot[end];
+        bytes += m.username_.length() + m.arg_.length() + m.txt_.length();
+        ++end;
+    }
+    mutations.assign(connection_snapshot.begin() + offset,
+                     connection_snapshot.begin() + end);
+    const bool done = end == connection_snapshot.size();
+    msg = chat262::tail_response::serialize(connection_snapshot_seq + 1,
+                                            log_.last_seq(),
+                                            true,
+                                            done,
+                                            mutations);
+    if (done) {
+        connection_snapshot.clear();
+        connection_snapshot.shrink_to_fit();
+    }
+    return send_msg(client_fd, msg);
+}
+
+status server::handle_sync(int client_fd,
+                           const std::vector<uint8_t>& body_data) {
+    uint64_t token;
+    uint32_t max_wait_ms;
+    status s = chat262::sync_request::deserialize(body_data,
+                                                  token,
+                                                  max_wait_ms);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
+    syncs_.fetch_add(1, std::memory_order_relaxed);
+
+    uint32_t stat_code = chat262::status_code_ok;
+    uint64_t applied;
+    uint32_t staleness_ms;
+    if (backup_ || tailer_) {
+        // Backups and read replicas apply the mutations of a primary, whose
+        // sequence numbers are the tokens
+        if (database_.wait_applied(
+                token,
+                std::min(std::chrono::milliseconds(max_wait_ms),
+                         max_sync_wait),
+                applied) != status::ok) {
+            logger::log_out("Write %" PRIu64 " not applied in time\n", token);
+            stale_syncs_.fetch_add(1, std::memory_order_relaxed);
+            stat_code = chat262::status_code_stale;
+        }
+        // A backup doesn't know how far behind the primary it is
+        staleness_ms = tailer_ ? tailer_->staleness_ms()
+                               : std::numeric_limits<uint32_t>::max();
+    } else {
+        // Every write is applied here first
+        applied = log_.last_seq();
+        staleness_ms = 0;
+    }
+
+    std::shared_ptr<chat262::message> msg =
+        chat262::sync_response::serialize(stat_code, applied, staleness_ms);
+    return send_msg(client_fd, msg);
+}
+
+status server::handle_forward(int client_fd,
+                               const std::vector<uint8_t>& body_data) {
+    if (!router_) {
+        logger::log_err("%s", "Forward request, but this is not a shard\n");
+        return handle_invalid_type(client_fd);
+    }
+    if (!router_->is_peer(connection_addr)) {
+        logger::log_err("%s", "Forward request, but not from a shard\n");
+        return handle_invalid_type(client_fd);
+    }
+
+    chat262::mutation m;
+    status s = chat262::forward_request::deserialize(body_data, m);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
 
-    database_.delete_user();
-    msg = chat262::delete_response::serialize(chat262::status_code_ok);
+    uint32_t stat_code = chat262::status_code_ok;
+    uint32_t n_ip_addr;
+    switch (m.op_) {
+    case chat262::mutation::op_send_txt:
+        if (router_->owns(m.arg_)) {
+            s = database_.deliver_remote_txt(m.username_, m.arg_, m.txt_);
+            if (s == status::quota_error) {
+                stat_code = chat262::status_code_quota_exceeded;
+                break;
+            } else if (s == status::ok) {
+                break;
+            }
+            // The recipient may be moving to another shard
+            router_->await(m.arg_);
+            if (router_->owns(m.arg_)) {
+                stat_code = chat262::status_code_user_noexist;
+                break;
+            }
+        }
+        // A shard that doesn't know that the recipient moved sent the text
+        // here, so relay it to the recipient's new shard
+        if (!router_->moved(m.arg_)) {
+            stat_code = chat262::status_code_wrong_shard;
+        } else if (router_->forward_txt(m, stat_code) != status::ok) {
+            return status::receive_error;
+        }
+        break;
+    case chat262::mutation::op_delete_user:
+        database_.remove_remote_user(m.username_);
+        break;
+    case chat262::mutation::op_move_user:
+        if (inet_pton(AF_INET, m.arg_.c_str(), &n_ip_addr) != 1) {
+            logger::log_err("Invalid shard address \"%s\"\n",
+                            m.arg_.c_str());
+            return status::body_error;
+        }
+        router_->set_owner(m.username_, n_ip_addr);
+        break;
+    default:
+        logger::log_err("Mutation %" PRIu8 " can't be forwarded\n", m.op_);
+        return status::body_error;
+    }
+    logger::log_out("Forwarded %s from \"%s\": %s\n",
+                    m.op_ == chat262::mutation::op_send_txt     ? "text"
+                    : m.op_ == chat262::mutation::op_delete_user ? "deletion"
+                                                                 : "move",
+                    m.username_.c_str(),
+                    chat262::status_code_lookup(stat_code));
+
+    std::shared_ptr<chat262::message> msg =
+        chat262::forward_response::serialize(stat_code);
     return send_msg(client_fd, msg);
 }
 
+status server::handle_shard_accounts(int client_fd,
+                                     const std::vector<uint8_t>& body_data) {
+    if (!router_) {
+        logger::log_err("%s",
+                        "Shard accounts request, but this is not a shard\n");
+        return handle_invalid_type(client_fd);
+    }
+    if (!router_->is_peer(connection_addr)) {
+        logger::log_err("%s",
+                        "Shard accounts request, but not from a shard\n");
+        return handle_invalid_type(client_fd);
+    }
+
+    std::string pattern;
+    status s = chat262::shard_accounts_request::deserialize(body_data, pattern);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
+
+    std::shared_ptr<chat262::message> msg =
+        chat262::shard_accounts_response::serialize(
+            chat262::status_code_ok,
+            database_.get_usernames(pattern));
+    return send_msg(client_fd, msg);
+}
+
+status server::handle_proxy(int client_fd,
+                            const std::vector<uint8_t>& body_data) {
+    if (std::find(proxies_.begin(), proxies_.end(), connection_addr) ==
+        proxies_.end()) {
+        logger::log_err("%s", "Proxy request, but not from a proxy\n");
+        return handle_invalid_type(client_fd);
+    }
+
+    uint32_t features;
+    std::string username;
+    std::string request;
+    status s = chat262::proxy_request::deserialize(body_data,
+                                                   features,
+                                                   username,
+                                                   request);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
+
+    // The relayed request must be a complete client request of a version
+    // that this server speaks
+    chat262::message_header hdr;
+    if (request.size() < sizeof(hdr) ||
+        chat262::message_header::deserialize(
+            std::vector<uint8_t>(request.begin(),
+                                 request.begin() + sizeof(hdr)),
+            hdr) != status::ok ||
+        hdr.body_len_ != request.size() - sizeof(hdr) ||
+        hdr.version_ < chat262::version ||
+        hdr.version_ > chat262::latest_version) {
+        logger::log_err("%s", "Invalid relayed request\n");
+        return status::body_error;
+    }
+    const std::vector<uint8_t> body(request.begin() + sizeof(hdr),
+                                    request.end());
+    logger::log_out("Relayed request: type %" PRIu16 " (%s) of \"%s\"\n",
+                    hdr.type_,
+                    chat262::message_type_lookup(hdr.type_),
+                    username.c_str());
+
+    if (!connection_from_proxy) {
+        // Requests of many clients wait behind each other on the connection
+        static constexpr int enable_nodelay = 1;
+        setsockopt(client_fd,
+                   IPPROTO_TCP,
+                   TCP_NODELAY,
+                   &enable_nodelay,
+                   sizeof(enable_nodelay));
+        connection_from_proxy = true;
+    }
+
+    // Handle the relayed request like a request of the client's own
+    // connection, except that the response is kept rather than sent. A user
+    // that was deleted in the meantime is simply not logged in anymore.
+    const uint16_t proxy_version = connection_version;
+    const uint32_t proxy_features = connection_features;
+    connection_version = hdr.version_;
+    connection_features =
+        hdr.version_ == chat262::version ? 0 : features & supported_features;
+    if (database_.is_logged_in()) {
+        database_.logout();
+    }
+
+    // The request of a user that moved to another shard is not handled, and
+    // the response is left empty to tell the proxy so. The user must not
+    // move while its request is handled.
+    std::string routed = username;
+    if (hdr.type_ == chat262::msgtype_login_request) {
+        std::string password;
+        chat262::login_request::deserialize(body, routed, password);
+    }
+    if (router_ && !routed.empty()) {
+        router_->enter(routed);
+        if (!router_->owns(routed)) {
+            router_->leave(routed);
+            connection_version = proxy_version;
+            connection_features = proxy_features;
+            logger::log_out("User \"%s\" moved to another shard\n",
+                            routed.c_str());
+            return send_msg(client_fd,
+                            chat262::proxy_response::serialize(routed, ""));
+        }
+    }
+
+    if (!username.empty()) {
+        database_.login_as(username);
+    }
+    std::shared_ptr<chat262::message> response;
+    proxied_response = &response;
+    if (hdr.type_ >= chat262::msgtype_registration_request &&
+        hdr.type_ <= chat262::msgtype_delete_request) {
+        s = handle_request(client_fd, hdr.type_, body);
+    } else {
+        logger::log_err("Type %" PRIu16 " can't be relayed\n", hdr.type_);
+        s = handle_invalid_type(client_fd);
+    }
+    if (s == status::body_error) {
+        s = handle_invalid_body(client_fd);
+    }
+    proxied_response = nullptr;
+    connection_version = proxy_version;
+    connection_features = proxy_features;
+    username.clear();
+    if (database_.current_username(username) == status::ok) {
+        database_.logout();
+    }
+    if (router_ && !routed.empty()) {
+        router_->leave(routed);
+    }
+    // A request that broke the client's connection breaks the connection of
+    // the proxy, which drops the client
+    if (s != status::ok) {
+        return s;
+    }
+    if (!response) {
+        return status::error;
+    }
+    proxied_reqs_.fetch_add(1, std::memory_order_relaxed);
+
+    const uint8_t* response_data =
+        reinterpret_cast<const uint8_t*>(response.get());
+    auto msg = chat262::proxy_response::serialize(
+        username,
+        std::string(response_data,
+                    response_data + sizeof(chat262::message_header) +
+                        e_le32toh(response->hdr_.body_len_)));
+    return send_msg(client_fd, msg);
+}
+
+status server::handle_migrate(int client_fd,
+                              const std::vector<uint8_t>& body_data) {
+    if (!router_) {
+        logger::log_err("%s", "Migrate request, but this is not a shard\n");
+        return handle_invalid_type(client_fd);
+    }
+    // Users are moved by the operators of the cluster, from the hosts of the
+    // shards
+    if (connection_addr != n_ip_addr_ && !router_->is_peer(connection_addr)) {
+        logger::log_err("%s", "Migrate request, but not from a shard\n");
+        return handle_invalid_type(client_fd);
+    }
+
+    uint32_t n_ip_addr;
+    std::string username;
+    status s =
+        chat262::migrate_request::deserialize(body_data, n_ip_addr, username);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
+
+    logger::log_out("Moving user \"%s\" to another shard\n",
+                    username.c_str());
+    uint32_t stat_code;
+    uint64_t bytes;
+    uint64_t copy_ns;
+    uint64_t pause_ns;
+    if (router_->migrate(username,
+                         n_ip_addr,
+                         stat_code,
+                         bytes,
+                         copy_ns,
+                         pause_ns) != status::ok) {
+        // There is no status code for server failures, so give up on the
+        // connection
+        return status::receive_error;
+    }
+    std::shared_ptr<chat262::message> msg;
+    if (stat_code == chat262::status_code_ok) {
+        logger::log_out("Moved user \"%s\": %" PRIu64
+                        " bytes, paused for %.1f us\n",
+                        username.c_str(),
+                        bytes,
+                        pause_ns / 1e3);
+        msg = chat262::migrate_response::serialize(stat_code,
+                                                   bytes,
+                                                   copy_ns / 1000,
+                                                   pause_ns / 1000);
+    } else {
+        logger::log_out("Could not move user \"%s\": %s\n",
+                        username.c_str(),
+                        chat262::status_code_lookup(stat_code));
+        msg = chat262::migrate_response::serialize(stat_code);
+    }
+    return send_msg(client_fd, msg);
+}
+
+status server::handle_import(int client_fd,
+                             const std::vector<uint8_t>& body_data) {
+    if (!router_) {
+        logger::log_err("%s", "Import request, but this is not a shard\n");
+        return handle_invalid_type(client_fd);
+    }
+    if (!router_->is_peer(connection_addr)) {
+        logger::log_err("%s", "Import request, but not from a shard\n");
+        return handle_invalid_type(client_fd);
+    }
+
+    bool done;
+    std::string username;
+    std::vector<chat262::mutation> mutations;
+    status s = chat262::import_request::deserialize(body_data,
+                                                    done,
+                                                    username,
+                                                    mutations);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
+
+    uint32_t stat_code = chat262::status_code_ok;
+    s = database_.import_user(username, mutations);
+    if (s == status::body_error) {
+        logger::log_err("Invalid mutations of \"%s\"\n", username.c_str());
+        return s;
+    } else if (s != status::ok) {
+        stat_code = chat262::status_code_user_exists;
+    } else if (done) {
+        database_.adopt_user(username);
+        router_->adopt(username);
+    }
+    logger::log_out("Imported %zu mutations of \"%s\"%s: %s\n",
+                    mutations.size(),
+                    username.c_str(),
+                    done ? ", the last" : "",
+                    chat262::status_code_lookup(stat_code));
+
+    std::shared_ptr<chat262::message> msg =
+        chat262::import_response::serialize(stat_code);
+    return send_msg(client_fd, msg);
+}
+
+status server::handle_locate(int client_fd,
+                             const std::vector<uint8_t>& body_data) {
+    if (!router_) {
+        logger::log_err("%s", "Locate request, but this is not a shard\n");
+        return handle_invalid_type(client_fd);
+    }
+
+    std::string username;
+    status s = chat262::locate_request::deserialize(body_data, username);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
+
+    std::shared_ptr<chat262::message> msg =
+        chat262::locate_response::serialize(chat262::status_code_ok,
+                                            router_->owner_of(username));
+    return send_msg(client_fd, msg);
+}
+
+status server::send_remote_txt(const std::string& recipient,
+                               const std::string& txt,
+                               uint32_t& stat_code) {
+    std::string sender;
+    database_.current_username(sender);
+    // The sender must not move before its copy is stored. A relayed request
+    // already holds its user.
+    const shard_router::pin pin(connection_from_proxy ? nullptr : router_.get(),
+                                sender);
+    if (!database_.is_logged_in()) {
+        stat_code = chat262::status_code_unauthorized;
+        return status::ok;
+    }
+    if (database_.check_remote_txt(recipient, txt) != status::ok) {
+        logger::log_out("Storage quota exceeded for a text to \"%s\"\n",
+                        recipient.c_str());
+        stat_code = chat262::status_code_quota_exceeded;
+        return status::ok;
+    }
+    if (router_->forward_txt(
+            {chat262::mutation::op_send_txt, sender, recipient, txt},
+            stat_code) != status::ok) {
+        // There is no status code for server failures, so give up on the
+        // connection
+        return status::receive_error;
+    }
+    if (stat_code != chat262::status_code_ok) {
+        logger::log_out("Shard of \"%s\" refused a text: %s\n",
+                        recipient.c_str(),
+                        chat262::status_code_lookup(stat_code));
+        return status::ok;
+    }
+    // The recipient was deleted meanwhile
+    if (database_.store_remote_txt(recipient, txt) != status::ok) {
+        stat_code = chat262::status_code_user_noexist;
+        return status::ok;
+    }
+    logger::log_out("Sent text to \"%s\" on another shard\n",
+                    recipient.c_str());
+    return status::ok;
+}
+
+status server::wait_for_journal() {
+    if (!journal_) {
+        return status::ok;
+    }
+    const uint64_t seq = journal::last_appended();
+    if (seq != 0 && journal_->wait_durable(seq) != status::ok) {
+        logger::log_err("Mutation %" PRIu64 " could not be journaled\n", seq);
+        return status::error;
+    }
+    return status::ok;
+}
+
+void server::wait_for_followers() {
+    if (!sync_replication_ || replicators_.empty()) {
+        return;
+    }
+    const uint64_t seq = replication_log::last_appended();
+    if (seq != 0 && log_.wait_replicated(seq, replication_timeout) !=
+                        status::ok) {
+        logger::log_err("Mutation %" PRIu64 " not replicated in time\n", seq);
+    }
+}
+
+status server::handle_hello(int client_fd,
+                            const std::vector<uint8_t>& body_data) {
+    uint16_t max_version;
+    uint32_t features;
+    status s =
+        chat262::hello_request::deserialize(body_data, max_version, features);
+    if (s != status::ok) {
+        logger::log_err("%s", "Unable to deserialize request body\n");
+        return s;
+    }
+
+    logger::log_out("Hello with version %" PRIu16 ", features 0x%" PRIx32
+                    "\n",
+                    max_version,
+                    features);
+
+    // Speak the latest version both sides know. Version 1 has no features.
+    uint16_t chosen_version = std::min(max_version, chat262::latest_version);
+    if (chosen_version < chat262::version) {
+        chosen_version = chat262::version;
+    }
+    const uint32_t enabled =
+        chosen_version == chat262::version ? 0 : features & supported_features;
+
+    // The response still goes out with the version and features of the hello
+    std::shared_ptr<chat262::message> msg =
+        chat262::hello_response::serialize(chosen_version, enabled);
+    s = send_msg(client_fd, msg);
+    connection_version = chosen_version;
+    connection_features = enabled;
+    return s;
+}
+
 status server::handle_wrong_version(int client_fd) {
-    auto msg = chat262::wrong_version_response::serialize(chat262::version);
+    auto msg =
+        chat262::wrong_version_response::serialize(connection_version);
     return send_msg(client_fd, msg);
 }
 
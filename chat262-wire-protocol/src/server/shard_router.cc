@@ -0,0 +1,533 @@
+#include "shard_router.h"
+
+#include "endianness.h"
+#include "logger.h"
+#include "peer_io.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <iterator>
+#include <unistd.h>
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+// Addresses of all shards of the cluster: this one and its peers
+static std::vector<uint32_t> cluster_addresses(
+    const uint32_t n_ip_addr,
+    const std::vector<std::pair<uint32_t, std::string>>& peers) {
+    std::vector<uint32_t> addrs = {n_ip_addr};
+    for (const auto& p : peers) {
+        addrs.push_back(p.first);
+    }
+    return addrs;
+}
+
+// Nanoseconds since `start`
+static uint64_t elapsed_ns(const steady_clock::time_point& start) {
+    return static_cast<uint64_t>(
+        duration_cast<nanoseconds>(steady_clock::now() - start).count());
+}
+
+shard_router::shard_router(
+    database& db,
+    const uint32_t n_ip_addr,
+    const std::vector<std::pair<uint32_t, std::string>>& peers)
+    : db_(db),
+      n_ip_addr_(n_ip_addr),
+      ring_(cluster_addresses(n_ip_addr, peers)),
+      stats_{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0} {
+    for (const auto& p : peers) {
+        peers_.push_back({p.first, p.second, {}});
+    }
+}
+
+shard_router::pin::pin(shard_router* router, const std::string& username)
+    : router_(router),
+      username_(username) {
+    if (router_ != nullptr) {
+        router_->enter(username_);
+    }
+}
+
+shard_router::pin::~pin() {
+    if (router_ != nullptr) {
+        router_->leave(username_);
+    }
+}
+
+shard_router::~shard_router() {
+    for (peer& p : peers_) {
+        for (const int fd : p.idle_) {
+            close(fd);
+        }
+    }
+}
+
+bool shard_router::is_peer(const uint32_t n_ip_addr) const {
+    for (const peer& p : peers_) {
+        if (p.n_ip_addr_ == n_ip_addr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool shard_router::owns(const std::string& username) const {
+    return owner_of(username) == n_ip_addr_;
+}
+
+uint32_t shard_router::owner_of(const std::string& username) const {
+    {
+        const std::lock_guard<std::mutex> lock(owners_mutex_);
+        auto it = owners_.find(username);
+        if (it != owners_.end()) {
+            return (*it).second;
+        }
+    }
+    return ring_.shard_of(username);
+}
+
+bool shard_router::moved(const std::string& username) const {
+    const std::lock_guard<std::mutex> lock(owners_mutex_);
+    return owners_.count(username) != 0;
+}
+
+void shard_router::set_owner(const std::string& username,
+                             const uint32_t n_ip_addr) {
+    const std::lock_guard<std::mutex> lock(owners_mutex_);
+    owners_[username] = n_ip_addr;
+}
+
+void shard_router::adopt(const std::string& username) {
+    set_owner(username, n_ip_addr_);
+    const std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.migrations_in_;
+}
+
+void shard_router::enter(const std::string& username) {
+    std::unique_lock<std::mutex> lock(owners_mutex_);
+    owners_cv_.wait(lock, [&] { return frozen_.count(username) == 0; });
+    ++active_[username];
+}
+
+void shard_router::leave(const std::string& username) {
+    const std::lock_guard<std::mutex> lock(owners_mutex_);
+    auto it = active_.find(username);
+    if (--(*it).second == 0) {
+        active_.erase(it);
+        if (frozen_.count(username) != 0) {
+            owners_cv_.notify_all();
+        }
+    }
+}
+
+void shard_router::await(const std::string& username) {
+    std::unique_lock<std::mutex> lock(owners_mutex_);
+    owners_cv_.wait(lock, [&] { return frozen_.count(username) == 0; });
+}
+
+status shard_router::migrate(const std::string& username,
+                             const uint32_t n_ip_addr,
+                             uint32_t& stat_code,
+                             uint64_t& bytes,
+                             uint64_t& copy_ns,
+                             uint64_t& pause_ns) {
+    peer* p = find_peer(n_ip_addr);
+    if (p == nullptr || !owns(username)) {
+        stat_code = chat262::status_code_wrong_shard;
+        return status::ok;
+    }
+    const std::lock_guard<std::mutex> migrate_lock(migrate_mutex_);
+    // The user may have moved while another user was moving
+    if (!owns(username)) {
+        stat_code = chat262::status_code_wrong_shard;
+        return status::ok;
+    }
+
+    // Copy the chats while the user keeps writing
+    const steady_clock::time_point start = steady_clock::now();
+    bytes = 0;
+    std::vector<chat262::mutation> mutations;
+    status s = db_.export_user(username, mutations);
+    if (s == status::error) {
+        stat_code = chat262::status_code_user_noexist;
+        return status::ok;
+    }
+    if (s == status::ok) {
+        s = import(*p, username, mutations, false, stat_code, bytes);
+    }
+    // Then the writes made meanwhile, until few enough are left
+    for (int round = 0; round != max_catch_up_rounds && s == status::ok &&
+                        stat_code == chat262::status_code_ok;
+         ++round) {
+        db_.take_exported(username, mutations);
+        s = import(*p, username, mutations, false, stat_code, bytes);
+        if (mutations.size() < catch_up_threshold) {
+            break;
+        }
+    }
+    if (s != status::ok || stat_code != chat262::status_code_ok) {
+        db_.cancel_export(username);
+        const std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.failed_migrations_;
+        return s;
+    }
+    copy_ns = elapsed_ns(start);
+
+    // Pause the user to copy the last writes. A user that was deleted
+    // meanwhile stays here, and the deletion reaches the other shard as it
+    // reaches every shard.
+    const steady_clock::time_point pause_start = steady_clock::now();
+    freeze(username);
+    if (db_.seal_user(username, mutations) != status::ok) {
+        thaw(username);
+        stat_code = chat262::status_code_user_noexist;
+        return status::ok;
+    }
+    s = import(*p, username, mutations, true, stat_code, bytes);
+    if (s != status::ok || stat_code != chat262::status_code_ok) {
+        db_.unseal_user(username);
+        thaw(username);
+        const std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.failed_migrations_;
+        return s;
+    }
+    db_.drop_user(username);
+    set_owner(username, n_ip_addr);
+    thaw(username);
+    pause_ns = elapsed_ns(pause_start);
+    announce_move(*p, username);
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.migrations_out_;
+    stats_.migrated_bytes_ += bytes;
+    stats_.total_copy_ns_ += copy_ns;
+    stats_.total_pause_ns_ += pause_ns;
+    stats_.max_pause_ns_ = std::max(stats_.max_pause_ns_, pause_ns);
+    return status::ok;
+}
+
+status shard_router::forward_txt(const chat262::mutation& m,
+                                 uint32_t& stat_code) {
+    peer* p = find_peer(owner_of(m.arg_));
+    if (p == nullptr) {
+        return status::error;
+    }
+
+    const steady_clock::time_point start = steady_clock::now();
+    std::vector<uint8_t> body;
+    if (call(*p,
+             chat262::forward_request::serialize(m),
+             chat262::msgtype_forward_response,
+             body) != status::ok ||
+        chat262::forward_response::deserialize(body, stat_code) !=
+            status::ok) {
+        record_failure(*p);
+        return status::error;
+    }
+    const uint64_t ns = elapsed_ns(start);
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.forwarded_txts_;
+    stats_.total_forward_ns_ += ns;
+    stats_.max_forward_ns_ = std::max(stats_.max_forward_ns_, ns);
+    return status::ok;
+}
+
+status shard_router::forward_deletion(const chat262::mutation& m) {
+    const std::shared_ptr<chat262::message> msg =
+        chat262::forward_request::serialize(m);
+    status result = status::ok;
+    for (peer& p : peers_) {
+        std::vector<uint8_t> body;
+        uint32_t stat_code;
+        if (call(p, msg, chat262::msgtype_forward_response, body) !=
+                status::ok ||
+            chat262::forward_response::deserialize(body, stat_code) !=
+                status::ok) {
+            record_failure(p);
+            result = status::error;
+        }
+    }
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.forwarded_deletions_;
+    return result;
+}
+
+status shard_router::search(const std::string& pattern,
+                            std::vector<std::string>& usernames) {
+    const steady_clock::time_point start = steady_clock::now();
+    const std::shared_ptr<chat262::message> msg =
+        chat262::shard_accounts_request::serialize(pattern);
+
+    // Scatter the request to all shards before waiting for any of them. A
+    // connection is -1 if the request could not be sent on it.
+    std::vector<int> fds(peers_.size(), -1);
+    std::vector<bool> fresh(peers_.size(), true);
+    for (size_t i = 0; i != peers_.size(); ++i) {
+        int fd;
+        bool is_fresh;
+        if (take_connection(peers_[i], fd, is_fresh) != status::ok) {
+            continue;
+        }
+        fresh[i] = is_fresh;
+        if (send_all(fd, msg) != status::ok) {
+            close(fd);
+            continue;
+        }
+        fds[i] = fd;
+    }
+
+    // The other shards search while this one does
+    usernames = db_.get_usernames(pattern);
+
+    status result = status::ok;
+    std::vector<uint8_t> body;
+    std::vector<std::string> theirs;
+    for (size_t i = 0; i != peers_.size(); ++i) {
+        status s = status::error;
+        if (fds[i] != -1) {
+            s = receive(peers_[i],
+                        fds[i],
+                        chat262::msgtype_shard_accounts_response,
+                        body);
+        }
+        if (s != status::ok && !fresh[i]) {
+            s = call(peers_[i],
+                     msg,
+                     chat262::msgtype_shard_accounts_response,
+                     body);
+        }
+        uint32_t stat_code;
+        if (s != status::ok ||
+            chat262::shard_accounts_response::deserialize(body,
+                                                          stat_code,
+                                                          theirs) !=
+                status::ok ||
+            stat_code != chat262::status_code_ok) {
+            record_failure(peers_[i]);
+            result = status::error;
+            continue;
+        }
+
+        // Every shard's usernames are sorted, and no two shards have the
+        // same username
+        const size_t mid = usernames.size();
+        usernames.insert(usernames.end(),
+                         std::make_move_iterator(theirs.begin()),
+                         std::make_move_iterator(theirs.end()));
+        std::inplace_merge(usernames.begin(),
+                           usernames.begin() + mid,
+                           usernames.end());
+    }
+    const uint64_t ns = elapsed_ns(start);
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.searches_;
+    stats_.total_search_ns_ += ns;
+    stats_.max_search_ns_ = std::max(stats_.max_search_ns_, ns);
+    return result;
+}
+
+status shard_router::lookup(const std::string& username, bool& exists) {
+    peer* p = find_peer(owner_of(username));
+    if (p == nullptr) {
+        return status::error;
+    }
+
+    // Usernames have no `*`, so the username matches itself only
+    std::vector<uint8_t> body;
+    uint32_t stat_code;
+    std::vector<std::string> usernames;
+    if (call(*p,
+             chat262::shard_accounts_request::serialize(username),
+             chat262::msgtype_shard_accounts_response,
+             body) != status::ok ||
+        chat262::shard_accounts_response::deserialize(body,
+                                                      stat_code,
+                                                      usernames) !=
+            status::ok ||
+        stat_code != chat262::status_code_ok) {
+        record_failure(*p);
+        return status::error;
+    }
+    exists = !usernames.empty();
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.lookups_;
+    return status::ok;
+}
+
+shard_router::stats shard_router::get_stats() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+shard_router::peer* shard_router::find_peer(const uint32_t n_ip_addr) {
+    for (peer& p : peers_) {
+        if (p.n_ip_addr_ == n_ip_addr) {
+            return &p;
+        }
+    }
+    return nullptr;
+}
+
+status shard_router::take_connection(peer& p, int& fd, bool& fresh) {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (!p.idle_.empty()) {
+            fd = p.idle_.back();
+            p.idle_.pop_back();
+            fresh = false;
+            return status::ok;
+        }
+    }
+
+    fresh = true;
+    // The other shard takes forwarded writes only from the shards' addresses
+    if (connect_peer(p.n_ip_addr_, n_ip_addr_, fd) != status::ok) {
+        return status::error;
+    }
+    const std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.connects_;
+    return status::ok;
+}
+
+void shard_router::give_back(peer& p, const int fd) {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (p.idle_.size() < max_idle) {
+            p.idle_.push_back(fd);
+            return;
+        }
+    }
+    close(fd);
+}
+
+status shard_router::receive(peer& p,
+                             const int fd,
+                             const uint16_t type,
+                             std::vector<uint8_t>& body) {
+    chat262::message_header hdr;
+    if (recv_message(fd, hdr, body) != status::ok || hdr.type_ != type) {
+        close(fd);
+        return status::error;
+    }
+    give_back(p, fd);
+    return status::ok;
+}
+
+status shard_router::call(peer& p,
+                          const std::shared_ptr<chat262::message>& msg,
+                          const uint16_t type,
+                          std::vector<uint8_t>& body) {
+    while (true) {
+        int fd;
+        bool fresh;
+        if (take_connection(p, fd, fresh) != status::ok) {
+            return status::error;
+        }
+        if (send_all(fd, msg) != status::ok) {
+            close(fd);
+        } else if (receive(p, fd, type, body) == status::ok) {
+            return status::ok;
+        }
+        if (fresh) {
+            return status::error;
+        }
+    }
+}
+
+void shard_router::record_failure(const peer& p) {
+    logger::log_err("Could not reach shard %s\n", p.str_ip_addr_.c_str());
+    const std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.failures_;
+}
+
+void shard_router::freeze(const std::string& username) {
+    std::unique_lock<std::mutex> lock(owners_mutex_);
+    frozen_.insert(username);
+    owners_cv_.wait(lock, [&] { return active_.count(username) == 0; });
+}
+
+void shard_router::thaw(const std::string& username) {
+    const std::lock_guard<std::mutex> lock(owners_mutex_);
+    frozen_.erase(username);
+    owners_cv_.notify_all();
+}
+
+status shard_router::import(peer& p,
+                            const std::string& username,
+                            const std::vector<chat262::mutation>& mutations,
+                            const bool done,
+                            uint32_t& stat_code,
+                            uint64_t& bytes) {
+    stat_code = chat262::status_code_ok;
+    if (mutations.empty() && !done) {
+        return status::ok;
+    }
+    size_t first = 0;
+    do {
+        // Every mutation costs its three lengths and its operation on top of
+        // its bytes
+        size_t last = first;
+        size_t batch_bytes = 0;
+        while (last != mutations.size() && batch_bytes < migration_batch) {
+            const chat262::mutation& m = mutations[last++];
+            batch_bytes += 16 + m.username_.length() + m.arg_.length() +
+                           m.txt_.length();
+        }
+        const std::shared_ptr<chat262::message> msg =
+            chat262::import_request::serialize(
+                done && last == mutations.size(),
+                username,
+                std::vector<chat262::mutation>(mutations.begin() + first,
+                                               mutations.begin() + last));
+        std::vector<uint8_t> body;
+        if (call(p, msg, chat262::msgtype_import_response, body) !=
+                status::ok ||
+            chat262::import_response::deserialize(body, stat_code) !=
+                status::ok) {
+            record_failure(p);
+            return status::error;
+        }
+        bytes += sizeof(chat262::message_header) +
+                 e_le32toh(msg->hdr_.body_len_);
+        if (stat_code != chat262::status_code_ok) {
+            logger::log_err("Shard %s refused user \"%s\": %s\n",
+                            p.str_ip_addr_.c_str(),
+                            username.c_str(),
+                            chat262::status_code_lookup(stat_code));
+            return status::ok;
+        }
+        first = last;
+    } while (first != mutations.size());
+    return status::ok;
+}
+
+void shard_router::announce_move(const peer& p, const std::string& username) {
+    char str_ip_addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &p.n_ip_addr_, str_ip_addr, sizeof(str_ip_addr));
+    const std::shared_ptr<chat262::message> msg =
+        chat262::forward_request::serialize(
+            {chat262::mutation::op_move_user, username, str_ip_addr, ""});
+    for (peer& other : peers_) {
+        if (&other == &p) {
+            continue;
+        }
+        // A shard that doesn't hear of the move relays the user's texts
+        // through this one
+        std::vector<uint8_t> body;
+        uint32_t stat_code;
+        if (call(other, msg, chat262::msgtype_forward_response, body) !=
+                status::ok ||
+            chat262::forward_response::deserialize(body, stat_code) !=
+                status::ok) {
+            record_failure(other);
+        }
+    }
+}
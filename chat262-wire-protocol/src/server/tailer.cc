@@ -0,0 +1,221 @@
+#include "tailer.h"
+
+#include "logger.h"
+#include "peer_io.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <iterator>
+#include <limits>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+// How long to wait between attempts to reach the primary
+static constexpr milliseconds reconnect_interval(100);
+
+tailer::tailer(database& db,
+               const uint32_t n_replica_addr,
+               const uint32_t n_ip_addr,
+               const std::string& str_ip_addr)
+    : db_(db),
+      n_replica_addr_(n_replica_addr),
+      n_ip_addr_(n_ip_addr),
+      str_ip_addr_(str_ip_addr),
+      stop_(false),
+      fd_(-1),
+      caught_up_(false),
+      stats_{false, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0} {
+}
+
+tailer::~tailer() {
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        if (fd_ != -1) {
+            shutdown(fd_, SHUT_RDWR);
+        }
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void tailer::start() {
+    thread_ = std::thread(&tailer::run, this);
+}
+
+const std::string& tailer::address() const {
+    return str_ip_addr_;
+}
+
+uint32_t tailer::staleness_ms() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    if (!caught_up_) {
+        return std::numeric_limits<uint32_t>::max();
+    }
+    const uint64_t ms = static_cast<uint64_t>(
+        duration_cast<milliseconds>(steady_clock::now() - caught_up_at_)
+            .count());
+    return static_cast<uint32_t>(
+        std::min<uint64_t>(ms, std::numeric_limits<uint32_t>::max() - 1));
+}
+
+tailer::stats tailer::get_stats() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void tailer::run() {
+    while (true) {
+        int fd;
+        // The primary serves its log only to the replicas' addresses
+        if (connect_peer(n_ip_addr_, n_replica_addr_, fd) == status::ok) {
+            bool stopped;
+            {
+                const std::lock_guard<std::mutex> lock(mutex_);
+                stopped = stop_;
+                if (!stopped) {
+                    fd_ = fd;
+                    stats_.connected_ = true;
+                    ++stats_.connects_;
+                }
+            }
+            if (stopped) {
+                close(fd);
+                return;
+            }
+            logger::log_out("Tailing primary %s\n", str_ip_addr_.c_str());
+            tail(fd);
+            {
+                const std::lock_guard<std::mutex> lock(mutex_);
+                fd_ = -1;
+                stats_.connected_ = false;
+            }
+            close(fd);
+            logger::log_err("Stopped tailing primary %s\n",
+                            str_ip_addr_.c_str());
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait_for(lock, reconnect_interval, [&]() {
+            return stop_;
+        });
+        if (stop_) {
+            return;
+        }
+    }
+}
+
+void tailer::tail(int fd) {
+    // Chunks of the snapshot being received, and the number of its mutations
+    // received so far. A snapshot is started over on every connection.
+    std::vector<chat262::mutation> snapshot;
+    uint64_t offset = 0;
+    bool in_snapshot = false;
+
+    std::vector<chat262::mutation> mutations;
+    std::vector<uint8_t> data;
+    while (true) {
+        uint64_t next_seq;
+        {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            if (stop_) {
+                return;
+            }
+            next_seq = stats_.applied_ + 1;
+        }
+
+        const steady_clock::time_point sent = steady_clock::now();
+        if (send_all(fd,
+                     chat262::tail_request::serialize(
+                         next_seq,
+                         offset,
+                         static_cast<uint32_t>(poll_wait.count()))) !=
+            status::ok) {
+            return;
+        }
+        chat262::message_header hdr;
+        if (recv_message(fd, hdr, data) != status::ok) {
+            return;
+        }
+        if (hdr.type_ != chat262::msgtype_tail_response) {
+            logger::log_err("Primary %s sent %s instead of a tail response\n",
+                            str_ip_addr_.c_str(),
+                            chat262::message_type_lookup(hdr.type_));
+            return;
+        }
+        uint64_t first_seq;
+        uint64_t last_seq;
+        bool is_snapshot;
+        bool done;
+        if (chat262::tail_response::deserialize(data,
+                                                first_seq,
+                                                last_seq,
+                                                is_snapshot,
+                                                done,
+                                                mutations) != status::ok ||
+            (is_snapshot && first_seq == 0)) {
+            logger::log_err("Primary %s sent a malformed tail response\n",
+                            str_ip_addr_.c_str());
+            return;
+        }
+
+        uint64_t applied = next_seq - 1;
+        const size_t received = mutations.size();
+        if (is_snapshot) {
+            if (!in_snapshot) {
+                logger::log_out("Receiving a snapshot up to mutation %" PRIu64
+                                " from primary %s\n",
+                                first_seq - 1,
+                                str_ip_addr_.c_str());
+                in_snapshot = true;
+            }
+            snapshot.insert(snapshot.end(),
+                            std::make_move_iterator(mutations.begin()),
+                            std::make_move_iterator(mutations.end()));
+            offset += received;
+            if (done) {
+                db_.restore(snapshot, first_seq - 1);
+                applied = first_seq - 1;
+                logger::log_out("Installed a snapshot of %zu mutations\n",
+                                snapshot.size());
+                snapshot.clear();
+                snapshot.shrink_to_fit();
+                offset = 0;
+                in_snapshot = false;
+            }
+        } else if (db_.apply(first_seq, mutations, applied) != status::ok) {
+            logger::log_err("Primary %s sent a malformed mutation\n",
+                            str_ip_addr_.c_str());
+            return;
+        }
+
+        const uint64_t ns = static_cast<uint64_t>(
+            duration_cast<nanoseconds>(steady_clock::now() - sent).count());
+        const std::lock_guard<std::mutex> lock(mutex_);
+        stats_.applied_ = applied;
+        stats_.primary_seq_ = last_seq;
+        ++stats_.polls_;
+        stats_.bytes_ += data.size();
+        stats_.total_rtt_ns_ += ns;
+        stats_.max_rtt_ns_ = std::max(stats_.max_rtt_ns_, ns);
+        if (is_snapshot) {
+            stats_.snapshot_mutations_ += received;
+            stats_.snapshots_ += done ? 1 : 0;
+        } else {
+            stats_.mutations_ += received;
+        }
+        // The primary had nothing newer when it answered, which it did after
+        // the request was sent
+        if (!in_snapshot && applied >= last_seq) {
+            caught_up_ = true;
+            caught_up_at_ = sent;
+        }
+    }
+}
@@ -0,0 +1,126 @@
+#ifndef _RAW_CONNECTION_H_
+#define _RAW_CONNECTION_H_
+
+#include "chat262_protocol.h"
+#include "common.h"
+#include "endianness.h"
+
+#include <arpa/inet.h>
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Raw connections to the server, for tests that send what the client
+// doesn't: several requests in one write, other versions, or messages that
+// the client would never send.
+
+// Connect to the server on `n_ip_addr` (in network byte order)
+inline int connect_server(const uint32_t n_ip_addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd > 0);
+
+    sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(chat262::port);
+    server_addr.sin_addr.s_addr = n_ip_addr;
+
+    assert(connect(fd, (const sockaddr*) &server_addr, sizeof(server_addr)) ==
+           0);
+    return fd;
+}
+
+// Send all `msgs` with `version` in one write
+inline void send_msgs(
+    int fd,
+    const std::vector<std::shared_ptr<chat262::message>>& msgs,
+    const uint16_t version) {
+    std::vector<uint8_t> data;
+    for (const std::shared_ptr<chat262::message>& msg : msgs) {
+        msg->hdr_.version_ = e_htole16(version);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(msg.get());
+        data.insert(data.end(),
+                    bytes,
+                    bytes + sizeof(chat262::message_header) +
+                        e_le32toh(msg->hdr_.body_len_));
+    }
+    size_t total_sent = 0;
+    while (total_sent != data.size()) {
+        ssize_t sent = send(fd,
+                            data.data() + total_sent,
+                            data.size() - total_sent,
+                            MSG_NOSIGNAL);
+        assert(sent > 0);
+        total_sent += sent;
+    }
+}
+
+inline status recv_bytes(int fd, size_t len, std::vector<uint8_t>& data) {
+    data.resize(len);
+    size_t total_read = 0;
+    while (total_read != len) {
+        ssize_t readed = read(fd, data.data() + total_read, len - total_read);
+        if (readed < 0) {
+            return status::receive_error;
+        } else if (readed == 0) {
+            return status::closed_connection;
+        }
+        total_read += readed;
+    }
+    return status::ok;
+}
+
+inline status recv_msg(int fd,
+                       chat262::message_header& hdr,
+                       std::vector<uint8_t>& body) {
+    std::vector<uint8_t> hdr_data;
+    status s = recv_bytes(fd, sizeof(chat262::message_header), hdr_data);
+    if (s != status::ok) {
+        return s;
+    }
+    assert(chat262::message_header::deserialize(hdr_data, hdr) == status::ok);
+    return recv_bytes(fd, hdr.body_len_, body);
+}
+
+// Receive a registration response on `fd` and return its status code
+inline uint32_t recv_registration(int fd) {
+    chat262::message_header hdr;
+    std::vector<uint8_t> body;
+    assert(recv_msg(fd, hdr, body) == status::ok);
+    assert(hdr.type_ == chat262::msgtype_registration_response);
+    uint32_t stat_code;
+    assert(chat262::registration_response::deserialize(body, stat_code) ==
+           status::ok);
+    return stat_code;
+}
+
+// Send a hello offering `max_version` and `features` on a new connection to
+// the server on `n_ip_addr`, and check the response
+inline int connect_hello(const uint32_t n_ip_addr,
+                         const uint16_t max_version,
+                         const uint32_t features,
+                         const uint16_t expected_version,
+                         const uint32_t expected_features) {
+    int fd = connect_server(n_ip_addr);
+    send_msgs(fd,
+              {chat262::hello_request::serialize(max_version, features)},
+              chat262::version);
+    chat262::message_header hdr;
+    std::vector<uint8_t> body;
+    assert(recv_msg(fd, hdr, body) == status::ok);
+    assert(hdr.version_ == chat262::version);
+    assert(hdr.type_ == chat262::msgtype_hello_response);
+    uint16_t chosen_version;
+    uint32_t enabled;
+    assert(chat262::hello_response::deserialize(body,
+                                                chosen_version,
+                                                enabled) == status::ok);
+    assert(chosen_version == expected_version);
+    assert(enabled == expected_features);
+    return fd;
+}
+
+#endif
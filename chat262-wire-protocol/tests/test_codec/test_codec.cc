@@ -0,0 +1,307 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "endianness.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Messages are compared byte for byte against the layouts of the
+// specification, and malformed bodies must be rejected.
+
+static std::vector<uint8_t> wire(
+    const std::shared_ptr<chat262::message>& msg) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(msg.get());
+    return std::vector<uint8_t>(bytes,
+                                bytes + sizeof(chat262::message_header) +
+                                    e_le32toh(msg->hdr_.body_len_));
+}
+
+static std::vector<uint8_t> body(
+    const std::shared_ptr<chat262::message>& msg) {
+    std::vector<uint8_t> data = wire(msg);
+    data.erase(data.begin(), data.begin() + sizeof(chat262::message_header));
+    return data;
+}
+
+static void put32(std::vector<uint8_t>& data, const uint32_t x) {
+    for (int i = 0; i != 4; ++i) {
+        data.push_back(static_cast<uint8_t>(x >> (8 * i)));
+    }
+}
+
+int main() {
+    // Headers, then lengths, then bytes
+    assert(wire(chat262::registration_request::serialize("user", "pw")) ==
+           std::vector<uint8_t>({1,   0,   101, 0,   14,  0,   0,   0,
+                                 4,   0,   0,   0,   2,   0,   0,   0,
+                                 'u', 's', 'e', 'r', 'p', 'w'}));
+    assert(wire(chat262::logout_request::serialize()) ==
+           std::vector<uint8_t>({1, 0, 103, 0, 0, 0, 0, 0}));
+    assert(wire(chat262::wrong_version_response::serialize(2)) ==
+           std::vector<uint8_t>({1, 0, 45, 1, 2, 0, 0, 0, 2, 0}));
+    assert(wire(chat262::hello_request::serialize(7, 0xDEADBEEF)) ==
+           std::vector<uint8_t>(
+               {1, 0, 109, 0, 6, 0, 0, 0, 7, 0, 0xEF, 0xBE, 0xAD, 0xDE}));
+    assert(wire(chat262::accounts_response::serialize(0, {"a", "bcd", ""})) ==
+           std::vector<uint8_t>({1, 0, 204, 0, 24, 0, 0, 0,   0,   0,   0,
+                                 0, 3, 0,   0, 0,  1, 0, 0,   0,   3,   0,
+                                 0, 0, 0,   0, 0,  0, 'a', 'b', 'c', 'd'}));
+    // A request ID goes ahead of the body, and is flagged in the type
+    const std::shared_ptr<chat262::message> identified =
+        chat262::identified_request::attach(
+            chat262::recv_txt_request::serialize("ab"),
+            0x0102030405060708);
+    assert(wire(identified) ==
+           std::vector<uint8_t>({1, 0, 106, 0x40, 14, 0, 0, 0, 8, 7,
+                                 6, 5, 4,   3,    2,  1, 2, 0, 0, 0,
+                                 'a', 'b'}));
+    uint64_t request_id;
+    std::vector<uint8_t> unidentified;
+    assert(chat262::identified_request::detach(body(identified),
+                                               request_id,
+                                               unidentified) == status::ok);
+    assert(request_id == 0x0102030405060708);
+    assert(unidentified == body(chat262::recv_txt_request::serialize("ab")));
+    assert(chat262::identified_request::detach({1, 2, 3, 4, 5, 6, 7},
+                                               request_id,
+                                               unidentified) ==
+           status::body_error);
+    // Nothing follows a status code that is not OK
+    assert(wire(chat262::accounts_response::serialize(2, {"a"})) ==
+           std::vector<uint8_t>({1, 0, 204, 0, 4, 0, 0, 0, 2, 0, 0, 0}));
+
+    // Senders, then lengths, then texts, whether from a chat or a view
+    chat c;
+    c.texts_ = {{text::sender_you, "ab"}, {text::sender_other, "xyz"}};
+    const std::vector<uint8_t> expected = {
+        1, 0, 206, 0, 23, 0, 0, 0, 0,   0,   0,   0,   2,   0,   0,   0,
+        0, 1, 2,   0, 0,  0, 3, 0, 0,   0,   'a', 'b', 'x', 'y', 'z'};
+    assert(wire(chat262::recv_txt_response::serialize(0, c)) == expected);
+    chat_view v;
+    v.senders_ = {text::sender_you, text::sender_other};
+    v.lengths_ = {2, 3};
+    std::shared_ptr<uint8_t> bytes(static_cast<uint8_t*>(malloc(5)), free);
+    memcpy(bytes.get(), "abxyz", 5);
+    v.runs_ = {{bytes, 1},
+               {std::shared_ptr<const uint8_t>(bytes, bytes.get() + 1), 4}};
+    assert(wire(chat262::recv_txt_response::serialize(0, v)) == expected);
+
+    // Everything round-trips
+    uint32_t stat_code;
+    chat decoded;
+    assert(chat262::recv_txt_response::deserialize(
+               body(chat262::recv_txt_response::serialize(0, c)),
+               stat_code,
+               decoded) == status::ok);
+    assert(stat_code == 0);
+    assert(decoded.texts_.size() == 2);
+    assert(decoded.texts_[1].sender_ == text::sender_other);
+    assert(decoded.texts_[1].content_ == "xyz");
+    std::string recipient;
+    std::string txt;
+    assert(chat262::send_txt_request::deserialize(
+               body(chat262::send_txt_request::serialize("bob", "hello")),
+               recipient,
+               txt) == status::ok);
+    assert(recipient == "bob");
+    assert(txt == "hello");
+    uint16_t max_version;
+    uint32_t features;
+    assert(chat262::hello_request::deserialize(
+               body(chat262::hello_request::serialize(3, 5)),
+               max_version,
+               features) == status::ok);
+    assert(max_version == 3);
+    assert(features == 5);
+    uint64_t term;
+    uint32_t leader;
+    uint64_t prev_index;
+    uint64_t prev_term;
+    uint64_t commit;
+    std::vector<uint64_t> terms;
+    std::vector<chat262::mutation> mutations;
+    std::vector<uint8_t> append = body(chat262::append_request::serialize(
+        9, 0x0100007F, 4, 8, 3, {8, 9}, {{1, "u", "p", ""}, {4, "", "", ""}}));
+    assert(append.size() == 44 + 2 * 8 + 2 + 6 * 4 + 2);
+    assert(chat262::append_request::deserialize(append,
+                                                term,
+                                                leader,
+                                                prev_index,
+                                                prev_term,
+                                                commit,
+                                                terms,
+                                                mutations) == status::ok);
+    assert(term == 9 && leader == 0x0100007F && prev_index == 4);
+    assert(prev_term == 8 && commit == 3);
+    assert(terms == std::vector<uint64_t>({8, 9}));
+    assert(mutations.size() == 2);
+    assert(mutations[0].username_ == "u" && mutations[0].arg_ == "p");
+    assert(mutations[1].op_ == chat262::mutation::op_noop);
+    uint64_t first_seq;
+    uint64_t last_seq;
+    bool snapshot;
+    bool done;
+    assert(chat262::tail_response::deserialize(
+               body(chat262::tail_response::serialize(
+                   5, 9, true, false, {{2, "u", "v", "hi"}})),
+               first_seq,
+               last_seq,
+               snapshot,
+               done,
+               mutations) == status::ok);
+    assert(first_seq == 5 && last_seq == 9 && snapshot && !done);
+    assert(mutations.size() == 1 && mutations[0].txt_ == "hi");
+    chat262::mutation forwarded;
+    assert(wire(chat262::forward_request::serialize({2, "u", "v", "hi"})) ==
+           std::vector<uint8_t>({1, 0, 116, 0, 20, 0, 0, 0, 2, 0, 0, 0,
+                                 1, 0, 0,   0, 1,  0, 0, 0, 2, 0, 0, 0,
+                                 'u', 'v', 'h', 'i'}));
+    assert(chat262::forward_request::deserialize(
+               body(chat262::forward_request::serialize({3, "u", "", ""})),
+               forwarded) == status::ok);
+    assert(forwarded.op_ == 3 && forwarded.username_ == "u");
+    assert(wire(chat262::proxy_request::serialize(1, "u", "req")) ==
+           std::vector<uint8_t>({1, 0, 118, 0, 16, 0, 0, 0, 1, 0,   0,   0,
+                                 1, 0, 0,   0, 3,  0, 0, 0, 'u', 'r', 'e',
+                                 'q'}));
+    uint32_t relayed_features;
+    std::string relayed_user;
+    std::string relayed;
+    std::string username_out;
+    assert(chat262::proxy_response::deserialize(
+               body(chat262::proxy_response::serialize("", "resp")),
+               relayed_user,
+               relayed) == status::ok);
+    assert(relayed_user.empty() && relayed == "resp");
+    assert(chat262::proxy_request::deserialize(
+               body(chat262::proxy_request::serialize(3, "u", "")),
+               relayed_features,
+               relayed_user,
+               relayed) == status::ok);
+    assert(relayed_features == 3 && relayed_user == "u" && relayed.empty());
+    uint32_t shard;
+    assert(wire(chat262::migrate_request::serialize(0x0200007F, "u")) ==
+           std::vector<uint8_t>(
+               {1, 0, 119, 0, 9, 0, 0, 0, 0x7F, 0, 0, 2, 1, 0, 0, 0, 'u'}));
+    assert(chat262::migrate_request::deserialize(
+               body(chat262::migrate_request::serialize(7, "mover")),
+               shard,
+               username_out) == status::ok);
+    assert(shard == 7 && username_out == "mover");
+    uint64_t moved_bytes;
+    uint64_t copy_us;
+    uint64_t pause_us;
+    assert(chat262::migrate_response::deserialize(
+               body(chat262::migrate_response::serialize(0, 100, 20, 3)),
+               stat_code,
+               moved_bytes,
+               copy_us,
+               pause_us) == status::ok);
+    assert(stat_code == 0 && moved_bytes == 100 && copy_us == 20 &&
+           pause_us == 3);
+    assert(wire(chat262::migrate_response::serialize(
+               chat262::status_code_wrong_shard)) ==
+           std::vector<uint8_t>({1, 0, 219, 0, 4, 0, 0, 0, 11, 0, 0, 0}));
+    assert(chat262::import_request::deserialize(
+               body(chat262::import_request::serialize(
+                   true, "u", {{1, "u", "pw", ""}, {2, "u", "v", "hi"}})),
+               done,
+               username_out,
+               mutations) == status::ok);
+    assert(done && username_out == "u" && mutations.size() == 2);
+    assert(mutations[1].arg_ == "v" && mutations[1].txt_ == "hi");
+    assert(chat262::locate_request::deserialize(
+               body(chat262::locate_request::serialize("u")),
+               username_out) == status::ok);
+    assert(username_out == "u");
+    assert(chat262::locate_response::deserialize(
+               body(chat262::locate_response::serialize(0, 0x0200007F)),
+               stat_code,
+               shard) == status::ok);
+    assert(stat_code == 0 && shard == 0x0200007F);
+
+    // A read token only follows a status code that is OK
+    assert(wire(chat262::send_txt_response::serialize(0, 0x0102)) ==
+           std::vector<uint8_t>({1, 0, 205, 0, 12, 0, 0, 0, 0, 0,
+                                 0, 0, 2,   1, 0,  0, 0, 0, 0, 0}));
+    assert(wire(chat262::send_txt_response::serialize(3, 0x0102)) ==
+           wire(chat262::send_txt_response::serialize(3)));
+
+    // Bodies that are too short or too long are rejected, and leave the
+    // outputs alone
+    std::vector<uint8_t> data =
+        body(chat262::login_request::serialize("u", "p"));
+    std::string username = "unchanged";
+    std::string password;
+    data.pop_back();
+    assert(chat262::login_request::deserialize(data, username, password) ==
+           status::body_error);
+    data.push_back('p');
+    data.push_back('!');
+    assert(chat262::login_request::deserialize(data, username, password) ==
+           status::body_error);
+    assert(username == "unchanged");
+    assert(chat262::logout_request::deserialize({0}) == status::body_error);
+    assert(chat262::login_response::deserialize({0, 0, 0}, stat_code) ==
+           status::body_error);
+    assert(chat262::hello_response::deserialize({2, 0, 0, 0, 0, 0, 0},
+                                                max_version,
+                                                features) ==
+           status::body_error);
+    // Every entry of an append request has a term and a mutation
+    append[36] = 1;
+    append.erase(append.begin() + 52, append.begin() + 60);
+    assert(chat262::append_request::deserialize(append,
+                                                term,
+                                                leader,
+                                                prev_index,
+                                                prev_term,
+                                                commit,
+                                                terms,
+                                                mutations) ==
+           status::body_error);
+
+    // Lengths that only add up to the body size after wrapping around are
+    // rejected
+    data.clear();
+    put32(data, 0xFFFFFFFF);
+    put32(data, 2);
+    data.push_back('a');
+    assert(chat262::send_txt_request::deserialize(data, recipient, txt) ==
+           status::body_error);
+    data.clear();
+    put32(data, 0);
+    put32(data, 2);
+    put32(data, 0xFFFFFFFF);
+    put32(data, 2);
+    data.push_back('a');
+    std::vector<std::string> usernames;
+    assert(chat262::accounts_response::deserialize(data,
+                                                   stat_code,
+                                                   usernames) ==
+           status::body_error);
+
+    // A list longer than the body is rejected before its lengths are read
+    data.clear();
+    put32(data, 0);
+    put32(data, 0x40000000);
+    put32(data, 0);
+    assert(chat262::recv_txt_response::deserialize(data,
+                                                   stat_code,
+                                                   decoded) ==
+           status::body_error);
+
+    // Anything may follow a status code that is not OK
+    data.clear();
+    put32(data, chat262::status_code_user_noexist);
+    put32(data, 0x40000000);
+    assert(chat262::recv_txt_response::deserialize(data,
+                                                   stat_code,
+                                                   decoded) == status::ok);
+    assert(stat_code == chat262::status_code_user_noexist);
+
+    return EXIT_SUCCESS;
+}
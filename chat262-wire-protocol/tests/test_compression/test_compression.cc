@@ -0,0 +1,120 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+constexpr uint32_t n_ip_addr = 0x0100007F;
+
+static void spawn_server() {
+    const char* localhost = "127.0.0.1";
+    // Chunks are compressed a second after they fill up, and every read
+    // decompresses them, since nothing is cached. Chats are evicted after 4
+    // seconds of inactivity.
+    char const* argv[] = {"./server",
+                          "-z",
+                          "1",
+                          "-Z",
+                          "0",
+                          "-e",
+                          "4",
+                          "-f",
+                          "test_compression.seg",
+                          localhost};
+    std::thread thread([&]() {
+        server s;
+        s.run(10, argv);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    thread.detach();
+}
+
+static void check_chat(client& c,
+                       const std::string& correspondent,
+                       const std::vector<std::string>& txts) {
+    uint32_t stat_code;
+    chat curr_chat;
+    assert(c.recv_txt(correspondent, stat_code, curr_chat) == status::ok);
+    assert(stat_code == 0);
+    assert(curr_chat.texts_.size() == txts.size());
+    for (size_t i = 0; i != txts.size(); ++i) {
+        assert(curr_chat.texts_[i].sender_ == text::sender_you);
+        assert(curr_chat.texts_[i].content_ == txts[i]);
+    }
+}
+
+int main() {
+    spawn_server();
+
+    client c;
+    assert(c.connect_server(n_ip_addr) == status::ok);
+
+    uint32_t stat_code;
+    assert(c.registration("testuser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.registration("otheruser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.login("testuser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    // Texts that compress well, texts that don't compress at all, and long
+    // texts with long and overlapping repetitions
+    std::vector<std::string> txts;
+    std::mt19937_64 rng(0);
+    for (int i = 0; i != 300; ++i) {
+        switch (i % 3) {
+        case 0:
+            txts.push_back("See you at " + std::to_string(i % 12) +
+                           " in the library, ok?");
+            break;
+        case 1: {
+            std::string random_txt(40, '\0');
+            for (char& ch : random_txt) {
+                ch = static_cast<char>(rng());
+            }
+            txts.push_back(random_txt);
+            break;
+        }
+        case 2:
+            txts.push_back("");
+            break;
+        }
+    }
+    txts.push_back(std::string(5000, 'z'));
+    std::string pattern;
+    for (int i = 0; i != 1000; ++i) {
+        pattern += "abc" + std::to_string(i % 7);
+    }
+    txts.push_back(pattern);
+    for (int i = 0; i != 100; ++i) {
+        txts.push_back("Text number " + std::to_string(i));
+    }
+    for (const std::string& txt : txts) {
+        assert(c.send_txt("otheruser", txt, stat_code) == status::ok);
+        assert(stat_code == 0);
+    }
+
+    // The full chunks are compressed in the meantime
+    std::this_thread::sleep_for(std::chrono::milliseconds(2000));
+    check_chat(c, "otheruser", txts);
+
+    // New texts go after the compressed ones
+    txts.push_back("After compression");
+    assert(c.send_txt("otheruser", txts.back(), stat_code) == status::ok);
+    assert(stat_code == 0);
+    check_chat(c, "otheruser", txts);
+
+    // Compressed chunks are decompressed when the chat is evicted
+    std::this_thread::sleep_for(std::chrono::milliseconds(5000));
+    check_chat(c, "otheruser", txts);
+
+    return EXIT_SUCCESS;
+}
@@ -119,5 +119,26 @@ int main() {
     assert(c.recv_txt("otheruser", stat_code, curr_chat) == status::ok);
     assert(stat_code == 3);
 
+    // Deleting an account logs out its other connections too
+    assert(c.registration("carol", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    client c2;
+    assert(c2.connect_server(n_ip_addr) == status::ok);
+    assert(c2.login("carol", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.login("carol", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.delete_account(stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c2.send_txt("newuser", "still here?", stat_code) == status::ok);
+    assert(stat_code == 6);
+    assert(c2.recv_correspondents(stat_code, correspondents) == status::ok);
+    assert(stat_code == 6);
+    assert(c.login("newuser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.recv_correspondents(stat_code, correspondents) == status::ok);
+    assert(stat_code == 0);
+    assert(correspondents.size() == 0);
+
     return EXIT_SUCCESS;
 }
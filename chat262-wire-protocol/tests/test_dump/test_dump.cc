@@ -0,0 +1,212 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "server.h"
+
+#include <cassert>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// A server in a child process writes a dump on SIGUSR2, and another one
+// loads it on start.
+
+constexpr uint32_t n_ip_addr = 0x0100007F;
+
+static const char* dump_path = "test_dump.dmp";
+static const char* bad_dump_path = "test_dump.bad";
+static const char* segment_prefix = "test_dump.seg";
+
+// Start the server with the options `opts` in a child process and return its
+// process ID
+static pid_t spawn_server(const std::vector<const char*>& opts) {
+    // The child must not print what the parent buffered
+    fflush(stdout);
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        return pid;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    assert(freopen("/dev/null", "w", stdout) != nullptr);
+    assert(freopen("/dev/null", "w", stderr) != nullptr);
+    std::vector<const char*> argv = {"./server"};
+    argv.insert(argv.end(), opts.begin(), opts.end());
+    argv.push_back("127.0.0.1");
+    server s;
+    s.run(static_cast<int>(argv.size()), argv.data());
+    _exit(1);
+}
+
+static void crash(const pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+static bool file_exists(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+// Log `c` in as `name`
+static void login(client& c, const std::string& name) {
+    uint32_t stat_code;
+    assert(c.connect_server(n_ip_addr) == status::ok);
+    assert(c.login(name, "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+}
+
+static void send(const std::string& sender,
+                 const std::string& recipient,
+                 const std::string& txt) {
+    client c;
+    login(c, sender);
+    uint32_t stat_code;
+    assert(c.send_txt(recipient, txt, stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+}
+
+// The chat of `name` with `correspondent`
+static chat read(const std::string& name, const std::string& correspondent) {
+    client c;
+    login(c, name);
+    uint32_t stat_code;
+    chat ch;
+    assert(c.recv_txt(correspondent, stat_code, ch) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    return ch;
+}
+
+static void assert_same(const chat& a, const chat& b) {
+    assert(a.texts_.size() == b.texts_.size());
+    for (size_t i = 0; i != a.texts_.size(); ++i) {
+        assert(a.texts_[i].sender_ == b.texts_[i].sender_);
+        assert(a.texts_[i].content_ == b.texts_[i].content_);
+    }
+}
+
+int main() {
+    remove(dump_path);
+    remove(bad_dump_path);
+
+    // Chats are evicted after a second, into segment files that are sealed
+    // at 512 bytes, so the dump holds chats that are read back from sealed
+    // and unsealed segments
+    pid_t pid = spawn_server(
+        {"-e", "1", "-f", segment_prefix, "-s", "512", "-x", dump_path});
+    const std::vector<std::string> users = {"alice", "bobby", "carol", "david"};
+    uint32_t stat_code;
+    {
+        client r;
+        assert(r.connect_server(n_ip_addr) == status::ok);
+        for (const std::string& u : users) {
+            assert(r.registration(u, "password", stat_code) == status::ok);
+            assert(stat_code == chat262::status_code_ok);
+        }
+        assert(r.registration("gone", "password", stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+    }
+    for (size_t i = 0; i != 50; ++i) {
+        send("alice", "bobby", "hello " + std::to_string(i));
+        send("bobby", "alice", "hi " + std::to_string(i));
+    }
+    send("carol", "carol", "a note to self");
+    send("carol", "alice", std::string(2000, 'x'));
+    send("gone", "alice", "goodbye");
+    {
+        client c;
+        login(c, "gone");
+        assert(c.delete_account(stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+    // Texts in memory follow the evicted ones
+    send("alice", "bobby", "after the eviction");
+
+    std::vector<std::pair<std::pair<std::string, std::string>, chat>> chats;
+    for (const std::string& u : users) {
+        for (const std::string& correspondent : users) {
+            chats.push_back({{u, correspondent}, read(u, correspondent)});
+        }
+    }
+    assert(chats[1].second.texts_.size() == 101);
+    assert(chats[10].second.texts_.size() == 2);
+
+    kill(pid, SIGUSR2);
+    for (size_t i = 0; i != 50 && !file_exists(dump_path); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    assert(file_exists(dump_path));
+    crash(pid);
+
+    // Everything is loaded, and can be written to
+    pid = spawn_server({"-l", dump_path});
+    for (const auto& expected : chats) {
+        assert_same(read(expected.first.first, expected.first.second),
+                    expected.second);
+    }
+    {
+        client r;
+        assert(r.connect_server(n_ip_addr) == status::ok);
+        assert(r.registration("gone", "password", stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_user_exists);
+        assert(r.login("gone", "password", stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_invalid_credentials);
+    }
+    send("david", "alice", "first text after the load");
+    assert(read("alice", "david").texts_.size() == 1);
+    assert(read("alice", "bobby").texts_.size() == 101);
+    crash(pid);
+
+    // A dump that is cut short, or that is not a dump, is not loaded
+    FILE* in = fopen(dump_path, "rb");
+    assert(in != nullptr);
+    std::vector<uint8_t> data(1 << 20);
+    data.resize(fread(data.data(), 1, data.size(), in));
+    fclose(in);
+    for (const size_t len : {data.size() / 2, size_t{16}}) {
+        FILE* out = fopen(bad_dump_path, "wb");
+        assert(out != nullptr);
+        assert(fwrite(data.data(), 1, len, out) == len);
+        fclose(out);
+        server s;
+        char const* argv[] = {"./server", "-l", bad_dump_path, "127.0.0.1"};
+        assert(s.run(4, argv) == status::error);
+    }
+    // The journal would apply the writes in the dump twice
+    {
+        server s;
+        char const* argv[] = {"./server",
+                              "-j",
+                              "test_dump.journal",
+                              "-l",
+                              dump_path,
+                              "127.0.0.1"};
+        assert(s.run(6, argv) == status::error);
+    }
+    // A dump holds no send times
+    {
+        server s;
+        char const* argv[] = {"./server", "-T", "-l", dump_path, "127.0.0.1"};
+        assert(s.run(5, argv) == status::error);
+    }
+
+    remove(dump_path);
+    remove(bad_dump_path);
+    for (int i = 0; i != 16; ++i) {
+        const std::string path =
+            std::string(segment_prefix) + "." + std::to_string(i);
+        remove(path.c_str());
+    }
+    return 0;
+}
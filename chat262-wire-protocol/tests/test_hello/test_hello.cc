@@ -0,0 +1,151 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "endianness.h"
+#include "raw_connection.h"
+#include "server.h"
+
+#include <cassert>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Versions are checked on raw connections (see raw_connection.h)
+
+constexpr uint32_t n_ip_addr = 0x0100007F;
+
+static void spawn_server() {
+    const char* localhost = "127.0.0.1";
+    char const* argv[] = {"./server", localhost};
+    std::thread thread([&]() {
+        server s;
+        s.run(2, argv);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    thread.detach();
+}
+
+int main() {
+    spawn_server();
+
+    chat262::message_header hdr;
+    std::vector<uint8_t> body;
+    uint32_t stat_code;
+
+    // A client that never says hello speaks version 1 as before
+    client plain;
+    assert(plain.connect_server(n_ip_addr) == status::ok);
+    assert(plain.registration("testuser", "password", stat_code) ==
+           status::ok);
+    assert(stat_code == 0);
+    assert(plain.registration("otheruser", "password", stat_code) ==
+           status::ok);
+    assert(stat_code == 0);
+
+    // The client switches to version 2, and requests keep working
+    client c;
+    assert(c.connect_server(n_ip_addr) == status::ok);
+    uint16_t version;
+    uint32_t enabled;
+    assert(c.hello(chat262::latest_version,
+                   chat262::feature_pipelining,
+                   version,
+                   enabled) == status::ok);
+    assert(version == 2);
+    assert(enabled == chat262::feature_pipelining);
+    assert(c.login("testuser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("otheruser", "Hello", stat_code) == status::ok);
+    assert(stat_code == 0);
+    chat curr_chat;
+    assert(c.recv_txt("otheruser", stat_code, curr_chat) == status::ok);
+    assert(stat_code == 0);
+    assert(curr_chat.texts_.size() == 1);
+
+    // A client that offers only version 1 gets no features
+    client old;
+    assert(old.connect_server(n_ip_addr) == status::ok);
+    assert(old.hello(1, chat262::feature_compression, version, enabled) ==
+           status::ok);
+    assert(version == 1);
+    assert(enabled == 0);
+    assert(old.login("testuser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    // Later versions are answered with the latest one the server knows, and
+    // unknown or unsupported features are left out
+    int fd = connect_hello(n_ip_addr,
+                           7,
+                           0xFFFFFFFF,
+                           2,
+                           chat262::feature_compression |
+                               chat262::feature_pipelining |
+                               chat262::feature_read_tokens |
+                               chat262::feature_request_ids);
+
+    // Once on version 2, requests of version 1 are refused
+    send_msgs(fd, {chat262::logout_request::serialize()}, 1);
+    assert(recv_msg(fd, hdr, body) == status::ok);
+    assert(hdr.version_ == 2);
+    assert(hdr.type_ == chat262::msgtype_wrong_version_response);
+    uint16_t correct_version;
+    assert(
+        chat262::wrong_version_response::deserialize(body, correct_version) ==
+        status::ok);
+    assert(correct_version == 2);
+    assert(recv_msg(fd, hdr, body) == status::closed_connection);
+    close(fd);
+
+    // Requests of version 2 are refused before a hello
+    fd = connect_server(n_ip_addr);
+    send_msgs(fd, {chat262::logout_request::serialize()}, 2);
+    assert(recv_msg(fd, hdr, body) == status::ok);
+    assert(hdr.version_ == 1);
+    assert(hdr.type_ == chat262::msgtype_wrong_version_response);
+    assert(
+        chat262::wrong_version_response::deserialize(body, correct_version) ==
+        status::ok);
+    assert(correct_version == 1);
+    assert(recv_msg(fd, hdr, body) == status::closed_connection);
+    close(fd);
+
+    // With pipelining, requests sent back to back are answered in order
+    fd = connect_hello(n_ip_addr,
+                       2,
+                       chat262::feature_pipelining,
+                       2,
+                       chat262::feature_pipelining);
+    send_msgs(fd,
+              {chat262::login_request::serialize("testuser", "password"),
+               chat262::send_txt_request::serialize("otheruser", "One"),
+               chat262::send_txt_request::serialize("otheruser", "Two"),
+               chat262::recv_txt_request::serialize("otheruser")},
+              2);
+    assert(recv_msg(fd, hdr, body) == status::ok);
+    assert(hdr.type_ == chat262::msgtype_login_response);
+    assert(chat262::login_response::deserialize(body, stat_code) ==
+           status::ok);
+    assert(stat_code == 0);
+    for (int i = 0; i != 2; ++i) {
+        assert(recv_msg(fd, hdr, body) == status::ok);
+        assert(hdr.version_ == 2);
+        assert(hdr.type_ == chat262::msgtype_send_txt_response);
+        assert(chat262::send_txt_response::deserialize(body, stat_code) ==
+               status::ok);
+        assert(stat_code == 0);
+    }
+    assert(recv_msg(fd, hdr, body) == status::ok);
+    assert(hdr.type_ == chat262::msgtype_recv_txt_response);
+    assert(chat262::recv_txt_response::deserialize(body,
+                                                   stat_code,
+                                                   curr_chat) == status::ok);
+    assert(stat_code == 0);
+    assert(curr_chat.texts_.size() == 3);
+    assert(curr_chat.texts_[1].content_ == "One");
+    assert(curr_chat.texts_[2].content_ == "Two");
+    close(fd);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,229 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "handover.h"
+#include "raw_connection.h"
+#include "server.h"
+
+#include <cassert>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// A server in a child process is restarted hot by new servers in child
+// processes, while the clients stay connected. Registrations with request
+// IDs are sent on a raw connection (see raw_connection.h).
+
+constexpr uint32_t n_ip_addr = 0x0100007F;
+
+static const char* handover_path = "test_hot_restart.sock";
+
+// Start the server with the options `opts` in a child process and return its
+// process ID
+static pid_t spawn_server(const std::vector<const char*>& opts) {
+    // The child must not print what the parent buffered
+    fflush(stdout);
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        return pid;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    assert(freopen("/dev/null", "w", stdout) != nullptr);
+    assert(freopen("/dev/null", "w", stderr) != nullptr);
+    std::vector<const char*> argv = {"./server"};
+    argv.insert(argv.end(), opts.begin(), opts.end());
+    argv.push_back("127.0.0.1");
+    server s;
+    s.run(static_cast<int>(argv.size()), argv.data());
+    _exit(1);
+}
+
+// Start a new server that takes over from the server `pid`, and wait until
+// the old one exited
+static pid_t restart(const pid_t pid) {
+    const pid_t new_pid = spawn_server({"-U", handover_path});
+    int wstatus;
+    assert(waitpid(pid, &wstatus, 0) == pid);
+    assert(WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0);
+    return new_pid;
+}
+
+static void send(client& c,
+                 const std::string& recipient,
+                 const std::string& txt) {
+    uint32_t stat_code;
+    assert(c.send_txt(recipient, txt, stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+}
+
+static size_t num_texts(client& c, const std::string& correspondent) {
+    uint32_t stat_code;
+    chat ch;
+    assert(c.recv_txt(correspondent, stat_code, ch) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    return ch.texts_.size();
+}
+
+int main() {
+    pid_t pid = spawn_server({"-U", handover_path});
+
+    uint32_t stat_code;
+    client alice;
+    assert(alice.connect_server(n_ip_addr) == status::ok);
+    uint16_t version;
+    uint32_t enabled;
+    assert(alice.hello(chat262::latest_version,
+                       chat262::feature_compression,
+                       version,
+                       enabled) == status::ok);
+    assert(version == chat262::latest_version);
+    assert(enabled == chat262::feature_compression);
+    assert(alice.registration("alice", "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(alice.login("alice", "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+
+    client bobby;
+    assert(bobby.connect_server(n_ip_addr) == status::ok);
+    assert(bobby.registration("bobby", "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(bobby.login("bobby", "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+
+    client anonymous;
+    assert(anonymous.connect_server(n_ip_addr) == status::ok);
+
+    // Writes with request IDs, for alice and for a connection that is not
+    // logged in
+    const uint32_t features = chat262::feature_request_ids;
+    client retrier;
+    assert(retrier.connect_server(n_ip_addr) == status::ok);
+    assert(retrier.hello(chat262::latest_version, features, version, enabled) ==
+           status::ok);
+    assert(enabled == features);
+    assert(retrier.login("alice", "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    const int raw_fd = connect_hello(n_ip_addr,
+                                     chat262::latest_version,
+                                     features,
+                                     chat262::latest_version,
+                                     features);
+    const std::shared_ptr<chat262::message> dave_registration =
+        chat262::identified_request::attach(
+            chat262::registration_request::serialize("dave", "password"),
+            7);
+    send_msgs(raw_fd, {dave_registration}, chat262::latest_version);
+    assert(recv_registration(raw_fd) == chat262::status_code_ok);
+
+    send(alice, "bobby", "before the restart");
+    assert(retrier.send_txt("bobby", "retried", 1, stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+
+    // A new server that goes away without confirming leaves the running
+    // server serving. It was handed every connection with its state.
+    {
+        int fd;
+        assert(connect_handover(handover_path, fd) == status::ok);
+        int listen_fd;
+        std::string dump_path;
+        std::vector<handed_connection> conns;
+        std::vector<handed_user> users;
+        assert(recv_handover(fd, listen_fd, dump_path, conns, users) ==
+               status::ok);
+        assert(conns.size() == 5);
+        size_t logged_in = 0;
+        size_t deduped = 0;
+        uint32_t alice_features = 0;
+        for (const handed_connection& conn : conns) {
+            if (conn.username_ == "alice") {
+                assert(conn.version_ == chat262::latest_version);
+                alice_features ^= conn.features_;
+                ++logged_in;
+            } else if (conn.username_ == "bobby") {
+                assert(conn.version_ == chat262::version);
+                ++logged_in;
+            } else {
+                assert(conn.username_.empty());
+            }
+            if (!conn.dedupe_.empty()) {
+                assert(conn.features_ == features);
+                assert(conn.dedupe_.size() == 1);
+                assert(conn.dedupe_[0].first == 7);
+                ++deduped;
+            }
+            close(conn.fd_);
+        }
+        // alice is logged in on two connections
+        assert(logged_in == 3);
+        assert(alice_features == (chat262::feature_compression | features));
+        assert(deduped == 1);
+        assert(users.size() == 1);
+        assert(users[0].username_ == "alice");
+        assert(users[0].dedupe_.size() == 1);
+        assert(users[0].dedupe_[0].first == 1);
+        close(listen_fd);
+        close(fd);
+    }
+    send(alice, "bobby", "after the failed restart");
+    assert(num_texts(bobby, "alice") == 3);
+
+    // The connections move to the new server and stay logged in, and new
+    // connections are accepted by it
+    pid = restart(pid);
+    send(alice, "bobby", "after the restart");
+    assert(num_texts(bobby, "alice") == 4);
+
+    // The dedupe caches came along, so the retries are not applied again
+    assert(retrier.send_txt("bobby", "retried", 1, stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(num_texts(bobby, "alice") == 4);
+    send_msgs(raw_fd, {dave_registration}, chat262::latest_version);
+    assert(recv_registration(raw_fd) == chat262::status_code_ok);
+    close(raw_fd);
+
+    assert(anonymous.send_txt("alice", "who am I", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_unauthorized);
+    {
+        client carol;
+        assert(carol.connect_server(n_ip_addr) == status::ok);
+        assert(carol.registration("carol", "password", stat_code) ==
+               status::ok);
+        assert(stat_code == chat262::status_code_ok);
+        assert(carol.login("carol", "password", stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+        send(carol, "alice", "hello from the new server");
+    }
+    assert(bobby.logout(stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+
+    // And again, to a third server
+    pid = restart(pid);
+    assert(num_texts(alice, "carol") == 1);
+    assert(num_texts(alice, "bobby") == 4);
+    assert(bobby.send_txt("alice", "logged out", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_unauthorized);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+
+    // A hot restart hands over no send times
+    {
+        server s;
+        char const* argv[] = {
+            "./server", "-T", "-U", handover_path, "127.0.0.1"};
+        assert(s.run(5, argv) == status::error);
+    }
+
+    remove(handover_path);
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "server.h"
+
+#include <cassert>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// The server runs in a child process with a journal, and is killed and
+// started again on the same journal.
+
+constexpr uint32_t n_ip_addr = 0x0100007F;
+
+static const char* journal_path = "test_journal.log";
+
+constexpr size_t num_users = 8;
+constexpr size_t num_texts = 100;
+
+// Start the server on the journal in a child process and return its process
+// ID
+static pid_t spawn_server() {
+    // The child must not print what the parent buffered
+    fflush(stdout);
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return pid;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    assert(freopen("/dev/null", "w", stdout) != nullptr);
+    assert(freopen("/dev/null", "w", stderr) != nullptr);
+    char const* argv[] = {"./server", "-j", journal_path, "127.0.0.1"};
+    server s;
+    s.run(4, argv);
+    _exit(1);
+}
+
+// Kill the server without giving it a chance to write anything more
+static void crash(const pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+static std::string username(const size_t u) {
+    return "user" + std::to_string(u);
+}
+
+// Log `c` in as `name`
+static void login(client& c, const std::string& name) {
+    uint32_t stat_code;
+    assert(c.connect_server(n_ip_addr) == status::ok);
+    assert(c.login(name, "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+}
+
+// Every user sends its texts to the next user, all at once, so that the
+// writes of the users are synced together
+static void send_texts(const size_t u) {
+    client c;
+    login(c, username(u));
+    uint32_t stat_code;
+    for (size_t i = 0; i != num_texts; ++i) {
+        assert(c.send_txt(username((u + 1) % num_users),
+                          "text " + std::to_string(i),
+                          stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+    }
+}
+
+// Check that every user has all texts of the previous user, in order, and
+// that the first user has `extra` more texts from the last one after those
+static void check_texts(const size_t extra) {
+    uint32_t stat_code;
+    for (size_t u = 0; u != num_users; ++u) {
+        client c;
+        login(c, username(u));
+        chat ch;
+        assert(c.recv_txt(username((u + num_users - 1) % num_users),
+                          stat_code,
+                          ch) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+        assert(ch.texts_.size() == num_texts + (u == 0 ? extra : 0));
+        for (size_t i = 0; i != num_texts; ++i) {
+            assert(ch.texts_[i].sender_ == text::sender_other);
+            assert(ch.texts_[i].content_ == "text " + std::to_string(i));
+        }
+    }
+}
+
+int main() {
+    remove(journal_path);
+    pid_t pid = spawn_server();
+
+    uint32_t stat_code;
+    client r;
+    assert(r.connect_server(n_ip_addr) == status::ok);
+    for (size_t u = 0; u != num_users + 1; ++u) {
+        assert(r.registration(username(u), "password", stat_code) ==
+               status::ok);
+        assert(stat_code == chat262::status_code_ok);
+    }
+    std::vector<std::thread> threads;
+    for (size_t u = 0; u != num_users; ++u) {
+        threads.emplace_back(send_texts, u);
+    }
+    for (std::thread& t : threads) {
+        t.join();
+    }
+    client deleting;
+    login(deleting, username(num_users));
+    assert(deleting.delete_account(stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+
+    // Every answered write survives a crash
+    crash(pid);
+    pid = spawn_server();
+    check_texts(0);
+    assert(r.connect_server(n_ip_addr) == status::ok);
+    assert(r.registration(username(0), "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_user_exists);
+    assert(r.registration(username(num_users), "password", stat_code) ==
+           status::ok);
+    assert(stat_code == chat262::status_code_user_exists);
+    assert(r.login(username(num_users), "password", stat_code) ==
+           status::ok);
+    assert(stat_code == chat262::status_code_invalid_credentials);
+
+    // A batch cut short by a crash is dropped, and writes go on after the
+    // last complete one
+    crash(pid);
+    FILE* f = fopen(journal_path, "ab");
+    assert(f != nullptr);
+    const uint8_t torn[] = {1, 0, 110, 0, 0xFF, 0, 0, 0, 1, 2, 3};
+    assert(fwrite(torn, 1, sizeof(torn), f) == sizeof(torn));
+    fclose(f);
+    pid = spawn_server();
+    check_texts(0);
+    {
+        client c;
+        login(c, username(num_users - 1));
+        assert(c.send_txt(username(0), "after the crash", stat_code) ==
+               status::ok);
+        assert(stat_code == chat262::status_code_ok);
+    }
+    crash(pid);
+    pid = spawn_server();
+    check_texts(1);
+
+    crash(pid);
+    remove(journal_path);
+    return 0;
+}
@@ -0,0 +1,258 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "peer_io.h"
+#include "proxy.h"
+#include "server.h"
+#include "shard_ring.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Two shards listen on 127.0.0.1 and 127.0.0.2, and a proxy on 127.0.0.3
+// relays to both. A user of the first shard moves to the second while texts
+// to and from it keep coming, through the proxy and straight to the shards.
+
+static const char* const str_shards[] = {"127.0.0.1", "127.0.0.2"};
+static const uint32_t n_shards[] = {0x0100007F, 0x0200007F};
+constexpr size_t num_shards = 2;
+constexpr uint32_t n_proxy = 0x0300007F;
+constexpr uint32_t n_other_addr = 0x0400007F;
+
+constexpr size_t num_users = 16;
+constexpr size_t num_texts = 200;
+
+// Run `argv` as a server (or as the proxy, if `is_proxy`) in a child process
+// and return its process ID
+static pid_t spawn(std::vector<const char*> argv, const bool is_proxy) {
+    // The child must not print what the parent buffered
+    fflush(stdout);
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return pid;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    assert(freopen("/dev/null", "w", stdout) != nullptr);
+    assert(freopen("/dev/null", "w", stderr) != nullptr);
+    if (is_proxy) {
+        proxy p;
+        p.run(argv.size(), argv.data());
+    } else {
+        server s;
+        s.run(argv.size(), argv.data());
+    }
+    _exit(1);
+}
+
+// Index of the shard that `username` belongs to by the ring
+static size_t shard_of(const std::string& username) {
+    static const chat262::shard_ring ring(
+        std::vector<uint32_t>(n_shards, n_shards + num_shards));
+    const uint32_t addr = ring.shard_of(username);
+    return std::find(n_shards, n_shards + num_shards, addr) - n_shards;
+}
+
+static std::string username(const size_t u) {
+    return "user" + std::to_string(u);
+}
+
+// First user from `u` on that belongs to the shard `shard`
+static size_t user_on(const size_t shard, size_t u) {
+    while (shard_of(username(u)) != shard) {
+        ++u;
+    }
+    return u;
+}
+
+// Connect `c` to `n_ip_addr` and log in as `name`
+static void login(client& c,
+                  const uint32_t n_ip_addr,
+                  const std::string& name) {
+    uint32_t stat_code;
+    assert(c.connect_server(n_ip_addr) == status::ok);
+    assert(c.login(name, "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+}
+
+// Log in as `from` on `n_ip_addr` and send `num_texts` numbered texts to `to`
+static void send_texts(const uint32_t n_ip_addr,
+                       const std::string& from,
+                       const std::string& to) {
+    client c;
+    login(c, n_ip_addr, from);
+    uint32_t stat_code;
+    for (size_t i = 0; i != num_texts; ++i) {
+        assert(c.send_txt(to, "text " + std::to_string(i), stat_code) ==
+               status::ok);
+        assert(stat_code == chat262::status_code_ok);
+    }
+}
+
+// Check that the chat of `c` with `correspondent` holds `num_texts` numbered
+// texts from `sender`, in order
+static void check_texts(client& c,
+                        const std::string& correspondent,
+                        const uint8_t sender) {
+    uint32_t stat_code;
+    chat ch;
+    assert(c.recv_txt(correspondent, stat_code, ch) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    size_t received = 0;
+    for (const text& t : ch.texts_) {
+        if (t.sender_ == sender) {
+            assert(t.content_ == "text " + std::to_string(received++));
+        }
+    }
+    assert(received == num_texts);
+}
+
+int main() {
+    pid_t pids[num_shards + 1];
+    pids[0] = spawn(
+        {"./server", "-H", str_shards[1], "-P", "127.0.0.3", str_shards[0]},
+        false);
+    pids[1] = spawn(
+        {"./server", "-H", str_shards[0], "-P", "127.0.0.3", str_shards[1]},
+        false);
+    pids[2] = spawn({"./chat262-proxy",
+                     "-B",
+                     str_shards[0],
+                     "-B",
+                     str_shards[1],
+                     "127.0.0.3"},
+                    true);
+
+    uint32_t stat_code;
+    client r;
+    assert(r.connect_server(n_proxy) == status::ok);
+    for (size_t u = 0; u != num_users; ++u) {
+        assert(r.registration(username(u), "password", stat_code) ==
+               status::ok);
+        assert(stat_code == chat262::status_code_ok);
+    }
+    // The user that moves, a user of its shard and a user of the other
+    const std::string mover = username(user_on(0, 0));
+    const std::string neighbor = username(user_on(0, user_on(0, 0) + 1));
+    const std::string stranger = username(user_on(1, 0));
+
+    // A client of the shard is logged out by the move
+    client direct;
+    login(direct, n_shards[0], mover);
+
+    // Texts come and go while the user moves: through the proxy, which
+    // follows the user, and straight from the shards of the others
+    std::vector<std::thread> threads;
+    threads.emplace_back(send_texts, n_proxy, mover, neighbor);
+    threads.emplace_back(send_texts, n_proxy, mover, stranger);
+    threads.emplace_back(send_texts, n_proxy, mover, mover);
+    threads.emplace_back(send_texts, n_shards[0], neighbor, mover);
+    threads.emplace_back(send_texts, n_shards[1], stranger, mover);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    client admin;
+    assert(admin.connect_server(n_shards[0]) == status::ok);
+    uint64_t bytes;
+    uint64_t copy_us;
+    uint64_t pause_us;
+    assert(admin.migrate(mover, n_shards[1], stat_code, bytes, copy_us,
+                         pause_us) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(bytes > 0);
+    for (std::thread& t : threads) {
+        t.join();
+    }
+
+    // The other shard has every text, and the user's shard sends the user's
+    // clients there
+    client moved;
+    login(moved, n_shards[1], mover);
+    check_texts(moved, neighbor, text::sender_you);
+    check_texts(moved, neighbor, text::sender_other);
+    check_texts(moved, stranger, text::sender_you);
+    check_texts(moved, stranger, text::sender_other);
+    check_texts(moved, mover, text::sender_you);
+    client left_behind;
+    login(left_behind, n_shards[0], neighbor);
+    check_texts(left_behind, mover, text::sender_you);
+    check_texts(left_behind, mover, text::sender_other);
+    std::vector<std::string> usernames;
+    assert(direct.recv_correspondents(stat_code, usernames) == status::ok);
+    assert(stat_code == chat262::status_code_unauthorized);
+    assert(direct.login(mover, "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_wrong_shard);
+    uint32_t n_ip_addr;
+    assert(direct.locate(mover, stat_code, n_ip_addr) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(n_ip_addr == n_shards[1]);
+    assert(r.registration(mover, "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_user_exists);
+
+    // Only the user's shard moves it, and only a user that exists
+    assert(admin.migrate(mover, n_shards[1], stat_code, bytes, copy_us,
+                         pause_us) == status::ok);
+    assert(stat_code == chat262::status_code_wrong_shard);
+    client back;
+    assert(back.connect_server(n_shards[1]) == status::ok);
+    const std::string nobody = username(user_on(1, num_users));
+    assert(back.migrate(nobody, n_shards[0], stat_code, bytes, copy_us,
+                        pause_us) == status::ok);
+    assert(stat_code == chat262::status_code_user_noexist);
+    // Users are moved from the hosts of the shards, and imported from the
+    // shards only
+    int fd;
+    assert(connect_peer(n_shards[1], n_other_addr, fd) == status::ok);
+    assert(send_all(fd,
+                    chat262::migrate_request::serialize(n_shards[0], mover)) ==
+           status::ok);
+    chat262::message_header hdr;
+    std::vector<uint8_t> body;
+    assert(recv_message(fd, hdr, body) == status::ok);
+    assert(hdr.type_ == chat262::msgtype_invalid_type_response);
+    assert(send_all(fd,
+                    chat262::import_request::serialize(
+                        true,
+                        nobody,
+                        {{chat262::mutation::op_registration,
+                          nobody,
+                          "password",
+                          ""}})) == status::ok);
+    assert(recv_message(fd, hdr, body) == status::ok);
+    assert(hdr.type_ == chat262::msgtype_invalid_type_response);
+    close(fd);
+    assert(back.login(nobody, "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_invalid_credentials);
+
+    // The user can move back, and a deletion on its new shard reaches the
+    // chats of the others
+    assert(back.migrate(mover, n_shards[0], stat_code, bytes, copy_us,
+                        pause_us) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    client returned;
+    login(returned, n_proxy, mover);
+    check_texts(returned, stranger, text::sender_other);
+    assert(returned.delete_account(stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    client other;
+    login(other, n_proxy, stranger);
+    chat ch;
+    assert(other.recv_txt(mover, stat_code, ch) == status::ok);
+    assert(stat_code == chat262::status_code_user_noexist);
+
+    for (const pid_t pid : pids) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+    return 0;
+}
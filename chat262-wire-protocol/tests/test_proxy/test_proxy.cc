@@ -0,0 +1,278 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "endianness.h"
+#include "peer_io.h"
+#include "proxy.h"
+#include "server.h"
+#include "shard_ring.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <netinet/in.h>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Two shards listen on 127.0.0.1 and 127.0.0.2, and the proxy on 127.0.0.3
+// relays to both over two connections each. Every one of them runs in its own
+// process, and the clients only ever connect to the proxy.
+
+static const char* const str_shards[] = {"127.0.0.1", "127.0.0.2"};
+static const uint32_t n_shards[] = {0x0100007F, 0x0200007F};
+constexpr size_t num_shards = 2;
+constexpr uint32_t n_proxy = 0x0300007F;
+
+constexpr size_t num_users = 16;
+constexpr size_t num_texts = 50;
+
+// Run `argv` as a server (or as the proxy, if `is_proxy`) in a child process
+// and return its process ID
+static pid_t spawn(std::vector<const char*> argv, const bool is_proxy) {
+    // The child must not print what the parent buffered
+    fflush(stdout);
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return pid;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    assert(freopen("/dev/null", "w", stdout) != nullptr);
+    assert(freopen("/dev/null", "w", stderr) != nullptr);
+    if (is_proxy) {
+        proxy p;
+        p.run(argv.size(), argv.data());
+    } else {
+        server s;
+        s.run(argv.size(), argv.data());
+    }
+    _exit(1);
+}
+
+// Index of the shard that owns `username`
+static size_t shard_of(const std::string& username) {
+    static const chat262::shard_ring ring(
+        std::vector<uint32_t>(n_shards, n_shards + num_shards));
+    const uint32_t addr = ring.shard_of(username);
+    return std::find(n_shards, n_shards + num_shards, addr) - n_shards;
+}
+
+static std::string username(const size_t u) {
+    return "user" + std::to_string(u);
+}
+
+// Connect `c` to the proxy and log in as `name`
+static void login(client& c, const std::string& name) {
+    uint32_t stat_code;
+    assert(c.connect_server(n_proxy) == status::ok);
+    assert(c.login(name, "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+}
+
+// Every user sends its own texts to the next user, while all others do the
+// same over the same connections of the proxy, and gets exactly the texts of
+// the previous user back
+static void exchange_texts(const size_t u) {
+    client c;
+    login(c, username(u));
+    const std::string next = username((u + 1) % num_users);
+    const std::string prev = username((u + num_users - 1) % num_users);
+    uint32_t stat_code;
+    for (size_t i = 0; i != num_texts; ++i) {
+        assert(c.send_txt(next,
+                          "text " + std::to_string(i) + " from " +
+                              username(u),
+                          stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+    }
+    // The previous user may not be done yet
+    chat ch;
+    do {
+        assert(c.recv_txt(prev, stat_code, ch) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+    } while (std::count_if(ch.texts_.begin(),
+                           ch.texts_.end(),
+                           [](const text& t) {
+                               return t.sender_ == text::sender_other;
+                           }) != static_cast<ptrdiff_t>(num_texts));
+    size_t received = 0;
+    for (const text& t : ch.texts_) {
+        if (t.sender_ == text::sender_other) {
+            assert(t.content_ == "text " + std::to_string(received++) +
+                                     " from " + prev);
+        }
+    }
+}
+
+int main() {
+    pid_t pids[num_shards + 1];
+    pids[0] = spawn(
+        {"./server", "-H", str_shards[1], "-P", "127.0.0.3", str_shards[0]},
+        false);
+    pids[1] = spawn(
+        {"./server", "-H", str_shards[0], "-P", "127.0.0.3", str_shards[1]},
+        false);
+    pids[2] = spawn({"./chat262-proxy",
+                     "-n",
+                     "2",
+                     "-B",
+                     str_shards[0],
+                     "-B",
+                     str_shards[1],
+                     "127.0.0.3"},
+                    true);
+
+    // Every user registers through the proxy, which sends the registration
+    // to the user's shard
+    uint32_t stat_code;
+    size_t users_per_shard[num_shards] = {0, 0};
+    client r;
+    assert(r.connect_server(n_proxy) == status::ok);
+    for (size_t u = 0; u != num_users; ++u) {
+        assert(r.registration(username(u), "password", stat_code) ==
+               status::ok);
+        assert(stat_code == chat262::status_code_ok);
+        ++users_per_shard[shard_of(username(u))];
+    }
+    assert(users_per_shard[0] > 0 && users_per_shard[1] > 0);
+    assert(r.registration(username(0), "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_user_exists);
+    // The users really live on their shards
+    for (size_t u = 0; u != num_users; ++u) {
+        client d;
+        assert(d.connect_server(n_shards[shard_of(username(u))]) ==
+               status::ok);
+        assert(d.login(username(u), "password", stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+    }
+    // Only the proxy may relay requests, which act as any user
+    const std::shared_ptr<chat262::message> relayed =
+        chat262::correspondents_request::serialize();
+    const uint8_t* relayed_data =
+        reinterpret_cast<const uint8_t*>(relayed.get());
+    int fd;
+    assert(connect_peer(n_shards[0], htonl(INADDR_ANY), fd) == status::ok);
+    assert(send_all(fd,
+                    chat262::proxy_request::serialize(
+                        0,
+                        username(0),
+                        std::string(relayed_data,
+                                    relayed_data +
+                                        sizeof(chat262::message_header) +
+                                        e_le32toh(relayed->hdr_.body_len_)))) ==
+           status::ok);
+    chat262::message_header hdr;
+    std::vector<uint8_t> body;
+    assert(recv_message(fd, hdr, body) == status::ok);
+    assert(hdr.type_ == chat262::msgtype_invalid_type_response);
+    close(fd);
+
+    // Clients that share the connections to the shards only see their own
+    // responses
+    std::vector<std::thread> threads;
+    for (size_t u = 0; u != num_users; ++u) {
+        threads.emplace_back(exchange_texts, u);
+    }
+    for (std::thread& t : threads) {
+        t.join();
+    }
+
+    // The proxy keeps track of the logged in user of every client
+    std::vector<std::string> usernames;
+    assert(r.recv_correspondents(stat_code, usernames) == status::ok);
+    assert(stat_code == chat262::status_code_unauthorized);
+    assert(r.login(username(3), "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(r.recv_correspondents(stat_code, usernames) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    std::sort(usernames.begin(), usernames.end());
+    assert(usernames == std::vector<std::string>({username(2), username(4)}));
+    // A registration doesn't log the client out, even on another shard
+    size_t elsewhere = num_users;
+    while (shard_of(username(elsewhere)) == shard_of(username(3))) {
+        ++elsewhere;
+    }
+    assert(r.registration(username(elsewhere), "password", stat_code) ==
+           status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(r.recv_correspondents(stat_code, usernames) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(r.login(username(3), "wrong", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_invalid_credentials);
+    assert(r.recv_correspondents(stat_code, usernames) == status::ok);
+    assert(stat_code == chat262::status_code_unauthorized);
+    assert(r.login(username(5), "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    // Searches list the users of all shards
+    assert(r.list_accounts("user1*", stat_code, usernames) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(usernames.size() >= 7);
+    assert(r.logout(stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(r.recv_correspondents(stat_code, usernames) == status::ok);
+    assert(stat_code == chat262::status_code_unauthorized);
+
+    // The proxy negotiates the features it can relay, and relays compressed
+    // responses as they are
+    client v2;
+    uint16_t chosen;
+    uint32_t enabled;
+    assert(v2.connect_server(n_proxy) == status::ok);
+    assert(v2.hello(chat262::latest_version,
+                    chat262::feature_compression |
+                        chat262::feature_read_tokens,
+                    chosen,
+                    enabled) == status::ok);
+    assert(chosen == chat262::latest_version);
+    assert(enabled == chat262::feature_compression);
+    assert(v2.login(username(1), "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    chat ch;
+    assert(v2.recv_txt(username(0), stat_code, ch) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(ch.texts_.size() == num_texts);
+
+    // A user deleted through one client is logged out of the others
+    client other;
+    login(other, username(7));
+    client deleting;
+    login(deleting, username(7));
+    assert(deleting.delete_account(stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(other.recv_correspondents(stat_code, usernames) == status::ok);
+    assert(stat_code == chat262::status_code_unauthorized);
+
+    // When a shard goes away, only its users lose their connections
+    size_t lost = num_users;
+    size_t kept = num_users;
+    for (size_t u = 0; u != num_users; ++u) {
+        if (u != 7) {
+            (shard_of(username(u)) == 1 ? lost : kept) = u;
+        }
+    }
+    client lost_client;
+    login(lost_client, username(lost));
+    client kept_client;
+    login(kept_client, username(kept));
+    kill(pids[1], SIGKILL);
+    waitpid(pids[1], nullptr, 0);
+    assert(lost_client.recv_correspondents(stat_code, usernames) !=
+           status::ok);
+    assert(kept_client.recv_correspondents(stat_code, usernames) ==
+           status::ok);
+    assert(stat_code == chat262::status_code_ok);
+
+    kill(pids[0], SIGKILL);
+    waitpid(pids[0], nullptr, 0);
+    kill(pids[2], SIGKILL);
+    waitpid(pids[2], nullptr, 0);
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include "chat262_protocol.h"
+#include "client.h"
+#include "server.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+constexpr uint32_t n_ip_addr = 0x0100007F;
+
+static void spawn_server() {
+    const char* localhost = "127.0.0.1";
+    // Every text costs its length plus 4 bytes, in each of the two chats.
+    // The sender's limits count its own copies.
+    char const* argv[] =
+        {"./server", "-u", "100", "-c", "60", "-m", "250", localhost};
+    std::thread thread([&]() {
+        server s;
+        s.run(8, argv);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    thread.detach();
+}
+
+int main() {
+    spawn_server();
+
+    client c;
+    assert(c.connect_server(n_ip_addr) == status::ok);
+
+    uint32_t stat_code;
+    for (const char* username : {"usera", "userb", "userc", "userd"}) {
+        assert(c.registration(username, "password", stat_code) == status::ok);
+        assert(stat_code == 0);
+    }
+
+    // The chat limit is reached with the third 20-byte text
+    assert(c.login("usera", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    const std::string txt(20, 'x');
+    assert(c.send_txt("userb", txt, stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("userb", txt, stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("userb", txt, stat_code) == status::ok);
+    assert(stat_code == 7);
+
+    // The rejected text is not stored
+    chat ch;
+    assert(c.recv_txt("userb", stat_code, ch) == status::ok);
+    assert(stat_code == 0);
+    assert(ch.texts_.size() == 2);
+
+    // The user limit is reached at 100 bytes, across chats
+    assert(c.send_txt("userc", std::string(40, 'y'), stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("userc", "z", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("userc", "abcd", stat_code) == status::ok);
+    assert(stat_code == 7);
+
+    // A rejected text doesn't create a chat
+    assert(c.send_txt("userd", "hello", stat_code) == status::ok);
+    assert(stat_code == 7);
+    std::vector<std::string> correspondents;
+    assert(c.recv_correspondents(stat_code, correspondents) == status::ok);
+    assert(stat_code == 0);
+    std::sort(correspondents.begin(), correspondents.end());
+    assert(correspondents == std::vector<std::string>({"userb", "userc"}));
+    assert(c.logout(stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    // The server stores 194 bytes, so the global limit is reached with the
+    // second text
+    assert(c.login("userb", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("userc", txt, stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("userc", "abcd", stat_code) == status::ok);
+    assert(stat_code == 7);
+    assert(c.logout(stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    // Deleting a user frees both copies of its texts
+    assert(c.login("usera", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.delete_account(stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.login("userb", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("userc", "abcd", stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    // Sending to oneself stores both copies in one chat
+    assert(c.send_txt("userb", std::string(30, 'w'), stat_code) ==
+           status::ok);
+    assert(stat_code == 7);
+    assert(c.send_txt("userb", txt, stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.logout(stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    // Only the sender is charged, so texts that fill up the chat of the
+    // recipient don't stop the recipient from answering
+    assert(c.login("userc", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("userd", std::string(26, 'v'), stat_code) ==
+           status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("userd", std::string(26, 'v'), stat_code) ==
+           status::ok);
+    assert(stat_code == 0);
+    assert(c.login("userd", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("userc", "ok", stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,276 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "peer_io.h"
+#include "server.h"
+
+#include <cassert>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// The three servers of the cluster listen on 127.0.0.1, 127.0.0.2 and
+// 127.0.0.3, which are all loopback addresses. Every server runs in its own
+// process, so that it can be killed.
+
+static const char* const str_addrs[] = {"127.0.0.1", "127.0.0.2", "127.0.0.3"};
+static const uint32_t n_addrs[] = {0x0100007F, 0x0200007F, 0x0300007F};
+static const char* const state_paths[] = {
+    "test_raft.0.state", "test_raft.1.state", "test_raft.2.state"};
+constexpr size_t num_servers = 3;
+constexpr uint32_t n_other_addr = 0x0400007F;
+
+constexpr size_t num_texts = 200;
+
+// Start the server `i` in a child process and return its process ID. A small
+// log makes the leader send snapshots to the servers that fall behind. The
+// server keeps its term and vote in its state file.
+static pid_t spawn_server(const size_t i) {
+    // The child must not print what the parent buffered
+    fflush(stdout);
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return pid;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    assert(freopen("/dev/null", "w", stdout) != nullptr);
+    assert(freopen("/dev/null", "w", stderr) != nullptr);
+    std::vector<const char*> argv = {
+        "./server", "-L", "4K", "-v", state_paths[i]};
+    for (size_t j = 0; j != num_servers; ++j) {
+        if (j != i) {
+            argv.push_back("-p");
+            argv.push_back(str_addrs[j]);
+        }
+    }
+    argv.push_back(str_addrs[i]);
+    server s;
+    s.run(argv.size(), argv.data());
+    _exit(1);
+}
+
+// Register `username` on whichever server is the leader, and return the
+// leader. Gives up after `attempts` rounds over all servers.
+static size_t register_on_leader(const std::string& username,
+                                 const int attempts) {
+    for (int attempt = 0; attempt != attempts; ++attempt) {
+        for (size_t i = 0; i != num_servers; ++i) {
+            client c;
+            uint32_t stat_code;
+            if (c.connect_server(n_addrs[i]) != status::ok ||
+                c.registration(username, "password", stat_code) !=
+                    status::ok) {
+                continue;
+            }
+            if (stat_code == chat262::status_code_ok ||
+                stat_code == chat262::status_code_user_exists) {
+                return i;
+            }
+            assert(stat_code == chat262::status_code_not_leader);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    assert(false);
+    return num_servers;
+}
+
+// Ask the server `i` for its vote in `term` for the server after it, with a
+// log that is far ahead, and store its term into `resp_term` and whether it
+// voted into `granted`
+static void request_vote(const size_t i,
+                         const uint64_t term,
+                         uint64_t& resp_term,
+                         bool& granted) {
+    const uint32_t candidate = n_addrs[(i + 1) % num_servers];
+    int fd;
+    assert(connect_peer(n_addrs[i], candidate, fd) == status::ok);
+    assert(send_all(fd,
+                    chat262::vote_request::serialize(
+                        term, candidate, 1000000, 1000000)) == status::ok);
+    chat262::message_header hdr;
+    std::vector<uint8_t> body;
+    assert(recv_message(fd, hdr, body) == status::ok);
+    assert(hdr.type_ == chat262::msgtype_vote_response);
+    assert(chat262::vote_response::deserialize(body, resp_term, granted) ==
+           status::ok);
+    close(fd);
+}
+
+// Wait until the server `i` stores `count` texts from alice to bobby
+static void wait_for_texts(const size_t i, const size_t count) {
+    client bobby;
+    assert(bobby.connect_server(n_addrs[i]) == status::ok);
+    for (int attempt = 0; attempt != 200; ++attempt) {
+        uint32_t stat_code;
+        chat c;
+        if (bobby.login("bobby", "password", stat_code) == status::ok &&
+            stat_code == chat262::status_code_ok &&
+            bobby.recv_txt("alice", stat_code, c) == status::ok &&
+            stat_code == chat262::status_code_ok &&
+            c.texts_.size() == count) {
+            for (size_t j = 0; j != count; ++j) {
+                assert(c.texts_[j].content_ == "text " + std::to_string(j));
+            }
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(25));
+    }
+    assert(false);
+}
+
+int main() {
+    pid_t pids[num_servers];
+    for (size_t i = 0; i != num_servers; ++i) {
+        remove(state_paths[i]);
+        pids[i] = spawn_server(i);
+    }
+
+    // A leader is elected, and only the leader accepts writes
+    const size_t leader = register_on_leader("alice", 100);
+    assert(register_on_leader("bobby", 1) == leader);
+    const size_t follower = (leader + 1) % num_servers;
+    uint32_t stat_code;
+    {
+        client c;
+        assert(c.connect_server(n_addrs[follower]) == status::ok);
+        assert(c.registration("carol", "password", stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_not_leader);
+    }
+    // Only the servers of the cluster take part in elections
+    {
+        int fd;
+        assert(connect_peer(n_addrs[follower], n_other_addr, fd) ==
+               status::ok);
+        assert(send_all(fd,
+                        chat262::vote_request::serialize(
+                            1000000, n_other_addr, 1000000, 1000000)) ==
+               status::ok);
+        chat262::message_header hdr;
+        std::vector<uint8_t> body;
+        assert(recv_message(fd, hdr, body) == status::ok);
+        assert(hdr.type_ == chat262::msgtype_invalid_type_response);
+        close(fd);
+    }
+
+    {
+        client alice;
+        assert(alice.connect_server(n_addrs[leader]) == status::ok);
+        assert(alice.login("alice", "password", stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+        for (size_t i = 0; i != num_texts; ++i) {
+            assert(alice.send_txt("bobby", "text " + std::to_string(i),
+                                  stat_code) == status::ok);
+            assert(stat_code == chat262::status_code_ok);
+        }
+        assert(alice.send_txt("nobody", "text", stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_user_noexist);
+    }
+    for (size_t i = 0; i != num_servers; ++i) {
+        wait_for_texts(i, num_texts);
+    }
+
+    // Kill the leader. The others elect a new one, which has all texts.
+    assert(kill(pids[leader], SIGKILL) == 0);
+    assert(waitpid(pids[leader], nullptr, 0) == pids[leader]);
+    const auto killed = std::chrono::steady_clock::now();
+    const size_t new_leader = register_on_leader("carol", 200);
+    const auto failover = std::chrono::steady_clock::now() - killed;
+    printf("New leader after %lld ms\n",
+           static_cast<long long>(
+               std::chrono::duration_cast<std::chrono::milliseconds>(failover)
+                   .count()));
+    assert(new_leader != leader);
+    assert(failover < std::chrono::seconds(2));
+
+    client alice;
+    assert(alice.connect_server(n_addrs[new_leader]) == status::ok);
+    assert(alice.login("alice", "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(alice.send_txt("bobby", "text " + std::to_string(num_texts),
+                          stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    wait_for_texts(new_leader, num_texts + 1);
+
+    // The old leader comes back empty, and catches up from a snapshot
+    pids[leader] = spawn_server(leader);
+    wait_for_texts(leader, num_texts + 1);
+    assert(alice.send_txt("bobby", "text " + std::to_string(num_texts + 1),
+                          stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    for (size_t i = 0; i != num_servers; ++i) {
+        wait_for_texts(i, num_texts + 2);
+    }
+
+    // A deletion is applied everywhere
+    assert(alice.delete_account(stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    for (size_t i = 0; i != num_servers; ++i) {
+        client c;
+        assert(c.connect_server(n_addrs[i]) == status::ok);
+        bool deleted = false;
+        for (int attempt = 0; attempt != 200 && !deleted; ++attempt) {
+            assert(c.login("alice", "password", stat_code) == status::ok);
+            deleted = stat_code == chat262::status_code_invalid_credentials;
+            std::this_thread::sleep_for(std::chrono::milliseconds(25));
+        }
+        assert(deleted);
+    }
+
+    // When every server restarted, none of them holds the committed entries,
+    // so none of them votes, even in a new term, and no leader is elected.
+    // They kept their terms.
+    for (size_t i = 0; i != num_servers; ++i) {
+        kill(pids[i], SIGKILL);
+        waitpid(pids[i], nullptr, 0);
+    }
+    for (size_t i = 0; i != num_servers; ++i) {
+        pids[i] = spawn_server(i);
+    }
+    for (size_t i = 0; i != num_servers; ++i) {
+        uint64_t term;
+        bool granted;
+        request_vote(i, 1, term, granted);
+        assert(term > 1);
+        assert(!granted);
+        request_vote(i, 1000000, term, granted);
+        assert(term == 1000000);
+        assert(!granted);
+    }
+    for (int attempt = 0; attempt != 20; ++attempt) {
+        for (size_t i = 0; i != num_servers; ++i) {
+            client c;
+            assert(c.connect_server(n_addrs[i]) == status::ok);
+            assert(c.registration("dave", "password", stat_code) ==
+                   status::ok);
+            assert(stat_code == chat262::status_code_not_leader);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    // Without their state files, they start over as a new cluster
+    for (size_t i = 0; i != num_servers; ++i) {
+        kill(pids[i], SIGKILL);
+        waitpid(pids[i], nullptr, 0);
+        remove(state_paths[i]);
+    }
+    for (size_t i = 0; i != num_servers; ++i) {
+        pids[i] = spawn_server(i);
+    }
+    register_on_leader("dave", 100);
+
+    for (size_t i = 0; i != num_servers; ++i) {
+        kill(pids[i], SIGKILL);
+        waitpid(pids[i], nullptr, 0);
+        remove(state_paths[i]);
+    }
+    return 0;
+}
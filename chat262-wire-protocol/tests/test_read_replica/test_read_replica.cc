@@ -0,0 +1,201 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "peer_io.h"
+#include "server.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// The primary listens on 127.0.0.1 and the read replica on 127.0.0.2, which
+// are both loopback addresses
+
+constexpr uint32_t n_primary_addr = 0x0100007F;
+constexpr uint32_t n_replica_addr = 0x0200007F;
+constexpr uint32_t n_other_addr = 0x0300007F;
+
+constexpr size_t num_texts = 200;
+
+static void spawn_server(const std::vector<const char*>& args) {
+    std::thread thread([args]() {
+        std::vector<const char*> argv = {"./server"};
+        argv.insert(argv.end(), args.begin(), args.end());
+        server s;
+        s.run(argv.size(), argv.data());
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    thread.detach();
+}
+
+// Connect `c` to the primary with read tokens and log in as `username`
+static void connect_with_tokens(client& c, const std::string& username) {
+    uint32_t stat_code;
+    uint16_t chosen;
+    uint32_t enabled;
+    assert(c.connect_server(n_primary_addr) == status::ok);
+    assert(c.hello(chat262::latest_version,
+                   chat262::feature_read_tokens,
+                   chosen,
+                   enabled) == status::ok);
+    assert(enabled == chat262::feature_read_tokens);
+    assert(c.login(username, "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+}
+
+// Wait until the replica applied the write of `token`, and return how stale
+// it is
+static uint32_t sync_replica(client& replica, const uint64_t token) {
+    uint32_t stat_code;
+    uint64_t applied;
+    uint32_t staleness_ms;
+    assert(replica.sync(token, 5000, stat_code, applied, staleness_ms) ==
+           status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(applied >= token);
+    return staleness_ms;
+}
+
+int main() {
+    // The log is small, so the texts sent before the replica starts are
+    // dropped from it, and the replica starts from a snapshot
+    spawn_server({"-t", "127.0.0.2", "-L", "4K", "127.0.0.1"});
+
+    uint32_t stat_code;
+    {
+        client c;
+        assert(c.connect_server(n_primary_addr) == status::ok);
+        for (const char* username : {"alice", "bobby", "carol"}) {
+            assert(c.registration(username, "password", stat_code) ==
+                   status::ok);
+            assert(stat_code == chat262::status_code_ok);
+        }
+        // Without the feature, writes have no tokens
+        assert(c.last_token() == 0);
+    }
+
+    // Every write has a larger token than the one before
+    client alice;
+    connect_with_tokens(alice, "alice");
+    uint64_t token = 0;
+    for (size_t i = 0; i != num_texts; ++i) {
+        assert(alice.send_txt("bobby", "early " + std::to_string(i),
+                              stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+        assert(alice.last_token() > token);
+        token = alice.last_token();
+    }
+    // A failed write has no token
+    assert(alice.send_txt("nobody", "text", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_user_noexist);
+    assert(alice.last_token() == token);
+
+    // The primary has applied every write it answered
+    {
+        uint64_t applied;
+        uint32_t staleness_ms;
+        assert(alice.sync(token, 0, stat_code, applied, staleness_ms) ==
+               status::ok);
+        assert(stat_code == chat262::status_code_ok);
+        assert(applied == token);
+        assert(staleness_ms == 0);
+    }
+
+    // Only the read replica tails the log and its snapshots, which hold
+    // every password and text
+    {
+        int fd;
+        assert(connect_peer(n_primary_addr, n_other_addr, fd) == status::ok);
+        chat262::message_header hdr;
+        std::vector<uint8_t> body;
+        for (const uint64_t offset : {0, 1}) {
+            assert(send_all(fd,
+                            chat262::tail_request::serialize(1, offset, 0)) ==
+                   status::ok);
+            assert(recv_message(fd, hdr, body) == status::ok);
+            assert(hdr.type_ == chat262::msgtype_invalid_type_response);
+        }
+        close(fd);
+    }
+
+    spawn_server({"-R", "127.0.0.1", "127.0.0.2"});
+
+    client replica;
+    assert(replica.connect_server(n_replica_addr) == status::ok);
+    const uint32_t staleness_ms = sync_replica(replica, token);
+    assert(staleness_ms < 1000);
+    assert(replica.login("bobby", "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    chat c;
+    assert(replica.recv_txt("alice", stat_code, c) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(c.texts_.size() == num_texts);
+    for (size_t i = 0; i != num_texts; ++i) {
+        assert(c.texts_[i].content_ == "early " + std::to_string(i));
+    }
+
+    // Once the replica applied the token of a write, it reads the write
+    for (size_t i = 0; i != num_texts; ++i) {
+        assert(alice.send_txt("bobby", "late " + std::to_string(i),
+                              stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+        sync_replica(replica, alice.last_token());
+        assert(replica.recv_txt("alice", stat_code, c) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+        assert(c.texts_.size() == num_texts + 1 + i);
+        assert(c.texts_.back().content_ == "late " + std::to_string(i));
+    }
+
+    // The replica serves searches and correspondents too
+    std::vector<std::string> usernames;
+    assert(replica.list_accounts("*", stat_code, usernames) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(usernames.size() == 3);
+    std::vector<std::string> correspondents;
+    assert(replica.recv_correspondents(stat_code, correspondents) ==
+           status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(correspondents == std::vector<std::string>{"alice"});
+
+    // A write the replica can't have applied yet makes the sync time out
+    {
+        uint64_t applied;
+        uint32_t stale_ms;
+        assert(replica.sync(alice.last_token() + 1000,
+                            50,
+                            stat_code,
+                            applied,
+                            stale_ms) == status::ok);
+        assert(stat_code == chat262::status_code_stale);
+        assert(applied == alice.last_token());
+        assert(stale_ms != std::numeric_limits<uint32_t>::max());
+    }
+
+    // The replica refuses writes from clients
+    {
+        client w;
+        assert(w.connect_server(n_replica_addr) == status::ok);
+        assert(w.registration("dave", "password", stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_read_only);
+    }
+    assert(replica.send_txt("alice", "hello", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_read_only);
+    assert(replica.delete_account(stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_read_only);
+
+    // A deletion has a token as well
+    token = alice.last_token();
+    assert(alice.delete_account(stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(alice.last_token() > token);
+    sync_replica(replica, alice.last_token());
+    assert(replica.recv_txt("alice", stat_code, c) == status::ok);
+    assert(stat_code == chat262::status_code_user_noexist);
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "peer_io.h"
+#include "server.h"
+
+#include <cassert>
+#include <chrono>
+#include <string>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+
+// The primary listens on 127.0.0.1 and the backup on 127.0.0.2, which are both
+// loopback addresses
+
+constexpr uint32_t n_primary_addr = 0x0100007F;
+constexpr uint32_t n_backup_addr = 0x0200007F;
+constexpr uint32_t n_other_addr = 0x0300007F;
+
+static void spawn_server(const std::vector<const char*>& args) {
+    std::thread thread([args]() {
+        std::vector<const char*> argv = {"./server"};
+        argv.insert(argv.end(), args.begin(), args.end());
+        server s;
+        s.run(argv.size(), argv.data());
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    thread.detach();
+}
+
+static void connect_as(client& c,
+                       const uint32_t n_ip_addr,
+                       const std::string& username) {
+    uint32_t stat_code;
+    assert(c.connect_server(n_ip_addr) == status::ok);
+    assert(c.login(username, "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+}
+
+// Check that both servers store the same chat of `username` with
+// `correspondent`, and return the number of texts in it
+static size_t check_same_chat(client& primary,
+                              client& backup,
+                              const std::string& correspondent) {
+    uint32_t stat_code;
+    chat primary_chat;
+    chat backup_chat;
+    assert(primary.recv_txt(correspondent, stat_code, primary_chat) ==
+           status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(backup.recv_txt(correspondent, stat_code, backup_chat) ==
+           status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(primary_chat.texts_.size() == backup_chat.texts_.size());
+    for (size_t i = 0; i != primary_chat.texts_.size(); ++i) {
+        assert(primary_chat.texts_[i].sender_ ==
+               backup_chat.texts_[i].sender_);
+        assert(primary_chat.texts_[i].content_ ==
+               backup_chat.texts_[i].content_);
+    }
+    return backup_chat.texts_.size();
+}
+
+int main() {
+    // The backup is not up yet, so the first writes are answered right away
+    // and shipped once the primary connects to it
+    spawn_server({"-r", "127.0.0.2", "-S", "127.0.0.1"});
+
+    uint32_t stat_code;
+    {
+        client c;
+        assert(c.connect_server(n_primary_addr) == status::ok);
+        for (const char* username : {"alice", "bobby", "carol"}) {
+            assert(c.registration(username, "password", stat_code) ==
+                   status::ok);
+            assert(stat_code == chat262::status_code_ok);
+        }
+    }
+    client alice;
+    connect_as(alice, n_primary_addr, "alice");
+    for (int i = 0; i != 100; ++i) {
+        assert(alice.send_txt("bobby", "early " + std::to_string(i),
+                              stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+    }
+
+    spawn_server({"-b", "127.0.0.1", "127.0.0.2"});
+
+    // Wait until the backup catches up
+    client backup;
+    assert(backup.connect_server(n_backup_addr) == status::ok);
+    for (int i = 0; i != 100; ++i) {
+        chat c;
+        if (backup.login("bobby", "password", stat_code) == status::ok &&
+            stat_code == chat262::status_code_ok &&
+            backup.recv_txt("alice", stat_code, c) == status::ok &&
+            c.texts_.size() == 100) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    client bobby;
+    connect_as(bobby, n_primary_addr, "bobby");
+    assert(check_same_chat(bobby, backup, "alice") == 100);
+
+    // Now that the backup is connected, every write is applied on it before
+    // it is answered
+    for (int i = 0; i != 100; ++i) {
+        assert(alice.send_txt("bobby", "late " + std::to_string(i),
+                              stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_ok);
+        chat c;
+        assert(backup.recv_txt("alice", stat_code, c) == status::ok);
+        assert(c.texts_.size() == 101 + static_cast<size_t>(i));
+        assert(c.texts_.back().content_ == "late " + std::to_string(i));
+    }
+    assert(check_same_chat(bobby, backup, "alice") == 200);
+
+    // Writes from several clients at once are batched together
+    {
+        std::vector<std::thread> writers;
+        for (const char* username : {"alice", "bobby"}) {
+            writers.emplace_back([username]() {
+                client c;
+                connect_as(c, n_primary_addr, username);
+                uint32_t code;
+                for (int i = 0; i != 500; ++i) {
+                    assert(c.send_txt("carol", std::to_string(i), code) ==
+                           status::ok);
+                    assert(code == chat262::status_code_ok);
+                }
+            });
+        }
+        for (std::thread& t : writers) {
+            t.join();
+        }
+    }
+    client carol;
+    connect_as(carol, n_primary_addr, "carol");
+    client carol_backup;
+    connect_as(carol_backup, n_backup_addr, "carol");
+    assert(check_same_chat(carol, carol_backup, "alice") == 500);
+    assert(check_same_chat(carol, carol_backup, "bobby") == 500);
+
+    // The backup refuses writes from clients
+    {
+        client c;
+        assert(c.connect_server(n_backup_addr) == status::ok);
+        assert(c.registration("dave", "password", stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_read_only);
+    }
+    assert(backup.send_txt("alice", "hello", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_read_only);
+    assert(backup.delete_account(stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_read_only);
+    assert(check_same_chat(bobby, backup, "alice") == 200);
+
+    // Only the primary replicates to the backup
+    {
+        int fd;
+        assert(connect_peer(n_backup_addr, n_other_addr, fd) == status::ok);
+        chat262::mutation m = {chat262::mutation::op_registration,
+                               "mallory",
+                               "password",
+                               ""};
+        assert(send_all(fd,
+                        chat262::replicate_request::serialize(1000000, {m})) ==
+               status::ok);
+        chat262::message_header hdr;
+        std::vector<uint8_t> body;
+        assert(recv_message(fd, hdr, body) == status::ok);
+        assert(hdr.type_ == chat262::msgtype_invalid_type_response);
+        close(fd);
+        client c;
+        assert(c.connect_server(n_backup_addr) == status::ok);
+        assert(c.login("mallory", "password", stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_invalid_credentials);
+    }
+
+    // A deletion is replicated as well
+    assert(alice.delete_account(stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    chat c;
+    assert(backup.recv_txt("alice", stat_code, c) == status::ok);
+    assert(stat_code == chat262::status_code_user_noexist);
+    std::vector<std::string> correspondents;
+    assert(carol_backup.recv_correspondents(stat_code, correspondents) ==
+           status::ok);
+    assert(correspondents == std::vector<std::string>{"bobby"});
+    {
+        client c2;
+        assert(c2.connect_server(n_backup_addr) == status::ok);
+        assert(c2.login("alice", "password", stat_code) == status::ok);
+        assert(stat_code == chat262::status_code_invalid_credentials);
+    }
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "dedupe_cache.h"
+#include "endianness.h"
+#include "raw_connection.h"
+#include "server.h"
+
+#include <cassert>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Duplicate registrations and requests without the feature are sent on raw
+// connections (see raw_connection.h)
+
+constexpr uint32_t n_ip_addr = 0x0100007F;
+
+// Number of texts in the chat of the logged in user of `c` with `other`
+static size_t num_texts(client& c, const std::string& other) {
+    uint32_t stat_code;
+    chat ch;
+    assert(c.recv_txt(other, stat_code, ch) == status::ok);
+    assert(stat_code == 0);
+    return ch.texts_.size();
+}
+
+static void spawn_server() {
+    const char* localhost = "127.0.0.1";
+    char const* argv[] = {"./server", localhost};
+    std::thread thread([&]() {
+        server s;
+        s.run(2, argv);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    thread.detach();
+}
+
+int main() {
+    spawn_server();
+
+    chat262::message_header hdr;
+    std::vector<uint8_t> body;
+    uint32_t stat_code;
+
+    client c;
+    assert(c.connect_server(n_ip_addr) == status::ok);
+    uint16_t version;
+    uint32_t enabled;
+    assert(c.hello(chat262::latest_version,
+                   chat262::feature_request_ids,
+                   version,
+                   enabled) == status::ok);
+    assert(enabled == chat262::feature_request_ids);
+    assert(c.registration("alice", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.registration("bobby", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.login("alice", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    // A text sent again with the same ID is stored once, and both requests
+    // are answered with OK
+    assert(c.send_txt("bobby", "One", 1, stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("bobby", "One", 1, stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(num_texts(c, "bobby") == 1);
+    assert(c.send_txt("bobby", "Two", 2, stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(num_texts(c, "bobby") == 2);
+
+    // Texts without an ID are never deduplicated
+    assert(c.send_txt("bobby", "Three", stat_code) == status::ok);
+    assert(c.send_txt("bobby", "Three", stat_code) == status::ok);
+    assert(num_texts(c, "bobby") == 4);
+
+    // Request IDs belong to the logged in user, so a text retried on a new
+    // connection is stored once
+    client other;
+    assert(other.connect_server(n_ip_addr) == status::ok);
+    assert(other.hello(chat262::latest_version,
+                       chat262::feature_request_ids,
+                       version,
+                       enabled) == status::ok);
+    assert(other.login("alice", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(other.send_txt("bobby", "Two", 2, stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(num_texts(c, "bobby") == 4);
+
+    // It is remembered after the connection that sent it went away
+    {
+        client gone;
+        assert(gone.connect_server(n_ip_addr) == status::ok);
+        assert(gone.hello(chat262::latest_version,
+                          chat262::feature_request_ids,
+                          version,
+                          enabled) == status::ok);
+        assert(gone.login("alice", "password", stat_code) == status::ok);
+        assert(stat_code == 0);
+        assert(gone.send_txt("bobby", "Retried", 9, stat_code) == status::ok);
+        assert(stat_code == 0);
+    }
+    assert(other.send_txt("bobby", "Retried", 9, stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(num_texts(c, "bobby") == 5);
+
+    // The same ID from another user is a different request
+    assert(other.login("bobby", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(other.send_txt("alice", "One", 1, stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(num_texts(c, "bobby") == 6);
+
+    // Only the last writes are remembered, so an old ID is handled again
+    for (uint64_t id = 100; id != 100 + dedupe_cache::capacity; ++id) {
+        assert(c.send_txt("bobby", "Filler", id, stat_code) == status::ok);
+        assert(stat_code == 0);
+    }
+    assert(num_texts(c, "bobby") == 6 + dedupe_cache::capacity);
+    assert(c.send_txt("bobby", "One", 1, stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(num_texts(c, "bobby") == 7 + dedupe_cache::capacity);
+
+    // A registration retried in a pipeline is answered with the response to
+    // the first, not with a conflict, and another ID does conflict
+    const uint32_t features =
+        chat262::feature_pipelining | chat262::feature_request_ids;
+    int fd = connect_hello(n_ip_addr,
+                           chat262::latest_version,
+                           features,
+                           chat262::latest_version,
+                           features);
+    send_msgs(fd,
+              {chat262::identified_request::attach(
+                   chat262::registration_request::serialize("carol",
+                                                            "password"),
+                   7),
+               chat262::identified_request::attach(
+                   chat262::registration_request::serialize("carol",
+                                                            "password"),
+                   7),
+               chat262::identified_request::attach(
+                   chat262::registration_request::serialize("carol",
+                                                            "password"),
+                   8)},
+              chat262::latest_version);
+    assert(recv_registration(fd) == 0);
+    assert(recv_registration(fd) == 0);
+    assert(recv_registration(fd) == chat262::status_code_user_exists);
+    close(fd);
+
+    // A request ID that is too short is an invalid body
+    fd = connect_hello(n_ip_addr,
+                       chat262::latest_version,
+                       chat262::feature_request_ids,
+                       chat262::latest_version,
+                       chat262::feature_request_ids);
+    std::shared_ptr<chat262::message> logout =
+        chat262::logout_request::serialize();
+    logout->hdr_.type_ = e_htole16(chat262::msgtype_logout_request |
+                                   chat262::msgflag_request_id);
+    send_msgs(fd, {logout}, chat262::latest_version);
+    assert(recv_msg(fd, hdr, body) == status::ok);
+    assert(hdr.type_ == chat262::msgtype_invalid_body_response);
+    close(fd);
+
+    // Without the feature, a request with an ID is of an unknown type
+    fd = connect_server(n_ip_addr);
+    send_msgs(fd,
+              {chat262::identified_request::attach(
+                  chat262::logout_request::serialize(),
+                  1)},
+              chat262::version);
+    assert(recv_msg(fd, hdr, body) == status::ok);
+    assert(hdr.type_ == chat262::msgtype_invalid_type_response);
+    close(fd);
+
+    return EXIT_SUCCESS;
+}
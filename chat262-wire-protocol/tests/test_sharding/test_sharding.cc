@@ -0,0 +1,264 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "peer_io.h"
+#include "server.h"
+#include "shard_ring.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// The three shards of the cluster listen on 127.0.0.1, 127.0.0.2 and
+// 127.0.0.3, which are all loopback addresses. Every shard runs in its own
+// process.
+
+static const char* const str_addrs[] = {"127.0.0.1", "127.0.0.2", "127.0.0.3"};
+static const uint32_t n_addrs[] = {0x0100007F, 0x0200007F, 0x0300007F};
+constexpr size_t num_shards = 3;
+constexpr uint32_t n_other_addr = 0x0400007F;
+
+constexpr size_t num_users = 60;
+constexpr size_t num_texts = 100;
+
+// Start the shard `i` in a child process and return its process ID. Chats
+// are limited to 4K on every shard.
+static pid_t spawn_shard(const size_t i) {
+    // The child must not print what the parent buffered
+    fflush(stdout);
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return pid;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    assert(freopen("/dev/null", "w", stdout) != nullptr);
+    assert(freopen("/dev/null", "w", stderr) != nullptr);
+    std::vector<const char*> argv = {"./server", "-c", "4K"};
+    for (size_t j = 0; j != num_shards; ++j) {
+        if (j != i) {
+            argv.push_back("-H");
+            argv.push_back(str_addrs[j]);
+        }
+    }
+    argv.push_back(str_addrs[i]);
+    server s;
+    s.run(argv.size(), argv.data());
+    _exit(1);
+}
+
+// Index of the shard that owns `username`
+static size_t shard_of(const std::string& username) {
+    static const chat262::shard_ring ring(
+        std::vector<uint32_t>(n_addrs, n_addrs + num_shards));
+    const uint32_t addr = ring.shard_of(username);
+    return std::find(n_addrs, n_addrs + num_shards, addr) - n_addrs;
+}
+
+// Connect `c` to the shard of `username` and log in
+static void login(client& c, const std::string& username) {
+    uint32_t stat_code;
+    assert(c.connect_server(n_addrs[shard_of(username)]) == status::ok);
+    assert(c.login(username, "password", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+}
+
+static std::vector<std::string> correspondents(client& c) {
+    uint32_t stat_code;
+    std::vector<std::string> usernames;
+    assert(c.recv_correspondents(stat_code, usernames) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    std::sort(usernames.begin(), usernames.end());
+    return usernames;
+}
+
+int main() {
+    pid_t pids[num_shards];
+    for (size_t i = 0; i != num_shards; ++i) {
+        pids[i] = spawn_shard(i);
+    }
+
+    // Every user registers on its own shard only, and the users are spread
+    // over all shards
+    uint32_t stat_code;
+    std::vector<std::string> all_users;
+    size_t users_per_shard[num_shards] = {0, 0, 0};
+    for (size_t u = 0; u != num_users; ++u) {
+        const std::string username = "user" + std::to_string(u);
+        const size_t owner = shard_of(username);
+        for (size_t i = 0; i != num_shards; ++i) {
+            client c;
+            assert(c.connect_server(n_addrs[i]) == status::ok);
+            assert(c.registration(username, "password", stat_code) ==
+                   status::ok);
+            assert(stat_code == (i == owner
+                                     ? chat262::status_code_ok
+                                     : chat262::status_code_wrong_shard));
+            assert(c.login(username, "password", stat_code) == status::ok);
+            assert(stat_code == (i == owner
+                                     ? chat262::status_code_ok
+                                     : chat262::status_code_wrong_shard));
+        }
+        all_users.push_back(username);
+        ++users_per_shard[owner];
+    }
+    for (size_t i = 0; i != num_shards; ++i) {
+        assert(users_per_shard[i] > 0);
+    }
+    std::sort(all_users.begin(), all_users.end());
+
+    // Pick two users on different shards, and a third on the first one's
+    std::string alice;
+    std::string bobby;
+    std::string carol;
+    for (const std::string& username : all_users) {
+        if (alice.empty()) {
+            alice = username;
+        } else if (bobby.empty() && shard_of(username) != shard_of(alice)) {
+            bobby = username;
+        } else if (carol.empty() && shard_of(username) == shard_of(alice)) {
+            carol = username;
+        }
+    }
+    assert(!bobby.empty() && !carol.empty());
+
+    // Texts to a user of another shard are stored on both shards
+    client a;
+    login(a, alice);
+    for (size_t i = 0; i != num_texts; ++i) {
+        assert(a.send_txt(bobby, "text " + std::to_string(i), stat_code) ==
+               status::ok);
+        assert(stat_code == chat262::status_code_ok);
+    }
+    client b;
+    login(b, bobby);
+    chat c;
+    assert(b.recv_txt(alice, stat_code, c) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(c.texts_.size() == num_texts);
+    for (size_t i = 0; i != num_texts; ++i) {
+        assert(c.texts_[i].sender_ == text::sender_other);
+        assert(c.texts_[i].content_ == "text " + std::to_string(i));
+    }
+    assert(a.recv_txt(bobby, stat_code, c) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(c.texts_.size() == num_texts);
+    assert(c.texts_.back().sender_ == text::sender_you);
+    assert(b.send_txt(alice, "reply", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(a.recv_txt(bobby, stat_code, c) == status::ok);
+    assert(c.texts_.size() == num_texts + 1);
+    assert(c.texts_.back().sender_ == text::sender_other);
+    assert(correspondents(a) == std::vector<std::string>{bobby});
+    assert(correspondents(b) == std::vector<std::string>{alice});
+
+    // Users of other shards that don't exist are not found
+    std::string nobody;
+    for (size_t i = 0; nobody.empty(); ++i) {
+        const std::string username = "nobody" + std::to_string(i);
+        if (shard_of(username) != shard_of(alice)) {
+            nobody = username;
+        }
+    }
+    assert(a.send_txt(nobody, "text", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_user_noexist);
+    assert(a.recv_txt(nobody, stat_code, c) == status::ok);
+    assert(stat_code == chat262::status_code_user_noexist);
+    assert(correspondents(a) == std::vector<std::string>{bobby});
+    // Users of other shards that do exist have an empty chat
+    std::string other;
+    for (const std::string& username : all_users) {
+        if (shard_of(username) != shard_of(alice) && username != bobby) {
+            other = username;
+            break;
+        }
+    }
+    assert(a.recv_txt(other, stat_code, c) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(c.texts_.empty());
+
+    // Searches cover all shards, from any shard
+    std::vector<std::string> usernames;
+    assert(a.list_accounts("*", stat_code, usernames) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(usernames == all_users);
+    assert(b.list_accounts("user1*", stat_code, usernames) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    std::vector<std::string> expected;
+    for (const std::string& username : all_users) {
+        if (username.compare(0, 5, "user1") == 0) {
+            expected.push_back(username);
+        }
+    }
+    assert(usernames == expected);
+
+    // The sender's limits are enforced on its shard before the text is
+    // forwarded, and the sender only keeps the texts that the recipient got
+    client cc;
+    login(cc, carol);
+    const std::string big(1000, 'x');
+    size_t sent = 0;
+    while (true) {
+        assert(cc.send_txt(bobby, big, stat_code) == status::ok);
+        if (stat_code != chat262::status_code_ok) {
+            break;
+        }
+        ++sent;
+    }
+    assert(stat_code == chat262::status_code_quota_exceeded);
+    assert(sent > 0);
+    assert(cc.recv_txt(bobby, stat_code, c) == status::ok);
+    assert(c.texts_.size() == sent);
+    assert(b.recv_txt(carol, stat_code, c) == status::ok);
+    assert(c.texts_.size() == sent);
+
+    // Only the other shards forward writes and searches
+    int fd;
+    assert(connect_peer(n_addrs[shard_of(bobby)], n_other_addr, fd) ==
+           status::ok);
+    assert(send_all(fd,
+                    chat262::forward_request::serialize(
+                        {chat262::mutation::op_delete_user, carol, "", ""})) ==
+           status::ok);
+    chat262::message_header hdr;
+    std::vector<uint8_t> body;
+    assert(recv_message(fd, hdr, body) == status::ok);
+    assert(hdr.type_ == chat262::msgtype_invalid_type_response);
+    assert(send_all(fd, chat262::shard_accounts_request::serialize("*")) ==
+           status::ok);
+    assert(recv_message(fd, hdr, body) == status::ok);
+    assert(hdr.type_ == chat262::msgtype_invalid_type_response);
+    close(fd);
+    assert(b.recv_txt(carol, stat_code, c) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(c.texts_.size() == sent);
+
+    // A deletion deletes the chats with the user on every shard
+    assert(b.delete_account(stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_ok);
+    assert(correspondents(a).empty());
+    assert(correspondents(cc).empty());
+    assert(a.recv_txt(bobby, stat_code, c) == status::ok);
+    assert(stat_code == chat262::status_code_user_noexist);
+    assert(a.send_txt(bobby, "text", stat_code) == status::ok);
+    assert(stat_code == chat262::status_code_user_noexist);
+    assert(a.list_accounts("*", stat_code, usernames) == status::ok);
+    assert(usernames.size() == num_users - 1);
+    assert(!std::binary_search(usernames.begin(), usernames.end(), bobby));
+
+    for (size_t i = 0; i != num_shards; ++i) {
+        kill(pids[i], SIGKILL);
+        waitpid(pids[i], nullptr, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "segment_store.h"
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+constexpr uint32_t n_ip_addr = 0x0100007F;
+
+static const char* segment_prefix = "test_tiering.seg";
+
+static void spawn_server() {
+    const char* localhost = "127.0.0.1";
+    // Chats are evicted after a second of inactivity, and segment files are
+    // sealed at 512 bytes
+    char const* argv[] = {"./server",
+                          "-e",
+                          "1",
+                          "-f",
+                          segment_prefix,
+                          "-s",
+                          "512",
+                          localhost};
+    std::thread thread([&]() {
+        server s;
+        s.run(8, argv);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    thread.detach();
+}
+
+static std::string segment_path(const int idx) {
+    return std::string(segment_prefix) + "." + std::to_string(idx);
+}
+
+static bool segment_file_exists(const int idx) {
+    struct stat st;
+    return stat(segment_path(idx).c_str(), &st) == 0;
+}
+
+static void wait_for_eviction() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+}
+
+int main() {
+    spawn_server();
+    assert(segment_file_exists(0));
+    assert(!segment_file_exists(1));
+
+    client c;
+    assert(c.connect_server(n_ip_addr) == status::ok);
+
+    uint32_t stat_code;
+    assert(c.registration("testuser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.registration("otheruser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    assert(c.login("testuser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    std::vector<std::string> txts;
+    for (int i = 0; i != 20; ++i) {
+        txts.push_back("Text number " + std::to_string(i));
+        assert(c.send_txt("otheruser", txts.back(), stat_code) == status::ok);
+        assert(stat_code == 0);
+    }
+    // An empty text is stored too
+    txts.push_back("");
+    assert(c.send_txt("otheruser", "", stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    // Both sides of the chat are written to the disk. They don't fit into
+    // one file, so the first file is sealed.
+    wait_for_eviction();
+    assert(segment_file_exists(1));
+    std::shared_ptr<const uint8_t> data;
+    size_t len;
+    assert(segment_store::map_sealed(segment_path(0), data, len) ==
+           status::ok);
+
+    // The sealed file holds one segment, laid out like a receive text
+    // response body. The active file is not sealed yet.
+    segment_store::file_header hdr;
+    memcpy(&hdr, data.get(), sizeof(hdr));
+    assert(memcmp(hdr.magic_, segment_store::file_magic, 8) == 0);
+    assert(hdr.version_ == segment_store::file_version);
+    assert(hdr.num_segments_ == 1);
+    assert(sizeof(hdr) + hdr.data_len_ == len);
+    uint32_t num_txts;
+    memcpy(&num_txts, data.get() + sizeof(hdr), sizeof(num_txts));
+    assert(num_txts == txts.size());
+    assert(segment_store::map_sealed(segment_path(1), data, len) ==
+           status::error);
+
+    // Receiving reads the texts from the mapping or faults them back in
+    chat curr_chat;
+    assert(c.recv_txt("otheruser", stat_code, curr_chat) == status::ok);
+    assert(stat_code == 0);
+    assert(curr_chat.texts_.size() == txts.size());
+    for (size_t i = 0; i != txts.size(); ++i) {
+        assert(curr_chat.texts_[i].sender_ == text::sender_you);
+        assert(curr_chat.texts_[i].content_ == txts[i]);
+    }
+    assert(c.logout(stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    // New texts go after the evicted ones, without faulting them in
+    assert(c.login("otheruser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.send_txt("testuser", "Reply", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.recv_txt("testuser", stat_code, curr_chat) == status::ok);
+    assert(stat_code == 0);
+    assert(curr_chat.texts_.size() == txts.size() + 1);
+    for (size_t i = 0; i != txts.size(); ++i) {
+        assert(curr_chat.texts_[i].sender_ == text::sender_other);
+        assert(curr_chat.texts_[i].content_ == txts[i]);
+    }
+    assert(curr_chat.texts_.back().sender_ == text::sender_you);
+    assert(curr_chat.texts_.back().content_ == "Reply");
+
+    // Chats can be evicted more than once
+    wait_for_eviction();
+    assert(c.recv_txt("testuser", stat_code, curr_chat) == status::ok);
+    assert(stat_code == 0);
+    assert(curr_chat.texts_.size() == txts.size() + 1);
+    assert(curr_chat.texts_.front().content_ == txts.front());
+    assert(curr_chat.texts_.back().content_ == "Reply");
+
+    // Deleting a user with evicted chats works, and deletes the sealed
+    // files, which only hold garbage
+    wait_for_eviction();
+    assert(c.delete_account(stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(!segment_file_exists(0));
+    assert(c.login("testuser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    assert(c.recv_txt("otheruser", stat_code, curr_chat) == status::ok);
+    assert(stat_code == 3);
+
+    return EXIT_SUCCESS;
+}
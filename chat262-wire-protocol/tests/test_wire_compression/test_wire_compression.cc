@@ -0,0 +1,217 @@
+#include "chat.h"
+#include "chat262_protocol.h"
+#include "client.h"
+#include "endianness.h"
+#include "server.h"
+
+#include <arpa/inet.h>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// The client hides whether a body was compressed, so the wire format is
+// checked on a raw socket, with `send_msg` and `recv_*` copied here.
+
+constexpr uint32_t n_ip_addr = 0x0100007F;
+
+static int connect_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd > 0);
+
+    sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(chat262::port);
+    server_addr.sin_addr.s_addr = n_ip_addr;
+
+    assert(connect(fd, (const sockaddr*) &server_addr, sizeof(server_addr)) ==
+           0);
+    return fd;
+}
+
+static void send_msg(int fd,
+                     std::shared_ptr<chat262::message> msg,
+                     const uint16_t version = chat262::version) {
+    msg->hdr_.version_ = e_htole16(version);
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(msg.get());
+    size_t total_len =
+        sizeof(chat262::message_header) + e_le32toh(msg->hdr_.body_len_);
+    size_t total_sent = 0;
+    while (total_sent != total_len) {
+        ssize_t sent =
+            send(fd, data + total_sent, total_len - total_sent, MSG_NOSIGNAL);
+        assert(sent > 0);
+        total_sent += sent;
+    }
+}
+
+static void recv_bytes(int fd, size_t len, std::vector<uint8_t>& data) {
+    data.resize(len);
+    size_t total_read = 0;
+    while (total_read != len) {
+        ssize_t readed = read(fd, data.data() + total_read, len - total_read);
+        assert(readed > 0);
+        total_read += readed;
+    }
+}
+
+static void recv_msg(int fd,
+                     chat262::message_header& hdr,
+                     std::vector<uint8_t>& body) {
+    std::vector<uint8_t> hdr_data;
+    recv_bytes(fd, sizeof(chat262::message_header), hdr_data);
+    assert(chat262::message_header::deserialize(hdr_data, hdr) == status::ok);
+    recv_bytes(fd, hdr.body_len_, body);
+}
+
+static void spawn_server() {
+    const char* localhost = "127.0.0.1";
+    char const* argv[] = {"./server", localhost};
+    std::thread thread([&]() {
+        server s;
+        s.run(2, argv);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    thread.detach();
+}
+
+static void check_chat(client& c,
+                       const std::string& correspondent,
+                       const std::vector<std::string>& txts) {
+    uint32_t stat_code;
+    chat curr_chat;
+    assert(c.recv_txt(correspondent, stat_code, curr_chat) == status::ok);
+    assert(stat_code == 0);
+    assert(curr_chat.texts_.size() == txts.size());
+    for (size_t i = 0; i != txts.size(); ++i) {
+        assert(curr_chat.texts_[i].sender_ == text::sender_you);
+        assert(curr_chat.texts_[i].content_ == txts[i]);
+    }
+}
+
+// Log in on a raw connection, optionally negotiating compression first, and
+// receive the chat with `correspondent` as raw bytes.
+static void recv_raw_chat(const bool compress,
+                          const std::string& correspondent,
+                          chat262::message_header& hdr,
+                          std::vector<uint8_t>& body) {
+    int fd = connect_server();
+    uint16_t version = chat262::version;
+    if (compress) {
+        send_msg(fd,
+                 chat262::hello_request::serialize(
+                     chat262::latest_version,
+                     chat262::feature_compression));
+        recv_msg(fd, hdr, body);
+        assert(hdr.version_ == chat262::version);
+        assert(hdr.type_ == chat262::msgtype_hello_response);
+        uint32_t enabled;
+        assert(chat262::hello_response::deserialize(body, version, enabled) ==
+               status::ok);
+        assert(version == chat262::latest_version);
+        assert(enabled == chat262::feature_compression);
+    }
+
+    // Small responses are never compressed
+    send_msg(fd,
+             chat262::login_request::serialize("testuser", "password"),
+             version);
+    recv_msg(fd, hdr, body);
+    assert(hdr.version_ == version);
+    assert(hdr.type_ == chat262::msgtype_login_response);
+
+    send_msg(fd, chat262::recv_txt_request::serialize(correspondent), version);
+    recv_msg(fd, hdr, body);
+    assert(hdr.version_ == version);
+    close(fd);
+}
+
+int main() {
+    spawn_server();
+
+    client c;
+    assert(c.connect_server(n_ip_addr) == status::ok);
+    uint16_t version;
+    uint32_t enabled;
+    assert(c.hello(chat262::latest_version,
+                   chat262::feature_compression,
+                   version,
+                   enabled) == status::ok);
+    assert(version == chat262::latest_version);
+    assert(enabled == chat262::feature_compression);
+
+    uint32_t stat_code;
+    assert(c.registration("testuser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    for (int i = 0; i != 200; ++i) {
+        assert(c.registration("user" + std::to_string(i),
+                              "password",
+                              stat_code) == status::ok);
+        assert(stat_code == 0);
+    }
+    assert(c.login("testuser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    std::vector<std::string> txts;
+    for (int i = 0; i != 200; ++i) {
+        txts.push_back("See you at " + std::to_string(i % 12) +
+                       " in the library, ok?");
+    }
+    for (const std::string& txt : txts) {
+        assert(c.send_txt("user0", txt, stat_code) == status::ok);
+        assert(stat_code == 0);
+    }
+    assert(c.send_txt("user1", "Hi", stat_code) == status::ok);
+    assert(stat_code == 0);
+
+    // Compressed and plain responses read the same through the client
+    check_chat(c, "user0", txts);
+    check_chat(c, "user1", {"Hi"});
+    std::vector<std::string> usernames;
+    assert(c.list_accounts("user*", stat_code, usernames) == status::ok);
+    assert(stat_code == 0);
+    assert(usernames.size() == 200);
+
+    client plain;
+    assert(plain.connect_server(n_ip_addr) == status::ok);
+    assert(plain.login("testuser", "password", stat_code) == status::ok);
+    assert(stat_code == 0);
+    check_chat(plain, "user0", txts);
+    usernames.clear();
+    assert(plain.list_accounts("user*", stat_code, usernames) == status::ok);
+    assert(stat_code == 0);
+    assert(usernames.size() == 200);
+
+    // Without negotiation, the large chat is sent as it is
+    chat262::message_header hdr;
+    std::vector<uint8_t> raw_body;
+    recv_raw_chat(false, "user0", hdr, raw_body);
+    assert(hdr.type_ == chat262::msgtype_recv_txt_response);
+
+    // With it, the chat is compressed and decompresses to the same bytes
+    std::vector<uint8_t> wire_body;
+    recv_raw_chat(true, "user0", hdr, wire_body);
+    assert(hdr.type_ ==
+           (chat262::msgtype_recv_txt_response | chat262::msgflag_compressed));
+    assert(wire_body.size() < raw_body.size() / 2);
+    std::vector<uint8_t> body;
+    assert(chat262::compressed_body::decompress(wire_body, body) ==
+           status::ok);
+    assert(body == raw_body);
+
+    // A short chat is not worth compressing
+    recv_raw_chat(true, "user1", hdr, wire_body);
+    assert(hdr.type_ == chat262::msgtype_recv_txt_response);
+
+    // A compressed body that lies about its length is rejected
+    wire_body.assign(4, 0xFF);
+    wire_body.push_back(0);
+    assert(chat262::compressed_body::decompress(wire_body, body) ==
+           status::body_error);
+
+    return EXIT_SUCCESS;
+}